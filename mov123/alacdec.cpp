@@ -0,0 +1,573 @@
+// alacdec.cpp : Apple Lossless packets to PCM - see alacdec.h
+//
+
+#include <string.h>
+#include "alacdec.h"
+
+// element tags
+#define ID_SCE  0               // single channel
+#define ID_CPE  1               // channel pair
+#define ID_CCE  2               // coupling channel
+#define ID_LFE  3
+#define ID_DSE  4               // data stream
+#define ID_PCE  5               // program config
+#define ID_FIL  6               // fill
+#define ID_END  7
+
+// the adaptive Rice coder keeps a running mean of the values, scaled by QB
+#define QBSHIFT     9
+#define QB          (1u << QBSHIFT)
+#define MMULSHIFT   2
+#define MDENSHIFT   (QBSHIFT - MMULSHIFT - 1)
+#define MOFF        (1u << (MDENSHIFT - 2))
+#define BITOFF      24
+#define MAX_PREFIX  9           // this many ones and the value follows whole
+#define RUN_BITS    16          // the width of a whole zero run
+#define MEAN_CLAMP  0xFFFF
+
+// the copy of a packet is followed by this many zero bytes, enough for any read that
+// starts inside it
+#define PACKET_PAD  16
+
+static unsigned long
+GetBE(const unsigned char* p, int nBytes) {
+  unsigned long v = 0;
+  for (int i = 0; i < nBytes; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static inline unsigned
+CountLeadingZeros(unsigned v) {
+#ifdef __GNUC__
+  return v ? __builtin_clz(v) : 32;
+#else
+  unsigned n = 0;
+  if (v == 0) {
+    return 32;
+  }
+  if (!(v & 0xFFFF0000)) { n += 16; v <<= 16; }
+  if (!(v & 0xFF000000)) { n += 8; v <<= 8; }
+  if (!(v & 0xF0000000)) { n += 4; v <<= 4; }
+  if (!(v & 0xC0000000)) { n += 2; v <<= 2; }
+  if (!(v & 0x80000000)) { n += 1; }
+  return n;
+#endif
+}
+
+// the 64 bits from bit dwPos on, of which at least 57 are real
+static inline unsigned long long
+Peek64(const unsigned char* p, unsigned long dwPos) {
+  p += dwPos >> 3;
+  unsigned long long v = 0;
+  for (int i = 0; i < 8; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v << (dwPos & 7);
+}
+
+static inline int
+SignExtend(int v, unsigned nShift) {
+  return (int)((unsigned)v << nShift) >> nShift;
+}
+
+static inline int
+Sign(int v) {
+  return (v > 0) - (v < 0);
+}
+
+//
+// Unpredict
+//
+// runs residuals back through the predictor. nActive 0 means the residuals are the
+// samples, and 31 that they're first differences; otherwise the coefficients adapt as
+// they go, each nudged by the sign of its error. pIn and pOut can be the same for 0
+// and 31
+//
+static void
+Unpredict(const int* pIn, int* pOut, unsigned long n, short* pCoefs, int nActive,
+          unsigned nChanBits, unsigned nDenShift) {
+  unsigned nShift = 32 - nChanBits;
+  if (n == 0) {
+    return;
+  }
+  pOut[0] = pIn[0];
+  if (nActive == 0) {
+    if (pIn != pOut) {
+      memcpy(pOut + 1, pIn + 1, (n - 1) * sizeof(int));
+    }
+    return;
+  }
+  if (nActive == 31) {
+    int nPrev = pOut[0];
+    for (unsigned long j = 1; j < n; j++) {
+      nPrev = SignExtend((int)((unsigned)pIn[j] + nPrev), nShift);
+      pOut[j] = nPrev;
+    }
+    return;
+  }
+
+  // the first samples, before there are enough to predict from
+  unsigned long j;
+  for (j = 1; j <= (unsigned long)nActive && j < n; j++) {
+    pOut[j] = SignExtend((int)((unsigned)pIn[j] + pOut[j - 1]), nShift);
+  }
+
+  // in 64 bits, where a good stream never overflows and a damaged one can't
+  long long llHalf = nDenShift ? 1 << (nDenShift - 1) : 0;
+  for (; j < n; j++) {
+    const int* pPrev = pOut + j - 1;
+    int nTop = pOut[j - nActive - 1];
+    long long llSum = 0;
+    for (int k = 0; k < nActive; k++) {
+      llSum += pCoefs[k] * ((long long)pPrev[-k] - nTop);
+    }
+
+    long long llDelta = pIn[j];
+    int nSign = Sign(pIn[j]);
+    pOut[j] = SignExtend((int)(llDelta + nTop + ((llSum + llHalf) >> nDenShift)), nShift);
+
+    // move the coefficients against the error, the oldest first, until it's used up
+    if (nSign > 0) {
+      for (int k = nActive - 1; k >= 0; k--) {
+        long long llDiff = (long long)nTop - pPrev[-k];
+        int nDiffSign = (llDiff > 0) - (llDiff < 0);
+        pCoefs[k] = (short)(pCoefs[k] - nDiffSign);
+        llDelta -= (nActive - k) * ((nDiffSign * llDiff) >> nDenShift);
+        if (llDelta <= 0) {
+          break;
+        }
+      }
+    }
+    else if (nSign < 0) {
+      for (int k = nActive - 1; k >= 0; k--) {
+        long long llDiff = (long long)nTop - pPrev[-k];
+        int nDiffSign = (llDiff > 0) - (llDiff < 0);
+        pCoefs[k] = (short)(pCoefs[k] + nDiffSign);
+        llDelta -= (nActive - k) * ((-nDiffSign * llDiff) >> nDenShift);
+        if (llDelta >= 0) {
+          break;
+        }
+      }
+    }
+  }
+}
+
+ALACDecoder::ALACDecoder() {
+  m_dwFrameLength = 0;
+  m_nBitDepth = 0;
+  m_nPB = 0;
+  m_nMB = 0;
+  m_nKB = 0;
+  m_nChannels = 0;
+  m_dwSampleRate = 0;
+  m_pPredictor = NULL;
+  m_pMix[0] = NULL;
+  m_pMix[1] = NULL;
+  m_pShift = NULL;
+  m_pPacket = NULL;
+  m_cbPacket = 0;
+  m_dwBits = 0;
+  m_dwPos = 0;
+  m_bOverrun = false;
+}
+
+ALACDecoder::~ALACDecoder() {
+  delete [] m_pPredictor;
+  delete [] m_pMix[0];
+  delete [] m_pMix[1];
+  delete [] m_pShift;
+  delete [] m_pPacket;
+}
+
+//
+// Init
+//
+// frame length (32 bits), compatible version, bit depth, the three Rice parameters pb,
+// mb and kb, channels (8 bits each), max run (16), max frame bytes, average bitrate and
+// sample rate (32 each)
+//
+bool
+ALACDecoder::Init(const unsigned char* pConfig, size_t cbConfig) {
+  if (cbConfig >= 12 && memcmp(pConfig + 4, "frma", 4) == 0) {
+    pConfig += 12;
+    cbConfig -= 12;
+  }
+  if (cbConfig >= 12 && memcmp(pConfig + 4, "alac", 4) == 0) {
+    pConfig += 12;
+    cbConfig -= 12;
+  }
+  if (cbConfig < ALAC_CONFIG_SIZE) {
+    return false;
+  }
+
+  unsigned long dwFrameLength = GetBE(pConfig, 4);
+  unsigned nBitDepth = pConfig[5];
+  unsigned nKB = pConfig[8];
+  unsigned nChannels = pConfig[9];
+  if (pConfig[4] != 0 || dwFrameLength == 0 || dwFrameLength > ALAC_MAX_FRAME ||
+      (nBitDepth != 16 && nBitDepth != 20 && nBitDepth != 24 && nBitDepth != 32) ||
+      nKB == 0 || nKB > 31 || nChannels == 0 || nChannels > ALAC_MAX_CHANNELS) {
+    return false;
+  }
+
+  m_dwFrameLength = dwFrameLength;
+  m_nBitDepth = nBitDepth;
+  m_nPB = pConfig[6];
+  m_nMB = pConfig[7];
+  m_nKB = nKB;
+  m_nChannels = nChannels;
+  m_dwSampleRate = GetBE(pConfig + 20, 4);
+
+  delete [] m_pPredictor;
+  delete [] m_pMix[0];
+  delete [] m_pMix[1];
+  delete [] m_pShift;
+  m_pPredictor = new int[dwFrameLength];
+  m_pMix[0] = new int[dwFrameLength];
+  m_pMix[1] = new int[dwFrameLength];
+  m_pShift = new unsigned[dwFrameLength * 2];
+  return true;
+}
+
+unsigned
+ALACDecoder::ReadBits(unsigned nBits) {
+  if (nBits == 0) {
+    return 0;
+  }
+  if (nBits > m_dwBits - m_dwPos) {
+    m_dwPos = m_dwBits;
+    m_bOverrun = true;
+    return 0;
+  }
+  unsigned long long v = Peek64(m_pPacket, m_dwPos);
+  m_dwPos += nBits;
+  return (unsigned)(v >> (64 - nBits));
+}
+
+void
+ALACDecoder::SkipBits(unsigned long nBits) {
+  if (nBits > m_dwBits - m_dwPos) {
+    m_dwPos = m_dwBits;
+    m_bOverrun = true;
+    return;
+  }
+  m_dwPos += nBits;
+}
+
+//
+// Decode
+//
+// The elements fill the channels in the order they come. They all have to be there
+// and agree on the frame count; after the last one anything but END is ignored.
+//
+long
+ALACDecoder::Decode(const unsigned char* pPacket, size_t cbPacket, int* pOut) {
+  if (!m_pPredictor || cbPacket >= 0x10000000) {
+    return -1;
+  }
+  if (cbPacket + PACKET_PAD > m_cbPacket) {
+    delete [] m_pPacket;
+    m_cbPacket = cbPacket + PACKET_PAD;
+    m_pPacket = new unsigned char[m_cbPacket];
+  }
+  memcpy(m_pPacket, pPacket, cbPacket);
+  memset(m_pPacket + cbPacket, 0, PACKET_PAD);
+  m_dwBits = (unsigned long)cbPacket * 8;
+  m_dwPos = 0;
+  m_bOverrun = false;
+
+  unsigned nChannel = 0;
+  long lFrames = -1;
+  while (nChannel < m_nChannels) {
+    unsigned nTag = ReadBits(3);
+    if (m_bOverrun) {
+      return -1;
+    }
+
+    switch (nTag) {
+    case ID_SCE:
+    case ID_LFE:
+    case ID_CPE: {
+      unsigned nElementChannels = nTag == ID_CPE ? 2 : 1;
+      unsigned long dwFrames;
+      if (nChannel + nElementChannels > m_nChannels ||
+          !DecodeElement(nElementChannels, pOut, nChannel, &dwFrames) ||
+          (lFrames >= 0 && (unsigned long)lFrames != dwFrames)) {
+        return -1;
+      }
+      lFrames = (long)dwFrames;
+      nChannel += nElementChannels;
+      break;
+    }
+
+    case ID_DSE: {
+      ReadBits(4);              // element instance tag
+      bool bAlign = ReadBits(1) != 0;
+      unsigned long cbData = ReadBits(8);
+      if (cbData == 255) {
+        cbData += ReadBits(8);
+      }
+      if (bAlign) {
+        m_dwPos = (m_dwPos + 7) & ~7UL;
+        if (m_dwPos > m_dwBits) {
+          return -1;
+        }
+      }
+      SkipBits(cbData * 8);
+      break;
+    }
+
+    case ID_FIL: {
+      unsigned long cbData = ReadBits(4);
+      if (cbData == 15) {
+        cbData += ReadBits(8) - 1;
+      }
+      SkipBits(cbData * 8);
+      break;
+    }
+
+    default:                    // END before the last channel, CCE or PCE
+      return -1;
+    }
+
+    if (m_bOverrun) {
+      return -1;
+    }
+  }
+
+  return lFrames;
+}
+
+//
+// DecodeElement
+//
+// element instance tag (4 bits), 12 unused, then a partial frame flag, how many low
+// bytes were shifted off (2 bits) and an escape flag for samples stored as they are.
+// A partial frame gives its frame count (32 bits). A coded element then has the mix
+// shift and weight (8 bits each) and for each channel its prediction mode and
+// denominator shift (4 each), Rice factor (3) and coefficient count (5), and the
+// coefficients (16 each). Then come the low bytes, and each channel's residuals.
+//
+bool
+ALACDecoder::DecodeElement(unsigned nChannels, int* pOut, unsigned nChannel,
+                           unsigned long* pdwFrames) {
+  ReadBits(4);
+  if (ReadBits(12) != 0) {
+    return false;
+  }
+  unsigned nHeader = ReadBits(4);
+  unsigned nShift = ((nHeader >> 1) & 3) * 8;
+  unsigned long dwFrames = m_dwFrameLength;
+  if (nHeader & 8) {
+    dwFrames = ReadBits(32);
+    if (dwFrames > m_dwFrameLength) {
+      return false;
+    }
+  }
+
+  unsigned nMixBits = 0;
+  int nMixRes = 0;
+
+  if (!(nHeader & 1)) {
+    // a pair's side channel needs a bit more than the samples do
+    if (nShift >= m_nBitDepth || m_nBitDepth - nShift + nChannels - 1 > 32) {
+      return false;
+    }
+    unsigned nChanBits = m_nBitDepth - nShift + nChannels - 1;
+    nMixBits = ReadBits(8);
+    nMixRes = (signed char)ReadBits(8);
+    if (nMixBits > 31) {
+      return false;
+    }
+
+    unsigned anMode[2], anDenShift[2], anPBFactor[2];
+    int anActive[2];
+    short aaCoefs[2][32];
+    for (unsigned ch = 0; ch < nChannels; ch++) {
+      unsigned b = ReadBits(8);
+      anMode[ch] = b >> 4;
+      anDenShift[ch] = b & 15;
+      b = ReadBits(8);
+      anPBFactor[ch] = b >> 5;
+      anActive[ch] = b & 31;
+      for (int i = 0; i < anActive[ch]; i++) {
+        aaCoefs[ch][i] = (short)ReadBits(16);
+      }
+    }
+
+    // the low bytes are read once the residuals are done
+    unsigned long dwShiftPos = m_dwPos;
+    if (nShift) {
+      SkipBits((unsigned long)nShift * nChannels * dwFrames);
+    }
+    if (m_bOverrun) {
+      return false;
+    }
+
+    for (unsigned ch = 0; ch < nChannels; ch++) {
+      if (!DecodeResiduals(m_pPredictor, dwFrames, nChanBits, m_nPB * anPBFactor[ch] / 4)) {
+        return false;
+      }
+      if (anMode[ch] != 0) {
+        Unpredict(m_pPredictor, m_pPredictor, dwFrames, NULL, 31, nChanBits, 0);
+      }
+      Unpredict(m_pPredictor, m_pMix[ch], dwFrames, aaCoefs[ch], anActive[ch], nChanBits,
+                anDenShift[ch]);
+    }
+
+    if (nShift) {
+      unsigned long dwEnd = m_dwPos;
+      m_dwPos = dwShiftPos;
+      for (unsigned long i = 0; i < dwFrames * nChannels; i++) {
+        m_pShift[i] = ReadBits(nShift);
+      }
+      m_dwPos = dwEnd;
+    }
+  }
+  else {
+    // stored as they are, a frame at a time
+    unsigned nSignShift = 32 - m_nBitDepth;
+    for (unsigned long i = 0; i < dwFrames; i++) {
+      for (unsigned ch = 0; ch < nChannels; ch++) {
+        m_pMix[ch][i] = SignExtend((int)ReadBits(m_nBitDepth), nSignShift);
+      }
+    }
+    nShift = 0;
+  }
+  if (m_bOverrun) {
+    return false;
+  }
+
+  int* p = pOut + nChannel;
+  unsigned nStride = m_nChannels;
+  if (nChannels == 1) {
+    const int* pU = m_pMix[0];
+    for (unsigned long i = 0; i < dwFrames; i++, p += nStride) {
+      p[0] = nShift ? (int)(((unsigned)pU[i] << nShift) | m_pShift[i]) : pU[i];
+    }
+  }
+  else {
+    const int* pU = m_pMix[0];
+    const int* pV = m_pMix[1];
+    for (unsigned long i = 0; i < dwFrames; i++, p += nStride) {
+      int l = pU[i];
+      int r = pV[i];
+      if (nMixRes) {
+        long long llLeft = (long long)pU[i] + pV[i] - (((long long)nMixRes * pV[i]) >> nMixBits);
+        l = (int)llLeft;
+        r = (int)(llLeft - pV[i]);
+      }
+      if (nShift) {
+        l = (int)(((unsigned)l << nShift) | m_pShift[2 * i]);
+        r = (int)(((unsigned)r << nShift) | m_pShift[2 * i + 1]);
+      }
+      p[0] = l;
+      p[1] = r;
+    }
+  }
+
+  *pdwFrames = dwFrames;
+  return true;
+}
+
+//
+// DecodeResiduals
+//
+// Each value is Rice coded with a k that follows the running mean: a unary prefix, then
+// k bits, or just k - 1 when those are all 0. Nine ones in the prefix escape to
+// the value sent whole. The value's low bit is its sign. When the mean falls low enough
+// a run of zeros follows, coded the same way with its own k.
+//
+bool
+ALACDecoder::DecodeResiduals(int* pResidual, unsigned long dwSamples, unsigned nChanBits,
+                             unsigned nPB) {
+  unsigned nMean = m_nMB;
+  unsigned nWB = (1u << m_nKB) - 1;
+  unsigned nZero = 0;
+  unsigned long dwPos = m_dwPos;
+  unsigned long c = 0;
+
+  while (c < dwSamples) {
+    if (dwPos >= m_dwBits) {
+      return false;
+    }
+
+    unsigned k = 31 - CountLeadingZeros((nMean >> QBSHIFT) + 3);
+    if (k > m_nKB) {
+      k = m_nKB;
+    }
+    unsigned m = (1u << k) - 1;
+
+    unsigned long long qwBits = Peek64(m_pPacket, dwPos);
+    unsigned nPrefix = CountLeadingZeros(~(unsigned)(qwBits >> 32));
+    unsigned n;
+    if (nPrefix >= MAX_PREFIX) {
+      n = (unsigned)((qwBits << MAX_PREFIX) >> (64 - nChanBits));
+      dwPos += MAX_PREFIX + nChanBits;
+    }
+    else {
+      n = nPrefix;
+      dwPos += nPrefix + 1;
+      if (k != 1) {
+        unsigned v = (unsigned)((qwBits << (nPrefix + 1)) >> (64 - k));
+        n = nPrefix * m;
+        dwPos += k - 1;
+        if (v >= 2) {
+          n += v - 1;
+          dwPos++;
+        }
+      }
+    }
+
+    unsigned nValue = n + nZero;
+    int nMagnitude = (int)((nValue + 1) >> 1);
+    pResidual[c++] = (nValue & 1) ? -nMagnitude : nMagnitude;
+
+    nMean = nPB * (n + nZero) + nMean - ((nPB * nMean) >> QBSHIFT);
+    if (n > MEAN_CLAMP) {
+      nMean = MEAN_CLAMP;
+    }
+    nZero = 0;
+
+    if ((nMean << MMULSHIFT) < QB && c < dwSamples) {
+      nZero = 1;
+      k = CountLeadingZeros(nMean) - BITOFF + ((nMean + MOFF) >> MDENSHIFT);
+      m = ((1u << k) - 1) & nWB;
+
+      qwBits = Peek64(m_pPacket, dwPos);
+      nPrefix = CountLeadingZeros(~(unsigned)(qwBits >> 32));
+      if (nPrefix >= MAX_PREFIX) {
+        n = (unsigned)((qwBits << MAX_PREFIX) >> (64 - RUN_BITS));
+        dwPos += MAX_PREFIX + RUN_BITS;
+      }
+      else {
+        unsigned v = (unsigned)((qwBits << (nPrefix + 1)) >> (64 - k));
+        n = nPrefix * m;
+        dwPos += nPrefix + k;
+        if (v >= 2) {
+          n += v - 1;
+          dwPos++;
+        }
+      }
+
+      if (n > dwSamples - c) {
+        return false;
+      }
+      memset(pResidual + c, 0, n * sizeof(int));
+      c += n;
+      if (n >= 65535) {
+        nZero = 0;
+      }
+      nMean = 0;
+    }
+
+    if (dwPos > m_dwBits) {
+      return false;
+    }
+  }
+
+  m_dwPos = dwPos;
+  return true;
+}
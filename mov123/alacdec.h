@@ -0,0 +1,70 @@
+// alacdec.h : Apple Lossless packets to PCM
+//
+// ALACDecoder is set up from the stream's ALACSpecificConfig, the 24 bytes that MP4 keeps
+// in the 'alac' box of its sample entry and CAF calls the magic cookie, and then decodes
+// one packet at a time to interleaved 32 bit integers, right justified at the stream's
+// depth of 16, 20, 24 or 32 bits.
+//
+// A packet is a run of elements up to an END tag. A single channel (SCE) or LFE element
+// holds one channel and a channel pair (CPE) two, the pair stored as a weighted mix
+// that's undone at the end. Each element is either stored as is, or coded: adaptive
+// Golomb-Rice residuals run back through an adaptive linear predictor. Past 16 bits the
+// encoder can take the low bytes off before predicting and send them plain, just ahead
+// of the residuals. DSE and FIL elements are skipped; CCE and PCE, which Apple's encoder
+// never writes, fail the packet.
+//
+// Written from the published format, nothing vendored. The packet is copied into a
+// padded buffer, so the bit reader can always load a whole word, and every read is
+// checked against the packet's real length: a damaged packet fails, it's never read past.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define ALAC_CONFIG_SIZE   24
+#define ALAC_MAX_CHANNELS  8
+#define ALAC_MAX_FRAME     65536    // samples per channel in a packet; Apple writes 4096
+
+class ALACDecoder {
+public:
+  ALACDecoder();
+  ~ALACDecoder();
+
+  // the config, bare or with the 'alac' box header (and a QuickTime 'frma' one) in front
+  bool Init(const unsigned char* pConfig, size_t cbConfig);
+
+  unsigned GetChannels() { return m_nChannels; }
+  unsigned GetBitDepth() { return m_nBitDepth; }
+  unsigned long GetSampleRate() { return m_dwSampleRate; }
+  unsigned long GetFrameLength() { return m_dwFrameLength; }
+
+  // one packet to pOut, which has room for GetFrameLength() frames. Returns the frames
+  // decoded, or -1 if the packet is damaged
+  long Decode(const unsigned char* pPacket, size_t cbPacket, int* pOut);
+
+protected:
+  unsigned ReadBits(unsigned nBits);
+  void SkipBits(unsigned long nBits);
+  bool DecodeElement(unsigned nChannels, int* pOut, unsigned nChannel, unsigned long* pdwFrames);
+  bool DecodeResiduals(int* pResidual, unsigned long dwSamples, unsigned nChanBits,
+                       unsigned nPB);
+
+  unsigned long m_dwFrameLength;
+  unsigned m_nBitDepth;
+  unsigned m_nPB;               // adaptive Rice parameters
+  unsigned m_nMB;
+  unsigned m_nKB;
+  unsigned m_nChannels;
+  unsigned long m_dwSampleRate;
+
+  int* m_pPredictor;            // residuals, then a channel after the predictor
+  int* m_pMix[2];               // the element's channels before unmixing
+  unsigned* m_pShift;           // the low bytes that skipped prediction, two per frame
+
+  unsigned char* m_pPacket;     // a copy of the packet, padded
+  size_t m_cbPacket;            // its room
+  unsigned long m_dwBits;       // the packet's length in bits
+  unsigned long m_dwPos;        // the next bit to read
+  bool m_bOverrun;              // a read went past the end
+};
@@ -12,18 +12,33 @@
 //
 //  mov123 - A very basic Quicktime decoder command line application.
 //
-//  usage:  mov123 <srcfile>
+//  usage:  mov123 [-n] [-f raw|wav|rf64|aiff] [-b 8|16|24|32|float] [-D none|tpdf|shaped] [-s pos] [-e pos] <srcfile>
 //
 //  opens and decodes the first audio track from a QuickTime compatible file.  This includes
 //  Movie files, m4a AAC files, AIFF, WAV and other formats supported natively by quicktime.
-//  Sends to standard out the raw uncompressed audio data in stereo 44.1kS/sec 16bit.
+//  Sends to standard out the raw uncompressed audio data in stereo 44.1kS/sec 16bit, or
+//  with -f the same data with a header in front (see pcmsink.h). -b picks another sample
+//  size, and -D how it's dithered when that has fewer bits than the source (see pcmdither.h).
+//  -s and -e start and stop at a position, [[hh:]mm:]ss[.frac] or a number of samples
+//  followed by 's' as in wmadec, counted from the start of the audio itself.
 //  Output goes to stdout
 //
+//  Without QuickTime, or with -n, Apple Lossless in MP4/M4A is decoded natively instead
+//  (see mp4demux.h and alacdec.h). That's stereo 44.1kS/sec too, a track at another rate
+//  going through PCMResampler (see pcmresample.h) on the way out.
+//  It goes straight to the packet holding -s through the track's sample table and cuts
+//  the output to the sample, and leaves out the encoder's priming and padding where an
+//  iTunSMPB tag or edit list gives them, so gapless albums play gapless.
+//  Where there's no QuickTime at all it builds with just that:
+//
+//      g++ -O2 -o mov123 mov123.cpp mp4demux.cpp alacdec.cpp ../pcmsink/pcmsink.cpp ../pcmsink/pcmdither.cpp ../pcmsink/pcmchmap.cpp ../pcmsink/pcmresample.cpp
+//
+//  tests/check.sh builds it with that line and checks its output for a few short files.
+//
 //  Todo:  - extract channel, sample rate, and sample size information from the movie for
 //           use in reencoding later
 //         - CLI options for:
 //             - specifying output file
-//             - output files for AIFF and WAV
 //             - changing sample rate, sample size, channel count, codec
 //			   - usage
 //	 	   - be graceful about failures
@@ -34,23 +49,41 @@
 //      (modification based on Adrian Bourke's (adrianb@bigpond.net.au) "Modified ConvertMovieSndTrack")
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 
 //#include <io.h>
 
 
+// QuickTime where there is one, the native ALAC decoder everywhere
+#if (defined(WIN32) || defined(__APPLE__)) && !defined(MOV123_NO_QUICKTIME)
+#define MOV123_QUICKTIME
+#endif
+
 #ifdef WIN32
 #include "stdafx.h"
 #include "io.h"
+#ifdef MOV123_QUICKTIME
 #include "Movies.h"
 //#include "SoundComponents.h"
 #include "QuickTimeComponents.h"
 #include "QTML.h"
-#else
+#endif
+#elif defined(MOV123_QUICKTIME)
 #include <QuickTime/QuickTime.h>
 #include <QuickTime/QTML.h>
 #endif
 
+#include "../pcmsink/pcmsink.h"
+#include "../pcmsink/pcmdither.h"
+#include "../pcmsink/pcmchmap.h"
+#include "../pcmsink/pcmresample.h"
+#include "mp4demux.h"
+#include "alacdec.h"
+
+#ifdef MOV123_QUICKTIME
+
 #define BailErr(x) {err = x; if (err != noErr) { fprintf(stderr, "Failed at line: %d\n", __LINE__); goto bail; } }
 
 const UInt32 kMaxBufferSize =  64 * 1024;  // max size of input buffer
@@ -69,9 +102,22 @@ typedef struct {
     MovieExportGetPropertyUPP 	getPropertyProc;
     void 						*refCon;
     long 						trackID;
+    Boolean 					isFirstData;	// nothing's been got since currentTime was set
+    TimeValue 					skipTime;		// how far before currentTime the first data started
 } SCFillBufferData, *SCFillBufferDataPtr;
 
+#endif
+
+int ConvertNative(const char* inFileToConvert);
+
 FILE* outFile;
+PCMFormat outFormat = PCM_RAW;
+unsigned outBits = 16;
+bool outFloat = false;
+PCMDitherMode outDither = DITHER_TPDF;
+bool useNative = false;
+const char* startPos = NULL;
+const char* endPos = NULL;
 
 #ifdef WIN32
 int _tmain(int argc, _TCHAR* argv[])
@@ -81,26 +127,111 @@ int main(int argc, char *argv[])
 {
 	
 //	FSSpec		theDestFSSpec;
-	OSErr		result = 0;
+	int			result = 0;
+	int			arg = 1;
 	
 	outFile = stdout;
 
+	while (arg + 1 < argc && argv[arg][0] == '-') {
+		if (strcmp(argv[arg], "-n") == 0) {
+			useNative = true;
+			arg++;
+			continue;
+		}
+		if (strcmp(argv[arg], "-f") == 0) {
+			if (!PCMSink::ParseFormat(argv[arg + 1], &outFormat)) {
+				fprintf(stderr, "Unknown output format %s\n", argv[arg + 1]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "-b") == 0) {
+			if (!PCMSink::ParseBits(argv[arg + 1], &outBits, &outFloat)) {
+				fprintf(stderr, "Unknown sample size %s\n", argv[arg + 1]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[arg], "-D") == 0) {
+			if (!PCMDither::ParseMode(argv[arg + 1], &outDither)) {
+				fprintf(stderr, "Unknown dither %s\n", argv[arg + 1]);
+				return 1;
+			}
+		}
+		// the positions are only counted in frames once the rate is known
+		else if (strcmp(argv[arg], "-s") == 0 || strcmp(argv[arg], "-e") == 0) {
+			unsigned long long frame;
+			if (!PCMSink::ParsePosition(argv[arg + 1], 44100, &frame)) {
+				fprintf(stderr, "Illegal value passed for %s parameter\n", argv[arg][1] == 's' ? "start" : "end");
+				return 1;
+			}
+			if (argv[arg][1] == 's')
+				startPos = argv[arg + 1];
+			else
+				endPos = argv[arg + 1];
+		}
+		else
+			break;
+		arg += 2;
+	}
+	if (arg >= argc) {
+		fprintf(stderr, "usage: mov123 [-n] [-f raw|wav|rf64|aiff] [-b 8|16|24|32|float] [-D none|tpdf|shaped] [-s pos] [-e pos] <srcfile>\n");
+		return 1;
+	}
+
 #ifdef WIN32
 	_setmode(_fileno(outFile), O_BINARY);	
-	InitializeQTML(0);                        // Initialize QTML
 #endif
-	EnterMovies();
 
-//	if (argc > 2) 
-//		result = NativePathNameToFSSpec(argv[2], &theDestFSSpec, 0 /* flags */);
-//	if (result) {printf("NativePathNameToFSSpec failed on dest file %s with  %d\n",  argv[2],  result); goto bail; }
+#ifdef MOV123_QUICKTIME
+	if (!useNative) {
+#ifdef WIN32
+		InitializeQTML(0);                        // Initialize QTML
+#endif
+		EnterMovies();
+
+//		if (argc > 2) 
+//			result = NativePathNameToFSSpec(argv[2], &theDestFSSpec, 0 /* flags */);
+//		if (result) {printf("NativePathNameToFSSpec failed on dest file %s with  %d\n",  argv[2],  result); goto bail; }
 
-	result = ConvertMovieSndTrack(argv[1]);
+		result = ConvertMovieSndTrack(argv[arg]);
+	}
+	else
+#endif
+		result = ConvertNative(argv[arg]);
 //bail:
 	if (result != 0) { fprintf(stderr, "Conversion failed with error: %d\n", result); }
 	return result;
 }
 
+// * ----------------------------
+// GetWindow
+//
+// the frames -s and -e asked for out of length at rate, the whole of it without them.
+// false, having said why, when they leave nothing between them
+static bool GetWindow(unsigned long rate, unsigned long long length, unsigned long long* start,
+                      unsigned long long* end)
+{
+    *start = 0;
+    *end = length;
+    if (startPos)
+        PCMSink::ParsePosition(startPos, rate, start);
+    if (endPos) {
+        PCMSink::ParsePosition(endPos, rate, end);
+        if (*end <= *start) {
+            fprintf(stderr, "The end must come after the start\n");
+            return false;
+        }
+        if (*end > length)
+            *end = length;
+    }
+    if (*start >= *end && startPos) {
+        fprintf(stderr, "The start is past the end of the audio\n");
+        return false;
+    }
+    return true;
+}
+
+
+#ifdef MOV123_QUICKTIME
 
 #ifndef AVAILABLE_MAC_OS_X_VERSION_10_2_AND_LATER
 #ifndef WIN32
@@ -191,6 +322,16 @@ static pascal Boolean SoundConverterFillBufferDataProc(SoundComponentDataPtr *ou
             }
         }
         else {
+            // the first data can start ahead of the time asked for, at the packet holding
+            // it; the writer trims the difference off the output
+            if (pFillData->isFirstData) {
+                pFillData->isFirstData = false;
+                if (getDataParams.actualTime < pFillData->currentTime) {
+                    pFillData->skipTime = pFillData->currentTime - getDataParams.actualTime;
+                    pFillData->currentTime = getDataParams.actualTime;
+                }
+            }
+            
             pFillData->currentTime += convertTime(getDataParams.actualSampleCount, (pFillData->compData.desc.sampleRate >> 16), pFillData->timescale) * getDataParams.durationPerSample;
         
             // Indicate whether we have more data in the source file. This is redundant with 
@@ -218,6 +359,46 @@ static pascal Boolean SoundConverterFillBufferDataProc(SoundComponentDataPtr *ou
     return (pFillData->isThereMoreSource);
 }
 
+// * ----------------------------
+// WriteSamples
+//
+// writes what the converter gave back, straight to the sink when it's the 16 bit the sink
+// was opened for, or through the dither into pOutBuffer when it's float
+static Boolean WriteSamples(PCMSink* sink, PCMDither* dither, Ptr pDecomBuffer, UInt32 bytes, Ptr pOutBuffer)
+{
+    if (!dither)
+        return sink->Write(pDecomBuffer, bytes);
+    
+    UInt32 count = bytes / sizeof(float);
+    
+#if defined(WIN32) || TARGET_RT_LITTLE_ENDIAN
+    // 'fl32' comes out of the converter big endian, same as the 16 bit format
+    UInt32* pWords = (UInt32*)pDecomBuffer;
+    for (UInt32 i = 0; i < count; i++)
+        pWords[i] = EndianU32_BtoN(pWords[i]);
+#endif
+    
+    dither->Convert((const float*)pDecomBuffer, count, (unsigned char*)pOutBuffer);
+    return sink->Write(pOutBuffer, count * dither->GetBytes());
+}
+
+// * ----------------------------
+// TrimSamples
+//
+// keeps what the converter gave back to the window -s and -e asked for: skipBytes come
+// off the front and nothing goes past bytesLeft
+static void TrimSamples(Ptr* ppData, UInt32* pBytes, UInt32* skipBytes, unsigned long long* bytesLeft)
+{
+    UInt32 skip = *skipBytes < *pBytes ? *skipBytes : *pBytes;
+    *ppData += skip;
+    *pBytes -= skip;
+    *skipBytes -= skip;
+    
+    if (*pBytes > *bytesLeft)
+        *pBytes = (UInt32)*bytesLeft;
+    *bytesLeft -= *pBytes;
+}
+
 // * ----------------------------
 // ConvertMovieSndTrack
 //
@@ -241,6 +422,13 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
     
     SCFillBufferData 		 scFillBufferData = { NULL };
     Ptr						 pDecomBuffer = NULL;
+    Ptr						 pOutBuffer = NULL;
+    Boolean					 isFloatOutput;
+    
+    unsigned long long		 startFrame, endFrame;
+    UInt32					 frameBytes, skipBytes = 0;
+    unsigned long long		 bytesLeft;
+    Boolean					 isSkipSet = false;
     
     Boolean					 isSoundDone = false;
     
@@ -255,6 +443,9 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
     
     CompressionInfo compressionFactor;
     
+    PCMSink sink;
+    PCMDither dither;
+    
     if (strncmp(inFileToConvert, "http:", strlen("http:")) &&
         strncmp(inFileToConvert, "rtsp:", strlen("rtsp:")) &&
         strncmp(inFileToConvert, "ftp:", strlen("ftp:") )) {
@@ -360,10 +551,14 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
         theInputFormat.buffer = NULL;
         theInputFormat.reserved = 0;
         
+        // 16 bits from a source with no more goes straight out, as it always has. Anything
+        // else is decoded to float, and the dither takes it to the size that was asked for
+        isFloatOutput = outFloat || outBits != 16 || theInputFormat.sampleSize > 16;
+        
         theOutputFormat.flags = kNoRealtimeProcessing;
-        theOutputFormat.format = k16BitBigEndianFormat;
+        theOutputFormat.format = isFloatOutput ? kFloat32Format : k16BitBigEndianFormat;
         theOutputFormat.numChannels = 2; // theInputFormat.numChannels;
-        theOutputFormat.sampleSize = 16;
+        theOutputFormat.sampleSize = isFloatOutput ? 32 : 16;
         theOutputFormat.sampleRate = 44100 << 16; //theInputFormat.sampleRate;
         theOutputFormat.sampleCount = 0;
         theOutputFormat.buffer = NULL;
@@ -488,11 +683,38 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
         pDecomBuffer = NewPtr(outputBytes);
         BailErr(MemError());
         
+        // and one for the dither to write to, which never needs more than the floats took
+        if (isFloatOutput) {
+            if (!dither.Init(theOutputFormat.numChannels, theInputFormat.sampleSize, outBits,
+                             outFloat, true, outDither))
+                BailErr(paramErr);
+            pOutBuffer = NewPtr(outputBytes);
+            BailErr(MemError());
+        }
+        
+        // the window, in output frames. The exporter goes to the packet holding the start
+        // through QuickTime's own sample tables, and the end stops it asking for more
+        if (!GetWindow(theOutputSampleRate >> 16,
+                       convertTime(GetMovieDuration(theSrcMovie), GetMovieTimeScale(theSrcMovie), theOutputSampleRate >> 16),
+                       &startFrame, &endFrame))
+            BailErr(paramErr);
+        frameBytes = theOutputFormat.numChannels * (theOutputFormat.sampleSize / 8);
+        bytesLeft = endPos ? (endFrame - startFrame) * frameBytes : ~0ULL;
+        
+        // the header, if one was asked for, goes out before the first samples
+        if (!sink.Open(outFile, outFormat, theOutputSampleRate >> 16, theOutputFormat.numChannels,
+                       isFloatOutput ? outBits : 16, isFloatOutput && outFloat, true))
+            BailErr(ioErr);
+        
         // fill in struct that gets passed to SoundConverterFillBufferDataProc via the refcon
         // this includes the ExtendedSoundComponentData information		
-        scFillBufferData.currentTime = 0;		
+        scFillBufferData.currentTime = convertTime((TimeValue)startFrame, theOutputSampleRate >> 16, scFillBufferData.timescale);
         scFillBufferData.duration = convertTime(GetMovieDuration(theSrcMovie), GetMovieTimeScale(theSrcMovie), scFillBufferData.timescale);
+        if (endPos)
+            scFillBufferData.duration = convertTime((TimeValue)endFrame, theOutputSampleRate >> 16, scFillBufferData.timescale);
         scFillBufferData.isThereMoreSource = true;
+        scFillBufferData.isFirstData = true;
+        scFillBufferData.skipTime = 0;
         
         // if the source is VBR it means we're going to set the kExtendedSoundCommonFrameSizeValid
         // flag and use the commonFrameSize field in the FillBuffer callback
@@ -530,6 +752,17 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
                     isSoundDone = true;
                 }
                 
+                // output only comes once there's been data, so the skip is known by now
+                if (!isSkipSet && !scFillBufferData.isFirstData) {
+                    skipBytes = convertTime(scFillBufferData.skipTime, scFillBufferData.timescale, theOutputSampleRate >> 16) * frameBytes;
+                    isSkipSet = true;
+                }
+                
+                Ptr pData = pDecomBuffer;
+                TrimSamples(&pData, &actualOutputBytes, &skipBytes, &bytesLeft);
+                if (bytesLeft == 0)
+                    isSoundDone = true;
+                
                 // see if output buffer is filled so we can write some data	
                 if (actualOutputBytes > 0) {					
                     // so, what are we going to pass to AddMediaSample?
@@ -547,7 +780,7 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
                         durationPerMediaSample = 1;
                     }
                     
-                    if (!fwrite(pDecomBuffer, actualOutputBytes, 1, outFile)) goto bail;
+                    if (!WriteSamples(&sink, isFloatOutput ? &dither : NULL, pData, actualOutputBytes, pOutBuffer)) goto bail;
                     
                     if (err) break;
                 }
@@ -556,6 +789,9 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
             
             SoundConverterEndConversion(mySoundConverter, pDecomBuffer, &outputFrames, &actualOutputBytes);
             
+            Ptr pData = pDecomBuffer;
+            TrimSamples(&pData, &actualOutputBytes, &skipBytes, &bytesLeft);
+            
             // if there's any left over data write it out
             if (noErr == err && actualOutputBytes > 0) {
                 // see above comments regarding these calculations
@@ -567,7 +803,7 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
                     durationPerMediaSample = 1;
                 }
                 
-                if (!fwrite(pDecomBuffer, actualOutputBytes, 1, outFile)) goto bail;
+                if (!WriteSamples(&sink, isFloatOutput ? &dither : NULL, pData, actualOutputBytes, pOutBuffer)) goto bail;
                 
                 BailErr(err);
             }
@@ -579,12 +815,18 @@ OSErr ConvertMovieSndTrack(const char* inFileToConvert)
     }
         
 bail:
+        // puts the header sizes right, when stdout is a file
+        sink.Close();
+        
         if (mySoundConverter)
             SoundConverterClose(mySoundConverter);
         
         if (pDecomBuffer)
             DisposePtr(pDecomBuffer);
         
+        if (pOutBuffer)
+            DisposePtr(pOutBuffer);
+        
         if (theCompressionParams)
             DisposeHandle(theCompressionParams);
         
@@ -610,3 +852,202 @@ bail:
         return err;
     
 }
+
+#endif // MOV123_QUICKTIME
+
+// the speaker of each channel in ALAC's order, for each channel count: C, L R, C L R,
+// C L R Cs, C L R Ls Rs, C L R Ls Rs LFE, C L R Ls Rs Cs LFE, C Lc Rc L R Ls Rs LFE.
+// PCMChannelMap downmixes them as wmadec's are
+static const PCMSpeaker kALACSpeakers[ALAC_MAX_CHANNELS + 1][ALAC_MAX_CHANNELS] = {
+    { PCM_SPEAKER_FRONT_CENTER },
+    { PCM_SPEAKER_FRONT_CENTER },
+    { PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT, PCM_SPEAKER_BACK_CENTER },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT, PCM_SPEAKER_BACK_LEFT,
+      PCM_SPEAKER_BACK_RIGHT },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT, PCM_SPEAKER_BACK_LEFT,
+      PCM_SPEAKER_BACK_RIGHT, PCM_SPEAKER_LOW_FREQUENCY },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT, PCM_SPEAKER_BACK_LEFT,
+      PCM_SPEAKER_BACK_RIGHT, PCM_SPEAKER_BACK_CENTER, PCM_SPEAKER_LOW_FREQUENCY },
+    { PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT_OF_CENTER, PCM_SPEAKER_FRONT_RIGHT_OF_CENTER,
+      PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT, PCM_SPEAKER_BACK_LEFT, PCM_SPEAKER_BACK_RIGHT,
+      PCM_SPEAKER_LOW_FREQUENCY },
+};
+
+// * ----------------------------
+// Rescale
+//
+// a time from one timescale to another, rounded down
+static unsigned long long Rescale(unsigned long long time, unsigned long from, unsigned long to)
+{
+    if (from == to)
+        return time;
+    return time / from * to + time % from * to / from;
+}
+
+// * ----------------------------
+// WriteNative
+//
+// the native path's samples to the sink, through the resampler if there is one, and no
+// more than *remaining frames of them
+static bool WriteNative(PCMSink* pSink, PCMResampler* pResampler, unsigned char* pData, size_t bytes,
+                        unsigned long long* remaining)
+{
+    if (pResampler)
+        pData = pResampler->Process(pData, bytes, &bytes);
+    size_t frameBytes = 2 * (outBits / 8);
+    if (bytes / frameBytes > *remaining)
+        bytes = (size_t)*remaining * frameBytes;
+    *remaining -= bytes / frameBytes;
+    return pSink->Write(pData, bytes);
+}
+
+// the rate the native path writes, which is what the QuickTime path asks its sound
+// converter for
+static const unsigned long kOutputRate = 44100;
+
+// * ----------------------------
+// ConvertNative
+//
+// decodes Apple Lossless without QuickTime: MP4Demux finds each packet from the track's
+// sample table and ALACDecoder turns it into samples, which go out through the dither
+// like the QuickTime path's floats do. Every packet decodes on its own, so a start
+// partway in only needs the packet holding it, the frames ahead of it in the packet
+// dropped. A track that isn't at kOutputRate is dithered to 24 bits instead and goes
+// through a PCMResampler, and the window is counted at kOutputRate, as QuickTime's is
+int ConvertNative(const char* inFileToConvert)
+{
+    MP4Demux demux;
+    ALACDecoder decoder;
+    PCMSink sink;
+    PCMDither dither;
+    PCMChannelMap chmap;
+    PCMResampler resampler;
+    
+    int* pSamples = NULL;
+    float* pFloats = NULL;
+    unsigned char* pOutBuffer = NULL;
+    int err = 0;
+    
+    err = demux.Open(inFileToConvert);
+    if (err != MP4_OK) {
+        fprintf(stderr, "Can't read a sound track from %s (%d)\n", inFileToConvert, err);
+        return err;
+    }
+    
+    const MP4Track& track = demux.GetTrack();
+    if (track.dwFormat != MP4_TYPE('a', 'l', 'a', 'c')) {
+        fprintf(stderr, "%s isn't Apple Lossless, which is all that's decoded without QuickTime\n", inFileToConvert);
+        return 1;
+    }
+    if (!track.pConfig || !decoder.Init(track.pConfig, track.cbConfig)) {
+        fprintf(stderr, "Bad Apple Lossless config in %s\n", inFileToConvert);
+        return 1;
+    }
+    
+    unsigned channels = decoder.GetChannels();
+    unsigned long rate = decoder.GetSampleRate() ? decoder.GetSampleRate() : track.dwSampleRate;
+    unsigned long frameLength = decoder.GetFrameLength();
+    
+    if (!chmap.InitSpeakers(decoder.GetBitDepth(), channels, kALACSpeakers[channels], 2))
+        return 1;
+    
+    // a downmix has more to it than the source's bits. Resampled, the dither only takes
+    // the samples to 24 bits for the resampler, and the resampler dithers them to outBits
+    bool resample = rate != kOutputRate;
+    if (resample) {
+        dither.Init(2, channels > 2 ? 32 : decoder.GetBitDepth(), 24, false, false, outDither);
+        if (!resampler.Init(rate, 24, kOutputRate, outBits, outFloat, 2, RESAMPLE_QUALITY_DEFAULT,
+                            outDither, true))
+            return 1;
+    }
+    else if (!dither.Init(2, channels > 2 ? 24 : decoder.GetBitDepth(), outBits, outFloat, true, outDither)) {
+        fprintf(stderr, "Can't write %u bit samples\n", outBits);
+        return 1;
+    }
+    
+    // the audio proper starts after the priming and runs for the tag's or edit's length,
+    // or to the end of the packets, and the window is counted from its start
+    unsigned long long delay = Rescale(track.qwDelay, track.dwTimescale, rate);
+    unsigned long long audioFrames = track.qwLength ? Rescale(track.qwLength, track.dwTimescale, rate)
+                                                    : Rescale(track.qwSampleDuration, track.dwTimescale, rate) - delay;
+    unsigned long long outStart, outEnd;
+    if (!GetWindow(kOutputRate, Rescale(audioFrames, rate, kOutputRate), &outStart, &outEnd))
+        return 1;
+    // and at the track's rate, the end rounded up so the resampler has all it needs
+    unsigned long long start = Rescale(outStart, kOutputRate, rate);
+    unsigned long long end = Rescale(outEnd, kOutputRate, rate);
+    if (resample && end < audioFrames)
+        end++;
+    
+    // the packet holding the start, and how far into it that is
+    unsigned long long startFrame = delay + start;
+    unsigned long packet = track.dwSamples;
+    unsigned long long packetTime = 0;
+    unsigned long long skip = 0;
+    if (start < end && demux.FindSample(Rescale(startFrame, rate, track.dwTimescale), &packet, &packetTime))
+        skip = startFrame - Rescale(packetTime, track.dwTimescale, rate);
+    demux.Seek(packet);
+    unsigned long long remaining = end - start;
+    unsigned long long outRemaining = outEnd - outStart;
+    
+    // the header can have the real length when the table's durations are in samples
+    unsigned long long length = PCM_LENGTH_UNKNOWN;
+    if (track.dwTimescale == rate)
+        length = outRemaining * 2 * (outBits / 8);
+    
+    if (!sink.Open(outFile, outFormat, kOutputRate, 2, outBits, outFloat, true, length))
+        return 1;
+    
+    pSamples = new int[frameLength * channels];
+    pFloats = new float[frameLength * 2];
+    pOutBuffer = new unsigned char[frameLength * 2 * 4];
+    
+    const unsigned char* pPacket;
+    unsigned long packetBytes;
+    while (remaining > 0 && demux.ReadPacket(&pPacket, &packetBytes)) {
+        long frames = decoder.Decode(pPacket, packetBytes, pSamples);
+        if (frames < 0) {
+            fprintf(stderr, "Packet %lu of %s is damaged\n", demux.GetSample() - 1, inFileToConvert);
+            err = 1;
+            break;
+        }
+        
+        // the first packet can start before the window and the last run on past it
+        long first = skip < (unsigned long long)frames ? (long)skip : frames;
+        skip -= first;
+        frames -= first;
+        if ((unsigned long long)frames > remaining)
+            frames = (long)remaining;
+        remaining -= frames;
+        
+        chmap.MapFloat(pSamples + first * channels, frames, pFloats);
+        dither.Convert(pFloats, frames * 2, pOutBuffer);
+        if (!WriteNative(&sink, resample ? &resampler : NULL, pOutBuffer, frames * 2 * dither.GetBytes(),
+                         &outRemaining)) {
+            err = 1;
+            break;
+        }
+    }
+    // what the resampler's filter still holds
+    if (!err && resample) {
+        size_t bytes;
+        unsigned char* pOut = resampler.Drain(&bytes);
+        if (!WriteNative(&sink, NULL, pOut, bytes, &outRemaining))
+            err = 1;
+    }
+    if (!err && remaining > 0 && demux.GetSample() < track.dwSamples) {
+        fprintf(stderr, "Packet %lu of %s is past the end of the file\n", demux.GetSample(), inFileToConvert);
+        err = 1;
+    }
+    
+    // puts the header sizes right, when stdout is a file
+    sink.Close();
+    
+    delete [] pSamples;
+    delete [] pFloats;
+    delete [] pOutBuffer;
+    
+    return err;
+}
@@ -0,0 +1,735 @@
+// mp4demux.cpp : the sound track of an MP4 or M4A file - see mp4demux.h
+//
+
+#include <string.h>
+#include "mp4demux.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define FULL_BOX        4       // version and flags, ahead of a full box's fields
+#define AUDIO_ENTRY     28      // a version 0 sound sample entry, after its box header
+#define AUDIO_ENTRY_V1  16      // what version 1 adds
+#define AUDIO_ENTRY_V2  36      // and version 2
+
+static unsigned long long
+GetBE(const unsigned char* p, int nBytes) {
+  unsigned long long v = 0;
+  for (int i = 0; i < nBytes; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+//
+// NextBox
+//
+// the size of the box at p, its type and the size of its header, or 0 if it isn't a
+// whole one inside cb. A size of 1 means a 64 bit one follows the type, and 0 that the
+// box runs to the end of whatever holds it
+//
+static unsigned long long
+NextBox(const unsigned char* p, unsigned long long cb, unsigned long* pdwType,
+        unsigned* pcbHeader) {
+  if (cb < 8) {
+    return 0;
+  }
+  unsigned long long cbBox = GetBE(p, 4);
+  *pdwType = (unsigned long)GetBE(p + 4, 4);
+  *pcbHeader = 8;
+  if (cbBox == 1) {
+    if (cb < 16) {
+      return 0;
+    }
+    cbBox = GetBE(p + 8, 8);
+    *pcbHeader = 16;
+  }
+  else if (cbBox == 0) {
+    cbBox = cb;
+  }
+  if (cbBox < *pcbHeader || cbBox > cb) {
+    return 0;
+  }
+  return cbBox;
+}
+
+//
+// FindBox
+//
+// the contents of the first box of a type among those in p, and their size
+//
+static const unsigned char*
+FindBox(const unsigned char* p, unsigned long long cb, unsigned long dwType,
+        unsigned long long* pcbBox) {
+  unsigned long dwBoxType;
+  unsigned cbHeader;
+  unsigned long long cbBox;
+  while ((cbBox = NextBox(p, cb, &dwBoxType, &cbHeader)) != 0) {
+    if (dwBoxType == dwType) {
+      *pcbBox = cbBox - cbHeader;
+      return p + cbHeader;
+    }
+    p += cbBox;
+    cb -= cbBox;
+  }
+  return NULL;
+}
+
+//
+// FindConfig
+//
+// the codec config box in a sample entry, header and all. QuickTime files can have it
+// inside a 'wave' box, after a 'frma' box naming the format again
+//
+static const unsigned char*
+FindConfig(const unsigned char* p, unsigned long long cb, unsigned long dwConfig,
+           unsigned long long* pcbBox) {
+  unsigned long dwBoxType;
+  unsigned cbHeader;
+  unsigned long long cbBox;
+  while ((cbBox = NextBox(p, cb, &dwBoxType, &cbHeader)) != 0) {
+    if (dwBoxType == dwConfig) {
+      *pcbBox = cbBox;
+      return p;
+    }
+    if (dwBoxType == MP4_TYPE('w', 'a', 'v', 'e')) {
+      const unsigned char* pConfig = FindConfig(p + cbHeader, cbBox - cbHeader, dwConfig, pcbBox);
+      if (pConfig) {
+        return pConfig;
+      }
+    }
+    p += cbBox;
+    cb -= cbBox;
+  }
+  return NULL;
+}
+
+//
+// GetHex
+//
+// the next field of hex digits in an iTunSMPB string, after any spaces
+//
+static unsigned long long
+GetHex(const unsigned char** pp, const unsigned char* pEnd) {
+  const unsigned char* p = *pp;
+  while (p < pEnd && *p == ' ') {
+    p++;
+  }
+  unsigned long long v = 0;
+  for (; p < pEnd; p++) {
+    unsigned nDigit;
+    if (*p >= '0' && *p <= '9') {
+      nDigit = *p - '0';
+    }
+    else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+      nDigit = (*p | 0x20) - 'a' + 10;
+    }
+    else {
+      break;
+    }
+    v = (v << 4) | nDigit;
+  }
+  *pp = p;
+  return v;
+}
+
+MP4Demux::MP4Demux() {
+  m_pData = NULL;
+  m_cbData = 0;
+  m_pView = NULL;
+  m_cbView = 0;
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hMapping = NULL;
+#endif
+  Parse(NULL, 0);
+}
+
+MP4Demux::~MP4Demux() {
+  Close();
+}
+
+void
+MP4Demux::Close() {
+#ifdef _WIN32
+  if (m_pView) {
+    UnmapViewOfFile(m_pView);
+  }
+  if (m_hMapping) {
+    CloseHandle(m_hMapping);
+  }
+  if (m_hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hFile);
+  }
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hMapping = NULL;
+#else
+  if (m_pView) {
+    munmap((void*)m_pView, m_cbView);
+  }
+#endif
+  m_pView = NULL;
+  m_cbView = 0;
+}
+
+int
+MP4Demux::Open(const char* pszFile) {
+  Close();
+  Parse(NULL, 0);
+
+#ifdef _WIN32
+  m_hFile = CreateFileA(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE) {
+    return MP4_ERR_OPEN;
+  }
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(m_hFile, &liSize) || (unsigned long long)liSize.QuadPart > (size_t)-1) {
+    return MP4_ERR_OPEN;
+  }
+  if (liSize.QuadPart == 0) {
+    return MP4_ERR_NOT_MP4;
+  }
+  m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!m_hMapping) {
+    return MP4_ERR_OPEN;
+  }
+  m_pView = (const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (!m_pView) {
+    return MP4_ERR_OPEN;
+  }
+  m_cbView = (size_t)liSize.QuadPart;
+#else
+  int fd = open(pszFile, O_RDONLY);
+  if (fd < 0) {
+    return MP4_ERR_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (unsigned long long)st.st_size > (size_t)-1) {
+    close(fd);
+    return MP4_ERR_OPEN;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return MP4_ERR_NOT_MP4;
+  }
+  void* pView = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (pView == MAP_FAILED) {
+    return MP4_ERR_OPEN;
+  }
+  m_pView = (const unsigned char*)pView;
+  m_cbView = (size_t)st.st_size;
+#endif
+
+  return Parse(m_pView, m_cbView);
+}
+
+//
+// Parse
+//
+// The top level boxes are walked by their sizes, so mdat is never touched and moov can
+// be before or after it. The first sound track with a sample table that makes sense is
+// the one used.
+//
+int
+MP4Demux::Parse(const unsigned char* pData, size_t cbData) {
+  memset(&m_track, 0, sizeof(m_track));
+  m_dwMovieTimescale = 0;
+  m_pStts = NULL;
+  m_dwSttsEntries = 0;
+  m_pStsc = NULL;
+  m_dwStscEntries = 0;
+  m_pStsz = NULL;
+  m_dwSampleSize = 0;
+  m_pStco = NULL;
+  m_dwChunks = 0;
+  m_bCo64 = false;
+  m_dwSample = 0;
+  m_dwChunk = 0;
+  m_dwInChunk = 0;
+  m_dwChunkSamples = 0;
+  m_dwRun = 0;
+  m_qwOffset = 0;
+  m_pData = pData;
+  m_cbData = cbData;
+  if (!pData) {
+    return MP4_ERR_NOT_MP4;
+  }
+
+  unsigned long long cbMoov;
+  const unsigned char* pMoov = FindBox(pData, cbData, MP4_TYPE('m', 'o', 'o', 'v'), &cbMoov);
+  if (!pMoov) {
+    return MP4_ERR_NOT_MP4;
+  }
+
+  // the creation and modification times, then the timescale, which is all that's
+  // wanted. The times are 64 bit in version 1
+  unsigned long long cbBox;
+  const unsigned char* pBox = FindBox(pMoov, cbMoov, MP4_TYPE('m', 'v', 'h', 'd'), &cbBox);
+  if (pBox && cbBox >= FULL_BOX + 20) {
+    m_dwMovieTimescale = (unsigned long)GetBE(pBox + FULL_BOX + (pBox[0] == 1 ? 16 : 8), 4);
+  }
+
+  int nResult = MP4_ERR_NO_AUDIO;
+  const unsigned char* p = pMoov;
+  unsigned long long cb = cbMoov;
+  unsigned long dwType;
+  unsigned cbHeader;
+  while ((cbBox = NextBox(p, cb, &dwType, &cbHeader)) != 0) {
+    if (dwType == MP4_TYPE('t', 'r', 'a', 'k')) {
+      int nTrak = ParseTrak(p + cbHeader, cbBox - cbHeader);
+      if (nTrak == MP4_OK) {
+        ParseTags(pMoov, cbMoov);
+        // neither the edit nor the tag can have the audio run on past the packets
+        if (m_track.qwDelay > m_track.qwSampleDuration) {
+          m_track.qwDelay = m_track.qwSampleDuration;
+        }
+        if (m_track.qwLength > m_track.qwSampleDuration - m_track.qwDelay) {
+          m_track.qwLength = m_track.qwSampleDuration - m_track.qwDelay;
+        }
+        return Seek(0) ? MP4_OK : MP4_ERR_BAD_TABLE;
+      }
+      if (nTrak == MP4_ERR_BAD_TABLE) {
+        nResult = nTrak;
+      }
+    }
+    p += cbBox;
+    cb -= cbBox;
+  }
+  return nResult;
+}
+
+//
+// ParseTrak
+//
+// trak/mdia holds the handler, mdhd and minf/stbl, and trak/edts the edits
+//
+int
+MP4Demux::ParseTrak(const unsigned char* p, unsigned long long cb) {
+  unsigned long long cbMdia, cbBox;
+  const unsigned char* pMdia = FindBox(p, cb, MP4_TYPE('m', 'd', 'i', 'a'), &cbMdia);
+  if (!pMdia) {
+    return MP4_ERR_NO_AUDIO;
+  }
+
+  // pre-defined, then the handler type
+  const unsigned char* pBox = FindBox(pMdia, cbMdia, MP4_TYPE('h', 'd', 'l', 'r'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX + 8 ||
+      GetBE(pBox + FULL_BOX + 4, 4) != MP4_TYPE('s', 'o', 'u', 'n')) {
+    return MP4_ERR_NO_AUDIO;
+  }
+
+  memset(&m_track, 0, sizeof(m_track));
+
+  // creation and modification times, timescale and duration, all 64 bit in version 1
+  // but the timescale
+  pBox = FindBox(pMdia, cbMdia, MP4_TYPE('m', 'd', 'h', 'd'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  if (pBox[0] == 1) {
+    if (cbBox < FULL_BOX + 28) {
+      return MP4_ERR_BAD_TABLE;
+    }
+    m_track.dwTimescale = (unsigned long)GetBE(pBox + FULL_BOX + 16, 4);
+    m_track.qwDuration = GetBE(pBox + FULL_BOX + 20, 8);
+  }
+  else {
+    if (cbBox < FULL_BOX + 16) {
+      return MP4_ERR_BAD_TABLE;
+    }
+    m_track.dwTimescale = (unsigned long)GetBE(pBox + FULL_BOX + 8, 4);
+    m_track.qwDuration = GetBE(pBox + FULL_BOX + 12, 4);
+  }
+  if (m_track.dwTimescale == 0) {
+    return MP4_ERR_BAD_TABLE;
+  }
+
+  unsigned long long cbEdts;
+  const unsigned char* pEdts = FindBox(p, cb, MP4_TYPE('e', 'd', 't', 's'), &cbEdts);
+  if (pEdts) {
+    ParseEdit(pEdts, cbEdts);
+  }
+
+  unsigned long long cbMinf, cbStbl;
+  const unsigned char* pMinf = FindBox(pMdia, cbMdia, MP4_TYPE('m', 'i', 'n', 'f'), &cbMinf);
+  const unsigned char* pStbl = pMinf ? FindBox(pMinf, cbMinf, MP4_TYPE('s', 't', 'b', 'l'), &cbStbl) : NULL;
+  if (!pStbl) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  return ParseStbl(pStbl, cbStbl);
+}
+
+//
+// ParseEdit
+//
+// elst's entry count, then each edit's duration in the movie's timescale, where it
+// starts in the track's, and its rate in 16.16, the first two 64 bit in version 1. An
+// edit starting at -1 is empty, a pause ahead of the audio, and is passed over. The
+// duration is rounded up into the track's timescale, as writers round it up into the
+// movie's, so a coarse movie timescale can't cut the end of the audio off. A damaged
+// elst is no edit at all.
+//
+void
+MP4Demux::ParseEdit(const unsigned char* p, unsigned long long cb) {
+  unsigned long long cbBox;
+  const unsigned char* pBox = FindBox(p, cb, MP4_TYPE('e', 'l', 's', 't'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX + 4) {
+    return;
+  }
+  unsigned nField = pBox[0] == 1 ? 8 : 4;
+  unsigned long long qwEntries = GetBE(pBox + FULL_BOX, 4);
+  if (qwEntries > (cbBox - FULL_BOX - 4) / (2 * nField + 4)) {
+    return;
+  }
+  unsigned long long qwEmpty = nField == 8 ? ~0ULL : 0xFFFFFFFFULL;
+  for (unsigned long long i = 0; i < qwEntries; i++) {
+    const unsigned char* pEntry = pBox + FULL_BOX + 4 + i * (2 * nField + 4);
+    unsigned long long qwStart = GetBE(pEntry + nField, nField);
+    if (qwStart == qwEmpty) {
+      continue;
+    }
+    unsigned long long qwDuration = GetBE(pEntry, nField);
+    m_track.qwDelay = qwStart;
+    if (m_dwMovieTimescale && qwDuration <= ~0ULL / m_track.dwTimescale) {
+      m_track.qwLength = (qwDuration * m_track.dwTimescale + m_dwMovieTimescale - 1) /
+                         m_dwMovieTimescale;
+    }
+    return;
+  }
+}
+
+//
+// ParseTags
+//
+// iTunes keeps iTunSMPB in moov/udta/meta/ilst as a '----' item: a 'mean' of
+// com.apple.iTunes, a 'name' and a 'data', the first two full boxes and the last a type
+// and locale ahead of the text. The text is hex fields, a 0, the priming, the padding,
+// the length and more that isn't wanted. meta is a full box in MP4 but not in
+// QuickTime, where hdlr comes straight after its header.
+//
+void
+MP4Demux::ParseTags(const unsigned char* p, unsigned long long cb) {
+  unsigned long long cbUdta, cbMeta, cbIlst;
+  const unsigned char* pUdta = FindBox(p, cb, MP4_TYPE('u', 'd', 't', 'a'), &cbUdta);
+  const unsigned char* pMeta = pUdta ? FindBox(pUdta, cbUdta, MP4_TYPE('m', 'e', 't', 'a'), &cbMeta) : NULL;
+  if (!pMeta || cbMeta < FULL_BOX + 8) {
+    return;
+  }
+  if (GetBE(pMeta + 4, 4) != MP4_TYPE('h', 'd', 'l', 'r')) {
+    pMeta += FULL_BOX;
+    cbMeta -= FULL_BOX;
+  }
+  const unsigned char* pIlst = FindBox(pMeta, cbMeta, MP4_TYPE('i', 'l', 's', 't'), &cbIlst);
+  if (!pIlst) {
+    return;
+  }
+
+  unsigned long dwType;
+  unsigned cbHeader;
+  unsigned long long cbItem;
+  for (; (cbItem = NextBox(pIlst, cbIlst, &dwType, &cbHeader)) != 0; pIlst += cbItem, cbIlst -= cbItem) {
+    if (dwType != MP4_TYPE('-', '-', '-', '-')) {
+      continue;
+    }
+    const unsigned char* pItem = pIlst + cbHeader;
+    unsigned long long cbMean = 0, cbName = 0, cbText = 0;
+    const unsigned char* pMean = FindBox(pItem, cbItem - cbHeader, MP4_TYPE('m', 'e', 'a', 'n'), &cbMean);
+    const unsigned char* pName = FindBox(pItem, cbItem - cbHeader, MP4_TYPE('n', 'a', 'm', 'e'), &cbName);
+    const unsigned char* pText = FindBox(pItem, cbItem - cbHeader, MP4_TYPE('d', 'a', 't', 'a'), &cbText);
+    if (!pMean || cbMean != FULL_BOX + 16 || memcmp(pMean + FULL_BOX, "com.apple.iTunes", 16) != 0 ||
+        !pName || cbName != FULL_BOX + 8 || memcmp(pName + FULL_BOX, "iTunSMPB", 8) != 0 ||
+        !pText || cbText < 8) {
+      continue;
+    }
+
+    const unsigned char* pEnd = pText + cbText;
+    pText += 8;
+    GetHex(&pText, pEnd);
+    unsigned long long qwDelay = GetHex(&pText, pEnd);
+    unsigned long long qwPadding = GetHex(&pText, pEnd);
+    unsigned long long qwLength = GetHex(&pText, pEnd);
+    if (qwLength == 0 && qwDelay <= m_track.qwSampleDuration &&
+        qwPadding < m_track.qwSampleDuration - qwDelay) {
+      qwLength = m_track.qwSampleDuration - qwDelay - qwPadding;
+    }
+    if (qwLength != 0 && qwDelay < m_track.qwSampleDuration) {
+      m_track.qwDelay = qwDelay;
+      m_track.qwLength = qwLength;
+    }
+    return;
+  }
+}
+
+//
+// ParseStbl
+//
+// Each table is a full box with an entry count ahead of its entries, but for stsz,
+// which has a size for every packet first and only uses the entries when it's 0. stz2's
+// compact sizes aren't supported; nothing we'd decode uses them.
+//
+int
+MP4Demux::ParseStbl(const unsigned char* p, unsigned long long cb) {
+  // nothing from a sound track before this one that failed to parse
+  m_pStts = NULL;
+  m_dwSttsEntries = 0;
+  m_pStsc = NULL;
+  m_dwStscEntries = 0;
+  m_pStsz = NULL;
+  m_dwSampleSize = 0;
+  m_pStco = NULL;
+  m_dwChunks = 0;
+  m_bCo64 = false;
+
+  unsigned long long cbBox;
+  const unsigned char* pBox = FindBox(p, cb, MP4_TYPE('s', 't', 's', 'd'), &cbBox);
+  if (!pBox || !ParseStsd(pBox, cbBox)) {
+    return MP4_ERR_BAD_TABLE;
+  }
+
+  pBox = FindBox(p, cb, MP4_TYPE('s', 't', 't', 's'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX + 4) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  m_dwSttsEntries = (unsigned long)GetBE(pBox + FULL_BOX, 4);
+  m_pStts = pBox + FULL_BOX + 4;
+  if (m_dwSttsEntries > (cbBox - FULL_BOX - 4) / 8) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  for (unsigned long i = 0; i < m_dwSttsEntries; i++) {
+    m_track.qwSampleDuration += GetBE(m_pStts + 8 * i, 4) * GetBE(m_pStts + 8 * i + 4, 4);
+  }
+
+  pBox = FindBox(p, cb, MP4_TYPE('s', 't', 's', 'z'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX + 8) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  m_dwSampleSize = (unsigned long)GetBE(pBox + FULL_BOX, 4);
+  m_track.dwSamples = (unsigned long)GetBE(pBox + FULL_BOX + 4, 4);
+  if (m_dwSampleSize == 0) {
+    m_pStsz = pBox + FULL_BOX + 8;
+    if (m_track.dwSamples > (cbBox - FULL_BOX - 8) / 4) {
+      return MP4_ERR_BAD_TABLE;
+    }
+  }
+
+  pBox = FindBox(p, cb, MP4_TYPE('s', 't', 'c', 'o'), &cbBox);
+  if (!pBox) {
+    pBox = FindBox(p, cb, MP4_TYPE('c', 'o', '6', '4'), &cbBox);
+    m_bCo64 = true;
+  }
+  if (!pBox || cbBox < FULL_BOX + 4) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  m_dwChunks = (unsigned long)GetBE(pBox + FULL_BOX, 4);
+  m_pStco = pBox + FULL_BOX + 4;
+  if (m_dwChunks > (cbBox - FULL_BOX - 4) / (m_bCo64 ? 8 : 4)) {
+    return MP4_ERR_BAD_TABLE;
+  }
+
+  // first chunk (from 1), packets per chunk and sample entry for each run. The runs
+  // have to start at the first chunk and go up, and have enough for every packet
+  pBox = FindBox(p, cb, MP4_TYPE('s', 't', 's', 'c'), &cbBox);
+  if (!pBox || cbBox < FULL_BOX + 4) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  m_dwStscEntries = (unsigned long)GetBE(pBox + FULL_BOX, 4);
+  m_pStsc = pBox + FULL_BOX + 4;
+  if (m_dwStscEntries > (cbBox - FULL_BOX - 4) / 12) {
+    return MP4_ERR_BAD_TABLE;
+  }
+  unsigned long long qwCovered = 0;
+  for (unsigned long i = 0; i < m_dwStscEntries; i++) {
+    unsigned long long qwFirst = GetBE(m_pStsc + 12 * i, 4);
+    unsigned long long qwEnd = i + 1 < m_dwStscEntries ? GetBE(m_pStsc + 12 * (i + 1), 4)
+                                                       : (unsigned long long)m_dwChunks + 1;
+    unsigned long long qwPerChunk = GetBE(m_pStsc + 12 * i + 4, 4);
+    if ((i == 0 && qwFirst != 1) || qwEnd <= qwFirst || qwEnd > (unsigned long long)m_dwChunks + 1 ||
+        qwPerChunk == 0) {
+      return MP4_ERR_BAD_TABLE;
+    }
+    qwCovered += (qwEnd - qwFirst) * qwPerChunk;
+  }
+  if (qwCovered < m_track.dwSamples) {
+    return MP4_ERR_BAD_TABLE;
+  }
+
+  return MP4_OK;
+}
+
+//
+// ParseStsd
+//
+// The entry count, then the first sample entry: reserved and data reference index,
+// version, revision level and vendor, channels, sample size, compression ID, packet
+// size and the sample rate in 16.16. Version 1 adds four packet sizes and version 2 a
+// block with the rate as a double, and the channels and sample size again. The codec's
+// config box comes after.
+//
+bool
+MP4Demux::ParseStsd(const unsigned char* p, unsigned long long cb) {
+  if (cb < FULL_BOX + 4 || GetBE(p + FULL_BOX, 4) == 0) {
+    return false;
+  }
+  p += FULL_BOX + 4;
+  cb -= FULL_BOX + 4;
+
+  unsigned long dwType;
+  unsigned cbHeader;
+  unsigned long long cbEntry = NextBox(p, cb, &dwType, &cbHeader);
+  if (cbEntry < cbHeader + AUDIO_ENTRY) {
+    return false;
+  }
+  const unsigned char* pEntry = p + cbHeader;
+  cbEntry -= cbHeader;
+
+  m_track.dwFormat = dwType;
+  m_track.nChannels = (unsigned)GetBE(pEntry + 16, 2);
+  m_track.nSampleSize = (unsigned)GetBE(pEntry + 18, 2);
+  m_track.dwSampleRate = (unsigned long)(GetBE(pEntry + 24, 4) >> 16);
+
+  unsigned long long cbFields = AUDIO_ENTRY;
+  unsigned nVersion = (unsigned)GetBE(pEntry + 8, 2);
+  if (nVersion == 1) {
+    cbFields += AUDIO_ENTRY_V1;
+  }
+  else if (nVersion == 2) {
+    cbFields += AUDIO_ENTRY_V2;
+    if (cbEntry < cbFields) {
+      return false;
+    }
+    unsigned long long qwRate = GetBE(pEntry + 32, 8);
+    double dRate;
+    memcpy(&dRate, &qwRate, sizeof(dRate));
+    m_track.dwSampleRate = dRate > 0 && dRate < 4294967296.0 ? (unsigned long)(dRate + 0.5) : 0;
+    m_track.nChannels = (unsigned)GetBE(pEntry + 40, 4);
+    m_track.nSampleSize = (unsigned)GetBE(pEntry + 48, 4);
+  }
+  if (cbEntry < cbFields) {
+    return false;
+  }
+
+  unsigned long dwConfig = dwType == MP4_TYPE('m', 'p', '4', 'a') ? MP4_TYPE('e', 's', 'd', 's') : dwType;
+  unsigned long long cbConfig = 0;
+  m_track.pConfig = FindConfig(pEntry + cbFields, cbEntry - cbFields, dwConfig, &cbConfig);
+  m_track.cbConfig = (size_t)cbConfig;
+  return true;
+}
+
+unsigned long
+MP4Demux::GetSampleSize(unsigned long dwSample) {
+  return m_pStsz ? (unsigned long)GetBE(m_pStsz + 4 * dwSample, 4) : m_dwSampleSize;
+}
+
+unsigned long long
+MP4Demux::GetChunkOffset(unsigned long dwChunk) {
+  return m_bCo64 ? GetBE(m_pStco + 8 * dwChunk, 8) : GetBE(m_pStco + 4 * dwChunk, 4);
+}
+
+unsigned long
+MP4Demux::GetRunChunk(unsigned long dwRun) {
+  return (unsigned long)GetBE(m_pStsc + 12 * dwRun, 4) - 1;
+}
+
+//
+// FindSample
+//
+// The stts runs are walked until the one holding qwTime, whose packets all play for the
+// same time, so the packet comes from a division.
+//
+bool
+MP4Demux::FindSample(unsigned long long qwTime, unsigned long* pdwSample,
+                     unsigned long long* pqwSampleTime) {
+  unsigned long long qwRunTime = 0;
+  unsigned long long qwRunSample = 0;
+  for (unsigned long i = 0; i < m_dwSttsEntries; i++) {
+    unsigned long long qwCount = GetBE(m_pStts + 8 * i, 4);
+    unsigned long long qwDelta = GetBE(m_pStts + 8 * i + 4, 4);
+    if (qwTime < qwRunTime + qwCount * qwDelta) {
+      unsigned long long qwIn = (qwTime - qwRunTime) / qwDelta;
+      if (qwRunSample + qwIn >= m_track.dwSamples) {
+        return false;
+      }
+      *pdwSample = (unsigned long)(qwRunSample + qwIn);
+      *pqwSampleTime = qwRunTime + qwIn * qwDelta;
+      return true;
+    }
+    qwRunTime += qwCount * qwDelta;
+    qwRunSample += qwCount;
+  }
+  return false;
+}
+
+//
+// Seek
+//
+// Each stsc run covers the chunks up to the next one's first, all with the same number
+// of packets, so the packet's run, then its chunk, come from a walk over the runs and a
+// division. The sizes of the packets ahead of it in its chunk give its offset.
+//
+bool
+MP4Demux::Seek(unsigned long dwSample) {
+  if (dwSample > m_track.dwSamples) {
+    return false;
+  }
+  m_dwSample = dwSample;
+  if (dwSample == m_track.dwSamples) {
+    return true;
+  }
+
+  unsigned long long qwFirst = 0;
+  for (unsigned long i = 0; i < m_dwStscEntries; i++) {
+    unsigned long dwEnd = i + 1 < m_dwStscEntries ? GetRunChunk(i + 1) : m_dwChunks;
+    unsigned long dwPerChunk = (unsigned long)GetBE(m_pStsc + 12 * i + 4, 4);
+    unsigned long long qwRun = (unsigned long long)(dwEnd - GetRunChunk(i)) * dwPerChunk;
+    if (dwSample < qwFirst + qwRun) {
+      unsigned long dwInRun = (unsigned long)(dwSample - qwFirst);
+      m_dwRun = i;
+      m_dwChunk = GetRunChunk(i) + dwInRun / dwPerChunk;
+      m_dwInChunk = dwInRun % dwPerChunk;
+      m_dwChunkSamples = dwPerChunk;
+      m_qwOffset = GetChunkOffset(m_dwChunk);
+      for (unsigned long j = dwSample - m_dwInChunk; j < dwSample; j++) {
+        m_qwOffset += GetSampleSize(j);
+      }
+      return true;
+    }
+    qwFirst += qwRun;
+  }
+  return false;
+}
+
+bool
+MP4Demux::ReadPacket(const unsigned char** ppData, unsigned long* pcbData) {
+  if (m_dwSample >= m_track.dwSamples) {
+    return false;
+  }
+  unsigned long cbPacket = GetSampleSize(m_dwSample);
+  if (m_qwOffset > m_cbData || cbPacket > m_cbData - m_qwOffset) {
+    return false;
+  }
+  *ppData = m_pData + m_qwOffset;
+  *pcbData = cbPacket;
+
+  m_dwSample++;
+  m_qwOffset += cbPacket;
+  if (++m_dwInChunk == m_dwChunkSamples && m_dwSample < m_track.dwSamples) {
+    m_dwChunk++;
+    m_dwInChunk = 0;
+    if (m_dwRun + 1 < m_dwStscEntries && m_dwChunk == GetRunChunk(m_dwRun + 1)) {
+      m_dwRun++;
+      m_dwChunkSamples = (unsigned long)GetBE(m_pStsc + 12 * m_dwRun + 4, 4);
+    }
+    m_qwOffset = GetChunkOffset(m_dwChunk);
+  }
+  return true;
+}
@@ -0,0 +1,127 @@
+// mp4demux.h : the sound track of an MP4 or M4A file, a packet at a time
+//
+// MP4Demux maps the file and walks its boxes down to the first track whose handler is
+// 'soun', taking from it:
+//
+//   mdhd        the track's timescale and duration
+//   edts/elst   the first edit that isn't empty: where the audio starts, past the
+//               encoder's priming, and how long it plays
+//   stsd        the first sample entry: codec, channels, sample size and rate, and the
+//               codec's own config box ('alac' or 'esds', or either inside 'wave')
+//   stts        how long each packet plays, in runs
+//   stsc        how many packets each chunk holds, in runs
+//   stsz        each packet's size, or one size for them all
+//   stco/co64   where each chunk starts
+//
+// and from moov, mvhd's timescale for the edit, and the iTunSMPB tag iTunes keeps in
+// udta/meta/ilst, with the priming and padding of its gapless files. Where there's an
+// iTunSMPB it's used over the edit.
+//
+// Nothing else is read, mdat included: the tables say where every packet is, so any of
+// them can be had directly. FindSample turns a time into a packet through stts, Seek
+// finds the packet's chunk through stsc and its offset by adding up the sizes before it
+// in that chunk, and ReadPacket then steps on a packet at a time without going back to
+// stsc. The tables are left where they are in the mapping.
+// Every count is checked against the size of its box, and every packet against the
+// file's, so a damaged file fails rather than being read past.
+//
+// Like wmaprobe, it only uses the C library and the system's file mapping.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define MP4_TYPE(a, b, c, d) \
+  (((unsigned long)(a) << 24) | ((unsigned long)(b) << 16) | ((c) << 8) | (d))
+
+enum {
+  MP4_OK = 0,
+  MP4_ERR_OPEN,             // can't open or map the file
+  MP4_ERR_NOT_MP4,          // no moov box
+  MP4_ERR_NO_AUDIO,         // no sound track
+  MP4_ERR_BAD_TABLE         // the sound track's sample table is missing or damaged
+};
+
+struct MP4Track {
+  unsigned long dwTimescale;            // mdhd
+  unsigned long long qwDuration;        // in dwTimescale units
+  unsigned long dwFormat;               // the sample entry's type, 'alac' or 'mp4a'
+  unsigned nChannels;
+  unsigned nSampleSize;
+  unsigned long dwSampleRate;           // whole Hz
+  const unsigned char* pConfig;         // the codec's config box, header and all
+  size_t cbConfig;
+  unsigned long dwSamples;              // packets
+  unsigned long long qwSampleDuration;  // stts added up, in dwTimescale units
+
+  // for gapless playback, the priming the encoder put in front and the length of the
+  // real audio after it, in dwTimescale units; iTunSMPB's samples are taken to be in
+  // it. qwLength is 0 when neither iTunSMPB nor an edit says
+  unsigned long long qwDelay;
+  unsigned long long qwLength;
+};
+
+class MP4Demux {
+public:
+  MP4Demux();
+  ~MP4Demux();
+
+  // maps the file and parses it
+  int Open(const char* pszFile);
+  // parses a file already in memory
+  int Parse(const unsigned char* pData, size_t cbData);
+
+  const MP4Track& GetTrack() { return m_track; }
+
+  // the packet playing at qwTime, in dwTimescale units, and the time it starts
+  bool FindSample(unsigned long long qwTime, unsigned long* pdwSample,
+                  unsigned long long* pqwSampleTime);
+  // makes dwSample the next packet ReadPacket gives; dwSamples is the end
+  bool Seek(unsigned long dwSample);
+  unsigned long GetSample() { return m_dwSample; }
+  // the next packet, left in the mapping. false at the end, or if it isn't in the file
+  bool ReadPacket(const unsigned char** ppData, unsigned long* pcbData);
+
+protected:
+  void Close();
+  int ParseTrak(const unsigned char* p, unsigned long long cb);
+  void ParseEdit(const unsigned char* p, unsigned long long cb);
+  void ParseTags(const unsigned char* p, unsigned long long cb);
+  int ParseStbl(const unsigned char* p, unsigned long long cb);
+  bool ParseStsd(const unsigned char* p, unsigned long long cb);
+
+  unsigned long GetSampleSize(unsigned long dwSample);
+  unsigned long long GetChunkOffset(unsigned long dwChunk);
+  unsigned long GetRunChunk(unsigned long dwRun);     // first chunk of an stsc run, from 0
+
+  MP4Track m_track;
+  unsigned long m_dwMovieTimescale;     // mvhd, which edits are in
+
+  const unsigned char* m_pStts;
+  unsigned long m_dwSttsEntries;
+  const unsigned char* m_pStsc;
+  unsigned long m_dwStscEntries;
+  const unsigned char* m_pStsz;         // NULL when they're all m_dwSampleSize
+  unsigned long m_dwSampleSize;
+  const unsigned char* m_pStco;
+  unsigned long m_dwChunks;
+  bool m_bCo64;
+
+  // where ReadPacket is
+  unsigned long m_dwSample;
+  unsigned long m_dwChunk;
+  unsigned long m_dwInChunk;            // packets of the chunk before this one
+  unsigned long m_dwChunkSamples;       // packets in the chunk
+  unsigned long m_dwRun;                // the stsc entry the chunk comes under
+  unsigned long long m_qwOffset;
+
+  const unsigned char* m_pData;         // what's being parsed
+  size_t m_cbData;
+  const unsigned char* m_pView;         // what Open mapped
+  size_t m_cbView;
+#ifdef _WIN32
+  void* m_hFile;
+  void* m_hMapping;
+#endif
+};
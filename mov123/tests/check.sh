@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# check.sh : builds mov123 without QuickTime and checks what it makes of the fixtures
+#
+# The build is the g++ line in mov123.cpp's header, run as it stands, so the two can't
+# drift apart. Each line of expected.txt is the SHA-1 of mov123's output followed by the
+# arguments that give it, the fixture last. The fixtures are short ALAC files made with
+# ffmpeg's encoder from generated sines and noise, at 44.1kHz and at rates mov123 has to
+# resample from. The 44.1kHz 16 bit and 24 bit to 24 bit outputs were checked sample for
+# sample against what went into the encoder.
+#
+#   ./check.sh            build and check
+#   ./check.sh --update   rewrite expected.txt's hashes, after a deliberate change
+#
+
+cd "$(dirname "$0")" || exit 1
+
+build=$(sed -n 's|^//  *\(g++ .*\)$|\1|p' ../mov123.cpp | head -n 1)
+if [ -z "$build" ]; then
+  echo "check.sh: no g++ line in mov123.cpp" >&2
+  exit 1
+fi
+(cd .. && eval "${build/-o mov123 /-o tests/mov123 }") || exit 1
+
+failed=0
+while read -r hash args; do
+  case "$hash" in
+    ''|'#'*) echo "$hash${args:+ $args}"; continue ;;
+  esac
+  got=$(./mov123 $args | sha1sum | cut -d ' ' -f 1)
+  if [ "$1" = "--update" ]; then
+    echo "$got $args"
+  elif [ "$got" != "$hash" ]; then
+    echo "check.sh: mov123 $args gave $got, not $hash" >&2
+    failed=$((failed + 1))
+  fi
+done < expected.txt > expected.new
+
+if [ "$1" = "--update" ]; then
+  mv expected.new expected.txt
+  echo "check.sh: expected.txt updated"
+  exit 0
+fi
+rm -f expected.new
+
+if [ $failed -ne 0 ]; then
+  echo "check.sh: $failed failed" >&2
+  exit 1
+fi
+echo "check.sh: ok"
@@ -0,0 +1,80 @@
+// fuzz_demux.cpp : a libFuzzer entry point over MP4Demux::Parse
+//
+// Parse is meant to take anything, so every input is parsed, and when a sound track
+// comes out of it, its config has to be inside the input, and so does every packet
+// ReadPacket gives, from the start and from wherever FindSample puts a few times. Built
+// by `make fuzz` with clang's -fsanitize=fuzzer, or linked into test_demux, which runs it
+// under gcc's sanitizers on mutations of the moov of a file it builds and of the
+// fixtures, and on any files it's given.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mp4demux.h"
+
+// as many packets as are read from any one place
+#define MAX_PACKETS 100000
+
+static void
+Fail(const char* pszWhat) {
+  fprintf(stderr, "fuzz_demux: %s\n", pszWhat);
+  abort();
+}
+
+static bool
+Inside(const unsigned char* p, size_t cb, const unsigned char* pData, size_t cbData) {
+  return p >= pData && cb <= cbData && p - pData <= (ptrdiff_t)(cbData - cb);
+}
+
+static void
+ReadPackets(MP4Demux* pDemux, const unsigned char* pData, size_t cbData) {
+  const unsigned char* pPacket;
+  unsigned long cbPacket;
+  for (int i = 0; i < MAX_PACKETS && pDemux->ReadPacket(&pPacket, &cbPacket); i++) {
+    if (!Inside(pPacket, cbPacket, pData, cbData)) {
+      Fail("a packet runs outside the input");
+    }
+  }
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput(const unsigned char* pData, size_t cbData) {
+  MP4Demux demux;
+  if (demux.Parse(pData, cbData) != MP4_OK) {
+    return 0;
+  }
+  const MP4Track& track = demux.GetTrack();
+  if (track.pConfig && !Inside(track.pConfig, track.cbConfig, pData, cbData)) {
+    Fail("the config runs outside the input");
+  }
+  if (track.qwDelay > track.qwSampleDuration ||
+      track.qwLength > track.qwSampleDuration - track.qwDelay) {
+    Fail("the audio runs on past the packets");
+  }
+  if (demux.GetSample() != 0) {
+    Fail("not at the first packet");
+  }
+  ReadPackets(&demux, pData, cbData);
+
+  const unsigned long long times[] = {
+    0, 1, track.qwDelay, track.qwDelay + track.qwLength, track.qwSampleDuration / 2,
+    track.qwSampleDuration - 1, track.qwSampleDuration, ~0ULL
+  };
+  for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++) {
+    unsigned long dwSample;
+    unsigned long long qwSampleTime;
+    if (!demux.FindSample(times[i], &dwSample, &qwSampleTime)) {
+      continue;
+    }
+    if (dwSample >= track.dwSamples || qwSampleTime > times[i]) {
+      Fail("FindSample gave a packet it can't have");
+    }
+    if (demux.Seek(dwSample)) {
+      ReadPackets(&demux, pData, cbData);
+    }
+  }
+  demux.Seek(track.dwSamples);
+  ReadPackets(&demux, pData, cbData);
+  return 0;
+}
@@ -0,0 +1,514 @@
+// test_demux.cpp : MP4Demux on a file built here, then fuzz_demux's entry point on it
+//
+// A small M4A is put together box by box: ftyp, then a moov with mvhd, an ALAC sound
+// track with an edit and two runs each in stts and stsc, and an iTunSMPB tag, then mdat
+// with every packet filled with its own number. Parse has to read back what went in,
+// FindSample and Seek find the packets, and ReadPacket step across the chunks. The same
+// track, with its chunk offsets in co64, and behind a sound track whose stco is missing,
+// has to come out the same. Then MUTATIONS copies each of it and of the fixtures with
+// bytes, sizes and counts in the moov corrupted go through LLVMFuzzerTestOneInput, each
+// in a buffer of exactly its size so the sanitizers see any read past the end.
+//
+//   test_demux                  all that
+//   test_demux FILE...          just the entry point over each file, to replay what a
+//                               libFuzzer run found
+//   test_demux --seed FILE      writes the file built here, to start a corpus with
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "../mp4demux.h"
+#include "../../pcmsink/tests/testutil.h"
+
+#define MUTATIONS     100000
+#define PACKETS       10
+#define PACKET_FRAMES 4096
+#define LAST_FRAMES   1000
+#define FIXED_SIZE    16
+#define DELAY         2112
+#define LENGTH        30000
+#define CHUNKS        4
+
+// what BuildFile puts in
+#define FILE_CO64         1     // chunk offsets in co64 rather than stco
+#define FILE_BROKEN_FIRST 2     // a sound track with no stco ahead of the good one,
+                                // whose packets are then all FIXED_SIZE
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* pData, size_t cbData);
+
+static const char* fixtures[] = { "stereo16.m4a", "surround51.m4a" };
+
+static unsigned char*
+PutBE(unsigned char* p, unsigned long long v, int nBytes) {
+  for (int i = nBytes - 1; i >= 0; i--) {
+    *p++ = (unsigned char)(v >> (8 * i));
+  }
+  return p;
+}
+
+// a box's type and a size to be filled in by EndBox
+static unsigned char*
+StartBox(unsigned char* p, const char* pszType) {
+  memcpy(p + 4, pszType, 4);
+  return p + 8;
+}
+
+static void
+EndBox(unsigned char* pStart, unsigned char* pEnd) {
+  PutBE(pStart, pEnd - pStart, 4);
+}
+
+// a full box's version and flags, 0
+static unsigned char*
+StartFullBox(unsigned char* p, const char* pszType) {
+  p = StartBox(p, pszType);
+  return PutBE(p, 0, 4);
+}
+
+static unsigned long
+PacketSize(unsigned long dwPacket, int nFlags) {
+  return nFlags & FILE_BROKEN_FIRST ? FIXED_SIZE : 10 + dwPacket;
+}
+
+// 3 packets in each of the first two chunks and 2 in the other two
+static unsigned long
+PacketChunk(unsigned long dwPacket) {
+  return dwPacket < 6 ? dwPacket / 3 : 2 + (dwPacket - 6) / 2;
+}
+
+// stbl, its stco left out if bBroken, and the chunk offsets to be filled in once mdat's
+// place is known
+static unsigned char*
+PutStbl(unsigned char* p, int nFlags, bool bBroken, unsigned char** ppOffsets) {
+  unsigned char* pStbl = p;
+  p = StartBox(p, "stbl");
+
+  unsigned char* pBox = p;
+  p = StartFullBox(p, "stsd");
+  p = PutBE(p, 1, 4);
+  unsigned char* pEntry = p;
+  p = StartBox(p, "alac");
+  memset(p, 0, 28);
+  PutBE(p + 6, 1, 2);                         // data reference index
+  PutBE(p + 16, 2, 2);                        // channels
+  PutBE(p + 18, 16, 2);
+  PutBE(p + 24, 44100 << 16, 4);
+  p += 28;
+  unsigned char* pConfig = p;
+  p = StartFullBox(p, "alac");
+  memset(p, 0, 24);
+  PutBE(p, PACKET_FRAMES, 4);
+  p[5] = 16;
+  p[9] = 2;
+  PutBE(p + 20, 44100, 4);
+  p += 24;
+  EndBox(pConfig, p);
+  EndBox(pEntry, p);
+  EndBox(pBox, p);
+
+  pBox = p;
+  p = StartFullBox(p, "stts");
+  p = PutBE(p, 2, 4);
+  p = PutBE(p, PACKETS - 1, 4);
+  p = PutBE(p, PACKET_FRAMES, 4);
+  p = PutBE(p, 1, 4);
+  p = PutBE(p, LAST_FRAMES, 4);
+  EndBox(pBox, p);
+
+  pBox = p;
+  p = StartFullBox(p, "stsc");
+  p = PutBE(p, 2, 4);
+  p = PutBE(p, 1, 4);
+  p = PutBE(p, 3, 4);
+  p = PutBE(p, 1, 4);
+  p = PutBE(p, 3, 4);
+  p = PutBE(p, 2, 4);
+  p = PutBE(p, 1, 4);
+  EndBox(pBox, p);
+
+  // the broken track's sizes are all there is of it, and more of them than the good one
+  pBox = p;
+  p = StartFullBox(p, "stsz");
+  if (bBroken || !(nFlags & FILE_BROKEN_FIRST)) {
+    unsigned long dwPackets = bBroken ? 2 * PACKETS : PACKETS;
+    p = PutBE(p, 0, 4);
+    p = PutBE(p, dwPackets, 4);
+    for (unsigned long i = 0; i < dwPackets; i++) {
+      p = PutBE(p, PacketSize(i, 0), 4);
+    }
+  }
+  else {
+    p = PutBE(p, FIXED_SIZE, 4);
+    p = PutBE(p, PACKETS, 4);
+  }
+  EndBox(pBox, p);
+
+  if (!bBroken) {
+    int nOffset = nFlags & FILE_CO64 ? 8 : 4;
+    pBox = p;
+    p = StartFullBox(p, nFlags & FILE_CO64 ? "co64" : "stco");
+    p = PutBE(p, CHUNKS, 4);
+    *ppOffsets = p;
+    memset(p, 0, CHUNKS * nOffset);
+    p += CHUNKS * nOffset;
+    EndBox(pBox, p);
+  }
+
+  EndBox(pStbl, p);
+  return p;
+}
+
+static unsigned char*
+PutTrak(unsigned char* p, int nFlags, bool bBroken, unsigned char** ppOffsets) {
+  unsigned char* pTrak = p;
+  p = StartBox(p, "trak");
+
+  // 1000ms of audio, 44100 frames, after the priming
+  unsigned char* pEdts = p;
+  p = StartBox(p, "edts");
+  unsigned char* pBox = p;
+  p = StartFullBox(p, "elst");
+  p = PutBE(p, 1, 4);
+  p = PutBE(p, 1000, 4);
+  p = PutBE(p, DELAY / 2, 4);
+  p = PutBE(p, 0x10000, 4);
+  EndBox(pBox, p);
+  EndBox(pEdts, p);
+
+  unsigned char* pMdia = p;
+  p = StartBox(p, "mdia");
+  pBox = p;
+  p = StartFullBox(p, "mdhd");
+  memset(p, 0, 20);
+  PutBE(p + 8, 44100, 4);
+  PutBE(p + 12, (PACKETS - 1) * PACKET_FRAMES + LAST_FRAMES, 4);
+  p += 20;
+  EndBox(pBox, p);
+
+  pBox = p;
+  p = StartFullBox(p, "hdlr");
+  memset(p, 0, 21);
+  memcpy(p + 4, "soun", 4);
+  p += 21;
+  EndBox(pBox, p);
+
+  unsigned char* pMinf = p;
+  p = StartBox(p, "minf");
+  p = PutStbl(p, nFlags, bBroken, ppOffsets);
+  EndBox(pMinf, p);
+  EndBox(pMdia, p);
+  EndBox(pTrak, p);
+  return p;
+}
+
+// udta/meta/ilst with the priming, the padding and the length in iTunSMPB
+static unsigned char*
+PutTags(unsigned char* p) {
+  unsigned char* pUdta = p;
+  p = StartBox(p, "udta");
+  unsigned char* pMeta = p;
+  p = StartFullBox(p, "meta");
+  unsigned char* pBox = p;
+  p = StartFullBox(p, "hdlr");
+  memset(p, 0, 21);
+  memcpy(p + 4, "mdir", 4);
+  memcpy(p + 8, "appl", 4);
+  p += 21;
+  EndBox(pBox, p);
+
+  unsigned char* pIlst = p;
+  p = StartBox(p, "ilst");
+  unsigned char* pItem = p;
+  p = StartBox(p, "----");
+  pBox = p;
+  p = StartFullBox(p, "mean");
+  memcpy(p, "com.apple.iTunes", 16);
+  p += 16;
+  EndBox(pBox, p);
+  pBox = p;
+  p = StartFullBox(p, "name");
+  memcpy(p, "iTunSMPB", 8);
+  p += 8;
+  EndBox(pBox, p);
+  pBox = p;
+  p = StartBox(p, "data");
+  p = PutBE(p, 1, 4);
+  p = PutBE(p, 0, 4);
+  char szText[128];
+  int cch = snprintf(szText, sizeof(szText), " 00000000 %08X %08X %016X 00000000",
+                     DELAY, (PACKETS - 1) * PACKET_FRAMES + LAST_FRAMES - DELAY - LENGTH,
+                     LENGTH);
+  memcpy(p, szText, cch);
+  p += cch;
+  EndBox(pBox, p);
+  EndBox(pItem, p);
+  EndBox(pIlst, p);
+  EndBox(pMeta, p);
+  EndBox(pUdta, p);
+  return p;
+}
+
+// returns its size, and where moov is in it
+static size_t
+BuildFile(unsigned char* pFile, int nFlags, size_t* pnMoov, size_t* pcbMoov) {
+  unsigned char* p = StartBox(pFile, "ftyp");
+  memcpy(p, "M4A \0\0\0\0M4A ", 12);
+  p += 12;
+  EndBox(pFile, p);
+
+  unsigned char* pMoov = p;
+  p = StartBox(p, "moov");
+  unsigned char* pBox = p;
+  p = StartFullBox(p, "mvhd");
+  memset(p, 0, 96);
+  PutBE(p + 8, 1000, 4);                      // timescale
+  p += 96;
+  EndBox(pBox, p);
+
+  unsigned char* pOffsets = NULL;
+  if (nFlags & FILE_BROKEN_FIRST) {
+    p = PutTrak(p, nFlags, true, &pOffsets);
+  }
+  p = PutTrak(p, nFlags, false, &pOffsets);
+  p = PutTags(p);
+  EndBox(pMoov, p);
+  *pnMoov = pMoov - pFile;
+  *pcbMoov = p - pMoov;
+
+  unsigned char* pMdat = p;
+  p = StartBox(p, "mdat");
+  for (unsigned long i = 0; i < PACKETS; i++) {
+    if (i == 0 || PacketChunk(i) != PacketChunk(i - 1)) {
+      // a gap ahead of each chunk, so they're found by their offsets
+      memset(p, 0xEE, 5);
+      p += 5;
+      int nOffset = nFlags & FILE_CO64 ? 8 : 4;
+      PutBE(pOffsets + PacketChunk(i) * nOffset, p - pFile, nOffset);
+    }
+    memset(p, (int)i, PacketSize(i, nFlags));
+    p += PacketSize(i, nFlags);
+  }
+  EndBox(pMdat, p);
+  return p - pFile;
+}
+
+static void
+TestParse(const unsigned char* pFile, size_t cbFile, int nFlags) {
+  MP4Demux demux;
+  int nResult = demux.Parse(pFile, cbFile);
+  CHECK(nResult == MP4_OK);
+  if (nResult != MP4_OK) {
+    return;
+  }
+  const MP4Track& track = demux.GetTrack();
+  CHECK(track.dwTimescale == 44100);
+  CHECK(track.qwDuration == (PACKETS - 1) * PACKET_FRAMES + LAST_FRAMES);
+  CHECK(track.dwFormat == MP4_TYPE('a', 'l', 'a', 'c'));
+  CHECK(track.nChannels == 2 && track.nSampleSize == 16 && track.dwSampleRate == 44100);
+  CHECK(track.pConfig && track.cbConfig == 36 &&
+        memcmp(track.pConfig + 4, "alac", 4) == 0);
+  CHECK(track.dwSamples == PACKETS);
+  CHECK(track.qwSampleDuration == track.qwDuration);
+  // iTunSMPB over the edit
+  CHECK(track.qwDelay == DELAY && track.qwLength == LENGTH);
+
+  const unsigned char* pPacket;
+  unsigned long cbPacket;
+  unsigned long i;
+  for (i = 0; demux.ReadPacket(&pPacket, &cbPacket); i++) {
+    CHECK(cbPacket == PacketSize(i, nFlags) && pPacket[0] == i && pPacket[cbPacket - 1] == i);
+    CHECK(pPacket[-1] == (PacketChunk(i) == PacketChunk(i - 1) ? i - 1 : 0xEE));
+  }
+  CHECK(i == PACKETS);
+
+  // the last packet is shorter, and past it is nothing
+  unsigned long dwSample;
+  unsigned long long qwSampleTime;
+  CHECK(demux.FindSample(7 * PACKET_FRAMES + 5, &dwSample, &qwSampleTime));
+  CHECK(dwSample == 7 && qwSampleTime == 7 * PACKET_FRAMES);
+  CHECK(demux.FindSample(track.qwDuration - 1, &dwSample, &qwSampleTime));
+  CHECK(dwSample == PACKETS - 1 && qwSampleTime == (PACKETS - 1) * PACKET_FRAMES);
+  CHECK(!demux.FindSample(track.qwDuration, &dwSample, &qwSampleTime));
+
+  // into the middle of a chunk of each run, then on into the next
+  static const unsigned long seeks[] = { 4, 7, 0 };
+  for (int n = 0; n < 3; n++) {
+    CHECK(demux.Seek(seeks[n]) && demux.GetSample() == seeks[n]);
+    for (i = seeks[n]; i < seeks[n] + 3 && demux.ReadPacket(&pPacket, &cbPacket); i++) {
+      CHECK(cbPacket == PacketSize(i, nFlags) && pPacket[0] == i);
+    }
+    CHECK(i == seeks[n] + 3);
+  }
+  CHECK(demux.Seek(PACKETS) && !demux.ReadPacket(&pPacket, &cbPacket));
+  CHECK(!demux.Seek(PACKETS + 1));
+
+  // cut off in mdat, the tables are still good but the last packets aren't there
+  CHECK(demux.Parse(pFile, cbFile - 1) == MP4_OK);
+  for (i = 0; demux.ReadPacket(&pPacket, &cbPacket); i++) {
+  }
+  CHECK(i == PACKETS - 1);
+  CHECK(demux.Parse(pFile, 40) == MP4_ERR_NOT_MP4);
+}
+
+// a track whose stco is missing, and which has more packets with sizes of their own,
+// mustn't leave its co64 flag or its stsz behind for the one after it
+static void
+TestBrokenFirst(const unsigned char* pFile, size_t cbFile) {
+  TestParse(pFile, cbFile, FILE_BROKEN_FIRST);
+
+  // without the good track, the broken one is a bad table, not a missing one
+  MP4Demux demux;
+  unsigned char* pCopy = new unsigned char[cbFile];
+  memcpy(pCopy, pFile, cbFile);
+  unsigned char* p = pCopy;
+  int nTraks = 0;
+  while ((p = (unsigned char*)memmem(p, pCopy + cbFile - p, "trak", 4)) != NULL) {
+    if (++nTraks == 2) {
+      memcpy(p, "free", 4);
+    }
+    p += 4;
+  }
+  CHECK(nTraks == 2);
+  CHECK(demux.Parse(pCopy, cbFile) == MP4_ERR_BAD_TABLE);
+  delete [] pCopy;
+}
+
+static void
+Fuzz(const unsigned char* pFile, size_t cbFile, size_t nMoov, size_t cbMoov) {
+  unsigned nSeed = 1;
+  unsigned char* pCopy = new unsigned char[cbFile];
+  for (int i = 0; i < MUTATIONS; i++) {
+    memcpy(pCopy, pFile, cbFile);
+    size_t cb = cbFile;
+    int nChanges = Random(&nSeed) % 4 + 1;
+    for (int c = 0; c < nChanges; c++) {
+      size_t nAt = nMoov + Random(&nSeed) % cbMoov;
+      if (nAt >= cb) {
+        continue;
+      }
+      switch (Random(&nSeed) % 5) {
+        case 0:
+          pCopy[nAt] ^= (unsigned char)(1 << (Random(&nSeed) % 8));
+          break;
+        case 1:
+          pCopy[nAt] = (unsigned char)Random(&nSeed);
+          break;
+        case 2: {
+          // a size or count somewhere near the edges
+          static const unsigned long long values[] = {
+            0, 1, 2, 7, 8, 9, 16, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, ~0ULL, ~0ULL / 8 + 1
+          };
+          unsigned long long v = values[Random(&nSeed) % (sizeof(values) / sizeof(values[0]))];
+          int nBytes = 1 << (Random(&nSeed) % 4);
+          if (nAt + nBytes <= cb) {
+            PutBE(pCopy + nAt, v, nBytes);
+          }
+          break;
+        }
+        case 3:
+          cb = nAt + 1;
+          break;
+        default:
+          pCopy[nAt] = pCopy[nMoov + Random(&nSeed) % cbMoov];
+          break;
+      }
+    }
+    // exactly cb bytes, so reading past them is caught
+    unsigned char* pInput = (unsigned char*)malloc(cb);
+    memcpy(pInput, pCopy, cb);
+    LLVMFuzzerTestOneInput(pInput, cb);
+    free(pInput);
+  }
+  delete [] pCopy;
+}
+
+static bool
+ReadFile(const char* pszName, unsigned char** ppData, size_t* pcbData) {
+  FILE* pFile = fopen(pszName, "rb");
+  if (!pFile) {
+    return false;
+  }
+  fseek(pFile, 0, SEEK_END);
+  long cb = ftell(pFile);
+  rewind(pFile);
+  *ppData = (unsigned char*)malloc(cb > 0 ? cb : 1);
+  *pcbData = fread(*ppData, 1, cb > 0 ? cb : 0, pFile);
+  fclose(pFile);
+  return true;
+}
+
+// where a file's moov is, whatever its size field says
+static bool
+FindMoov(const unsigned char* pData, size_t cbData, size_t* pnMoov, size_t* pcbMoov) {
+  const unsigned char* p = (const unsigned char*)memmem(pData, cbData, "moov", 4);
+  if (!p || p < pData + 4) {
+    return false;
+  }
+  *pnMoov = p - 4 - pData;
+  *pcbMoov = cbData - *pnMoov;
+  unsigned long long cbBox = (unsigned long long)p[-4] << 24 | p[-3] << 16 | p[-2] << 8 | p[-1];
+  if (cbBox >= 8 && cbBox < *pcbMoov) {
+    *pcbMoov = (size_t)cbBox;
+  }
+  return true;
+}
+
+int
+main(int argc, char** argv) {
+  unsigned char file[4096];
+  size_t nMoov, cbMoov;
+  size_t cbFile = BuildFile(file, 0, &nMoov, &cbMoov);
+
+  if (argc == 3 && strcmp(argv[1], "--seed") == 0) {
+    FILE* pFile = fopen(argv[2], "wb");
+    CHECK(pFile && fwrite(file, 1, cbFile, pFile) == cbFile);
+    if (pFile) {
+      fclose(pFile);
+    }
+    return Failures("test_demux");
+  }
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      unsigned char* pData;
+      size_t cbData;
+      CHECK(ReadFile(argv[i], &pData, &cbData));
+      if (g_nFailures == 0) {
+        LLVMFuzzerTestOneInput(pData, cbData);
+        free(pData);
+      }
+    }
+    return Failures("test_demux");
+  }
+
+  TestParse(file, cbFile, 0);
+  Fuzz(file, cbFile, nMoov, cbMoov);
+
+  unsigned char co64[4096];
+  size_t cbCo64 = BuildFile(co64, FILE_CO64, &nMoov, &cbMoov);
+  TestParse(co64, cbCo64, FILE_CO64);
+  Fuzz(co64, cbCo64, nMoov, cbMoov);
+
+  unsigned char broken[4096];
+  size_t cbBroken = BuildFile(broken, FILE_BROKEN_FIRST, &nMoov, &cbMoov);
+  TestBrokenFirst(broken, cbBroken);
+  Fuzz(broken, cbBroken, nMoov, cbMoov);
+
+  int nMutations = 3 * MUTATIONS;
+  for (size_t i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+    unsigned char* pData;
+    size_t cbData;
+    if (!ReadFile(fixtures[i], &pData, &cbData)) {
+      fprintf(stderr, "test_demux: can't read %s\n", fixtures[i]);
+      g_nFailures++;
+      continue;
+    }
+    CHECK(FindMoov(pData, cbData, &nMoov, &cbMoov));
+    if (g_nFailures == 0) {
+      Fuzz(pData, cbData, nMoov, cbMoov);
+      nMutations += MUTATIONS;
+    }
+    free(pData);
+  }
+  printf("%d mutations parsed\n", nMutations);
+  return Failures("test_demux");
+}
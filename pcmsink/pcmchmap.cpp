@@ -0,0 +1,339 @@
+// pcmchmap.cpp : channel mapping for decoded samples - see pcmchmap.h
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "pcmchmap.h"
+#include "pcmsample.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CHMAP_SSE2
+#endif
+
+#define Q14_ONE   (1 << 14)
+#define MINUS_3DB 0.7071
+
+// left and right gain of each speaker position
+static const double speakerGains[PCM_MAX_CHANNELS][2] = {
+  { 1.0,       0.0 },         // front left
+  { 0.0,       1.0 },         // front right
+  { MINUS_3DB, MINUS_3DB },   // front centre
+  { 0.0,       0.0 },         // LFE
+  { MINUS_3DB, 0.0 },         // back left
+  { 0.0,       MINUS_3DB },   // back right
+  { 1.0,       0.0 },         // front left of centre
+  { 0.0,       1.0 },         // front right of centre
+  { 0.5,       0.5 },         // back centre
+  { MINUS_3DB, 0.0 },         // side left
+  { 0.0,       MINUS_3DB },   // side right
+  { 0.5,       0.5 },         // top centre
+  { MINUS_3DB, 0.0 },         // top front left
+  { 0.5,       0.5 },         // top front centre
+  { 0.0,       MINUS_3DB },   // top front right
+  { MINUS_3DB, 0.0 },         // top back left
+  { 0.5,       0.5 },         // top back centre
+  { 0.0,       MINUS_3DB },   // top back right
+};
+
+static int
+CountBits(unsigned long dw) {
+  int n = 0;
+  for (; dw; dw &= dw - 1) {
+    n++;
+  }
+  return n;
+}
+
+//
+// Kernels. n is the number of frames
+//
+static void
+DuplicateMono(const unsigned char* pIn, unsigned char* pOut, size_t n, int nBytes,
+              unsigned nOutChannels) {
+  size_t i = 0;
+
+#ifdef CHMAP_SSE2
+  if (nOutChannels == 2 && nBytes == 2) {
+    for (; i + 8 <= n; i += 8) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(pIn + 2 * i));
+      _mm_storeu_si128((__m128i*)(pOut + 4 * i), _mm_unpacklo_epi16(x, x));
+      _mm_storeu_si128((__m128i*)(pOut + 4 * i + 16), _mm_unpackhi_epi16(x, x));
+    }
+  }
+  else if (nOutChannels == 2 && nBytes == 1) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(pIn + i));
+      _mm_storeu_si128((__m128i*)(pOut + 2 * i), _mm_unpacklo_epi8(x, x));
+      _mm_storeu_si128((__m128i*)(pOut + 2 * i + 16), _mm_unpackhi_epi8(x, x));
+    }
+  }
+  else if (nOutChannels == 2 && nBytes == 4) {
+    for (; i + 4 <= n; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(pIn + 4 * i));
+      _mm_storeu_si128((__m128i*)(pOut + 8 * i), _mm_unpacklo_epi32(x, x));
+      _mm_storeu_si128((__m128i*)(pOut + 8 * i + 16), _mm_unpackhi_epi32(x, x));
+    }
+  }
+#endif
+
+  if (nOutChannels == 2 && nBytes == 2) {
+    const unsigned short* pSrc = (const unsigned short*)pIn;
+    unsigned short* pDest = (unsigned short*)pOut;
+    for (; i < n; i++) {
+      pDest[2 * i] = pDest[2 * i + 1] = pSrc[i];
+    }
+    return;
+  }
+  if (nOutChannels == 2 && nBytes == 3) {
+    for (; i < n; i++) {
+      const unsigned char* pSrc = pIn + 3 * i;
+      unsigned char* pDest = pOut + 6 * i;
+      pDest[0] = pDest[3] = pSrc[0];
+      pDest[1] = pDest[4] = pSrc[1];
+      pDest[2] = pDest[5] = pSrc[2];
+    }
+    return;
+  }
+
+  for (; i < n; i++) {
+    const unsigned char* pSrc = pIn + i * nBytes;
+    unsigned char* pDest = pOut + i * nBytes * nOutChannels;
+    for (unsigned ch = 0; ch < nOutChannels; ch++) {
+      for (int j = 0; j < nBytes; j++) {
+        *pDest++ = pSrc[j];
+      }
+    }
+  }
+}
+
+template <int BYTES, typename ACC>
+static void
+Downmix(const unsigned char* pIn, unsigned char* pOut, size_t n, unsigned nInChannels,
+        unsigned nOutChannels, const int (*matrix)[PCM_MAX_CHANNELS]) {
+  const ACC maxValue = (ACC)(((long long)1 << (8 * BYTES - 1)) - 1);
+  const ACC minValue = -maxValue - 1;
+
+  for (size_t i = 0; i < n; i++) {
+    int in[PCM_MAX_CHANNELS];
+    for (unsigned ch = 0; ch < nInChannels; ch++) {
+      in[ch] = LoadSample(pIn + ch * BYTES, BYTES);
+    }
+    for (unsigned out = 0; out < nOutChannels; out++) {
+      ACC acc = Q14_ONE / 2;
+      for (unsigned ch = 0; ch < nInChannels; ch++) {
+        acc += (ACC)in[ch] * matrix[out][ch];
+      }
+      acc >>= 14;
+      StoreSample(pOut + out * BYTES, BYTES,
+                  (int)(acc > maxValue ? maxValue : acc < minValue ? minValue : acc));
+    }
+    pIn += nInChannels * BYTES;
+    pOut += nOutChannels * BYTES;
+  }
+}
+
+PCMChannelMap::PCMChannelMap() {
+  m_nBytes = 2;
+  m_nInChannels = m_nOutChannels = 0;
+  memset(m_matrix, 0, sizeof(m_matrix));
+  memset(m_gains, 0, sizeof(m_gains));
+  m_pBuf = NULL;
+  m_cbBuf = 0;
+}
+
+PCMChannelMap::~PCMChannelMap() {
+  delete [] m_pBuf;
+}
+
+bool
+PCMChannelMap::Init(unsigned nBits, unsigned nInChannels, unsigned long dwChannelMask,
+                    unsigned nOutChannels, size_t cbMaxIn) {
+  if (CountBits(dwChannelMask) != (int)nInChannels) {
+    dwChannelMask = GetDefaultMask(nInChannels);
+  }
+
+  // channels come in channel mask bit order. Any beyond the mask are left out
+  PCMSpeaker speakers[PCM_MAX_CHANNELS];
+  unsigned ch = 0;
+  for (int bit = 0; bit < PCM_MAX_CHANNELS; bit++) {
+    if (dwChannelMask & (1UL << bit) && ch < PCM_MAX_CHANNELS) {
+      speakers[ch++] = (PCMSpeaker)bit;
+    }
+  }
+  for (; ch < PCM_MAX_CHANNELS; ch++) {
+    speakers[ch] = PCM_SPEAKER_LOW_FREQUENCY;
+  }
+
+  return InitSpeakers(nBits, nInChannels, speakers, nOutChannels, cbMaxIn);
+}
+
+bool
+PCMChannelMap::InitSpeakers(unsigned nBits, unsigned nInChannels, const PCMSpeaker* pSpeakers,
+                            unsigned nOutChannels, size_t cbMaxIn) {
+  if (nBits < 8 || nBits > 32) {
+    fprintf(stderr, "Can't map channels of %u bit samples\n", nBits);
+    return false;
+  }
+  if (nInChannels == 0 || nInChannels > PCM_MAX_CHANNELS ||
+      nOutChannels == 0 || nOutChannels > PCM_MAX_CHANNELS ||
+      (nInChannels != 1 && nInChannels != nOutChannels &&
+       (nOutChannels > 2 || nInChannels < nOutChannels))) {
+    fprintf(stderr, "Can't map %u channels to %u\n", nInChannels, nOutChannels);
+    return false;
+  }
+  if (!pSpeakers) {
+    return Init(nBits, nInChannels, 0, nOutChannels, cbMaxIn);
+  }
+
+  m_nBytes = (nBits + 7) / 8;
+  m_nInChannels = nInChannels;
+  m_nOutChannels = nOutChannels;
+  SetGains(pSpeakers);
+
+  // MapFloat's gains take full scale to 1.0 as well
+  float scale = 1.0f / (float)(1u << (nBits - 1));
+  for (unsigned out = 0; out < nOutChannels; out++) {
+    for (unsigned ch = 0; ch < nInChannels; ch++) {
+      m_gains[out][ch] *= scale;
+    }
+  }
+
+  // room for the mapped output of the biggest buffer we expect
+  size_t cbOut = cbMaxIn / (m_nBytes * nInChannels) * m_nBytes * nOutChannels;
+  if (cbOut > m_cbBuf) {
+    delete [] m_pBuf;
+    m_pBuf = new unsigned char[cbOut];
+    m_cbBuf = cbOut;
+  }
+
+  return true;
+}
+
+void
+PCMChannelMap::SetGains(const PCMSpeaker* pSpeakers) {
+  memset(m_matrix, 0, sizeof(m_matrix));
+  memset(m_gains, 0, sizeof(m_gains));
+
+  // the identity, and mono to every output, need no mixing
+  if (m_nInChannels == m_nOutChannels || m_nInChannels == 1) {
+    for (unsigned out = 0; out < m_nOutChannels; out++) {
+      m_gains[out][m_nInChannels == 1 ? 0 : out] = 1.0f;
+    }
+    return;
+  }
+
+  double gains[2][PCM_MAX_CHANNELS];
+  for (unsigned ch = 0; ch < m_nInChannels; ch++) {
+    for (unsigned out = 0; out < 2; out++) {
+      gains[out][ch] = speakerGains[pSpeakers[ch]][out];
+    }
+    if (m_nOutChannels == 1) {
+      gains[0][ch] = (gains[0][ch] + gains[1][ch]) / 2;
+    }
+  }
+
+  for (unsigned out = 0; out < m_nOutChannels; out++) {
+    double sum = 0;
+    for (unsigned ch = 0; ch < m_nInChannels; ch++) {
+      sum += gains[out][ch];
+    }
+    for (unsigned ch = 0; ch < m_nInChannels; ch++) {
+      double gain = sum > 0 ? gains[out][ch] / sum : 0;
+      m_matrix[out][ch] = (int)(gain * Q14_ONE + 0.5);
+      m_gains[out][ch] = (float)gain;
+    }
+  }
+}
+
+unsigned char*
+PCMChannelMap::Map(const unsigned char* pIn, size_t cbIn, size_t* pcbOut) {
+  size_t n = cbIn / (m_nBytes * m_nInChannels);
+
+  if (IsIdentity()) {
+    *pcbOut = n * m_nBytes * m_nInChannels;
+    return (unsigned char*)pIn;
+  }
+
+  size_t cbOut = n * m_nBytes * m_nOutChannels;
+  if (cbOut > m_cbBuf) {
+    // a bigger buffer than Init was told about, keep it for next time
+    delete [] m_pBuf;
+    m_pBuf = new unsigned char[cbOut];
+    m_cbBuf = cbOut;
+  }
+
+  if (m_nInChannels == 1) {
+    DuplicateMono(pIn, m_pBuf, n, m_nBytes, m_nOutChannels);
+  }
+  else if (m_nBytes == 1) {
+    Downmix<1, int>(pIn, m_pBuf, n, m_nInChannels, m_nOutChannels, m_matrix);
+  }
+  else if (m_nBytes == 2) {
+    Downmix<2, int>(pIn, m_pBuf, n, m_nInChannels, m_nOutChannels, m_matrix);
+  }
+  else if (m_nBytes == 3) {
+    Downmix<3, long long>(pIn, m_pBuf, n, m_nInChannels, m_nOutChannels, m_matrix);
+  }
+  else {
+    Downmix<4, long long>(pIn, m_pBuf, n, m_nInChannels, m_nOutChannels, m_matrix);
+  }
+
+  *pcbOut = cbOut;
+  return m_pBuf;
+}
+
+void
+PCMChannelMap::MapFloat(const int* pIn, size_t nFrames, float* pOut) {
+  // the gains in locals, as stores through pOut could be to them for all the compiler knows
+  if (IsIdentity()) {
+    float scale = m_gains[0][0];
+    size_t n = nFrames * m_nInChannels;
+    size_t i = 0;
+#ifdef CHMAP_SSE2
+    __m128 s = _mm_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+      __m128 a = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(pIn + i)));
+      __m128 b = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(pIn + i + 4)));
+      _mm_storeu_ps(pOut + i, _mm_mul_ps(a, s));
+      _mm_storeu_ps(pOut + i + 4, _mm_mul_ps(b, s));
+    }
+#endif
+    for (; i < n; i++) {
+      pOut[i] = pIn[i] * scale;
+    }
+    return;
+  }
+
+  unsigned nIn = m_nInChannels;
+  if (m_nOutChannels == 2) {
+    float left[PCM_MAX_CHANNELS], right[PCM_MAX_CHANNELS];
+    for (unsigned ch = 0; ch < nIn; ch++) {
+      left[ch] = m_gains[0][ch];
+      right[ch] = m_gains[1][ch];
+    }
+    for (size_t i = 0; i < nFrames; i++, pIn += nIn, pOut += 2) {
+      float l = 0, r = 0;
+      for (unsigned ch = 0; ch < nIn; ch++) {
+        l += pIn[ch] * left[ch];
+        r += pIn[ch] * right[ch];
+      }
+      pOut[0] = l;
+      pOut[1] = r;
+    }
+    return;
+  }
+
+  unsigned nOut = m_nOutChannels;
+  float gains[PCM_MAX_CHANNELS][PCM_MAX_CHANNELS];
+  memcpy(gains, m_gains, sizeof(gains));
+  for (size_t i = 0; i < nFrames; i++, pIn += nIn, pOut += nOut) {
+    for (unsigned out = 0; out < nOut; out++) {
+      float sum = 0;
+      for (unsigned ch = 0; ch < nIn; ch++) {
+        sum += pIn[ch] * gains[out][ch];
+      }
+      pOut[out] = sum;
+    }
+  }
+}
@@ -0,0 +1,96 @@
+// pcmchmap.h : channel mapping for decoded samples
+//
+// Shared by wmadec and mov123. PCMChannelMap turns interleaved samples with one channel
+// count into another, for when the decoder can't give the number of channels asked for:
+//
+//   mono -> any number of channels    every channel gets the mono sample
+//   more channels -> stereo or mono   downmixed by speaker position, so a 5.1 or 7.1
+//                                     stream plays on two speakers
+//
+// The downmix takes the speaker of each input channel from a WAVEFORMATEXTENSIBLE style
+// channel mask, or the usual layout for the channel count if there isn't one, or from a
+// list for decoders whose channels don't come in mask order: front left/right go to
+// their side, centre to both at -3dB, surrounds to their side at -3dB and LFE is
+// dropped. Each output is scaled so a full scale input can't clip.
+//
+// Map works on bytes: 8 bit unsigned, or 16, 24 or 32 bit signed little endian samples.
+// The output goes to a buffer allocated by Init that only grows if a bigger input than
+// expected turns up, so mapping a stream costs no allocation per buffer. Mono to stereo,
+// the common case, is done with SSE2 where the compiler targets it.
+//
+// MapFloat takes the samples as ints, nBits deep whatever that is, and gives floats with
+// full scale at +/-1.0, ready for PCMDither, through the same gains. When the channels
+// stay as they are that's just a scale, done with SSE2 too.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define PCM_MAX_CHANNELS    18          // speaker positions in a channel mask
+#define PCM_CHMAP_BUFFER    (64 << 10)
+
+// speaker positions, the bit numbers of a WAVEFORMATEXTENSIBLE channel mask
+enum PCMSpeaker {
+  PCM_SPEAKER_FRONT_LEFT,
+  PCM_SPEAKER_FRONT_RIGHT,
+  PCM_SPEAKER_FRONT_CENTER,
+  PCM_SPEAKER_LOW_FREQUENCY,
+  PCM_SPEAKER_BACK_LEFT,
+  PCM_SPEAKER_BACK_RIGHT,
+  PCM_SPEAKER_FRONT_LEFT_OF_CENTER,
+  PCM_SPEAKER_FRONT_RIGHT_OF_CENTER,
+  PCM_SPEAKER_BACK_CENTER,
+  PCM_SPEAKER_SIDE_LEFT,
+  PCM_SPEAKER_SIDE_RIGHT,
+  PCM_SPEAKER_TOP_CENTER,
+  PCM_SPEAKER_TOP_FRONT_LEFT,
+  PCM_SPEAKER_TOP_FRONT_CENTER,
+  PCM_SPEAKER_TOP_FRONT_RIGHT,
+  PCM_SPEAKER_TOP_BACK_LEFT,
+  PCM_SPEAKER_TOP_BACK_CENTER,
+  PCM_SPEAKER_TOP_BACK_RIGHT
+};
+
+class PCMChannelMap {
+public:
+  PCMChannelMap();
+  ~PCMChannelMap();
+
+  // nBits is 8 to 32, and Map's samples take that rounded up to whole bytes.
+  // dwChannelMask is 0 if the input has none
+  bool Init(unsigned nBits, unsigned nInChannels, unsigned long dwChannelMask,
+            unsigned nOutChannels, size_t cbMaxIn = PCM_CHMAP_BUFFER);
+  // the speaker of each input channel, or NULL for the usual layout
+  bool InitSpeakers(unsigned nBits, unsigned nInChannels, const PCMSpeaker* pSpeakers,
+                    unsigned nOutChannels, size_t cbMaxIn = PCM_CHMAP_BUFFER);
+  bool IsIdentity() { return m_nInChannels == m_nOutChannels; }
+
+  // the usual channel mask for a channel count, as used when the format doesn't say.
+  // 0 when there isn't one
+  static unsigned long GetDefaultMask(unsigned nChannels) {
+    static const unsigned long masks[9] = {
+      0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F
+    };
+    return nChannels < sizeof(masks) / sizeof(masks[0]) ? masks[nChannels] : 0;
+  }
+
+  // returns pIn itself for the identity map, else the map's own buffer, good until the
+  // next call, with *pcbOut set to the bytes in it. A partial frame at the end of pIn is
+  // dropped
+  unsigned char* Map(const unsigned char* pIn, size_t cbIn, size_t* pcbOut);
+
+  // nFrames of nInChannels ints to nFrames of nOutChannels floats
+  void MapFloat(const int* pIn, size_t nFrames, float* pOut);
+
+protected:
+  void SetGains(const PCMSpeaker* pSpeakers);
+
+  unsigned m_nBytes;                  // per sample for Map
+  unsigned m_nInChannels;
+  unsigned m_nOutChannels;
+  int m_matrix[2][PCM_MAX_CHANNELS];  // downmix gains, Q14
+  float m_gains[PCM_MAX_CHANNELS][PCM_MAX_CHANNELS];  // [out][in], scaled to 1.0
+  unsigned char* m_pBuf;
+  size_t m_cbBuf;
+};
@@ -0,0 +1,362 @@
+// pcmdither.cpp : float samples to the output's sample format - see pcmdither.h
+//
+
+#include <string.h>
+#include "pcmdither.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DITHER_SSE2
+#endif
+
+// the error feedback filter. With v = x - sum(shape[k] * e[n - 1 - k]) the error ends up
+// multiplied by 1 - sum(shape[k] z^-(k + 1)): 16dB down at DC and 19dB up at Nyquist
+static const float shape[DITHER_SHAPE_TAPS] = { 2.033f, -2.165f, 1.959f, -1.590f, 0.6149f };
+
+// more than this much error, in steps, means the sample was clipped
+#define DITHER_MAX_ERROR 1.5f
+
+#define UNIFORM_SCALE (1.0f / 16777216)
+
+static inline unsigned
+Xorshift(unsigned* pSeed) {
+  unsigned x = *pSeed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *pSeed = x;
+}
+
+// [-0.5, 0.5) from the top 24 bits
+static inline float
+Uniform(unsigned r) {
+  return (float)(int)(r >> 8) * UNIFORM_SCALE - 0.5f;
+}
+
+static inline float
+Clamp(float v, float fMin, float fMax) {
+  // in the order SSE2's max and min take them, so a NaN comes out the same
+  v = v > fMin ? v : fMin;
+  return v < fMax ? v : fMax;
+}
+
+// to nearest, halves away from zero
+static inline int
+Round(float v) {
+  return (int)(v >= 0 ? v + 0.5f : v - 0.5f);
+}
+
+static inline void
+StoreSample(unsigned char* p, unsigned nBytes, bool bBigEndian, int v) {
+  if (nBytes == 1) {
+    p[0] = (unsigned char)(v + 128);
+  }
+  else if (bBigEndian) {
+    for (unsigned i = 0; i < nBytes; i++) {
+      p[i] = (unsigned char)(v >> (8 * (nBytes - 1 - i)));
+    }
+  }
+  else {
+    for (unsigned i = 0; i < nBytes; i++) {
+      p[i] = (unsigned char)(v >> (8 * i));
+    }
+  }
+}
+
+#ifdef DITHER_SSE2
+// the four generators a step on, and a uniform number from each
+static inline __m128
+Uniform4(__m128i* pSeed) {
+  __m128i x = *pSeed;
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  *pSeed = x;
+  __m128 u = _mm_cvtepi32_ps(_mm_srli_epi32(x, 8));
+  return _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(UNIFORM_SCALE)), _mm_set1_ps(0.5f));
+}
+
+static inline __m128
+Triangular4(__m128i* pSeed) {
+  __m128 a = Uniform4(pSeed);
+  return _mm_add_ps(a, Uniform4(pSeed));
+}
+
+static inline __m128i
+Round4(__m128 v) {
+  __m128 half = _mm_or_ps(_mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x80000000))),
+                          _mm_set1_ps(0.5f));
+  return _mm_cvttps_epi32(_mm_add_ps(v, half));
+}
+#endif
+
+PCMDither::PCMDither() {
+  m_nChannels = 0;
+  m_nBytes = 2;
+  m_bFloat = false;
+  m_bBigEndian = false;
+  m_mode = DITHER_NONE;
+  m_fScale = 32768.0f;
+  m_fMin = -32768.0f;
+  m_fMax = 32767.0f;
+  m_pError = NULL;
+  m_pSeeds = NULL;
+  m_nGroups = 0;
+}
+
+PCMDither::~PCMDither() {
+  delete [] m_pError;
+  delete [] m_pSeeds;
+}
+
+bool
+PCMDither::ParseMode(const char* pszName, PCMDitherMode* pMode) {
+  static const struct {
+    const char* pszName;
+    PCMDitherMode mode;
+  } modes[] = {
+    { "none",   DITHER_NONE },
+    { "tpdf",   DITHER_TPDF },
+    { "shaped", DITHER_SHAPED },
+  };
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if (strcmp(pszName, modes[i].pszName) == 0) {
+      *pMode = modes[i].mode;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+PCMDither::Init(unsigned nChannels, unsigned nSourceBits, unsigned nBits, bool bFloat,
+                bool bBigEndian, PCMDitherMode mode) {
+  if ((bFloat ? nBits != 32 : nBits != 8 && nBits != 16 && nBits != 24 && nBits != 32) ||
+      nChannels == 0) {
+    return false;
+  }
+
+  m_nChannels = nChannels;
+  m_nBytes = nBits / 8;
+  m_bFloat = bFloat;
+  m_bBigEndian = bBigEndian;
+  m_mode = bFloat || nBits >= nSourceBits ? DITHER_NONE : mode;
+
+  m_fScale = (float)(1u << (nBits - 1));
+  m_fMin = -m_fScale;
+  // the biggest float that's still in range, which for 32 bits is well short of 2^31 - 1
+  m_fMax = nBits == 32 ? 2147483520.0f : m_fScale - 1;
+
+  static const unsigned seeds[4] = { 0x9E3779B9, 0x7F4A7C15, 0x85EBCA6B, 0xC2B2AE35 };
+  memcpy(m_aSeed, seeds, sizeof(m_aSeed));
+
+  // a new stream starts with no error to feed back
+  delete [] m_pError;
+  delete [] m_pSeeds;
+  m_pError = NULL;
+  m_pSeeds = NULL;
+  m_nGroups = (nChannels + 3) / 4;
+  if (m_mode == DITHER_SHAPED) {
+    m_pError = new float[m_nGroups * DITHER_SHAPE_TAPS * 4];
+    memset(m_pError, 0, sizeof(float) * m_nGroups * DITHER_SHAPE_TAPS * 4);
+    m_pSeeds = new unsigned[m_nGroups * 4];
+    for (unsigned i = 0; i < m_nGroups * 4; i++) {
+      m_pSeeds[i] = seeds[i & 3] ^ (0x01000193 * (i / 4));
+    }
+  }
+
+  return true;
+}
+
+// the sum of two uniform numbers from one lane's generator
+float
+PCMDither::Triangular(unsigned nLane) {
+  float a = Uniform(Xorshift(&m_aSeed[nLane]));
+  return a + Uniform(Xorshift(&m_aSeed[nLane]));
+}
+
+void
+PCMDither::Convert(const float* pIn, size_t nSamples, unsigned char* pOut) {
+  if (m_bFloat) {
+    for (size_t i = 0; i < nSamples; i++) {
+      int v;
+      memcpy(&v, &pIn[i], 4);
+      StoreSample(pOut + 4 * i, 4, m_bBigEndian, v);
+    }
+  }
+  else if (m_mode == DITHER_SHAPED) {
+    ConvertShaped(pIn, nSamples / m_nChannels, pOut);
+  }
+  else {
+    ConvertSamples(pIn, nSamples, pOut);
+  }
+}
+
+//
+// ConvertSamples
+//
+// rounded, or dithered and rounded. Nothing carries over from one sample to the next
+// but the generators, so it goes four samples at a time whatever the channels
+//
+void
+PCMDither::ConvertSamples(const float* pIn, size_t nSamples, unsigned char* pOut) {
+  bool bDither = m_mode == DITHER_TPDF;
+  size_t i = 0;
+
+#ifdef DITHER_SSE2
+  const __m128 scale = _mm_set1_ps(m_fScale);
+  const __m128 lo = _mm_set1_ps(m_fMin);
+  const __m128 hi = _mm_set1_ps(m_fMax);
+  __m128i seed = _mm_loadu_si128((const __m128i*)m_aSeed);
+
+  for (; i + 4 <= nSamples; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(pIn + i), scale);
+    if (bDither) {
+      v = _mm_add_ps(v, Triangular4(&seed));
+    }
+    __m128i q = Round4(_mm_min_ps(_mm_max_ps(v, lo), hi));
+
+    if (m_nBytes == 2) {
+      q = _mm_packs_epi32(q, q);
+      if (m_bBigEndian) {
+        q = _mm_or_si128(_mm_slli_epi16(q, 8), _mm_srli_epi16(q, 8));
+      }
+      _mm_storel_epi64((__m128i*)(pOut + 2 * i), q);
+    }
+    else {
+      int aq[4];
+      _mm_storeu_si128((__m128i*)aq, q);
+      for (int k = 0; k < 4; k++) {
+        StoreSample(pOut + (i + k) * m_nBytes, m_nBytes, m_bBigEndian, aq[k]);
+      }
+    }
+  }
+
+  _mm_storeu_si128((__m128i*)m_aSeed, seed);
+#endif
+
+  for (; i < nSamples; i++) {
+    float v = pIn[i] * m_fScale;
+    if (bDither) {
+      v += Triangular(i & 3);
+    }
+    StoreSample(pOut + i * m_nBytes, m_nBytes, m_bBigEndian, Round(Clamp(v, m_fMin, m_fMax)));
+  }
+}
+
+//
+// ConvertShaped
+//
+// dithered with the error fed back. Each group of four channels has its own generators
+// and its last DITHER_SHAPE_TAPS errors in m_pError, newest first, four floats apiece.
+// Groups don't touch each other, so each goes through the whole buffer in turn with its
+// errors in registers. A group short of four channels runs silence in the spare lanes
+//
+void
+PCMDither::ConvertShaped(const float* pIn, size_t nFrames, unsigned char* pOut) {
+  const unsigned nBytes = m_nBytes;
+  const size_t cbFrame = m_nChannels * nBytes;
+
+#ifdef DITHER_SSE2
+  const __m128 scale = _mm_set1_ps(m_fScale);
+  const __m128 lo = _mm_set1_ps(m_fMin);
+  const __m128 hi = _mm_set1_ps(m_fMax);
+  const __m128 maxErr = _mm_set1_ps(DITHER_MAX_ERROR);
+  const __m128 minErr = _mm_set1_ps(-DITHER_MAX_ERROR);
+  __m128 h[DITHER_SHAPE_TAPS];
+  for (int k = 0; k < DITHER_SHAPE_TAPS; k++) {
+    h[k] = _mm_set1_ps(shape[k]);
+  }
+
+  for (unsigned g = 0; g < m_nGroups; g++) {
+    unsigned ch = g * 4;
+    unsigned nLanes = m_nChannels - ch < 4 ? m_nChannels - ch : 4;
+    float* pErr = m_pError + g * DITHER_SHAPE_TAPS * 4;
+    __m128i seed = _mm_loadu_si128((const __m128i*)(m_pSeeds + ch));
+    __m128 e[DITHER_SHAPE_TAPS];
+    for (int k = 0; k < DITHER_SHAPE_TAPS; k++) {
+      e[k] = _mm_loadu_ps(pErr + 4 * k);
+    }
+
+    const float* pX = pIn + ch;
+    unsigned char* pQ = pOut + ch * nBytes;
+    for (size_t n = 0; n < nFrames; n++, pX += m_nChannels, pQ += cbFrame) {
+      __m128 x;
+      if (nLanes == 4) {
+        x = _mm_loadu_ps(pX);
+      }
+      else if (nLanes == 2) {
+        x = _mm_castpd_ps(_mm_load_sd((const double*)pX));
+      }
+      else {
+        float ax[4] = { 0, 0, 0, 0 };
+        memcpy(ax, pX, nLanes * sizeof(float));
+        x = _mm_loadu_ps(ax);
+      }
+
+      __m128 fb = _mm_mul_ps(h[0], e[0]);
+      for (int k = 1; k < DITHER_SHAPE_TAPS; k++) {
+        fb = _mm_add_ps(fb, _mm_mul_ps(h[k], e[k]));
+      }
+      __m128 v = _mm_sub_ps(_mm_mul_ps(x, scale), fb);
+      __m128 t = _mm_add_ps(v, Triangular4(&seed));
+      __m128i q = Round4(_mm_min_ps(_mm_max_ps(t, lo), hi));
+
+      for (int k = DITHER_SHAPE_TAPS - 1; k > 0; k--) {
+        e[k] = e[k - 1];
+      }
+      e[0] = _mm_min_ps(_mm_max_ps(_mm_sub_ps(_mm_cvtepi32_ps(q), v), minErr), maxErr);
+
+      if (nBytes == 2 && (nLanes == 4 || nLanes == 2)) {
+        q = _mm_packs_epi32(q, q);
+        if (m_bBigEndian) {
+          q = _mm_or_si128(_mm_slli_epi16(q, 8), _mm_srli_epi16(q, 8));
+        }
+        if (nLanes == 4) {
+          _mm_storel_epi64((__m128i*)pQ, q);
+        }
+        else {
+          int n2 = _mm_cvtsi128_si32(q);
+          memcpy(pQ, &n2, 4);
+        }
+      }
+      else {
+        int aq[4];
+        _mm_storeu_si128((__m128i*)aq, q);
+        for (unsigned k = 0; k < nLanes; k++) {
+          StoreSample(pQ + k * nBytes, nBytes, m_bBigEndian, aq[k]);
+        }
+      }
+    }
+
+    for (int k = 0; k < DITHER_SHAPE_TAPS; k++) {
+      _mm_storeu_ps(pErr + 4 * k, e[k]);
+    }
+    _mm_storeu_si128((__m128i*)(m_pSeeds + ch), seed);
+  }
+#else
+  for (unsigned ch = 0; ch < m_nChannels; ch++) {
+    float* pErr = m_pError + (ch / 4) * DITHER_SHAPE_TAPS * 4 + (ch & 3);
+    const float* pX = pIn + ch;
+    unsigned char* pQ = pOut + ch * nBytes;
+
+    for (size_t n = 0; n < nFrames; n++, pX += m_nChannels, pQ += cbFrame) {
+      float fb = shape[0] * pErr[0];
+      for (int k = 1; k < DITHER_SHAPE_TAPS; k++) {
+        fb += shape[k] * pErr[4 * k];
+      }
+      float v = *pX * m_fScale - fb;
+      float a = Uniform(Xorshift(&m_pSeeds[ch]));
+      float d = a + Uniform(Xorshift(&m_pSeeds[ch]));
+      int q = Round(Clamp(v + d, m_fMin, m_fMax));
+
+      for (int k = DITHER_SHAPE_TAPS - 1; k > 0; k--) {
+        pErr[4 * k] = pErr[4 * (k - 1)];
+      }
+      pErr[0] = Clamp((float)q - v, -DITHER_MAX_ERROR, DITHER_MAX_ERROR);
+
+      StoreSample(pQ, nBytes, m_bBigEndian, q);
+    }
+  }
+#endif
+}
@@ -0,0 +1,73 @@
+// pcmdither.h : float samples to the output's sample format, dithered when it's coarser
+//
+// Shared by wmadec and mov123. Samples come in as floats with full scale at +/-1.0 and go
+// out as 8 bit unsigned, 16, 24 or 32 bit signed, or 32 bit float, in either byte order.
+// When the output has fewer bits than the source had, plain rounding leaves an error that
+// follows the signal, heard as distortion on quiet passages and fades, so it's dithered:
+//
+//   none     rounded to the nearest step
+//   tpdf     triangular dither of up to a step either way before rounding, which leaves
+//            the error as steady white noise, 4.8dB over rounding's. The default
+//   shaped   the same, with each channel's error fed back through the 5 tap E-weighted
+//            filter of Lipshitz, Vanderkooy and Wannamaker, moving the noise up towards
+//            Nyquist where it's hardest to hear. The filter is meant for 44.1 and 48kHz
+//
+// An output at least as deep as the source, or float, is left alone: converting to it is
+// exact. Samples past full scale are clipped, and clipping isn't fed back.
+//
+// The random numbers come from xorshift generators, one for each SSE2 lane. tpdf works
+// four samples at a time along the buffer. Shaping has to follow each channel from one
+// frame to the next, so it does four channels at a time down the buffer instead, each
+// with a generator of its own. Without SSE2 the same sums are done one sample at a time,
+// and give the same output.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define DITHER_SHAPE_TAPS 5
+
+enum PCMDitherMode {
+  DITHER_NONE,
+  DITHER_TPDF,
+  DITHER_SHAPED
+};
+
+class PCMDither {
+public:
+  PCMDither();
+  ~PCMDither();
+
+  // "none", "tpdf" or "shaped"
+  static bool ParseMode(const char* pszName, PCMDitherMode* pMode);
+
+  // nSourceBits is what the samples really hold, 24 for ones worked out in float. Can be
+  // called again for the next stream
+  bool Init(unsigned nChannels, unsigned nSourceBits, unsigned nBits, bool bFloat,
+            bool bBigEndian, PCMDitherMode mode = DITHER_TPDF);
+  bool IsDithered() { return m_mode != DITHER_NONE; }
+  unsigned GetBytes() { return m_nBytes; }    // per sample out
+
+  // nSamples from pIn, in whole frames, to pOut, which has room for nSamples * GetBytes()
+  void Convert(const float* pIn, size_t nSamples, unsigned char* pOut);
+
+protected:
+  void ConvertSamples(const float* pIn, size_t nSamples, unsigned char* pOut);
+  void ConvertShaped(const float* pIn, size_t nFrames, unsigned char* pOut);
+  float Triangular(unsigned nLane);
+
+  unsigned m_nChannels;
+  unsigned m_nBytes;
+  bool m_bFloat;
+  bool m_bBigEndian;
+  PCMDitherMode m_mode;         // what's done, which is none when it needn't be
+  float m_fScale;               // from full scale 1.0 to the output's
+  float m_fMin;                 // the output's range, in steps
+  float m_fMax;
+
+  unsigned m_aSeed[4];          // one generator per lane
+  float* m_pError;              // for shaping, the last errors of each channel
+  unsigned* m_pSeeds;           // and generators of its own, see ConvertShaped
+  unsigned m_nGroups;           // of four channels
+};
@@ -0,0 +1,357 @@
+// pcmresample.cpp : sample rate and sample size conversion - see pcmresample.h
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "pcmresample.h"
+#include "pcmsample.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2
+#endif
+
+#define PI 3.14159265358979323846
+
+typedef struct {
+  unsigned nTaps;
+  double dRolloff;          // passband edge, as a fraction of the lower Nyquist
+  double dBeta;             // Kaiser window
+} ResampleQuality;
+
+static const ResampleQuality qualities[RESAMPLE_MAX_QUALITY + 1] = {
+  {  8, 0.80,  5.0 },
+  { 16, 0.88,  6.5 },
+  { 32, 0.93,  8.0 },
+  { 64, 0.96, 10.0 },
+};
+
+static unsigned long
+Gcd(unsigned long a, unsigned long b) {
+  while (b) {
+    unsigned long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// modified Bessel function of the first kind, order 0
+static double
+BesselI0(double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 50; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+static inline float
+Dot(const float* a, const float* b, unsigned n) {
+#ifdef RESAMPLE_SSE2
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  if (i < n) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+  acc0 = _mm_add_ps(acc0, acc1);
+  acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+  acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+  return _mm_cvtss_f32(acc0);
+#else
+  float sum = 0;
+  for (unsigned i = 0; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+#endif
+}
+
+PCMResampler::PCMResampler() {
+  m_nL = m_nM = 1;
+  m_nInBytes = m_nOutBytes = 2;
+  m_bOutFloat = false;
+  m_nChannels = 0;
+  m_nTaps = 0;
+  m_pCoefs = NULL;
+  m_pHist = NULL;
+  m_nHistSize = m_nHistFrames = 0;
+  m_nPos = 0;
+  m_nPhase = 0;
+  m_pOut = NULL;
+  m_nOutSize = 0;
+  m_pBuf = NULL;
+  m_cbBuf = 0;
+  m_qwIn = m_qwOut = 0;
+}
+
+PCMResampler::~PCMResampler() {
+  delete [] m_pCoefs;
+  delete [] m_pHist;
+  delete [] m_pOut;
+  delete [] m_pBuf;
+}
+
+bool
+PCMResampler::Init(unsigned long dwInRate, unsigned nInBits, unsigned long dwOutRate,
+                   unsigned nOutBits, bool bOutFloat, unsigned nChannels, int nQuality,
+                   PCMDitherMode dither, bool bOutBigEndian) {
+  if ((nInBits != 8 && nInBits != 16 && nInBits != 24) ||
+      (nOutBits != 8 && nOutBits != 16 && nOutBits != 24 && nOutBits != 32) ||
+      (bOutFloat && nOutBits != 32) ||
+      dwInRate == 0 || dwOutRate == 0 || nChannels == 0) {
+    fprintf(stderr, "Can't convert %u bit %luHz to %u bit%s %luHz\n",
+            nInBits, dwInRate, nOutBits, bOutFloat ? " float" : "", dwOutRate);
+    return false;
+  }
+  if (nQuality < 0 || nQuality > RESAMPLE_MAX_QUALITY) {
+    nQuality = RESAMPLE_QUALITY_DEFAULT;
+  }
+
+  // a new stream, which starts again from silence
+  delete [] m_pCoefs;
+  delete [] m_pHist;
+  m_pCoefs = NULL;
+  m_pHist = NULL;
+  m_nTaps = 0;
+  m_nHistSize = m_nHistFrames = 0;
+  m_nPos = 0;
+  m_nPhase = 0;
+  m_qwIn = m_qwOut = 0;
+
+  m_nInBytes = nInBits / 8;
+  m_nOutBytes = nOutBits / 8;
+  m_bOutFloat = bOutFloat;
+  m_nChannels = nChannels;
+
+  unsigned long g = Gcd(dwInRate, dwOutRate);
+  m_nL = dwOutRate / g;
+  m_nM = dwInRate / g;
+  if (m_nL > RESAMPLE_MAX_PHASES) {
+    // the nearest ratio we can do
+    double dRatio = (double)dwOutRate / dwInRate;
+    double dBest = 1e9;
+    for (unsigned l = 1; l <= RESAMPLE_MAX_PHASES; l++) {
+      unsigned m = (unsigned)(l / dRatio + 0.5);
+      if (m == 0) {
+        continue;
+      }
+      double dErr = fabs((double)l / m - dRatio);
+      if (dErr < dBest) {
+        dBest = dErr;
+        m_nL = l;
+        m_nM = m;
+      }
+    }
+  }
+
+  // samples worked out in float are as good as 24 bits
+  m_Dither.Init(nChannels, m_nL == m_nM ? nInBits : 24, nOutBits, bOutFloat, bOutBigEndian,
+                dither);
+
+  if (m_nL != m_nM) {
+    MakeFilter(nQuality);
+  }
+  return true;
+}
+
+void
+PCMResampler::MakeFilter(int nQuality) {
+  const ResampleQuality* pQ = &qualities[nQuality];
+  unsigned nTaps = pQ->nTaps;
+  double dHalf = nTaps / 2;
+
+  // cut off below the lower of the two Nyquist frequencies
+  double dCutoff = pQ->dRolloff * (m_nL < m_nM ? (double)m_nL / m_nM : 1.0);
+
+  // a wide decimation needs a longer filter to reach the same stopband
+  if (m_nM > m_nL) {
+    nTaps = (unsigned)ceil(nTaps * (double)m_nM / m_nL / 4) * 4;
+    dHalf = nTaps / 2;
+  }
+
+  m_nTaps = nTaps;
+  m_pCoefs = new float[m_nL * m_nTaps];
+
+  double dI0Beta = BesselI0(pQ->dBeta);
+  for (unsigned nPhase = 0; nPhase < m_nL; nPhase++) {
+    float* pC = m_pCoefs + nPhase * m_nTaps;
+    double dSum = 0;
+    for (unsigned k = 0; k < m_nTaps; k++) {
+      // distance of this tap from the point being computed
+      double x = (double)k - (dHalf - 1) - (double)nPhase / m_nL;
+      double dSinc = x == 0 ? 1.0 : sin(PI * dCutoff * x) / (PI * dCutoff * x);
+      double w = x / dHalf;
+      double dWindow = w * w < 1 ? BesselI0(pQ->dBeta * sqrt(1 - w * w)) / dI0Beta : 0;
+      double c = dSinc * dWindow;
+      pC[k] = (float)c;
+      dSum += c;
+    }
+    // unity gain at DC for every phase
+    for (unsigned k = 0; k < m_nTaps; k++) {
+      pC[k] = (float)(pC[k] / dSum);
+    }
+  }
+
+  // the first output is centred on the first input, so start with the filter's left
+  // half over silence
+  m_nHistFrames = (size_t)dHalf - 1;
+  Reserve(0, 0);
+  memset(m_pHist, 0, sizeof(float) * m_nHistSize * m_nChannels);
+}
+
+//
+// Reserve
+//
+// room for nInFrames more in the history and nOutFrames in the output buffer. Only
+// allocates when a bigger input than before turns up, and like the rest of the shared
+// code leaves running out of memory to new
+//
+void
+PCMResampler::Reserve(size_t nInFrames, size_t nOutFrames) {
+  size_t nNeed = m_nHistFrames + nInFrames;
+  if (m_nTaps && nNeed > m_nHistSize) {
+    size_t nSize = nNeed > 2 * m_nTaps + 4096 ? nNeed : 2 * m_nTaps + 4096;
+    float* pHist = new float[nSize * m_nChannels];
+    for (unsigned ch = 0; ch < m_nChannels; ch++) {
+      if (m_pHist) {
+        memcpy(pHist + ch * nSize, m_pHist + ch * m_nHistSize,
+               sizeof(float) * m_nHistFrames);
+      }
+      else {
+        memset(pHist + ch * nSize, 0, sizeof(float) * m_nHistFrames);
+      }
+    }
+    delete [] m_pHist;
+    m_pHist = pHist;
+    m_nHistSize = nSize;
+  }
+
+  size_t nOutNeed = nOutFrames * m_nChannels;
+  if (nOutNeed > m_nOutSize) {
+    delete [] m_pOut;
+    m_pOut = new float[nOutNeed];
+    m_nOutSize = nOutNeed;
+  }
+  size_t cbNeed = nOutFrames * m_nChannels * m_nOutBytes;
+  if (cbNeed > m_cbBuf) {
+    delete [] m_pBuf;
+    m_pBuf = new unsigned char[cbNeed];
+    m_cbBuf = cbNeed;
+  }
+}
+
+//
+// Filter
+//
+// runs the filter over the history for every output it has the input for, and drops
+// the input no output needs any more. Returns the number of frames written to pOut
+//
+size_t
+PCMResampler::Filter(float* pOut) {
+  size_t n = 0;
+
+  while (m_nPos + m_nTaps <= m_nHistFrames) {
+    const float* pC = m_pCoefs + m_nPhase * m_nTaps;
+    for (unsigned ch = 0; ch < m_nChannels; ch++) {
+      *pOut++ = Dot(m_pHist + ch * m_nHistSize + m_nPos, pC, m_nTaps);
+    }
+    n++;
+
+    m_nPhase += m_nM;
+    m_nPos += m_nPhase / m_nL;
+    m_nPhase %= m_nL;
+  }
+
+  // a wide decimation may step past what we have, the rest is skipped as it arrives
+  size_t nDrop = m_nPos < m_nHistFrames ? m_nPos : m_nHistFrames;
+  if (nDrop) {
+    for (unsigned ch = 0; ch < m_nChannels; ch++) {
+      float* pPlane = m_pHist + ch * m_nHistSize;
+      memmove(pPlane, pPlane + nDrop, sizeof(float) * (m_nHistFrames - nDrop));
+    }
+    m_nHistFrames -= nDrop;
+    m_nPos -= nDrop;
+  }
+
+  m_qwOut += n;
+  return n;
+}
+
+unsigned char*
+PCMResampler::Process(const unsigned char* pIn, size_t cbIn, size_t* pcbOut) {
+  size_t n = cbIn / (m_nInBytes * m_nChannels);
+  const float scale = 1.0f / (1 << (8 * m_nInBytes - 1));
+
+  if (m_nL == m_nM) {
+    // sample size only, through float, which holds any of the inputs exactly
+    Reserve(0, n);
+    for (size_t i = 0; i < n * m_nChannels; i++) {
+      m_pOut[i] = LoadSample(pIn, m_nInBytes) * scale;
+      pIn += m_nInBytes;
+    }
+    m_Dither.Convert(m_pOut, n * m_nChannels, m_pBuf);
+    *pcbOut = n * m_nChannels * m_nOutBytes;
+    return m_pBuf;
+  }
+
+  size_t nOut = (size_t)(((unsigned long long)(m_nHistFrames + n) * m_nL) / m_nM) + 2;
+  Reserve(n, nOut);
+
+  // deinterleave into the history as floats
+  for (size_t i = 0; i < n; i++) {
+    for (unsigned ch = 0; ch < m_nChannels; ch++) {
+      m_pHist[ch * m_nHistSize + m_nHistFrames + i] = LoadSample(pIn, m_nInBytes) * scale;
+      pIn += m_nInBytes;
+    }
+  }
+  m_nHistFrames += n;
+  m_qwIn += n;
+
+  size_t nFrames = Filter(m_pOut);
+  m_Dither.Convert(m_pOut, nFrames * m_nChannels, m_pBuf);
+  *pcbOut = nFrames * m_nChannels * m_nOutBytes;
+  return m_pBuf;
+}
+
+unsigned char*
+PCMResampler::Drain(size_t* pcbOut) {
+  *pcbOut = 0;
+  if (m_nL == m_nM) {
+    return m_pBuf;
+  }
+
+  // every input frame gets its share of outputs
+  unsigned long long qwWanted = (m_qwIn * m_nL + m_nM - 1) / m_nM;
+  if (qwWanted <= m_qwOut) {
+    return m_pBuf;
+  }
+  size_t nLeft = (size_t)(qwWanted - m_qwOut);
+
+  // pad with silence until the filter has passed the last of them
+  size_t nPad = m_nTaps + (size_t)((unsigned long long)nLeft * m_nM / m_nL) + 1;
+  size_t nOut = (size_t)(((unsigned long long)(m_nHistFrames + nPad) * m_nL) / m_nM) + 2;
+  Reserve(nPad, nOut);
+  for (unsigned ch = 0; ch < m_nChannels; ch++) {
+    memset(m_pHist + ch * m_nHistSize + m_nHistFrames, 0, sizeof(float) * nPad);
+  }
+  m_nHistFrames += nPad;
+
+  size_t n = Filter(m_pOut);
+  if (n > nLeft) {
+    n = nLeft;
+  }
+  m_Dither.Convert(m_pOut, n * m_nChannels, m_pBuf);
+  *pcbOut = n * m_nChannels * m_nOutBytes;
+  return m_pBuf;
+}
@@ -0,0 +1,32 @@
+// pcmsample.h : reading and writing single PCM samples
+//
+// 8 bit samples are unsigned, 16, 24 and 32 bit ones signed little endian. Values are
+// signed either way.
+//
+
+#pragma once
+
+static inline int
+LoadSample(const unsigned char* p, int nBytes) {
+  switch (nBytes) {
+    case 1:
+      return (int)p[0] - 128;
+    case 2:
+      return (short)(p[0] | (p[1] << 8));
+    case 3:
+      return ((int)((p[0] << 8) | (p[1] << 16) | ((unsigned)p[2] << 24))) >> 8;
+    default:
+      return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24));
+  }
+}
+
+static inline void
+StoreSample(unsigned char* p, int nBytes, int v) {
+  if (nBytes == 1) {
+    p[0] = (unsigned char)(v + 128);
+    return;
+  }
+  for (int i = 0; i < nBytes; i++) {
+    p[i] = (unsigned char)(v >> (8 * i));
+  }
+}
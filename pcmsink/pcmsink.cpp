@@ -0,0 +1,479 @@
+// pcmsink.cpp : decoded PCM out to a file - see pcmsink.h
+//
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcmsink.h"
+#include "pcmchmap.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define ftell64 _ftelli64
+#define fseek64 _fseeki64
+#else
+#include <sys/stat.h>
+#define ftell64 ftello
+#define fseek64 fseeko
+#endif
+
+#define SCRATCH_SIZE (3 << 14)      // a multiple of every sample size, 1 to 4 bytes
+
+//
+// Header fields
+//
+static unsigned char*
+PutLE(unsigned char* p, unsigned long long v, int nBytes) {
+  for (int i = 0; i < nBytes; i++) {
+    *p++ = (unsigned char)(v >> (8 * i));
+  }
+  return p;
+}
+
+static unsigned char*
+PutBE(unsigned char* p, unsigned long long v, int nBytes) {
+  for (int i = nBytes - 1; i >= 0; i--) {
+    *p++ = (unsigned char)(v >> (8 * i));
+  }
+  return p;
+}
+
+static unsigned char*
+PutTag(unsigned char* p, const char* pszTag) {
+  memcpy(p, pszTag, 4);
+  return p + 4;
+}
+
+// the sample rate as an 80 bit IEEE extended, which is what COMM wants
+static unsigned char*
+PutExtended(unsigned char* p, unsigned long dwRate) {
+  unsigned long long qwMantissa = dwRate;
+  int nExponent = 16383 + 63;
+  if (qwMantissa == 0) {
+    memset(p, 0, 10);
+    return p + 10;
+  }
+  while (!(qwMantissa & 0x8000000000000000ULL)) {
+    qwMantissa <<= 1;
+    nExponent--;
+  }
+  p = PutBE(p, nExponent, 2);
+  return PutBE(p, qwMantissa, 8);
+}
+
+static unsigned long long
+Clamp32(unsigned long long v) {
+  return v > 0xFFFFFFFFULL ? 0xFFFFFFFFULL : v;
+}
+
+// a file we can come back to, not a pipe or a console
+static bool
+IsSeekable(FILE* pFile) {
+#ifdef _WIN32
+  HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(pFile));
+  return hFile != INVALID_HANDLE_VALUE && GetFileType(hFile) == FILE_TYPE_DISK;
+#else
+  struct stat st;
+  return fstat(fileno(pFile), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+PCMSink::PCMSink() {
+  m_pFile = NULL;
+  m_format = PCM_RAW;
+  m_dwRate = 0;
+  m_nChannels = 0;
+  m_nBytes = 2;
+  m_bFloat = false;
+  m_bSwap = m_bSign = false;
+  m_bSeekable = false;
+  m_bFailed = false;
+  m_llHeaderPos = 0;
+  m_qwLength = PCM_LENGTH_UNKNOWN;
+  m_qwData = 0;
+  m_cbCarry = 0;
+  m_pScratch = NULL;
+}
+
+PCMSink::~PCMSink() {
+  delete [] m_pScratch;
+}
+
+bool
+PCMSink::ParseFormat(const char* pszName, PCMFormat* pFormat) {
+  static const struct {
+    const char* pszName;
+    PCMFormat format;
+  } formats[] = {
+    { "raw",  PCM_RAW },
+    { "wav",  PCM_WAV },
+    { "rf64", PCM_RF64 },
+    { "aiff", PCM_AIFF },
+  };
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (strcmp(pszName, formats[i].pszName) == 0) {
+      *pFormat = formats[i].format;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char*
+PCMSink::GetExtension(PCMFormat format) {
+  switch (format) {
+    case PCM_WAV:
+    case PCM_RF64:
+      return ".wav";
+    case PCM_AIFF:
+      return ".aif";
+    default:
+      return ".pcm";
+  }
+}
+
+bool
+PCMSink::ParseBits(const char* pszBits, unsigned* pnBits, bool* pbFloat) {
+  if (strcmp(pszBits, "float") == 0) {
+    *pnBits = 32;
+    *pbFloat = true;
+    return true;
+  }
+  char* pEnd;
+  unsigned long n = strtoul(pszBits, &pEnd, 10);
+  if (*pEnd != '\0' || (n != 8 && n != 16 && n != 24 && n != 32)) {
+    return false;
+  }
+  *pnBits = (unsigned)n;
+  *pbFloat = false;
+  return true;
+}
+
+bool
+PCMSink::ParsePosition(const char* pszPos, unsigned long dwRate,
+                       unsigned long long* pqwFrame) {
+  size_t len = strlen(pszPos);
+
+  if (len > 1 && pszPos[len - 1] == 's' && isdigit((unsigned char)pszPos[0])) {
+    unsigned long long qwSamples = 0;
+    for (size_t i = 0; i < len - 1; i++) {
+      if (!isdigit((unsigned char)pszPos[i]) || qwSamples > (~0ULL - 9) / 10) {
+        return false;
+      }
+      qwSamples = qwSamples * 10 + (pszPos[i] - '0');
+    }
+    *pqwFrame = qwSamples;
+    return true;
+  }
+
+  // each field is digits, and only the last, the seconds, can have a '.' and a fraction.
+  // Read by hand, as strtod would take hex and exponents too
+  double dSeconds = 0;
+  for (int nFields = 0; ; nFields++) {
+    if (!isdigit((unsigned char)*pszPos) || nFields > 2) {
+      return false;
+    }
+    double dField = 0;
+    while (isdigit((unsigned char)*pszPos)) {
+      dField = dField * 10 + (*pszPos++ - '0');
+    }
+    if (*pszPos == '.') {
+      double dScale = 0.1;
+      while (isdigit((unsigned char)*++pszPos)) {
+        dField += (*pszPos - '0') * dScale;
+        dScale /= 10;
+      }
+      if (*pszPos != '\0') {
+        return false;
+      }
+    }
+    dSeconds = dSeconds * 60 + dField;
+    if (*pszPos == '\0') {
+      break;
+    }
+    if (*pszPos != ':') {
+      return false;
+    }
+    pszPos++;
+  }
+  *pqwFrame = (unsigned long long)(dSeconds * dwRate + 0.5);
+  return true;
+}
+
+bool
+PCMSink::Open(FILE* pFile, PCMFormat format, unsigned long dwRate, unsigned nChannels,
+              unsigned nBits, bool bFloat, bool bBigEndian, unsigned long long qwLength) {
+  if ((nBits != 8 && nBits != 16 && nBits != 24 && nBits != 32) || (bFloat && nBits != 32)) {
+    fprintf(stderr, "Can't write %d bit %s samples\n", nBits, bFloat ? "float" : "integer");
+    return false;
+  }
+
+  m_pFile = pFile;
+  m_format = format;
+  m_dwRate = dwRate;
+  m_nChannels = nChannels;
+  m_nBytes = nBits / 8;
+  m_bFloat = bFloat;
+  m_qwLength = qwLength;
+  m_qwData = 0;
+  m_cbCarry = 0;
+  m_bFailed = false;
+
+  bool bWantBigEndian = (format == PCM_AIFF);
+  m_bSwap = format != PCM_RAW && m_nBytes > 1 && bBigEndian != bWantBigEndian;
+  m_bSign = format == PCM_AIFF && m_nBytes == 1;
+  if ((m_bSwap || m_bSign) && !m_pScratch) {
+    m_pScratch = new unsigned char[SCRATCH_SIZE];
+  }
+
+  if (format == PCM_RAW) {
+    return true;
+  }
+
+  m_bSeekable = IsSeekable(pFile);
+  m_llHeaderPos = m_bSeekable ? ftell64(pFile) : 0;
+  if (m_llHeaderPos < 0) {
+    m_bSeekable = false;
+  }
+
+  unsigned char header[PCM_MAX_HEADER];
+  size_t cbHeader = BuildHeader(header, qwLength);
+  if (fwrite(header, 1, cbHeader, pFile) != cbHeader) {
+    fprintf(stderr, "Writing the header failed\n");
+    m_bFailed = true;
+    return false;
+  }
+  return true;
+}
+
+size_t
+PCMSink::BuildHeader(unsigned char* pHeader, unsigned long long qwLength) {
+  bool bKnown = qwLength != PCM_LENGTH_UNKNOWN;
+  unsigned nBlockAlign = m_nBytes * m_nChannels;
+  unsigned long long qwFrames = bKnown && nBlockAlign ? qwLength / nBlockAlign : PCM_LENGTH_UNKNOWN;
+  unsigned nPad = bKnown ? (unsigned)(qwLength & 1) : 0;
+  // floats have a longer fmt and a fact chunk, or are AIFF-C with FVER and more COMM.
+  // More than stereo, or more than 16 bits, wants WAVE_FORMAT_EXTENSIBLE
+  bool bExtensible = m_nChannels > 2 || (!m_bFloat && m_nBytes > 2);
+  unsigned cbFmt = bExtensible ? 40 : m_bFloat ? 18 : 16;
+  unsigned cbFact = m_bFloat ? 12 : 0;
+  unsigned cbComm = m_bFloat ? 44 : 18;
+  unsigned cbVersion = m_bFloat ? 12 : 0;
+  unsigned char* p = pHeader;
+
+  switch (m_format) {
+    case PCM_RAW:
+      break;
+
+    case PCM_WAV:
+    case PCM_RF64:
+      if (m_format == PCM_WAV) {
+        p = PutTag(p, "RIFF");
+        p = PutLE(p, bKnown ? Clamp32(20 + cbFmt + cbFact + qwLength + nPad) : 0xFFFFFFFF, 4);
+        p = PutTag(p, "WAVE");
+      }
+      else {
+        p = PutTag(p, "RF64");
+        p = PutLE(p, 0xFFFFFFFF, 4);
+        p = PutTag(p, "WAVE");
+        p = PutTag(p, "ds64");
+        p = PutLE(p, 28, 4);
+        p = PutLE(p, bKnown ? 56 + cbFmt + cbFact + qwLength + nPad : PCM_LENGTH_UNKNOWN, 8);
+        p = PutLE(p, qwLength, 8);
+        p = PutLE(p, qwFrames, 8);
+        p = PutLE(p, 0, 4);                   // no table of other chunk sizes
+      }
+      p = PutTag(p, "fmt ");
+      p = PutLE(p, cbFmt, 4);
+      p = PutLE(p, bExtensible ? 0xFFFE : m_bFloat ? 3 : 1, 2);  // extensible, float or PCM
+      p = PutLE(p, m_nChannels, 2);
+      p = PutLE(p, m_dwRate, 4);
+      p = PutLE(p, (unsigned long long)m_dwRate * nBlockAlign, 4);
+      p = PutLE(p, nBlockAlign, 2);
+      p = PutLE(p, m_nBytes * 8, 2);
+      if (bExtensible) {
+        static const unsigned char subFormatTail[14] = {
+          0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+        };
+        p = PutLE(p, 22, 2);                  // extra format bytes
+        p = PutLE(p, m_nBytes * 8, 2);        // valid bits
+        p = PutLE(p, PCMChannelMap::GetDefaultMask(m_nChannels), 4);
+        p = PutLE(p, m_bFloat ? 3 : 1, 2);    // sub format GUID, from the format tag
+        memcpy(p, subFormatTail, sizeof(subFormatTail));
+        p += sizeof(subFormatTail);
+      }
+      else if (m_bFloat) {
+        p = PutLE(p, 0, 2);                   // no extra format bytes
+      }
+      if (m_bFloat) {
+        p = PutTag(p, "fact");
+        p = PutLE(p, 4, 4);
+        p = PutLE(p, m_format == PCM_WAV ? Clamp32(qwFrames) : 0xFFFFFFFF, 4);
+      }
+      p = PutTag(p, "data");
+      p = PutLE(p, m_format == PCM_WAV && bKnown ? Clamp32(qwLength) : 0xFFFFFFFF, 4);
+      break;
+
+    case PCM_AIFF:
+      p = PutTag(p, "FORM");
+      p = PutBE(p, bKnown ? Clamp32(28 + cbVersion + cbComm + qwLength + nPad) : 0xFFFFFFFF, 4);
+      p = PutTag(p, m_bFloat ? "AIFC" : "AIFF");
+      if (m_bFloat) {
+        p = PutTag(p, "FVER");
+        p = PutBE(p, 4, 4);
+        p = PutBE(p, 0xA2805140, 4);          // AIFF-C version 1
+      }
+      p = PutTag(p, "COMM");
+      p = PutBE(p, cbComm, 4);
+      p = PutBE(p, m_nChannels, 2);
+      p = PutBE(p, Clamp32(qwFrames), 4);
+      p = PutBE(p, m_nBytes * 8, 2);
+      p = PutExtended(p, m_dwRate);
+      if (m_bFloat) {
+        p = PutTag(p, "fl32");
+        *p++ = 21;                            // a Pascal string, even with its count
+        memcpy(p, "32-bit floating point", 21);
+        p += 21;
+      }
+      p = PutTag(p, "SSND");
+      p = PutBE(p, bKnown ? Clamp32(8 + qwLength) : 0xFFFFFFFF, 4);
+      p = PutBE(p, 0, 4);                     // offset
+      p = PutBE(p, 0, 4);                     // block size
+      break;
+  }
+
+  return p - pHeader;
+}
+
+//
+// Convert
+//
+// whole samples to the format's byte order and sign, returning the bytes converted
+//
+size_t
+PCMSink::Convert(const unsigned char* pIn, size_t cbIn, unsigned char* pOut) {
+  size_t n = cbIn - cbIn % m_nBytes;
+
+  if (m_bSign) {
+    for (size_t i = 0; i < n; i++) {
+      pOut[i] = pIn[i] ^ 0x80;
+    }
+  }
+  else if (m_nBytes == 2) {
+    for (size_t i = 0; i < n; i += 2) {
+      pOut[i] = pIn[i + 1];
+      pOut[i + 1] = pIn[i];
+    }
+  }
+  else if (m_nBytes == 3) {
+    for (size_t i = 0; i < n; i += 3) {
+      pOut[i] = pIn[i + 2];
+      pOut[i + 1] = pIn[i + 1];
+      pOut[i + 2] = pIn[i];
+    }
+  }
+  else {
+    for (size_t i = 0; i < n; i += 4) {
+      pOut[i] = pIn[i + 3];
+      pOut[i + 1] = pIn[i + 2];
+      pOut[i + 2] = pIn[i + 1];
+      pOut[i + 3] = pIn[i];
+    }
+  }
+  return n;
+}
+
+bool
+PCMSink::WriteOut(const unsigned char* p, size_t cb) {
+  if (fwrite(p, 1, cb, m_pFile) != cb) {
+    m_bFailed = true;
+    return false;
+  }
+  m_qwData += cb;
+  return true;
+}
+
+bool
+PCMSink::Write(const void* pData, size_t cbData) {
+  const unsigned char* pIn = (const unsigned char*)pData;
+
+  if (m_bFailed) {
+    return false;
+  }
+  if (!m_bSwap && !m_bSign) {
+    return WriteOut(pIn, cbData);
+  }
+
+  // finish off a sample the last Write split
+  if (m_cbCarry) {
+    while (m_cbCarry < m_nBytes && cbData) {
+      m_abCarry[m_cbCarry++] = *pIn++;
+      cbData--;
+    }
+    if (m_cbCarry < m_nBytes) {
+      return true;
+    }
+    Convert(m_abCarry, m_nBytes, m_pScratch);
+    m_cbCarry = 0;
+    if (!WriteOut(m_pScratch, m_nBytes)) {
+      return false;
+    }
+  }
+
+  while (cbData >= m_nBytes) {
+    size_t n = Convert(pIn, cbData < SCRATCH_SIZE ? cbData : SCRATCH_SIZE, m_pScratch);
+    if (!WriteOut(m_pScratch, n)) {
+      return false;
+    }
+    pIn += n;
+    cbData -= n;
+  }
+
+  memcpy(m_abCarry, pIn, cbData);
+  m_cbCarry = cbData;
+  return true;
+}
+
+bool
+PCMSink::Flush() {
+  return fflush(m_pFile) == 0;
+}
+
+bool
+PCMSink::Close() {
+  if (!m_pFile) {
+    return true;
+  }
+  if (m_cbCarry && !m_bFailed) {
+    fprintf(stderr, "Dropping %d bytes of a partial sample\n", (int)m_cbCarry);
+  }
+
+  // chunks are padded to an even length
+  if ((m_format == PCM_WAV || m_format == PCM_RF64 || m_format == PCM_AIFF) &&
+      (m_qwData & 1) && !m_bFailed) {
+    static const unsigned char bPad = 0;
+    if (fwrite(&bPad, 1, 1, m_pFile) != 1) {
+      m_bFailed = true;
+    }
+  }
+
+  // the header guessed, or was told, the length. Put it right if we can
+  if (m_format != PCM_RAW && m_bSeekable && !m_bFailed && m_qwData != m_qwLength) {
+    unsigned char header[PCM_MAX_HEADER];
+    size_t cbHeader = BuildHeader(header, m_qwData);
+    long long llEnd = ftell64(m_pFile);
+    if (fseek64(m_pFile, m_llHeaderPos, SEEK_SET) != 0 ||
+        fwrite(header, 1, cbHeader, m_pFile) != cbHeader ||
+        fseek64(m_pFile, llEnd, SEEK_SET) != 0) {
+      fprintf(stderr, "Updating the header failed\n");
+      m_bFailed = true;
+    }
+  }
+
+  if (fflush(m_pFile) != 0) {
+    m_bFailed = true;
+  }
+  m_pFile = NULL;
+  return !m_bFailed;
+}
@@ -0,0 +1,90 @@
+// pcmsink.h : decoded PCM out to a file, raw or with a WAV, RF64 or AIFF header
+//
+// Shared by wmadec and mov123, so it only leans on the C library. The header is built in
+// one buffer and goes out with one fwrite, sized from the length given to Open. When that
+// isn't known the sizes are left at their largest (0xFFFFFFFF, or all ones in RF64's ds64
+// chunk), which players take to mean "until the data runs out". Either way, Close goes
+// back and writes the real sizes if the output is a file it can seek in; a pipe keeps
+// what it was sent.
+//
+//   raw   just the samples
+//   wav   a RIFF header, the usual 44 bytes for 16 bit stereo. Sizes over 4GB are cut to
+//         0xFFFFFFFF
+//   rf64  RIFF with a ds64 chunk holding 64 bit sizes, for output that may pass 4GB
+//   aiff  FORM/COMM/SSND, big endian
+//
+// Samples are 8, 16, 24 or 32 bit integers, or 32 bit floats. Floats get a WAVE_FORMAT_
+// IEEE_FLOAT fmt chunk with the fact chunk that wants, or go in an AIFF-C file as 'fl32'.
+// They're handed to Write in the decoder's byte order, which Open is told, and are
+// swapped when the format wants the other one. 8 bit samples come unsigned, as WAV has
+// them, and are made signed for AIFF. A sample split between two Writes is fine.
+//
+// A WAV or RF64 file with more than 2 channels, or integers over 16 bits, has a WAVE_
+// FORMAT_EXTENSIBLE fmt chunk instead, as Windows wants, with PCMChannelMap's usual
+// channel mask for the channel count. tests/test_golden holds the files byte for byte.
+//
+
+#pragma once
+
+#include <stdio.h>
+
+#define PCM_LENGTH_UNKNOWN ((unsigned long long)-1)
+#define PCM_MAX_HEADER     128
+
+enum PCMFormat {
+  PCM_RAW,
+  PCM_WAV,
+  PCM_RF64,
+  PCM_AIFF
+};
+
+class PCMSink {
+public:
+  PCMSink();
+  ~PCMSink();
+
+  // "raw", "wav", "rf64" or "aiff"
+  static bool ParseFormat(const char* pszName, PCMFormat* pFormat);
+  // the file name extension for the format, with its dot
+  static const char* GetExtension(PCMFormat format);
+  // "8", "16", "24", "32" or "float", which is 32 bits
+  static bool ParseBits(const char* pszBits, unsigned* pnBits, bool* pbFloat);
+  // a -s or -e position, [[hh:]mm:]ss[.frac] or a number of samples followed by 's', as
+  // a count of frames at dwRate
+  static bool ParsePosition(const char* pszPos, unsigned long dwRate,
+                            unsigned long long* pqwFrame);
+
+  bool Open(FILE* pFile, PCMFormat format, unsigned long dwRate, unsigned nChannels,
+            unsigned nBits, bool bFloat, bool bBigEndian,
+            unsigned long long qwLength = PCM_LENGTH_UNKNOWN);
+  bool Write(const void* pData, size_t cbData);
+  bool Flush();
+  bool Close();
+
+  unsigned long long GetDataBytes() { return m_qwData; }
+
+  // the header for qwLength bytes of data, returning its size
+  size_t BuildHeader(unsigned char* pHeader, unsigned long long qwLength);
+
+protected:
+  bool WriteOut(const unsigned char* p, size_t cb);
+  size_t Convert(const unsigned char* pIn, size_t cbIn, unsigned char* pOut);
+
+  FILE* m_pFile;
+  PCMFormat m_format;
+  unsigned long m_dwRate;
+  unsigned m_nChannels;
+  unsigned m_nBytes;            // per sample
+  bool m_bFloat;
+  bool m_bSwap;                 // byte order differs from the format's
+  bool m_bSign;                 // 8 bit unsigned to signed
+  bool m_bSeekable;
+  bool m_bFailed;
+  long long m_llHeaderPos;      // where the header went, for patching it
+  unsigned long long m_qwLength;  // as given to Open
+  unsigned long long m_qwData;    // bytes of samples written
+
+  unsigned char m_abCarry[4];   // the start of a sample the last Write split
+  size_t m_cbCarry;
+  unsigned char* m_pScratch;    // converted samples on their way out
+};
@@ -0,0 +1,157 @@
+// pcmthread.h : the little threading the shared PCM code needs, on Win32 or pthreads
+//
+//   PCMLock    a mutex, a CRITICAL_SECTION on Windows
+//   PCMEvent   an auto-reset event: Set wakes one Wait, or the next one if nobody is
+//              waiting yet
+//   PCMThread  runs a function on a thread of its own until Join
+//
+// Just enough for PCMWriter's ring, and kept to what Windows 2000 has, so no condition
+// variables there.
+//
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+class PCMLock {
+public:
+#ifdef _WIN32
+  PCMLock() { InitializeCriticalSection(&m_cs); }
+  ~PCMLock() { DeleteCriticalSection(&m_cs); }
+  void Enter() { EnterCriticalSection(&m_cs); }
+  void Leave() { LeaveCriticalSection(&m_cs); }
+
+protected:
+  CRITICAL_SECTION m_cs;
+#else
+  PCMLock() { pthread_mutex_init(&m_mutex, NULL); }
+  ~PCMLock() { pthread_mutex_destroy(&m_mutex); }
+  void Enter() { pthread_mutex_lock(&m_mutex); }
+  void Leave() { pthread_mutex_unlock(&m_mutex); }
+
+protected:
+  pthread_mutex_t m_mutex;
+#endif
+
+private:
+  PCMLock(const PCMLock&);
+  PCMLock& operator=(const PCMLock&);
+};
+
+class PCMEvent {
+public:
+#ifdef _WIN32
+  PCMEvent() { m_hEvent = CreateEvent(NULL, FALSE, FALSE, NULL); }
+  ~PCMEvent() {
+    if (m_hEvent) {
+      CloseHandle(m_hEvent);
+    }
+  }
+  bool IsValid() { return m_hEvent != NULL; }
+  void Set() { SetEvent(m_hEvent); }
+  void Wait() { WaitForSingleObject(m_hEvent, INFINITE); }
+
+protected:
+  HANDLE m_hEvent;
+#else
+  PCMEvent() : m_bSet(false) {
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+  }
+  ~PCMEvent() {
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+  }
+  bool IsValid() { return true; }
+  void Set() {
+    pthread_mutex_lock(&m_mutex);
+    m_bSet = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+  }
+  void Wait() {
+    pthread_mutex_lock(&m_mutex);
+    while (!m_bSet) {
+      pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    m_bSet = false;
+    pthread_mutex_unlock(&m_mutex);
+  }
+
+protected:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_cond;
+  bool m_bSet;
+#endif
+
+private:
+  PCMEvent(const PCMEvent&);
+  PCMEvent& operator=(const PCMEvent&);
+};
+
+class PCMThread {
+public:
+  typedef void (*Proc)(void* pv);
+
+  PCMThread() : m_bRunning(false) {}
+  ~PCMThread() { Join(); }
+
+  bool IsRunning() { return m_bRunning; }
+
+  bool Start(Proc pfn, void* pv) {
+    m_pfn = pfn;
+    m_pv = pv;
+#ifdef _WIN32
+    m_hThread = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, this, 0, NULL);
+    m_bRunning = (m_hThread != NULL);
+#else
+    m_bRunning = (pthread_create(&m_thread, NULL, ThreadProc, this) == 0);
+#endif
+    return m_bRunning;
+  }
+
+  // waits for the function to return
+  void Join() {
+    if (!m_bRunning) {
+      return;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(m_hThread, INFINITE);
+    CloseHandle(m_hThread);
+#else
+    pthread_join(m_thread, NULL);
+#endif
+    m_bRunning = false;
+  }
+
+protected:
+#ifdef _WIN32
+  static unsigned __stdcall ThreadProc(void* pv) {
+    PCMThread* pThread = (PCMThread*)pv;
+    pThread->m_pfn(pThread->m_pv);
+    return 0;
+  }
+
+  HANDLE m_hThread;
+#else
+  static void* ThreadProc(void* pv) {
+    PCMThread* pThread = (PCMThread*)pv;
+    pThread->m_pfn(pThread->m_pv);
+    return NULL;
+  }
+
+  pthread_t m_thread;
+#endif
+  Proc m_pfn;
+  void* m_pv;
+  bool m_bRunning;
+
+private:
+  PCMThread(const PCMThread&);
+  PCMThread& operator=(const PCMThread&);
+};
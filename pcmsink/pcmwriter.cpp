@@ -0,0 +1,215 @@
+// pcmwriter.cpp : buffered output for decoded samples - see pcmwriter.h
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "pcmwriter.h"
+#include "pcmsink.h"
+
+PCMWriter::PCMWriter(PCMSink* pSink)
+  : m_pSink(pSink) {
+  m_pRing = NULL;
+  m_cbRing = m_cbBlock = 0;
+  m_nHead = m_nCount = 0;
+  m_bFlush = m_bClosing = false;
+  m_bFailed = false;
+  m_qwWritten = 0;
+  m_dwStalls = 0;
+  m_dwFrameInput = 0;
+}
+
+PCMWriter::~PCMWriter() {
+  Close();
+  delete [] m_pRing;
+}
+
+bool
+PCMWriter::Start(size_t cbRing, size_t cbBlock) {
+  if (cbBlock > cbRing / 2) {
+    cbBlock = cbRing / 2;
+  }
+  m_cbRing = cbRing;
+  m_cbBlock = cbBlock;
+
+  m_pRing = new unsigned char[m_cbRing];
+  if (!m_evData.IsValid() || !m_evSpace.IsValid() || !m_evFlushed.IsValid()) {
+    fprintf(stderr, "Creating output writer events failed\n");
+    return false;
+  }
+
+  if (!m_thread.Start(WriterThreadProc, this)) {
+    fprintf(stderr, "Creating output writer thread failed with error %d\n",
+            errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+PCMWriter::Write(const void* pData, size_t cbData) {
+  if (m_dwFrameInput) {
+    return WriteFrame("DATA", pData, cbData);
+  }
+  return Queue((const unsigned char*)pData, cbData);
+}
+
+bool
+PCMWriter::WriteFrame(const char* pszTag, const void* pData, size_t cbData) {
+  unsigned char header[PCM_FRAME_HEADER];
+  memcpy(header, pszTag, 4);
+  for (int i = 0; i < 4; i++) {
+    header[4 + i] = (unsigned char)(m_dwFrameInput >> (8 * i));
+    header[8 + i] = (unsigned char)(cbData >> (8 * i));
+  }
+  return Queue(header, sizeof(header)) &&
+         Queue((const unsigned char*)pData, cbData);
+}
+
+//
+// Queue
+//
+// copies into the ring, waiting for the writer to make room when it's full
+//
+bool
+PCMWriter::Queue(const unsigned char* pData, size_t cbData) {
+  while (cbData) {
+    m_lock.Enter();
+    bool bFailed = m_bFailed;
+    size_t nTail = (m_nHead + m_nCount) % m_cbRing;
+    size_t n = m_cbRing - m_nCount;
+    if (n > m_cbRing - nTail) {
+      n = m_cbRing - nTail;
+    }
+    if (n > cbData) {
+      n = cbData;
+    }
+    if (n == 0 && !bFailed) {
+      m_dwStalls++;
+    }
+    m_lock.Leave();
+
+    if (bFailed) {
+      return false;
+    }
+    if (n == 0) {
+      m_evSpace.Wait();
+      continue;
+    }
+
+    // only this thread writes beyond the tail, so the copy needs no lock
+    memcpy(m_pRing + nTail, pData, n);
+    pData += n;
+    cbData -= n;
+
+    m_lock.Enter();
+    m_nCount += n;
+    bool bWake = (m_nCount >= m_cbBlock);
+    m_lock.Leave();
+
+    if (bWake) {
+      m_evData.Set();
+    }
+  }
+
+  return true;
+}
+
+bool
+PCMWriter::Flush() {
+  if (!m_thread.IsRunning()) {
+    return true;
+  }
+
+  m_lock.Enter();
+  m_bFlush = true;
+  m_lock.Leave();
+
+  m_evData.Set();
+  m_evFlushed.Wait();
+  return !m_bFailed;
+}
+
+bool
+PCMWriter::Close() {
+  if (!m_thread.IsRunning()) {
+    return !m_bFailed;
+  }
+
+  m_lock.Enter();
+  m_bClosing = true;
+  m_lock.Leave();
+
+  m_evData.Set();
+  m_thread.Join();
+  return !m_bFailed;
+}
+
+unsigned
+PCMWriter::GetFill() {
+  m_lock.Enter();
+  unsigned nFill = m_cbRing ? (unsigned)((unsigned long long)m_nCount * 100 / m_cbRing) : 0;
+  m_lock.Leave();
+  return nFill;
+}
+
+void
+PCMWriter::WriterThreadProc(void* pv) {
+  ((PCMWriter*)pv)->WriterLoop();
+}
+
+void
+PCMWriter::WriterLoop() {
+  for (;;) {
+    m_lock.Enter();
+    while (m_nCount < m_cbBlock && !m_bFlush && !m_bClosing) {
+      m_lock.Leave();
+      m_evData.Wait();
+      m_lock.Enter();
+    }
+    // up to the end of the ring, the rest next time round
+    size_t n = m_nCount;
+    if (n > m_cbRing - m_nHead) {
+      n = m_cbRing - m_nHead;
+    }
+    unsigned char* p = m_pRing + m_nHead;
+    bool bClosing = m_bClosing;
+    m_lock.Leave();
+
+    if (n) {
+      bool bFailed = !m_pSink->Write(p, n);
+
+      m_lock.Enter();
+      if (bFailed) {
+        if (!m_bFailed) {
+          fprintf(stderr, "Writing output failed with error %d\n", errno);
+        }
+        m_bFailed = true;
+        m_nHead = m_nCount = 0;
+      }
+      else {
+        m_nHead = (m_nHead + n) % m_cbRing;
+        m_nCount -= n;
+        m_qwWritten += n;
+      }
+      m_lock.Leave();
+
+      m_evSpace.Set();
+      continue;
+    }
+
+    // caught up with a flush or close
+    if (!m_bFailed) {
+      m_pSink->Flush();
+    }
+    m_lock.Enter();
+    m_bFlush = false;
+    m_lock.Leave();
+    m_evFlushed.Set();
+
+    if (bClosing) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,78 @@
+// pcmwriter.h : buffered output for decoded samples, on a writer thread of its own
+//
+// PCMWriter takes the samples from the decoder's thread and hands them to a writer
+// thread through a bounded ring, so a slow reader of the output holds up the writer
+// rather than the decoder until the ring is full. The writer passes them to the PCMSink
+// in blocks of at least PCM_WRITER_BLOCK and only flushes when asked to or at the end,
+// instead of an fwrite and fflush per sample buffer. The threading is pcmthread.h's.
+//
+// Write blocks while the ring is full and fails once a write to the file has failed.
+// Flush waits until everything written so far is in the file. Close does the same and
+// stops the writer.
+//
+// When several inputs go to one stream they're told apart by framing. After SetFrame
+// every Write goes out as a DATA frame of the given input, and WriteFrame adds the
+// others. A frame is
+//
+//   tag      4 bytes  FILE   an input starts: rate (4), channels (2), bits (2, with
+//                            0x8000 set for float samples), name
+//                     DATA   its samples
+//                     DONE   it's finished: result (4), decode time in ms (4), bytes
+//                            of samples (8)
+//   input    4 bytes  its place in the batch, from 1
+//   length   4 bytes  of what follows
+//
+// all little endian. What goes in FILE and DONE is up to the caller.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include "pcmthread.h"
+
+class PCMSink;
+
+#define PCM_WRITER_RING     (1 << 20)
+#define PCM_WRITER_BLOCK    (64 << 10)
+#define PCM_FRAME_HEADER    12
+
+class PCMWriter {
+public:
+  PCMWriter(PCMSink* pSink);
+  ~PCMWriter();
+
+  bool Start(size_t cbRing = PCM_WRITER_RING, size_t cbBlock = PCM_WRITER_BLOCK);
+  bool Write(const void* pData, size_t cbData);
+  void SetFrame(unsigned long dwInput) { m_dwFrameInput = dwInput; }
+  bool WriteFrame(const char* pszTag, const void* pData, size_t cbData);
+  bool Flush();
+  bool Close();
+
+  unsigned GetFill();         // percent of the ring waiting to be written
+  unsigned long long GetBytesWritten() { return m_qwWritten; }
+  unsigned long GetStalls() { return m_dwStalls; }
+
+protected:
+  static void WriterThreadProc(void* pv);
+  void WriterLoop();
+  bool Queue(const unsigned char* pData, size_t cbData);
+
+  PCMSink* m_pSink;
+  unsigned char* m_pRing;
+  size_t m_cbRing;
+  size_t m_cbBlock;
+  size_t m_nHead;             // next byte for the writer
+  size_t m_nCount;            // bytes waiting in the ring
+  bool m_bFlush;              // write out everything and fflush
+  bool m_bClosing;
+  bool m_bFailed;             // a write failed, the rest of the stream is dropped
+  unsigned long long m_qwWritten;
+  unsigned long m_dwStalls;   // times Write found the ring full
+  unsigned long m_dwFrameInput;  // frame Writes for this input, 0 for none
+
+  PCMLock m_lock;
+  PCMThread m_thread;
+  PCMEvent m_evData;          // a block is waiting, or flush/close was asked for
+  PCMEvent m_evSpace;         // the writer has made room
+  PCMEvent m_evFlushed;       // the writer has caught up and flushed
+};
@@ -0,0 +1,157 @@
+// bench_chmap.cpp : PCMChannelMap against the loops it replaced
+//
+// Mono to stereo as wmadec did it before the map, a new buffer and a byte at a time per
+// sample buffer, and mov123's MixToStereo from ints to floats, each against the map
+// doing the same over buffers of BUFFER_FRAMES.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmchmap.h"
+#include "testutil.h"
+
+#define BUFFER_FRAMES 4096
+#define TOTAL_FRAMES  (64 << 20)
+
+static volatile unsigned g_nSink;
+// the sizes as the decoders have them, not known at compile time
+static volatile size_t g_nFrames = BUFFER_FRAMES;
+static volatile unsigned g_nChannels;
+
+// wmadec's mono to stereo before PCMChannelMap
+static void
+OldMakeStereo(const unsigned char* pData, size_t cbData, int sampleSize) {
+  int numSamples = (int)(cbData / sampleSize);
+  unsigned char* pDestBuf = new unsigned char[2 * cbData];
+  unsigned char* pWriteBuf = pDestBuf;
+  const unsigned char* pSrcBuf = pData;
+  for (int i = 0; i < numSamples; i++) {
+    for (int j = 0; j < sampleSize; j++) {
+      pDestBuf[j] = pSrcBuf[j];
+      pDestBuf[j + sampleSize] = pSrcBuf[j];
+    }
+    pDestBuf += (2 * sampleSize);
+    pSrcBuf += sampleSize;
+  }
+  g_nSink += pWriteBuf[cbData];
+  delete [] pWriteBuf;
+}
+
+// mov123's before PCMChannelMap
+static void
+OldMixToStereo(const int* pIn, long frames, unsigned channels, const float (*gains)[2],
+               float* pOut) {
+  if (channels == 2) {
+    for (long i = 0; i < frames * 2; i++)
+      pOut[i] = pIn[i] * gains[0][0];
+    return;
+  }
+  for (long i = 0; i < frames; i++, pIn += channels, pOut += 2) {
+    float left = 0, right = 0;
+    for (unsigned ch = 0; ch < channels; ch++) {
+      left += pIn[ch] * gains[ch][0];
+      right += pIn[ch] * gains[ch][1];
+    }
+    pOut[0] = left;
+    pOut[1] = right;
+  }
+}
+
+static void
+Report(const char* pszWhat, double tOld, double tNew, size_t cbOut) {
+  printf("%-24s old %7.0f MB/s   map %7.0f MB/s   %5.1fx\n", pszWhat,
+         cbOut / tOld / 1e6, cbOut / tNew / 1e6, tOld / tNew);
+}
+
+static void
+BenchMono(unsigned nBytes) {
+  size_t cbIn = g_nFrames * nBytes;
+  unsigned char* pIn = new unsigned char[cbIn];
+  unsigned nSeed = 1;
+  for (size_t i = 0; i < cbIn; i++) {
+    pIn[i] = (unsigned char)Random(&nSeed);
+  }
+
+  double t = Seconds();
+  for (size_t n = 0; n < TOTAL_FRAMES; n += BUFFER_FRAMES) {
+    OldMakeStereo(pIn, cbIn, nBytes);
+  }
+  double tOld = Seconds() - t;
+
+  PCMChannelMap map;
+  map.Init(8 * nBytes, 1, 0, 2, cbIn);
+  t = Seconds();
+  for (size_t n = 0; n < TOTAL_FRAMES; n += BUFFER_FRAMES) {
+    size_t cbOut;
+    g_nSink += map.Map(pIn, cbIn, &cbOut)[cbOut - 1];
+  }
+  double tNew = Seconds() - t;
+
+  char szWhat[64];
+  sprintf(szWhat, "mono -> stereo %u bit", 8 * nBytes);
+  Report(szWhat, tOld, tNew, (size_t)TOTAL_FRAMES * 2 * nBytes);
+  delete [] pIn;
+}
+
+static void
+BenchFloat(unsigned nChannelsIn) {
+  g_nChannels = nChannelsIn;
+  unsigned nChannels = g_nChannels;
+  long nFrames = (long)g_nFrames;
+  static const PCMSpeaker alac51[6] = {
+    PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT,
+    PCM_SPEAKER_BACK_LEFT, PCM_SPEAKER_BACK_RIGHT, PCM_SPEAKER_LOW_FREQUENCY
+  };
+  static const float oldGains[6][2] = {
+    { 0.7071f, 0.7071f }, { 1, 0 }, { 0, 1 }, { 0.7071f, 0 }, { 0, 0.7071f }, { 0, 0 }
+  };
+  float gains[6][2];
+  for (unsigned side = 0; side < 2; side++) {
+    float sum = 0;
+    for (unsigned ch = 0; ch < nChannels; ch++) {
+      sum += nChannels == 2 ? (ch == side) : oldGains[ch][side];
+    }
+    for (unsigned ch = 0; ch < nChannels; ch++) {
+      gains[ch][side] = (nChannels == 2 ? (ch == side) : oldGains[ch][side]) / sum / 32768.0f;
+    }
+  }
+
+  int* pIn = new int[BUFFER_FRAMES * nChannels];
+  float* pOut = new float[BUFFER_FRAMES * 2];
+  unsigned nSeed = 1;
+  for (size_t i = 0; i < BUFFER_FRAMES * nChannels; i++) {
+    pIn[i] = (int)Random(&nSeed) >> 16;
+  }
+
+  double t = Seconds();
+  for (size_t n = 0; n < TOTAL_FRAMES; n += BUFFER_FRAMES) {
+    OldMixToStereo(pIn, nFrames, nChannels, gains, pOut);
+    g_nSink += (unsigned)pOut[n % BUFFER_FRAMES];
+  }
+  double tOld = Seconds() - t;
+
+  PCMChannelMap map;
+  map.InitSpeakers(16, nChannels, nChannels == 2 ? NULL : alac51, 2);
+  t = Seconds();
+  for (size_t n = 0; n < TOTAL_FRAMES; n += BUFFER_FRAMES) {
+    map.MapFloat(pIn, nFrames, pOut);
+    g_nSink += (unsigned)pOut[n % BUFFER_FRAMES];
+  }
+  double tNew = Seconds() - t;
+
+  char szWhat[64];
+  sprintf(szWhat, "%u ch -> stereo float", nChannels);
+  Report(szWhat, tOld, tNew, (size_t)TOTAL_FRAMES * 2 * sizeof(float));
+  delete [] pIn;
+  delete [] pOut;
+}
+
+int
+main() {
+  BenchMono(1);
+  BenchMono(2);
+  BenchMono(3);
+  BenchFloat(2);
+  BenchFloat(6);
+  return 0;
+}
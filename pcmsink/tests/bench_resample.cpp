@@ -0,0 +1,52 @@
+// bench_resample.cpp : PCMResampler's throughput at each quality
+//
+// 16 bit stereo noise in buffers of BUFFER_FRAMES, as wmadec hands them over, to 16 bit
+// out with TPDF dither, for an upsample and a wide downsample. Reports input frames a
+// second and how many times faster than real time that is.
+//
+
+#include <stdlib.h>
+#include "../pcmresample.h"
+#include "testutil.h"
+
+#define BUFFER_FRAMES 4096
+#define SECONDS       20          // of input at each rate
+
+static volatile unsigned g_nSink;
+
+static void
+Bench(unsigned long dwInRate, unsigned long dwOutRate, int nQuality) {
+  unsigned char* pIn = new unsigned char[BUFFER_FRAMES * 4];
+  unsigned nSeed = 1;
+  for (size_t i = 0; i < BUFFER_FRAMES * 4; i++) {
+    pIn[i] = (unsigned char)(Random(&nSeed) >> 3);
+  }
+
+  PCMResampler resampler;
+  resampler.Init(dwInRate, 16, dwOutRate, 16, false, 2, nQuality);
+  size_t nTotal = (size_t)dwInRate * SECONDS;
+  double t = Seconds();
+  for (size_t n = 0; n < nTotal; n += BUFFER_FRAMES) {
+    size_t cbOut;
+    unsigned char* pOut = resampler.Process(pIn, BUFFER_FRAMES * 4, &cbOut);
+    if (cbOut) {
+      g_nSink += pOut[cbOut - 1];
+    }
+  }
+  t = Seconds() - t;
+
+  printf("%6lu -> %6lu  q%d   %7.2f M frames/s   %6.0fx real time\n", dwInRate, dwOutRate,
+         nQuality, nTotal / t / 1e6, SECONDS / t);
+  delete [] pIn;
+}
+
+int
+main() {
+  for (int q = 0; q <= RESAMPLE_MAX_QUALITY; q++) {
+    Bench(44100, 48000, q);
+  }
+  for (int q = 0; q <= RESAMPLE_MAX_QUALITY; q++) {
+    Bench(96000, 44100, q);
+  }
+  return 0;
+}
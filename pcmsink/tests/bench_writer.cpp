@@ -0,0 +1,69 @@
+// bench_writer.cpp : producer throughput into a PCMWriter against writing in line
+//
+// The producer hands over buffers the size WMA's reader gives, 4608 bytes or so. Written
+// in line each one costs an fwrite and fflush on the producer's thread, as wmadec did
+// before the writer thread; through PCMWriter it's a copy into the ring. The sink is a
+// file in the current directory unless one is given, /dev/null or a pipe say.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmsink.h"
+#include "../pcmwriter.h"
+#include "testutil.h"
+
+#define BUFFER_BYTES 4608
+#define TOTAL_BYTES  (256 << 20)
+
+static double
+Run(const char* pszPath, bool bWriter) {
+  FILE* pFile = fopen(pszPath, "wb");
+  if (!pFile) {
+    fprintf(stderr, "Can't open %s\n", pszPath);
+    exit(1);
+  }
+  PCMSink sink;
+  sink.Open(pFile, PCM_RAW, 44100, 2, 16, false, false);
+  PCMWriter writer(&sink);
+  if (bWriter) {
+    writer.Start();
+  }
+
+  unsigned char buffer[BUFFER_BYTES];
+  unsigned nSeed = 1;
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = (unsigned char)Random(&nSeed);
+  }
+
+  double tStart = Seconds();
+  for (size_t n = 0; n < TOTAL_BYTES; n += sizeof(buffer)) {
+    if (bWriter) {
+      writer.Write(buffer, sizeof(buffer));
+    }
+    else {
+      sink.Write(buffer, sizeof(buffer));
+      sink.Flush();
+    }
+  }
+  double tProduced = Seconds() - tStart;
+  writer.Close();
+  sink.Close();
+  double tAll = Seconds() - tStart;
+  fclose(pFile);
+
+  printf("%-8s producer %7.1f MB/s, with the last write out %7.1f MB/s, stalls %lu\n",
+         bWriter ? "writer" : "inline", TOTAL_BYTES / tProduced / 1e6,
+         TOTAL_BYTES / tAll / 1e6, writer.GetStalls());
+  return tAll;
+}
+
+int
+main(int argc, char** argv) {
+  const char* pszPath = argc > 1 ? argv[1] : "bench_writer.out";
+  Run(pszPath, false);
+  Run(pszPath, true);
+  if (argc <= 1) {
+    remove(pszPath);
+  }
+  return 0;
+}
@@ -0,0 +1,237 @@
+// test_chmap.cpp : PCMChannelMap against plain reference loops
+//
+// Mono duplication, the SSE2 paths included, has to match a byte for byte copy at every
+// sample size and length. Downmixes have to come within the Q14 gains' error of the same
+// sums done in double and never wrap at full scale, and MapFloat has to give what
+// mov123's own table of gains did before it used the map.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmchmap.h"
+#include "testutil.h"
+
+#define MINUS_3DB 0.7071
+
+static void
+Fill(unsigned char* p, size_t cb, unsigned nSeed) {
+  for (size_t i = 0; i < cb; i++) {
+    p[i] = (unsigned char)Random(&nSeed);
+  }
+}
+
+static long long
+Load(const unsigned char* p, unsigned nBytes) {
+  if (nBytes == 1) {
+    return (int)p[0] - 128;
+  }
+  long long v = 0;
+  for (unsigned i = 0; i < nBytes; i++) {
+    v |= (long long)p[i] << (8 * i);
+  }
+  long long sign = 1LL << (8 * nBytes - 1);
+  return (v ^ sign) - sign;
+}
+
+static void
+TestMono() {
+  unsigned char in[4 * 100], expected[4 * 100 * 6];
+  for (unsigned nBytes = 1; nBytes <= 4; nBytes++) {
+    for (unsigned nOut = 2; nOut <= 6; nOut += 4) {
+      for (size_t n = 0; n <= 100; n++) {
+        Fill(in, sizeof(in), (unsigned)n + 1);
+        for (size_t i = 0; i < n; i++) {
+          for (unsigned ch = 0; ch < nOut; ch++) {
+            memcpy(expected + (i * nOut + ch) * nBytes, in + i * nBytes, nBytes);
+          }
+        }
+
+        PCMChannelMap map;
+        CHECK(map.Init(8 * nBytes, 1, 0, nOut));
+        size_t cbOut;
+        // an odd byte past the last whole frame is left out
+        unsigned char* pOut = map.Map(in, n * nBytes + (nBytes > 1), &cbOut);
+        CHECK(cbOut == n * nBytes * nOut);
+        CHECK(memcmp(pOut, expected, cbOut) == 0);
+      }
+    }
+  }
+}
+
+// the sums done in double from the speaker gains, each output scaled to add up to one
+static void
+TestDownmix(unsigned nBytes, unsigned nIn, unsigned long dwMask, unsigned nOut,
+            const double (*gains)[2]) {
+  const size_t nFrames = 1000;
+  unsigned char* pIn = new unsigned char[nFrames * nIn * nBytes];
+  Fill(pIn, nFrames * nIn * nBytes, nIn * 7 + nBytes);
+  // the first frames at full scale, where the sums have to clamp rather than wrap
+  for (size_t i = 0; i < 2 * nIn * nBytes; i++) {
+    pIn[i] = i < nIn * nBytes ? 0xFF : 0x00;
+  }
+  for (size_t i = 0; nBytes > 1 && i < nIn; i++) {
+    pIn[i * nBytes + nBytes - 1] = 0x7F;
+    pIn[(nIn + i) * nBytes + nBytes - 1] = 0x80;
+  }
+  if (nBytes == 1) {
+    memset(pIn + nIn, 0x00, nIn);
+  }
+
+  PCMChannelMap map;
+  CHECK(map.Init(8 * nBytes, nIn, dwMask, nOut, 100));   // and grows in Map
+  size_t cbOut;
+  const unsigned char* pOut = map.Map(pIn, nFrames * nIn * nBytes, &cbOut);
+  CHECK(cbOut == nFrames * nOut * nBytes);
+
+  double sums[2] = { 0, 0 };
+  for (unsigned ch = 0; ch < nIn; ch++) {
+    sums[0] += gains[ch][0];
+    sums[1] += gains[ch][1];
+  }
+  long long maxValue = (1LL << (8 * nBytes - 1)) - 1;
+  double maxErr = 0;
+  for (size_t i = 0; i < nFrames; i++) {
+    for (unsigned out = 0; out < nOut; out++) {
+      double expected = 0;
+      for (unsigned ch = 0; ch < nIn; ch++) {
+        long long v = Load(pIn + (i * nIn + ch) * nBytes, nBytes);
+        double gain = nOut == 1 ? (gains[ch][0] + gains[ch][1]) / (sums[0] + sums[1])
+                                : gains[ch][out] / sums[out];
+        expected += v * gain;
+      }
+      if (expected > maxValue) {
+        expected = (double)maxValue;
+      }
+      if (expected < -maxValue - 1) {
+        expected = (double)(-maxValue - 1);
+      }
+      double err = fabs(Load(pOut + (i * nOut + out) * nBytes, nBytes) - expected);
+      if (err > maxErr) {
+        maxErr = err;
+      }
+    }
+  }
+  // each Q14 gain is off by up to 2^-15, a step a channel at 16 bits and more above
+  double limit = nIn * (maxValue + 1.0) / 32768 + 0.5;
+  CHECK(maxErr <= limit);
+  if (maxErr > limit) {
+    fprintf(stderr, "  %u bytes %u -> %u: error %g\n", nBytes, nIn, nOut, maxErr);
+  }
+  delete [] pIn;
+}
+
+static void
+TestDownmixes() {
+  // FL FR FC LFE BL BR
+  static const double g51[6][2] = {
+    { 1, 0 }, { 0, 1 }, { MINUS_3DB, MINUS_3DB }, { 0, 0 }, { MINUS_3DB, 0 }, { 0, MINUS_3DB }
+  };
+  // FL FR FC LFE BL BR SL SR
+  static const double g71[8][2] = {
+    { 1, 0 }, { 0, 1 }, { MINUS_3DB, MINUS_3DB }, { 0, 0 }, { MINUS_3DB, 0 }, { 0, MINUS_3DB },
+    { MINUS_3DB, 0 }, { 0, MINUS_3DB }
+  };
+  // FL FR
+  static const double g20[2][2] = { { 1, 0 }, { 0, 1 } };
+  for (unsigned nBytes = 1; nBytes <= 4; nBytes++) {
+    TestDownmix(nBytes, 6, 0x3F, 2, g51);
+    TestDownmix(nBytes, 6, 0, 2, g51);       // no mask, the usual layout
+    TestDownmix(nBytes, 6, 0x3F, 1, g51);
+    TestDownmix(nBytes, 8, 0x63F, 2, g71);
+    TestDownmix(nBytes, 2, 0x3, 1, g20);
+  }
+}
+
+// the table and loop mov123 had, which MapFloat now does from the speaker list
+static const float kOldGains[6][2] = {
+  { (float)MINUS_3DB, (float)MINUS_3DB }, { 1, 0 }, { 0, 1 }, { (float)MINUS_3DB, 0 },
+  { 0, (float)MINUS_3DB }, { 0, 0 }
+};
+
+static void
+TestFloat() {
+  static const PCMSpeaker alac51[6] = {
+    PCM_SPEAKER_FRONT_CENTER, PCM_SPEAKER_FRONT_LEFT, PCM_SPEAKER_FRONT_RIGHT,
+    PCM_SPEAKER_BACK_LEFT, PCM_SPEAKER_BACK_RIGHT, PCM_SPEAKER_LOW_FREQUENCY
+  };
+  const size_t nFrames = 500;
+  int in[nFrames * 6];
+  float out[nFrames * 6];
+  unsigned nSeed = 5;
+  for (unsigned nBits = 16; nBits <= 32; nBits += 4) {
+    for (size_t i = 0; i < nFrames * 6; i++) {
+      in[i] = (int)Random(&nSeed) >> (32 - nBits);
+    }
+
+    PCMChannelMap map;
+    CHECK(map.InitSpeakers(nBits, 6, alac51, 2));
+    map.MapFloat(in, nFrames, out);
+
+    float gains[6][2];
+    for (unsigned side = 0; side < 2; side++) {
+      float sum = 0;
+      for (unsigned ch = 0; ch < 6; ch++) {
+        sum += kOldGains[ch][side];
+      }
+      for (unsigned ch = 0; ch < 6; ch++) {
+        gains[ch][side] = kOldGains[ch][side] / sum / (float)(1u << (nBits - 1));
+      }
+    }
+    float maxErr = 0;
+    for (size_t i = 0; i < nFrames; i++) {
+      for (unsigned side = 0; side < 2; side++) {
+        float expected = 0;
+        for (unsigned ch = 0; ch < 6; ch++) {
+          expected += in[i * 6 + ch] * gains[ch][side];
+        }
+        float err = fabsf(out[i * 2 + side] - expected);
+        maxErr = err > maxErr ? err : maxErr;
+      }
+    }
+    CHECK(maxErr < 1e-6f);
+
+    // stereo is only scaled, mono goes to both sides
+    CHECK(map.InitSpeakers(nBits, 2, NULL, 2));
+    map.MapFloat(in, nFrames, out);
+    bool bSame = true;
+    for (size_t i = 0; i < nFrames * 2; i++) {
+      bSame = bSame && out[i] == in[i] / (float)(1u << (nBits - 1));
+    }
+    CHECK(bSame);
+    CHECK(map.InitSpeakers(nBits, 1, NULL, 2));
+    map.MapFloat(in, nFrames, out);
+    for (size_t i = 0; i < nFrames; i++) {
+      bSame = bSame && out[2 * i] == out[2 * i + 1] &&
+              out[2 * i] == in[i] / (float)(1u << (nBits - 1));
+    }
+    CHECK(bSame);
+  }
+}
+
+static void
+TestInit() {
+  PCMChannelMap map;
+  CHECK(!map.Init(16, 2, 0, 4));     // only mono goes up
+  CHECK(!map.Init(16, 6, 0, 3));     // and only to stereo or mono down
+  CHECK(!map.Init(16, 0, 0, 2));
+  CHECK(!map.Init(16, 2, 0, PCM_MAX_CHANNELS + 1));
+  CHECK(!map.Init(4, 1, 0, 2));
+  CHECK(!map.Init(40, 1, 0, 2));
+
+  CHECK(map.Init(16, 2, 0x3, 2));
+  CHECK(map.IsIdentity());
+  unsigned char in[9];
+  size_t cbOut;
+  CHECK(map.Map(in, sizeof(in), &cbOut) == in);
+  CHECK(cbOut == 8);
+}
+
+int
+main() {
+  TestInit();
+  TestMono();
+  TestDownmixes();
+  TestFloat();
+  return Failures("test_chmap");
+}
@@ -0,0 +1,232 @@
+// test_dither.cpp : PCMDither's SSE2 code against its scalar code, and what dither does
+//
+// The Makefile builds this twice, as test_dither and as test_dither_scalar with __SSE2__
+// undefined so pcmdither.cpp takes its one-sample-at-a-time path. Every mode, output
+// format, channel count from 1 to 8 and byte order, 240 cases, is run over the same
+// samples in random sized calls, and
+//
+//   test_dither_scalar --hashes | test_dither -
+//
+// has the SSE2 build check its output against the scalar build's, case by case. Both
+// also check that tpdf brings back a sine under half a step that plain rounding loses,
+// that shaping moves the noise out of the low frequencies, and that a conversion to at
+// least the source's depth is exact.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmdither.h"
+#include "testutil.h"
+
+#define CASE_FRAMES   5000
+#define SINE_SAMPLES  (1 << 16)
+#define SINE_STEPS    0.3
+
+static const char* modeNames[3] = { "none", "tpdf", "shaped" };
+static const struct {
+  unsigned nBits;
+  bool bFloat;
+} formats[5] = {
+  { 8, false }, { 16, false }, { 24, false }, { 32, false }, { 32, true }
+};
+
+// FNV-1a
+static unsigned long long
+Hash(const unsigned char* p, size_t cb) {
+  unsigned long long h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < cb; i++) {
+    h = (h ^ p[i]) * 0x100000001B3ULL;
+  }
+  return h;
+}
+
+// the hash of a case's output, from a signal that now and then goes past full scale
+static unsigned long long
+RunCase(PCMDitherMode mode, unsigned nBits, bool bFloat, unsigned nChannels,
+        bool bBigEndian) {
+  size_t nSamples = (size_t)CASE_FRAMES * nChannels;
+  float* pIn = new float[nSamples];
+  unsigned char* pOut = new unsigned char[nSamples * 4];
+  unsigned nSeed = 0x2545F491 + nChannels;
+  for (size_t i = 0; i < nSamples; i++) {
+    double v = 0.9 * sin(0.001 * i) + ((int)(Random(&nSeed) >> 16) - 32768) / 131072.0;
+    if (Random(&nSeed) % 500 == 0) {
+      v *= 4;
+    }
+    pIn[i] = (float)v;
+  }
+
+  PCMDither dither;
+  CHECK(dither.Init(nChannels, 32, nBits, bFloat, bBigEndian, mode));
+  unsigned nBytes = dither.GetBytes();
+  size_t nFrame = 0;
+  while (nFrame < CASE_FRAMES) {
+    size_t n = Random(&nSeed) % 700;
+    if (n > CASE_FRAMES - nFrame) {
+      n = CASE_FRAMES - nFrame;
+    }
+    dither.Convert(pIn + nFrame * nChannels, n * nChannels,
+                   pOut + nFrame * nChannels * nBytes);
+    nFrame += n;
+  }
+
+  unsigned long long h = Hash(pOut, nSamples * nBytes);
+  delete [] pIn;
+  delete [] pOut;
+  return h;
+}
+
+static void
+CaseName(char* psz, size_t cch, int nMode, int nFormat, unsigned nChannels,
+         bool bBigEndian) {
+  snprintf(psz, cch, "%s-%u%s-%uch-%s", modeNames[nMode], formats[nFormat].nBits,
+           formats[nFormat].bFloat ? "f" : "", nChannels, bBigEndian ? "be" : "le");
+}
+
+// prints each case's hash, or checks them against those read from pFile
+static void
+TestCases(bool bPrint, FILE* pFile) {
+  int nMatched = 0, nCases = 0;
+  for (int nMode = 0; nMode < 3; nMode++) {
+    for (int nFormat = 0; nFormat < 5; nFormat++) {
+      for (unsigned nChannels = 1; nChannels <= 8; nChannels++) {
+        for (int nOrder = 0; nOrder < 2; nOrder++) {
+          char szName[64];
+          CaseName(szName, sizeof(szName), nMode, nFormat, nChannels, nOrder != 0);
+          unsigned long long h = RunCase((PCMDitherMode)nMode, formats[nFormat].nBits,
+                                         formats[nFormat].bFloat, nChannels, nOrder != 0);
+          nCases++;
+          if (bPrint) {
+            printf("%s %016llx\n", szName, h);
+            continue;
+          }
+          if (!pFile) {
+            continue;
+          }
+          char szRefName[64];
+          unsigned long long hRef;
+          if (fscanf(pFile, "%63s %llx", szRefName, &hRef) != 2 ||
+              strcmp(szRefName, szName) != 0) {
+            fprintf(stderr, "test_dither: no scalar hash for %s\n", szName);
+            g_nFailures++;
+            return;
+          }
+          if (h == hRef) {
+            nMatched++;
+          }
+          else {
+            fprintf(stderr, "test_dither: %s differs from scalar\n", szName);
+            g_nFailures++;
+          }
+        }
+      }
+    }
+  }
+  if (pFile) {
+    printf("SSE2 matches scalar in %d of %d cases\n", nMatched, nCases);
+  }
+}
+
+// a sine of SINE_STEPS of a 16 bit step, 24 bit deep, to 16 bits. Returns the amplitude
+// of the sine that comes out and sets *pdLow and *pdHigh to the error's power in the
+// low and high ends of the band, through (1 + z^-1)^8, a lowpass with nothing left near
+// Nyquist, and the difference of neighbours
+static double
+Sine(PCMDitherMode mode, double* pdLow, double* pdHigh) {
+  float* pIn = new float[SINE_SAMPLES];
+  unsigned char* pOut = new unsigned char[SINE_SAMPLES * 2];
+  const double dOmega = 2 * M_PI * 441 / 44100;
+  for (int i = 0; i < SINE_SAMPLES; i++) {
+    pIn[i] = (float)(SINE_STEPS / 32768 * sin(dOmega * i));
+  }
+
+  PCMDither dither;
+  CHECK(dither.Init(1, 24, 16, false, false, mode));
+  dither.Convert(pIn, SINE_SAMPLES, pOut);
+
+  static const double binomial[9] = { 1, 8, 28, 56, 70, 56, 28, 8, 1 };
+  double dSin = 0, dLow = 0, dHigh = 0;
+  double e[16];
+  memset(e, 0, sizeof(e));
+  for (int i = 0; i < SINE_SAMPLES; i++) {
+    double v = (short)(pOut[2 * i] | pOut[2 * i + 1] << 8);
+    e[i & 15] = v - pIn[i] * 32768.0;
+    dSin += v * sin(dOmega * i);
+    double dSum = 0;
+    for (int k = 0; k < 9; k++) {
+      dSum += binomial[k] * e[(i - k) & 15];
+    }
+    double dDiff = e[i & 15] - e[(i - 1) & 15];
+    // the lowpass's power gain on white noise is the sum of its squared taps, 12870
+    dLow += dSum * dSum / 12870;
+    dHigh += dDiff * dDiff / 2;
+  }
+  *pdLow = dLow / SINE_SAMPLES;
+  *pdHigh = dHigh / SINE_SAMPLES;
+
+  delete [] pIn;
+  delete [] pOut;
+  return 2 * dSin / SINE_SAMPLES;
+}
+
+static void
+TestDither() {
+  double dLow, dHigh;
+  double dAmp = Sine(DITHER_NONE, &dLow, &dHigh);
+  CHECK(dAmp == 0);
+
+  double dTpdfLow, dTpdfHigh;
+  dAmp = Sine(DITHER_TPDF, &dTpdfLow, &dTpdfHigh);
+  CHECK(fabs(dAmp - SINE_STEPS) < 0.03);
+  // white: as much low as high
+  CHECK(dTpdfLow > 0.7 * dTpdfHigh && dTpdfLow < 1.3 * dTpdfHigh);
+
+  dAmp = Sine(DITHER_SHAPED, &dLow, &dHigh);
+  CHECK(fabs(dAmp - SINE_STEPS) < 0.03);
+  CHECK(dLow < 0.25 * dTpdfLow);
+  CHECK(dHigh > dTpdfHigh);
+}
+
+// 16 bit samples to 24 bits are left alone, whatever the mode, and come out exactly
+static void
+TestExact() {
+  float in[256];
+  unsigned char out[256 * 3];
+  for (int i = 0; i < 256; i++) {
+    in[i] = (float)((i - 128) * 255) / 32768;
+  }
+  for (int nMode = 0; nMode < 3; nMode++) {
+    PCMDither dither;
+    CHECK(dither.Init(2, 16, 24, false, false, (PCMDitherMode)nMode));
+    CHECK(!dither.IsDithered());
+    dither.Convert(in, 256, out);
+    int nBad = 0;
+    for (int i = 0; i < 256; i++) {
+      int v = out[3 * i] | out[3 * i + 1] << 8 | (signed char)out[3 * i + 2] << 16;
+      nBad += v != (i - 128) * 255 * 256;
+    }
+    CHECK(nBad == 0);
+  }
+}
+
+int
+main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--hashes") == 0) {
+    TestCases(true, NULL);
+    return 0;
+  }
+
+  FILE* pFile = NULL;
+  if (argc > 1) {
+    pFile = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+    if (!pFile) {
+      fprintf(stderr, "test_dither: can't open %s\n", argv[1]);
+      return 1;
+    }
+  }
+  TestCases(false, pFile);
+  TestDither();
+  TestExact();
+  return Failures("test_dither");
+}
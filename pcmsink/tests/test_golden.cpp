@@ -0,0 +1,192 @@
+// test_golden.cpp : PCMSink's files, byte for byte
+//
+// Each case writes a few frames of known samples through a PCMSink, in pieces of random
+// size that split samples, and what comes out has to match golden/<case> exactly: header,
+// byte order, sign and padding. The cases cover every format and sample size, plain and
+// WAVE_FORMAT_EXTENSIBLE fmt chunks, lengths given to Open, lengths Close has to put
+// right, and a pipe, where the header has to keep its "until the data runs out" sizes.
+//
+//   test_golden            compares
+//   test_golden --update   writes the golden files afresh, after a change to the format
+//                          that's been checked with something that reads them
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../pcmsink.h"
+#include "../pcmthread.h"
+#include "testutil.h"
+
+#define PI 3.14159265358979323846
+
+typedef struct {
+  const char* pszName;
+  PCMFormat format;
+  unsigned nChannels;
+  unsigned nBits;
+  bool bFloat;
+  bool bBigEndian;          // the samples as handed to Write
+  unsigned nFrames;
+  bool bKnown;              // the length is given to Open
+  bool bPipe;
+} GoldenCase;
+
+static const GoldenCase cases[] = {
+  { "wav_u8_mono_odd",   PCM_WAV,  1,  8, false, false, 101, true,  false },
+  { "wav_s16_stereo",    PCM_WAV,  2, 16, false, false, 100, false, false },
+  { "wav_s16_be_pipe",   PCM_WAV,  2, 16, false, true,  100, false, true  },
+  { "wav_s24_stereo",    PCM_WAV,  2, 24, false, false, 100, true,  false },
+  { "wav_s32_stereo",    PCM_WAV,  2, 32, false, false, 100, true,  false },
+  { "wav_s16_5.1",       PCM_WAV,  6, 16, false, false, 100, true,  false },
+  { "wav_f32_stereo",    PCM_WAV,  2, 32, true,  false, 100, true,  false },
+  { "wav_f32_5.1",       PCM_WAV,  6, 32, true,  false, 100, false, false },
+  { "rf64_s24_stereo",   PCM_RF64, 2, 24, false, false, 100, true,  false },
+  { "rf64_f32_stereo",   PCM_RF64, 2, 32, true,  true,  100, false, false },
+  { "aiff_s8_mono_odd",  PCM_AIFF, 1,  8, false, false, 101, true,  false },
+  { "aiff_s16_stereo",   PCM_AIFF, 2, 16, false, false, 100, false, false },
+  { "aiff_s24_stereo",   PCM_AIFF, 2, 24, false, true,  100, true,  false },
+  { "aifc_f32_stereo",   PCM_AIFF, 2, 32, true,  false, 100, true,  false },
+};
+
+// a sine for each channel at its own frequency and phase, in the decoder's sample format
+static size_t
+MakeSamples(const GoldenCase* pCase, unsigned char* p) {
+  unsigned nBytes = pCase->nBits / 8;
+  unsigned char* pStart = p;
+  for (unsigned i = 0; i < pCase->nFrames; i++) {
+    for (unsigned ch = 0; ch < pCase->nChannels; ch++) {
+      double s = 0.8 * sin(2 * PI * i * (ch + 1) / 37 + ch);
+      unsigned long v;
+      if (pCase->bFloat) {
+        float f = (float)s;
+        memcpy(&v, &f, 4);
+      }
+      else {
+        long lMax = (1L << (pCase->nBits - 1)) - 1;
+        v = (unsigned long)(long)floor(s * lMax + 0.5);
+        if (nBytes == 1) {
+          v += 0x80;
+        }
+      }
+      for (unsigned b = 0; b < nBytes; b++) {
+        unsigned nShift = 8 * (pCase->bBigEndian ? nBytes - 1 - b : b);
+        *p++ = (unsigned char)(v >> nShift);
+      }
+    }
+  }
+  return p - pStart;
+}
+
+typedef struct {
+  int fd;
+  unsigned char* pBuf;
+  size_t cbBuf;
+  size_t cbRead;
+} PipeReader;
+
+static void
+ReadPipe(void* pv) {
+  PipeReader* pReader = (PipeReader*)pv;
+  ssize_t n;
+  while ((n = read(pReader->fd, pReader->pBuf + pReader->cbRead,
+                   pReader->cbBuf - pReader->cbRead)) > 0) {
+    pReader->cbRead += n;
+  }
+}
+
+// what the sink makes of the case, in a new buffer
+static unsigned char*
+Run(const GoldenCase* pCase, size_t* pcbOut) {
+  size_t cbMax = PCM_MAX_HEADER + pCase->nFrames * pCase->nChannels * 4 + 1;
+  unsigned char* pSamples = new unsigned char[cbMax];
+  size_t cbSamples = MakeSamples(pCase, pSamples);
+  unsigned char* pOut = new unsigned char[cbMax];
+
+  FILE* pFile;
+  int fds[2] = { -1, -1 };
+  PipeReader reader = { -1, pOut, cbMax, 0 };
+  PCMThread thread;
+  if (pCase->bPipe) {
+    CHECK(pipe(fds) == 0);
+    pFile = fdopen(fds[1], "wb");
+    reader.fd = fds[0];
+    CHECK(thread.Start(ReadPipe, &reader));
+  }
+  else {
+    pFile = tmpfile();
+  }
+
+  PCMSink sink;
+  CHECK(sink.Open(pFile, pCase->format, 44100, pCase->nChannels, pCase->nBits,
+                  pCase->bFloat, pCase->bBigEndian,
+                  pCase->bKnown ? cbSamples : PCM_LENGTH_UNKNOWN));
+  unsigned nSeed = (unsigned)cbSamples;
+  for (size_t i = 0; i < cbSamples; ) {
+    size_t n = Random(&nSeed) % 23 + 1;
+    if (n > cbSamples - i) {
+      n = cbSamples - i;
+    }
+    CHECK(sink.Write(pSamples + i, n));
+    i += n;
+  }
+  CHECK(sink.Close());
+  delete [] pSamples;
+
+  if (pCase->bPipe) {
+    fclose(pFile);
+    thread.Join();
+    close(fds[0]);
+    *pcbOut = reader.cbRead;
+  }
+  else {
+    rewind(pFile);
+    *pcbOut = fread(pOut, 1, cbMax, pFile);
+    fclose(pFile);
+  }
+  return pOut;
+}
+
+int
+main(int argc, char** argv) {
+  bool bUpdate = argc > 1 && strcmp(argv[1], "--update") == 0;
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const GoldenCase* pCase = &cases[i];
+    char szPath[256];
+    sprintf(szPath, "golden/%s%s", pCase->pszName, PCMSink::GetExtension(pCase->format));
+    size_t cbOut;
+    unsigned char* pOut = Run(pCase, &cbOut);
+
+    if (bUpdate) {
+      FILE* pFile = fopen(szPath, "wb");
+      CHECK(pFile && fwrite(pOut, 1, cbOut, pFile) == cbOut);
+      if (pFile) {
+        fclose(pFile);
+      }
+      printf("wrote %s, %d bytes\n", szPath, (int)cbOut);
+    }
+    else {
+      FILE* pFile = fopen(szPath, "rb");
+      unsigned char* pGolden = new unsigned char[cbOut + 1];
+      size_t cbGolden = pFile ? fread(pGolden, 1, cbOut + 1, pFile) : 0;
+      if (pFile) {
+        fclose(pFile);
+      }
+      bool bSame = cbGolden == cbOut && memcmp(pGolden, pOut, cbOut) == 0;
+      if (!bSame) {
+        size_t nAt = 0;
+        while (nAt < cbOut && nAt < cbGolden && pGolden[nAt] == pOut[nAt]) {
+          nAt++;
+        }
+        fprintf(stderr, "%s: %d bytes against %d, first difference at %d\n", szPath,
+                (int)cbOut, (int)cbGolden, (int)nAt);
+      }
+      CHECK(bSame);
+      delete [] pGolden;
+    }
+    delete [] pOut;
+  }
+  return Failures("test_golden");
+}
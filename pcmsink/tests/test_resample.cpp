@@ -0,0 +1,292 @@
+// test_resample.cpp : PCMResampler's THD+N and frame counts
+//
+// Each case is fed 24 bit stereo in pieces of random size and drained, with float out so
+// nothing is dithered, and has to give every input frame its share of outputs. Then
+//
+//   tones    a sine at -6dBFS. A sine, cosine and DC at its frequency are fitted to the
+//            output by least squares, and what's left over is the THD+N
+//   sweep    a log sweep across most of the passband, against the same sweep worked
+//            out at the output's sample times. The filter is centred on its output so
+//            there's no delay to allow for, and the error includes passband ripple
+//   reject   when the input's Nyquist is well above the output's, a tone between the
+//            two, which has to be filtered out rather than aliased
+//
+// The limits are a few dB under what each quality level measures here, so a change that
+// costs the filter anything shows. The right channel is the left negated, which has to
+// stay that way.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmresample.h"
+#include "testutil.h"
+
+#define PI        3.14159265358979323846
+#define AMPLITUDE 0.5
+#define SECONDS   1.0
+#define EDGE      0.05            // seconds left out at each end, where the filter isn't full
+
+static unsigned long
+Gcd(unsigned long a, unsigned long b) {
+  while (b) {
+    unsigned long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// the L/M Init settles on, and so the rate the output really has: a ratio with too many
+// phases is brought to the nearest one with few enough, by the same search
+static double
+OutputRate(unsigned long dwInRate, unsigned long dwOutRate, unsigned long* pL,
+           unsigned long* pM) {
+  unsigned long g = Gcd(dwInRate, dwOutRate);
+  *pL = dwOutRate / g;
+  *pM = dwInRate / g;
+  if (*pL > RESAMPLE_MAX_PHASES) {
+    double dRatio = (double)dwOutRate / dwInRate;
+    double dBest = 1e9;
+    for (unsigned l = 1; l <= RESAMPLE_MAX_PHASES; l++) {
+      unsigned m = (unsigned)(l / dRatio + 0.5);
+      if (m && fabs((double)l / m - dRatio) < dBest) {
+        dBest = fabs((double)l / m - dRatio);
+        *pL = l;
+        *pM = m;
+      }
+    }
+  }
+  return (double)dwInRate * *pL / *pM;
+}
+
+typedef double (*Signal)(double t, const double* pParams);
+
+static double
+Tone(double t, const double* pParams) {
+  return AMPLITUDE * sin(2 * PI * pParams[0] * t);
+}
+
+// from pParams[0] Hz to pParams[1] Hz over SECONDS
+static double
+Sweep(double t, const double* pParams) {
+  double k = log(pParams[1] / pParams[0]) / SECONDS;
+  return AMPLITUDE * sin(2 * PI * pParams[0] * (exp(k * t) - 1) / k);
+}
+
+// the resampled left channel, or NULL if the frame count or right channel is wrong
+static double*
+Resample(unsigned long dwInRate, unsigned long dwOutRate, int nQuality, Signal signal,
+         const double* pParams, size_t* pnOut) {
+  size_t nIn = (size_t)(dwInRate * SECONDS);
+  unsigned char* pIn = new unsigned char[nIn * 6];
+  for (size_t i = 0; i < nIn; i++) {
+    int v = (int)floor(signal((double)i / dwInRate, pParams) * 8388608.0 + 0.5);
+    for (int b = 0; b < 3; b++) {
+      pIn[6 * i + b] = (unsigned char)(v >> (8 * b));
+      pIn[6 * i + 3 + b] = (unsigned char)(-v >> (8 * b));
+    }
+  }
+
+  PCMResampler resampler;
+  CHECK(resampler.Init(dwInRate, 24, dwOutRate, 32, true, 2, nQuality));
+  CHECK(!resampler.IsDithered());
+
+  unsigned long l, m;
+  OutputRate(dwInRate, dwOutRate, &l, &m);
+  size_t nWanted = (size_t)(((unsigned long long)nIn * l + m - 1) / m);
+  float* pOut = new float[(nWanted + 16) * 2];
+  size_t nOut = 0;
+  unsigned nSeed = (unsigned)(dwInRate + dwOutRate + nQuality);
+  for (size_t i = 0; i <= nIn; ) {
+    size_t n = Random(&nSeed) % 5000;
+    if (n > nIn - i) {
+      n = nIn - i;
+    }
+    size_t cbOut;
+    const unsigned char* p = i < nIn ? resampler.Process(pIn + 6 * i, n * 6, &cbOut)
+                                     : resampler.Drain(&cbOut);
+    if (nOut + cbOut / 8 > nWanted + 16) {
+      break;
+    }
+    memcpy(pOut + 2 * nOut, p, cbOut);
+    nOut += cbOut / 8;
+    i += i < nIn ? n : 1;
+  }
+  delete [] pIn;
+
+  double* pLeft = NULL;
+  bool bRight = true;
+  for (size_t i = 0; i < nOut; i++) {
+    bRight = bRight && fabs(pOut[2 * i] + pOut[2 * i + 1]) < 1e-6;
+  }
+  CHECK(nOut == nWanted);
+  CHECK(bRight);
+  if (nOut == nWanted && bRight) {
+    pLeft = new double[nOut];
+    for (size_t i = 0; i < nOut; i++) {
+      pLeft[i] = pOut[2 * i];
+    }
+  }
+  delete [] pOut;
+  *pnOut = nOut;
+  return pLeft;
+}
+
+static double
+Decibels(double ratio) {
+  return 20 * log10(ratio > 1e-12 ? ratio : 1e-12);
+}
+
+// least squares fit of a sin + b cos + c, by the normal equations
+static double
+ThdN(const double* pOut, size_t nFrom, size_t nTo, double dFreq, double dRate) {
+  double m[3][4] = { { 0 } };
+  for (size_t i = nFrom; i < nTo; i++) {
+    double w = 2 * PI * dFreq * i / dRate;
+    double x[3] = { sin(w), cos(w), 1 };
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        m[r][c] += x[r] * x[c];
+      }
+      m[r][3] += x[r] * pOut[i];
+    }
+  }
+  for (int p = 0; p < 3; p++) {
+    for (int r = 0; r < 3; r++) {
+      if (r != p) {
+        double f = m[r][p] / m[p][p];
+        for (int c = 0; c < 4; c++) {
+          m[r][c] -= f * m[p][c];
+        }
+      }
+    }
+  }
+  double a = m[0][3] / m[0][0], b = m[1][3] / m[1][1], c = m[2][3] / m[2][2];
+
+  double dResidual = 0;
+  for (size_t i = nFrom; i < nTo; i++) {
+    double w = 2 * PI * dFreq * i / dRate;
+    double e = pOut[i] - (a * sin(w) + b * cos(w) + c);
+    dResidual += e * e;
+  }
+  double dSignal = (a * a + b * b) / 2 * (nTo - nFrom);
+  return Decibels(sqrt(dResidual / dSignal));
+}
+
+typedef struct {
+  unsigned long dwInRate;
+  unsigned long dwOutRate;
+} Rates;
+
+static const Rates rates[] = {
+  { 44100, 48000 },
+  { 48000, 44100 },
+  { 96000, 44100 },
+  { 22050, 44100 },
+  { 44100, 44100 * 1001 / 1000 },  // more phases than RESAMPLE_MAX_PHASES
+};
+
+// THD+N and sweep error each quality has to beat, in dB
+static const double tonesLimit[RESAMPLE_MAX_QUALITY + 1] = { -40, -60, -80, -100 };
+static const double sweepLimit[RESAMPLE_MAX_QUALITY + 1] = { -35, -65, -85, -100 };
+static const double rejectLimit[RESAMPLE_MAX_QUALITY + 1] = { -55, -75, -90, -110 };
+
+static void
+TestRates(const Rates* pRates, int nQuality) {
+  unsigned long dwIn = pRates->dwInRate, dwOut = pRates->dwOutRate;
+  double dNyquist = (dwIn < dwOut ? dwIn : dwOut) / 2.0;
+  unsigned long l, m;
+  double dRate = OutputRate(dwIn, dwOut, &l, &m);
+  size_t nEdge = (size_t)(EDGE * dwOut);
+  size_t nOut;
+  printf("%6lu -> %6lu  q%d ", dwIn, dwOut, nQuality);
+
+  // tones up to three quarters of the lower Nyquist, inside every quality's passband
+  double dWorst = -1000;
+  double freqs[] = { 100, 1000, 5000, 0.5 * dNyquist, 0.75 * dNyquist };
+  for (size_t f = 0; f < sizeof(freqs) / sizeof(freqs[0]); f++) {
+    double* pOut = Resample(dwIn, dwOut, nQuality, Tone, &freqs[f], &nOut);
+    if (pOut) {
+      double d = ThdN(pOut, nEdge, nOut - nEdge, freqs[f], dRate);
+      dWorst = d > dWorst ? d : dWorst;
+      delete [] pOut;
+    }
+  }
+  printf(" tones %7.1f dB", dWorst);
+  CHECK(dWorst < tonesLimit[nQuality]);
+
+  double sweep[2] = { 20, 0.75 * dNyquist };
+  double* pOut = Resample(dwIn, dwOut, nQuality, Sweep, sweep, &nOut);
+  if (pOut) {
+    double dErr = 0, dRef = 0;
+    for (size_t i = nEdge; i < nOut - nEdge; i++) {
+      double r = Sweep(i / dRate, sweep);
+      dErr += (pOut[i] - r) * (pOut[i] - r);
+      dRef += r * r;
+    }
+    double d = Decibels(sqrt(dErr / dRef));
+    printf("   sweep %7.1f dB", d);
+    CHECK(d < sweepLimit[nQuality]);
+    delete [] pOut;
+  }
+
+  if (dwIn > dwOut * 6 / 5) {
+    double dAbove = dwOut / 2.0 + (dwIn / 2.0 - dwOut / 2.0) / 2;
+    pOut = Resample(dwIn, dwOut, nQuality, Tone, &dAbove, &nOut);
+    if (pOut) {
+      double dSum = 0;
+      for (size_t i = nEdge; i < nOut - nEdge; i++) {
+        dSum += pOut[i] * pOut[i];
+      }
+      double d = Decibels(sqrt(dSum / (nOut - 2 * nEdge)) / (AMPLITUDE / sqrt(2.0)));
+      printf("   reject %7.1f dB", d);
+      CHECK(d < rejectLimit[nQuality]);
+      delete [] pOut;
+    }
+  }
+  printf("\n");
+}
+
+// equal rates only change the sample size, exactly
+static void
+TestSizes() {
+  unsigned char in[3 * 256], out[4 * 256];
+  for (int i = 0; i < 256; i++) {
+    int v = (i - 128) * 65793;
+    in[3 * i] = (unsigned char)v;
+    in[3 * i + 1] = (unsigned char)(v >> 8);
+    in[3 * i + 2] = (unsigned char)(v >> 16);
+  }
+  PCMResampler resampler;
+  CHECK(resampler.Init(44100, 24, 44100, 32, false, 1, RESAMPLE_QUALITY_DEFAULT, DITHER_NONE));
+  CHECK(!resampler.IsIdentity());
+  size_t cbOut;
+  memcpy(out, resampler.Process(in, sizeof(in), &cbOut), 4 * 256);
+  CHECK(cbOut == 4 * 256);
+  bool bSame = true;
+  for (int i = 0; i < 256; i++) {
+    int v = (int)(out[4 * i] | (out[4 * i + 1] << 8) | (out[4 * i + 2] << 16) |
+                  ((unsigned)out[4 * i + 3] << 24));
+    bSame = bSame && v == ((i - 128) * 65793) * 256;
+  }
+  CHECK(bSame);
+  CHECK(resampler.Drain(&cbOut) == NULL || cbOut == 0);
+  CHECK(cbOut == 0);
+
+  CHECK(resampler.Init(44100, 16, 44100, 16, false, 2));
+  CHECK(resampler.IsIdentity());
+  CHECK(!resampler.Init(44100, 12, 48000, 16, false, 2));
+  CHECK(!resampler.Init(44100, 16, 0, 16, false, 2));
+}
+
+int
+main() {
+  TestSizes();
+  for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    for (int q = 0; q <= RESAMPLE_MAX_QUALITY; q++) {
+      TestRates(&rates[r], q);
+    }
+  }
+  return Failures("test_resample");
+}
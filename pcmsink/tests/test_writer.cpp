@@ -0,0 +1,123 @@
+// test_writer.cpp : PCMWriter against a synthetic producer
+//
+// The producer writes a known byte stream in chunks of random size, from one byte to
+// several times the ring, with the odd Flush between, and the file has to come out the
+// same. Then the framing, and a sink that can't write.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "../pcmsink.h"
+#include "../pcmwriter.h"
+#include "testutil.h"
+
+static unsigned char
+StreamByte(size_t i) {
+  return (unsigned char)(i * 7 + (i >> 9));
+}
+
+static void
+TestStream(size_t cbRing, size_t cbBlock, size_t cbTotal, unsigned nSeed) {
+  FILE* pFile = tmpfile();
+  PCMSink sink;
+  CHECK(sink.Open(pFile, PCM_RAW, 44100, 1, 8, false, false));
+  PCMWriter writer(&sink);
+  CHECK(writer.Start(cbRing, cbBlock));
+
+  unsigned char* pChunk = new unsigned char[cbRing * 3];
+  size_t nDone = 0;
+  while (nDone < cbTotal) {
+    size_t n = Random(&nSeed) % (cbRing * 3) + 1;
+    if (n > cbTotal - nDone) {
+      n = cbTotal - nDone;
+    }
+    for (size_t i = 0; i < n; i++) {
+      pChunk[i] = StreamByte(nDone + i);
+    }
+    CHECK(writer.Write(pChunk, n));
+    nDone += n;
+    if (Random(&nSeed) % 16 == 0) {
+      CHECK(writer.Flush());
+      CHECK(writer.GetBytesWritten() == nDone);
+      CHECK(writer.GetFill() == 0);
+    }
+  }
+  CHECK(writer.Close());
+  CHECK(writer.GetBytesWritten() == cbTotal);
+  CHECK(sink.Close());
+  delete [] pChunk;
+
+  rewind(pFile);
+  size_t nBad = 0, nRead = 0;
+  int c;
+  while ((c = fgetc(pFile)) != EOF) {
+    if ((unsigned char)c != StreamByte(nRead)) {
+      nBad++;
+    }
+    nRead++;
+  }
+  fclose(pFile);
+  CHECK(nRead == cbTotal);
+  CHECK(nBad == 0);
+}
+
+static void
+TestFrames() {
+  FILE* pFile = tmpfile();
+  PCMSink sink;
+  CHECK(sink.Open(pFile, PCM_RAW, 44100, 1, 8, false, false));
+  PCMWriter writer(&sink);
+  CHECK(writer.Start(64, 16));
+
+  writer.SetFrame(2);
+  CHECK(writer.WriteFrame("FILE", "ab", 2));
+  CHECK(writer.Write("xyz", 3));
+  writer.SetFrame(0);
+  CHECK(writer.Write("!", 1));
+  CHECK(writer.Close());
+  CHECK(sink.Close());
+
+  static const unsigned char expected[] = {
+    'F', 'I', 'L', 'E', 2, 0, 0, 0, 2, 0, 0, 0, 'a', 'b',
+    'D', 'A', 'T', 'A', 2, 0, 0, 0, 3, 0, 0, 0, 'x', 'y', 'z',
+    '!'
+  };
+  unsigned char got[64];
+  rewind(pFile);
+  size_t n = fread(got, 1, sizeof(got), pFile);
+  fclose(pFile);
+  CHECK(n == sizeof(expected));
+  CHECK(memcmp(got, expected, sizeof(expected)) == 0);
+}
+
+// every write to a read only stream fails, which has to reach the producer
+static void
+TestFailure() {
+  FILE* pFile = fopen("/dev/null", "rb");
+  PCMSink sink;
+  CHECK(sink.Open(pFile, PCM_RAW, 44100, 1, 8, false, false));
+  PCMWriter writer(&sink);
+  CHECK(writer.Start(4096, 1024));
+
+  unsigned char chunk[1000];
+  memset(chunk, 0x55, sizeof(chunk));
+  bool bFailed = false;
+  for (int i = 0; i < 100 && !bFailed; i++) {
+    bFailed = !writer.Write(chunk, sizeof(chunk));
+  }
+  CHECK(bFailed);
+  CHECK(!writer.Flush());
+  CHECK(!writer.Close());
+  fclose(pFile);
+}
+
+int
+main() {
+  TestStream(4096, 1024, 1 << 20, 1);
+  TestStream(4096, 4096, 1 << 20, 2);     // block cut to half the ring
+  TestStream(1 << 16, 1 << 12, 8 << 20, 3);
+  TestStream(PCM_WRITER_RING, PCM_WRITER_BLOCK, 16 << 20, 4);
+  TestFrames();
+  TestFailure();
+  return Failures("test_writer");
+}
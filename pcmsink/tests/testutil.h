@@ -0,0 +1,47 @@
+// testutil.h : what the pcmsink tests and benchmarks share
+//
+// CHECK counts a failure and says where, and the test's main returns Failures(). Seconds
+// is a monotonic clock for the benchmarks.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+static int g_nFailures = 0;
+
+#define CHECK(x)                                                          \
+  do {                                                                    \
+    if (!(x)) {                                                           \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+      g_nFailures++;                                                      \
+    }                                                                     \
+  } while (0)
+
+inline int
+Failures(const char* pszTest) {
+  if (g_nFailures) {
+    fprintf(stderr, "%s: %d failed\n", pszTest, g_nFailures);
+    return 1;
+  }
+  printf("%s: ok\n", pszTest);
+  return 0;
+}
+
+inline double
+Seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift, so runs are repeatable
+inline unsigned
+Random(unsigned* pSeed) {
+  unsigned x = *pSeed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *pSeed = x;
+}
@@ -79,35 +79,96 @@
 // Version 1.11
 // Fix to stop socketwrapper not shutting down properly when input from stdin and output pipe is closed.
 //
+// ++++++
+// Version 1.12
+// Built-in PCM transform stages. A command segment starting with @ (see swxform.h) is run
+// by a pump thread on the data it is moving instead of being spawned as a process.
+// e.g. command1 arg11 arg12 | @chmap 16 1 0,0 | command2 arg21 arg22 ...
+//
+// ++++++
+// Version 1.13
+// Pool mode (-P). One long-lived socketwrapper keeps warm pipeline shells for a set of
+// command templates and binds them to input/output ports on demand. See swpool.h.
+// The pipeline code moved to swpipeline.cpp. Pipes are no longer inherited by every
+// child, only by the step they belong to.
+//
+// ++++++
+// Version 1.14
+// Daemon mode. The pool's control connection accepts RUN inport outport command, so one
+// process can serve any number of pipelines (-P without -c is a plain daemon). In pool and
+// daemon mode the pumps run on a shared engine (swengine.cpp) of a few threads waiting on
+// an I/O completion port, rather than a thread per pump. Single mode is unchanged.
+//
+// ++++++
+// Version 1.15
+// -i/-o (and the pool's BIND/RUN) take endpoints rather than just TCP ports: unix:path for
+// AF_UNIX sockets on Windows 10 1803+, or fd:handle for an already connected socket that
+// was inherited, e.g. one end of a socketpair. TCP connections set TCP_NODELAY.
+// swbench.pl compares the transports.
+//
+// ++++++
+// Version 1.16
+// Fast cancel. If the output socket is closed by its reader, or the pool is sent
+// CANCEL id, the rest of the stream isn't wanted: the sockets are closed, the pumps'
+// I/O aborted and all the processes killed together, instead of waiting up to 2s for each
+// step to drain. swbench.pl --skips measures skip to first byte of the next stream.
+//
+// ++++++
+// Version 1.17
+// @tee built-in stage (see swtee.h). Sends the stream on unchanged and also to other
+// consumers on ports, unix sockets or named pipes, each with its own writer thread and a
+// block, drop or detach policy for when it can't keep up.
+//
+// ++++++
+// Version 1.18
+// @buffer read-ahead stage (see swring.h). A preallocated ring with the read and write
+// in flight together, so a slow patch upstream doesn't starve the output. Reports peak
+// and mean fill and how often it ran empty or full when the pipeline ends (with -d).
+//
+// ++++++
+// Version 1.19
+// #PIPE# gets a pipe name no other process can guess or claim first, a larger pipe buffer
+// for tools writing big blocks to it, and a clear error for a second #PIPE# in a command.
+// The token is still a Windows named pipe only: there's no POSIX build of socketwrapper,
+// so no mkfifo or /dev/fd/N form of it.
+//
+// ++++++
+// Version 1.20
+// Transfer buffers size themselves: pumps start with small reads and grow them while reads
+// keep coming back full and the bitrate calls for it, then shrink when they don't. The
+// size and rate are shown in pool STATS and when the pipeline is tidied.
+//
+// ++++++
+// Version 1.21
+// Commands are parsed once into a validated graph (see swgraph.h) instead of with strtok,
+// and the pool builds every shell from its template's graph. Empty steps are an error.
+// The 16 step limit is gone: steps are allocated to fit, and steps beyond what
+// WaitForMultipleObjects can watch are waited on through the thread pool.
+//
+// ++++++
+// Version 1.22
+// -a and -p (see swsched.h) pin socketwrapper and its children to a processor set and give
+// them a priority class, with the pumps at their children's priority rather than always
+// time critical so they no longer preempt the decoders they wait on.
+//
+// ++++++
+// Version 1.23
+// A final @pace rate [burst] segment (see swpace.h) sends the output socket at a steady bit
+// rate after an initial burst, so a relay no longer pushes a whole file into the player's
+// buffer at once. The engine waits for tokens on a timer queue timer rather than a thread,
+// and a paced pump always runs on the engine, in single mode too.
+//
 
 #include <process.h>
 #include "stdafx.h"
 #include "getopt.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swpool.h"
+#include "swengine.h"
+#include "swsched.h"
 
-#define	 SW_ID			  "Socketwrapper 1.11beta\n"
-
-// defines & global vars for extra thread mode
-#define  MAX_STEPS        16
-#define  PIPE_TOKEN       "#PIPE#"                     // token to look for
-#define  PIPE_NAME_ROOT   "\\\\.\\pipe\\socketwrapper" // root of named pipe name
-#define  BUFFER_SIZE      8192                         // size of buffer for transfers & named pipe
-#define  TIMEOUT          60000                        // timeout for wait checking thread state
-#define  DEBUG_TIMEOUT    10000                        // timeout when in debug mode
-
-// info about each step in process (also used as context for thread creation)
-typedef struct
-{
-	int i;
-	bool fIsWorkerThread;	// true for thread, false for child process
-	bool fInputIsNamed;		// for thread, true if input handle is named pipe false otherwise
-	bool fOutputIsSocket;   // true for last thread sending output to a socket
-	char *pBuff;			// either transfer buffer for thread or cmdline for process
-	HANDLE hInput;			// input handle for process/thread
-	HANDLE hOutput;			// output handle for process/thread
-	DWORD WatchDog;			// watchdog for worker threads
-	DWORD nBlocks;			// number of "blocks" read
-	DWORD nBytes;			// number of bytes read
-} Stage;
+#define	 SW_ID			  "Socketwrapper 1.23beta\n"
 
 BOOL bWatchdogEnabled = FALSE;
 BOOL bDebug = FALSE;
@@ -117,10 +178,25 @@ void
 printUsage() {
 	fprintf(stderr,
 		SW_ID
-		"Usage: socketwrapper -i port -o port [-d | -D] -c command\n"
-		"-o port \tUnix domain port to connect to for output.\n"
-		"-i port \tUnix domain port to connect to for input.\n"
-		"-c command \tCommand to execute.\n"
+		"Usage: socketwrapper -i endpoint -o endpoint [-w] [-d | -D] -c command\n"
+		"       socketwrapper -P port [-n warm] [-t threads] [-w] [-d | -D] [-c template ...]\n"
+		"       either with [-a cpus] [-p class[:pump]]\n"
+		"-o endpoint \tWhere to connect for output: a localhost TCP port, unix:path or\n"
+		"\t\tfd:handle for a connected socket inherited from the parent.\n"
+		"-i endpoint \tWhere to connect for input, as for -o.\n"
+		"-c command \tCommand to execute. Segments starting with @ are built-in stages:\n"
+		"\t\t@swap bits, @skip bytes, @wavstrip, @chmap bits channels map,\n"
+		"\t\t@format from to, @limit bytes, @tee [block:|drop:|detach:]target ...\n"
+		"\t\t@buffer size[k|M] or @buffer seconds's' bytes_per_second,\n"
+		"\t\tand last, @pace bits_per_second[k|M] [burst[k|M] or seconds's'].\n"
+		"-P port \tPool mode: listen for control connections on this port.\n"
+		"-n warm \tPool mode: number of warm shells to keep per template.\n"
+		"-t threads \tPool mode: number of pump engine threads (default one per processor).\n"
+		"-a cpus \tRun on these processors only, e.g. 0,2-3. Children inherit it.\n"
+		"-p class[:pump]\tPriority class for socketwrapper and its children (idle, below,\n"
+		"\t\tnormal, above, high, realtime) and optionally for the pumps within it\n"
+		"\t\t(idle, lowest, below, normal, above, highest, critical). Default: pumps\n"
+		"\t\tcritical, children normal.\n"
 		"-w \t\tEnables watchdog.\n"
 		"-d \t\tEnable debugging ouput.\n"
 		"-D \t\tEnable Verbose debugging ouput.\n"
@@ -175,129 +251,34 @@ debugMsg ( const char *fmt, ...) {
 	}
 }
 
-//
-// MoveDataThreadProc
-//
-// this is used for transferring data (when appropriate) as follows
-//	* from the named pipe to the next process (the original use of an extra thread)
-//  * from the input socket via a pipe to the first process
-//	* from the last process via a pipe to the output socket
-//
-unsigned __stdcall MoveDataThreadProc(void *pv) 
-{
-	Stage *pS = (Stage *)pv;
-	bool fShowDebug = true;
-	DWORD nNummsgs = 0;
-
-	debugMsg ( "MoveDataThreadProc for step %i started.\n", pS->i );
-
-	// if the input handle is for a named pipe then wait for the other end
-	if( pS->fInputIsNamed ){
-
-		if( !ConnectNamedPipe( pS->hInput, NULL) ) {
-			stderrMsg ( "MoveDataThreadProc for step %i failed to attach to named pipe.\n", pS->i );
-			_endthreadex(1); 
-			return 1;
-		} 
-
-		debugMsg ( "MoveDataThreadProc for step %i attached to named pipe.\n", pS->i );
-	}
-
-	DWORD bytesread, byteswritten;
-
-	for(;;)	{
-
-		if( fShowDebug ) {
-			debugMsg ( "MoveDataThreadProc for step %i about to call ReadFile.\n", pS->i );
-		}
-
-		// wait for some data from input
-		if( !ReadFile(pS->hInput, pS->pBuff, BUFFER_SIZE, &bytesread, NULL) ) {
-			stderrMsg ( "MoveDataThreadProc for step %i failed reading with error %i.\n", pS->i, GetLastError() );
-			break;
-		}
-		if (bytesread == 0) {
-			DWORD lasterror = GetLastError();
-			stderrMsg ( "MoveDataThreadProc for step %i read returned 0 bytes with no error. Last Error = %i.\n", pS->i, lasterror );
-			if (lasterror != 0) break;
-		// So no error and 0 bytes this means EOF so terminate the thread. 
-			break;
-
-		}
-
-
-		pS->nBytes += bytesread;
-		pS->nBlocks++;
-
-		// log when data starts
-		if( fShowDebug ) {
-			debugMsg ( "MoveDataThreadProc for step %i got %i bytes, about to write data.\n", pS->i, bytesread );
-			nNummsgs++;
-		}
-
-		// pass data to output
-		if (!pS->fOutputIsSocket){
-			if( !WriteFile(pS->hOutput, pS->pBuff, bytesread, &byteswritten, NULL) ) {
-				stderrMsg ( "MoveDataThreadProc for step %i failed WriteFile with error %i.\n", pS->i, GetLastError() );
-				break;
-			}
-		} else {
-			byteswritten = send ((SOCKET) pS->hOutput, pS->pBuff, bytesread, 0 );
-			if (byteswritten == INVALID_SOCKET) {
-				stderrMsg ( "MoveDataThreadProc for step %i failed Send writing with error %i.\n", pS->i, WSAGetLastError());
-				break;
-			}
-			if (byteswritten != bytesread) {
-				stderrMsg ( "MoveDataThreadProc for step %i : bytesread=%i byteswritten=%i\n", pS->i, bytesread, byteswritten );
-				break;
-			}
-		}
-
-		// increase watchdog counter
-		++(pS->WatchDog);
-
-		// turn off debug once going and verbose debug is not set
-		if (nNummsgs > 1 && !bDebugVerbose) fShowDebug = false;
-	}
-
-
-	debugMsg ( "MoveDataThreadProc for step %i ending.\n", pS->i );
-	if (!pS->fOutputIsSocket) {
-		if (!FlushFileBuffers(pS->hOutput)) {
-			stderrMsg ( "Error Flushing Output in Thread for step %d: %d\n", pS->i, GetLastError());
-		} 
-	} else {
-		shutdown((SOCKET) pS->hOutput, SD_SEND);
-	}
-	if(!CloseHandle(pS->hOutput )) {
-		stderrMsg ( "CloseHandle for step %i failed with error %i.\n", pS->i, GetLastError() );
-	}
- 
-	_endthreadex(0); 
-	return 0;
-}
-
-
 
 DWORD main(int argc, char **argv)
 {
-	USHORT inputPort = 0, outputPort = 0;
-	SOCKET inputSocket = INVALID_SOCKET, outputSocket = INVALID_SOCKET;
-	LPSTR command = NULL;
-	DWORD ret = 0;
+	USHORT controlPort = 0;
+	LPSTR inputSpec = "0", outputSpec = "0";
+	Endpoint input, output;
+	LPSTR commands[MAX_TEMPLATES];
+	int nCommands = 0;
+	bool fPool = false;
+	int nWarm = DEFAULT_WARM;
+	int nEngineThreads = 0;
 	
 	// Parse the command line arguments
 	char c;
-	while ((c = getopt(argc, argv, "i:o:c:wdD")) != EOF) {
+	while ((c = getopt(argc, argv, "i:o:c:wdDP:n:t:a:p:")) != EOF) {
 		switch(c) {
 			case 'i':
-				inputPort = atoi(optarg);
+				inputSpec = optarg;
 				break;
 			case 'o':
-				outputPort = atoi(optarg);
+				outputSpec = optarg;
 				break;
 			case 'c':
-				command = optarg;
+				if (nCommands == MAX_TEMPLATES) {
+					stderrMsg ( "No more than %d -c commands can be given\n", MAX_TEMPLATES );
+					return -1;
+				}
+				commands[nCommands++] = optarg;
 				break;
 			case 'w':
 				bWatchdogEnabled = true;
@@ -309,6 +290,30 @@ DWORD main(int argc, char **argv)
 				bDebug = true;
 				bDebugVerbose = true;
 				break;
+			case 'P':
+				fPool = true;
+				controlPort = atoi(optarg);
+				break;
+			case 'n':
+				nWarm = atoi(optarg);
+				if (nWarm < 0) nWarm = 0;
+				if (nWarm > MAX_WARM) nWarm = MAX_WARM;
+				break;
+			case 't':
+				nEngineThreads = atoi(optarg);
+				break;
+			case 'a':
+				if (!SchedParseAffinity(optarg)) {
+					printUsage();
+					return -1;
+				}
+				break;
+			case 'p':
+				if (!SchedParsePriority(optarg)) {
+					printUsage();
+					return -1;
+				}
+				break;
 			case '\0':
 				printUsage();
 				return -1;
@@ -317,356 +322,51 @@ DWORD main(int argc, char **argv)
 
 	debugMsg ( SW_ID );
 
-	if (!command) {
+	if (!nCommands && !fPool) {
 		printUsage();
 		return -1;
 	}
 
-	debugMsg( "-i %i -o %i -c %s\n", inputPort, outputPort, command );
-
-	// Initialize Winsock
-	WORD wVersionRequested = MAKEWORD( 1, 1 );
-	WSADATA wsaData;
-	int err = WSAStartup( wVersionRequested, &wsaData );
-	if ( err != 0 ) {
-		stderrMsg( " Couldn't initialize winsock\n");
+	if (!EndpointParse(inputSpec, &input, true) || !EndpointParse(outputSpec, &output, true)) {
+		printUsage();
 		return -1;
 	}
 
-	// reset our arrays
-	int numSteps = 0;
-
-	Stage info[MAX_STEPS] = {0};
-	HANDLE hChild[MAX_STEPS] = {0};
-
-	// count processes to spawn
-	int numProcesses = 0;
-	LPSTR token = strtok(command, "|");
-	while (token) {
-		numProcesses++;
-		token = strtok(NULL, "|");
-	}
-
-	// input socket - use via unnamed pipe and worker thread
-	if( inputPort )
-	{
-		debugMsg ( "Input from socket ...\n");
-		struct sockaddr_in addr;
-		addr.sin_family = AF_INET;
-		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-		inputSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, 0);
-		if (inputSocket == INVALID_SOCKET) {
-			stderrMsg( " Input socket creation error: %d\n", WSAGetLastError());
-			ret = -1;
-			goto tidy;
-		}
-
-		int iMode = 0;
-		ioctlsocket(inputSocket, FIONBIO, (u_long FAR*) &iMode);
-
-		addr.sin_port = htons(inputPort);
-		if (connect(inputSocket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-			stderrMsg( " input socket connection error: %d\n", WSAGetLastError());
-			ret = -1;
-			goto tidy;
-		}
-
-		debugMsg ( "Input socket connected OK.\n");
-
-		info[numSteps].hInput = (HANDLE)inputSocket;
-		info[numSteps].fIsWorkerThread = true;
-		info[numSteps].fInputIsNamed = false;
-		info[numSteps].fOutputIsSocket = false;
-		
-		SECURITY_ATTRIBUTES saAttr; 
-		saAttr.nLength = sizeof(SECURITY_ATTRIBUTES); 
-		saAttr.bInheritHandle = TRUE; 
-		saAttr.lpSecurityDescriptor = NULL; 
-		
-		if (!CreatePipe(&(info[numSteps+1].hInput),
-						&(info[numSteps].hOutput), 
-						&saAttr, 0)){
-			stderrMsg ( "Input socket pipe creation error: %d\n", GetLastError());
-			ret = -1;
-			goto tidy;
-		}
-
-		debugMsg ( "Input socket pipe created OK.\n");
-		++numSteps;
-	}
-	else{
-		info[numSteps].hInput = GetStdHandle(STD_INPUT_HANDLE);
-	}
-
-	// command line
-	token = command;
-	for (int i = 0; i < numProcesses; i++) 
-	{
-		while( *token==' ' ) ++token;
-
-		LPSTR p = strstr(token, PIPE_TOKEN);
-
-		if (p != NULL) // PIPE_TOKEN found
-		{
-			LPSTR p2 = p;
-			char pszNP[sizeof(PIPE_NAME_ROOT)+8];
-			sprintf( pszNP, "%s%06d", PIPE_NAME_ROOT, getpid() );
-			size_t n = strlen(token)+strlen(PIPE_NAME_ROOT)+8;
-			info[numSteps].pBuff = (char *)malloc(n);
-			if( info[numSteps].pBuff == NULL) {
-				stderrMsg ( "pBuff malloc failed\n");
-				ret = -1;
-				goto tidy;
-			}
-
-			p = p+strlen( PIPE_TOKEN );
-			*p2='\0';
-			sprintf((char *)info[numSteps].pBuff, "%s%s%s", token, pszNP, p); 
-			*p2='#';
-			info[numSteps+1].hInput = CreateNamedPipe( pszNP,
-							PIPE_ACCESS_INBOUND,
-							PIPE_TYPE_BYTE|PIPE_WAIT,
-							1,
-							BUFFER_SIZE,
-							BUFFER_SIZE,
-							INFINITE,
-							NULL);
-			if(info[numSteps+1].hInput == INVALID_HANDLE_VALUE) {
-				stderrMsg ( "Error Creating Named Pipe: %d\n", GetLastError());
-				ret = -1;
-				goto tidy;
-			}
-			info[numSteps].hOutput = GetStdHandle(STD_ERROR_HANDLE);
-			++numSteps;
-
-			info[numSteps].fIsWorkerThread = true;
-			info[numSteps].fInputIsNamed = true;
-			info[numSteps].fOutputIsSocket = false;
-
-		} else {  // no PIPE_TOKEN
-			info[numSteps].pBuff = (char *)malloc(strlen(token)+1);
-			if( info[numSteps].pBuff == NULL) {
-				stderrMsg ( "malloc failed\n");
-				ret = -1;
-				goto tidy;
-			}
-			strcpy( (char *)info[numSteps].pBuff, token );
-		}
-
-		if ( i != numProcesses - 1 || outputPort ) {
-
-			SECURITY_ATTRIBUTES saAttr; 
-			saAttr.nLength = sizeof(SECURITY_ATTRIBUTES); 
-			saAttr.bInheritHandle = TRUE; 
-			saAttr.lpSecurityDescriptor = NULL; 
-			
-			if (!CreatePipe(&(info[numSteps+1].hInput),
-							&(info[numSteps].hOutput), 
-							&saAttr, 0)){
-				stderrMsg ( "Error Creating Pipe: %d\n", GetLastError());
-				ret = -1;
-				goto tidy;
-			}
-		}
-
-		// last process
-		if ( i == numProcesses - 1 ) {
-
-			if ( outputPort ){
-				// anon pipe already done
-				// open socket
-				++numSteps;
-				info[numSteps].fIsWorkerThread = true;
-				info[numSteps].fInputIsNamed = false;
-				info[numSteps].fOutputIsSocket = true;
-
-				outputSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, 0);
-				if (outputSocket == INVALID_SOCKET) {
-					stderrMsg ( "Error creating output socket: %d\n", WSAGetLastError());
-					ret = -1;
-					goto tidy;
-				}
-				int iMode = 0;
-				ioctlsocket(outputSocket, FIONBIO, (u_long FAR*) &iMode);
-
-				struct sockaddr_in addr;
-				addr.sin_family = AF_INET;
-				addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-				addr.sin_port = htons(outputPort);
-				if (connect(outputSocket, (const sockaddr*)&addr, 
-							sizeof(addr)) == SOCKET_ERROR) {
-					stderrMsg ( "Error connecting to output socket: %d\n", WSAGetLastError());
-					ret = -1;
-					goto tidy;
-				}
-				info[numSteps].hOutput = (HANDLE)outputSocket;
-			}
-			else{
-				info[numSteps].hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-			}
-		}
-
-		++numSteps;
-
-		token += strlen(token) + 1;
+	if (!PipelineInit() || !SchedInit()) {
+		return -1;
 	}
 
-	// debugging
-	debugMsg ( "Init complete.\n" );
-	debugMsg ( "# =input== =output= ==type== ===details===\n" );
-	for( int i=0; i<numSteps; ++i ){
-		info[i].i = i;
-		if( info[i].fIsWorkerThread )
-			debugMsg ( "%1x %08x %08x  THREAD  %s%s\n", i, info[i].hInput, info[i].hOutput, (info[i].fInputIsNamed ? "Named Pipe" : ""), (info[i].fOutputIsSocket ? "Output Socket" : ""));
-		else
-			debugMsg ( "%1x %08x %08x  PROCESS %s\n" ,i, info[i].hInput, info[i].hOutput, info[i].pBuff );
+	if (fPool) {
+		return PoolRun(controlPort, nCommands, commands, nWarm, nEngineThreads);
 	}
-	
-	// turn on the pumps
-	for( int i = 0; i < numSteps; ++i ){
-		if( info[i].fIsWorkerThread )
-		{
-			info[i].pBuff = (char *)malloc(BUFFER_SIZE);
-			if( info[i].pBuff == NULL) {
-				stderrMsg ( "malloc failed for step %d \n",i);
-				ret = -1;
-				goto tidy;
-			}
 
-			hChild[i] = (HANDLE)_beginthreadex(NULL, 0, &MoveDataThreadProc, &info[i], 0, NULL);
-			if( hChild[i] ) 
-			{
-				if (!SetThreadPriority( hChild[i], THREAD_PRIORITY_TIME_CRITICAL)) {
-					stderrMsg ( "Error changing thread priority for step %d : %d\n",i, GetLastError());
-					ret = -1;
-					goto tidy;
-				}
+	// a single pipeline - as before, the last -c wins
+	LPSTR command = commands[nCommands - 1];
 
-			}
-		}
-	}
-
-	// and turn on the taps
-	for( int i = 0; i < numSteps; ++i ){
-		if( !info[i].fIsWorkerThread )
-		{
-			STARTUPINFO siStartInfo;
-			PROCESS_INFORMATION piProcInfo; 
-	
-			ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
-			ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
+	char inName[MAX_UNIX_PATH + 8], outName[MAX_UNIX_PATH + 8];
+	debugMsg( "-i %s -o %s -c %s\n", EndpointName(&input, inName, sizeof(inName)), EndpointName(&output, outName, sizeof(outName)), command );
 
-			siStartInfo.cb = sizeof(STARTUPINFO); 
-
-			siStartInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-			siStartInfo.hStdInput = info[i].hInput;
-			siStartInfo.hStdOutput = info[i].hOutput;
-			siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
-
-			if( !CreateProcess(NULL, info[i].pBuff,
-								  NULL, // process security attributes 
-								  NULL, // primary thread security attributes 
-								  TRUE, // handles are inherited 
-								  0,    // creation flags 
-								  NULL, // use parent's environment 
-								  NULL, // use parent's current directory 
-								  &siStartInfo,  // STARTUPINFO pointer 
-								  &piProcInfo)) {  // receives PROCESS_INFORMATION 
-				stderrMsg ( "Error Creating Process for step %d: %d\n", i, GetLastError());
-				ret = -1;
-				goto tidy;
-			}
-		
-			hChild[i] = piProcInfo.hProcess;
-			CloseHandle( piProcInfo.hThread );
-			if (info[i].hOutput != GetStdHandle(STD_ERROR_HANDLE))
-				CloseHandle(info[i].hOutput);
-		}
-	}
+	Graph *pG = GraphParse(command);
 
-	bool fDie = false;
-	DWORD deadstep = -1;
-
-	while( !fDie )	{
-		DWORD wr = WaitForMultipleObjects( numSteps, hChild, FALSE, bDebug ? DEBUG_TIMEOUT : TIMEOUT );
-		if( wr!=WAIT_TIMEOUT ) {
-			deadstep = wr-WAIT_OBJECT_0;
-			stderrMsg( "Timeout Process/Thread for step %i died.\n", deadstep );
-			fDie = true;
-		}
-		for( int i=0; i<numSteps; ++i ){
-			if( info[i].fIsWorkerThread ){
-				if( 0==info[i].WatchDog ) {
-					stderrMsg( "Watchdog expired - Thread for step %i stalled.\n", i );
-					if (bWatchdogEnabled)	fDie = true;
-				}
-				info[i].WatchDog=0;
-			}
-		}
+	// a paced output is pumped by the engine, so it needs one even here
+	bool fEngine = pG && pG->pace;
+	if (fEngine && !EngineInit(1)) {
+		GraphFree(pG);
+		return -1;
 	}
 
-tidy:
-	DWORD wr;
-	DWORD waittimeout = 2000; // Wait time for process / thread to pass remaining bytes in buffer.
-
-	debugMsg ( "Tidying up \n"); 
-	if (deadstep == 0) {
-		debugMsg ( " Normal source all read: Process 0 ended \n" );
-	} else {
-		if (deadstep != -1) debugMsg ( " Process/thread %d stopped\n", deadstep );
-		if ((deadstep +1) == numSteps) {
-				debugMsg ( " Output Process/thread %d stopped\n", deadstep );
-				waittimeout = 50 ; // Make shutdown faster if last process has stopped since no more bytes can be sent to output
-		}
-		if (fDie) debugMsg ( "Watchdog expired \n"); 
-	}
-	for( int i = 0; i < numSteps; ++i ){
-		if( info[i].fIsWorkerThread ){
-				wr = WaitForSingleObject( hChild[i],waittimeout );
-				if( wr==WAIT_TIMEOUT ) {
-					stderrMsg( "Tidying up - Thread for step %d hasn't died.\n", i );
-				} else if( wr==WAIT_FAILED ) {
-					stderrMsg ( "Tidying up - Wait for thread to die failed for step  %d: %d\n", i, GetLastError());
-				}
-				debugMsg("Thread for step %i streamed %6i blocks totalling %08X (%d) bytes\n",i, info[i].nBlocks , info[i].nBytes, info[i].nBytes );
-			} else {
-			debugMsg("Waiting for process step %i to terminate\n",i);
-			wr = WaitForSingleObject( hChild[i], 2000 );
-			if( wr==WAIT_TIMEOUT || wr==WAIT_FAILED ) {
-				stderrMsg( "Tidying up - process for step %d hasn't died or wait failed. wr=%d :%d \n", i,wr, GetLastError() );
-				if( hChild[i] ) {
-					if (!TerminateProcess( hChild[i], 0 ) )
-						stderrMsg ( "Error Terminating Process for step %d: %d\n", i, GetLastError());
-				}
-			}
+	Pipeline *pP = pG ? PipelineCreate(pG, input.type != TRANSPORT_NONE, output.type != TRANSPORT_NONE, false) : NULL;
+	GraphFree(pG);
+	if (pP) {
+		if (PipelineStart(pP) && PipelineBind(pP, &input, &output, 0, NULL)) {
+			PipelineRun(pP);
 		}
-		if( info[i].pBuff ) free( info[i].pBuff );
+		PipelineTidy(pP);
 	}
-
-//
-//  Now that all processes are terminated - check if any threads are still running and end them as well.
-//
-
-	for( int i = 0; i < numSteps; ++i ){
-		if( info[i].fIsWorkerThread ){
-			DWORD threadExitCode;
-			if (GetExitCodeThread(hChild[i],&threadExitCode)) {
-				if (threadExitCode == STILL_ACTIVE){
-					debugMsg("Exitcode for Thread %i Code=%d\n",i,threadExitCode);
-					if(!TerminateThread(hChild[i], 2)) {
-						stderrMsg ( "Error trying to TerminateThread for step %d: %d\n", i, GetLastError());
-					}
-				}
-			} else {
-				stderrMsg ( "Error GetExitThreadCode for step %d: %d\n", i, GetLastError());
-			}
-			CloseHandle(hChild[i]); // CloseHandle is required because _beginthreadex was used.
-		}
+	if (fEngine) {
+		EngineShutdown();
 	}
 
-	if( outputSocket ) closesocket( outputSocket );
-	if( inputSocket )  closesocket( inputSocket );
 	FlushFileBuffers(GetStdHandle(STD_OUTPUT_HANDLE));
 	debugMsg("Socketwrapper has terminated.\n\n");
 	return 0;
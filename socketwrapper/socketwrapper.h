@@ -0,0 +1,10 @@
+// socketwrapper.h : declarations shared between the socketwrapper source files
+//
+
+#pragma once
+
+extern BOOL bDebug;
+extern BOOL bDebugVerbose;
+
+void stderrMsg ( const char *fmt, ...);
+void debugMsg ( const char *fmt, ...);
@@ -0,0 +1,789 @@
+#!/usr/bin/perl
+#
+# $Id$
+#
+# Loopback benchmark for socketwrapper's transports (see swtransport.h).
+#
+# For each transport this starts "socketwrapper -i X -o Y -c @skip 0", which is a single
+# pump thread moving data from the input to the output, so what is measured is the
+# transport rather than any child process. It reports the round trip time of small
+# blocks sent one at a time and the throughput of a bulk transfer.
+#
+# Usage: swbench.pl [--exe socketwrapper.exe] [--transports tcp,unix,fd]
+#                   [--mb 64] [--pings 1000] [--ping-size 64]
+#        swbench.pl --skips n [--exe socketwrapper.exe] [--command cmd]
+#        swbench.pl --stages 1,2,4,8,16 [--sizes 512,8192,65536] [--mb 64] [--cat cmd]
+#        swbench.pl --concurrent n [--stages 2] [--mb 16] [--sw-args 'args;args...']
+#        swbench.pl --shapes [--exe socketwrapper.exe]
+#
+# With --skips it measures what a user skipping tracks sees instead. A stream is started
+# and, once it is flowing, dropped for a new one: first by closing its output socket as the
+# server does with a socketwrapper per stream, then with CANCEL to a socketwrapper daemon.
+# It reports the time from the skip to the first byte of the new stream and to the old
+# stream being torn down. Use --command to include a real decoder in the pipeline; it is
+# fed from the input socket.
+#
+# With --stages it looks for truncation and CPU hogs in the pipeline itself. Each run pushes
+# a known byte stream through a chain of that many cat-like children ("--cat", by default a
+# perl one-liner) written and read in blocks of each of the --sizes, then checks the output
+# is byte-exact by length and MD5. It reports MB/s, the time to the first byte out and the
+# CPU used by socketwrapper itself per stream (the children are not counted). On Windows
+# CPU needs Win32::API, otherwise it is shown as '-'.
+#
+# With --concurrent it runs that many pipelines of --stages children at once, all streams
+# pushed together, to show how scheduling (socketwrapper's -a and -p) holds up under load.
+# Each ';' separated set of --sw-args is one run, e.g. --sw-args ';-p normal;-p below -a 0-1'
+# compares the default with two policies. It reports the total and slowest stream MB/s,
+# the slowest first byte and socketwrapper CPU for all the streams.
+#
+# With --shapes it checks a megabyte through each of a few commands whose steps are put
+# together in ways that have broken before, byte-exact as with --stages: a child writing
+# to #PIPE#, and the same with built-in stages chained onto the pipe's reader and a paced
+# output, which makes that reader an engine pump even in single mode. The paced one runs
+# at 1Mbit/s, so takes some seconds.
+#
+# unix needs Windows 10 1803 or later and a perl with AF_UNIX support. fd passes one end
+# of a socketpair and needs Win32API::File.
+
+use strict;
+
+$|++;
+
+use Digest::MD5;
+use File::Spec;
+use Getopt::Long;
+use IO::Select;
+use IO::Socket::INET;
+use List::Util qw(min);
+use Socket;
+use Time::HiRes qw(time);
+
+my $exe        = 'socketwrapper.exe';
+my $transports = 'tcp,unix,fd';
+my $mb         = 64;
+my $pings      = 1000;
+my $pingSize   = 64;
+my $chunk      = 65536;
+my $skips      = 0;
+my $command    = '@skip 0';
+my $stages     = '';
+my $sizes      = '512,8192,65536';
+my $concurrent = 0;
+my $swArgs     = '';
+my $shapes     = 0;
+my $cat        = qq{"$^X" -e "binmode STDIN; binmode STDOUT; syswrite STDOUT, \$b while sysread STDIN, \$b, 65536"};
+my $writer     = qq{"$^X" -e "open F, '>', \$ARGV[0] or die; binmode STDIN; binmode F; syswrite F, \$b while sysread STDIN, \$b, 65536"};
+
+GetOptions(
+	'exe=s'        => \$exe,
+	'transports=s' => \$transports,
+	'mb=i'         => \$mb,
+	'pings=i'      => \$pings,
+	'ping-size=i'  => \$pingSize,
+	'skips=i'      => \$skips,
+	'command=s'    => \$command,
+	'stages=s'     => \$stages,
+	'sizes=s'      => \$sizes,
+	'cat=s'        => \$cat,
+	'concurrent=i' => \$concurrent,
+	'sw-args=s'    => \$swArgs,
+	'shapes'       => \$shapes,
+) || die "Usage: $0 [--exe path] [--transports tcp,unix,fd] [--mb n] [--pings n] [--ping-size n] [--skips n] [--command cmd] [--stages list] [--sizes list] [--cat cmd] [--concurrent n] [--sw-args list] [--shapes]\n";
+
+if ( $concurrent ) {
+	exit( bench_all_concurrent() ? 0 : 1 );
+}
+
+if ( $skips ) {
+	bench_skips();
+	exit;
+}
+
+if ( $stages ) {
+	exit( bench_all_stages() ? 0 : 1 );
+}
+
+if ( $shapes ) {
+	exit( bench_all_shapes() ? 0 : 1 );
+}
+
+printf "%-6s %10s %10s %10s %10s\n", 'trans', 'MB/s', 'rtt50 us', 'rtt99 us', 'rttmax us';
+
+for my $transport ( split /,/, $transports ) {
+	my $result = eval { bench($transport) };
+	if ( !$result ) {
+		my $err = $@ || "failed\n";
+		chomp $err;
+		printf "%-6s %s\n", $transport, $err;
+		next;
+	}
+
+	printf "%-6s %10.1f %10.0f %10.0f %10.0f\n", $transport, @{$result}{qw(mbps rtt50 rtt99 rttmax)};
+}
+
+# returns (spec for socketwrapper, listening socket or our end, their end or undef)
+sub endpoint {
+	my ($transport, $name) = @_;
+
+	if ( $transport eq 'tcp' ) {
+		my $l = IO::Socket::INET->new(
+			LocalAddr => '127.0.0.1',
+			LocalPort => 0,
+			Listen    => 1,
+			ReuseAddr => 1,
+		) || die "listen: $!\n";
+		return ( $l->sockport, $l, undef );
+	}
+
+	if ( $transport eq 'unix' ) {
+		require IO::Socket::UNIX;
+		my $path = File::Spec->catfile( File::Spec->tmpdir, "swbench-$$-$name.sock" );
+		unlink $path;
+		my $l = IO::Socket::UNIX->new(
+			Type   => SOCK_STREAM,
+			Local  => $path,
+			Listen => 1,
+		) || die "unix listen: $!\n";
+		return ( "unix:$path", $l, undef );
+	}
+
+	if ( $transport eq 'fd' ) {
+		eval { require Win32API::File } || die "fd needs Win32API::File\n";
+		socketpair( my $ours, my $theirs, AF_UNIX, SOCK_STREAM, PF_UNSPEC ) || die "socketpair: $!\n";
+		my $h = Win32API::File::FdGetOsFHandle( fileno($theirs) );
+		Win32API::File::SetHandleInformation( $h, Win32API::File::HANDLE_FLAG_INHERIT(), Win32API::File::HANDLE_FLAG_INHERIT() )
+			|| die "can't make socket inheritable: $^E\n";
+		return ( "fd:$h", $ours, $theirs );
+	}
+
+	die "unknown transport\n";
+}
+
+sub spawn {
+	my @args = @_;
+
+	if ( $^O eq 'MSWin32' ) {
+		# asynchronous spawn, inherits handles
+		my $pid = system( 1, @args );
+		die "can't start $args[0]: $!\n" if $pid <= 0;
+		return $pid;
+	}
+
+	my $pid = fork();
+	die "fork: $!\n" unless defined $pid;
+	if ( !$pid ) {
+		exec @args;
+		exit 1;
+	}
+	return $pid;
+}
+
+sub connected {
+	my ($sock, $theirs) = @_;
+
+	# socketpair end, already connected
+	return $sock if $theirs;
+
+	my $sel = IO::Select->new($sock);
+	$sel->can_read(10) || die "socketwrapper didn't connect\n";
+	my $c = $sock->accept || die "accept: $!\n";
+	close $sock;
+	return $c;
+}
+
+sub bench {
+	my $transport = shift;
+
+	my ($inSpec, $inSock, $inTheirs)    = endpoint( $transport, 'in' );
+	my ($outSpec, $outSock, $outTheirs) = endpoint( $transport, 'out' );
+
+	my $pid = spawn( $exe, '-i', $inSpec, '-o', $outSpec, '-c', '@skip 0' );
+	close $inTheirs  if $inTheirs;
+	close $outTheirs if $outTheirs;
+
+	my $in  = connected( $inSock, $inTheirs );
+	my $out = connected( $outSock, $outTheirs );
+	binmode $in;
+	binmode $out;
+
+	my %result;
+
+	# round trips - one small block at a time through the pump
+	my $ping = 'p' x $pingSize;
+	my @rtt;
+	for ( 1 .. $pings ) {
+		my $t0 = time();
+		syswrite( $in, $ping ) == $pingSize || die "write: $!\n";
+		my $got = 0;
+		while ( $got < $pingSize ) {
+			my $n = sysread( $out, my $buf, $pingSize - $got );
+			die "socketwrapper closed the output\n" unless $n;
+			$got += $n;
+		}
+		push @rtt, ( time() - $t0 ) * 1e6;
+	}
+	$result{rtt50}  = percentile( \@rtt, 0.5 );
+	$result{rtt99}  = percentile( \@rtt, 0.99 );
+	$result{rttmax} = percentile( \@rtt, 1 );
+
+	# bulk - write and read at the same time so neither side backs up
+	$in->blocking(0);
+	$out->blocking(0);
+
+	my $total   = $mb * 1024 * 1024;
+	my $block   = 'x' x $chunk;
+	my $sent    = 0;
+	my $recvd   = 0;
+	my $pending = '';
+	my $rsel    = IO::Select->new($out);
+	my $wsel    = IO::Select->new($in);
+
+	my $t0 = time();
+	while ( $recvd < $total ) {
+		my ($r, $w) = IO::Select->select( $rsel, $sent < $total ? $wsel : undef, undef, 10 );
+		die "stalled after $recvd bytes\n" unless $r || $w;
+
+		if ( $w && @$w ) {
+			$pending = substr( $block, 0, min( $chunk, $total - $sent ) ) if $pending eq '';
+			my $n = syswrite( $in, $pending );
+			if ( defined $n ) {
+				$sent += $n;
+				substr( $pending, 0, $n, '' );
+				if ( $sent == $total ) {
+					# EOF tells socketwrapper to finish
+					shutdown( $in, 1 );
+					$wsel->remove($in);
+				}
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "write: $!\n";
+			}
+		}
+
+		if ( $r && @$r ) {
+			my $n = sysread( $out, my $buf, $chunk );
+			if ( defined $n ) {
+				die "socketwrapper closed the output after $recvd bytes\n" if $n == 0;
+				$recvd += $n;
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "read: $!\n";
+			}
+		}
+	}
+	my $elapsed = time() - $t0;
+	$result{mbps} = $total / 1024 / 1024 / ( $elapsed || 1e-6 );
+
+	close $in;
+	close $out;
+	waitpid( $pid, 0 );
+
+	if ( $transport eq 'unix' ) {
+		( my $inPath = $inSpec )   =~ s/^unix://;
+		( my $outPath = $outSpec ) =~ s/^unix://;
+		unlink $inPath, $outPath;
+	}
+
+	return \%result;
+}
+
+sub percentile {
+	my ($list, $p) = @_;
+	my @sorted = sort { $a <=> $b } @$list;
+	return $sorted[ int( $#sorted * $p ) ];
+}
+
+# push data into the stream until the first byte comes out
+sub first_byte {
+	my ($in, $out) = @_;
+
+	my $sel   = IO::Select->new($out);
+	my $block = 'x' x 8192;
+	for ( 1 .. 1000 ) {
+		syswrite( $in, $block ) || die "write: $!\n";
+		if ( $sel->can_read(0.01) ) {
+			sysread( $out, my $buf, 1 ) || die "no output\n";
+			return;
+		}
+	}
+	die "no output\n";
+}
+
+sub accept_both {
+	my ($inSock, $outSock) = @_;
+
+	my $in  = connected( $inSock );
+	my $out = connected( $outSock );
+	binmode $in;
+	binmode $out;
+	return ( $in, $out );
+}
+
+sub bench_skips {
+	printf "%-8s %12s %12s %12s %12s\n", 'method', 'first50 ms', 'first99 ms', 'gone50 ms', 'gone99 ms';
+
+	# a socketwrapper per stream, skip by closing its output
+	my (@first, @gone);
+	my ($pid, $in, $out) = start_single();
+	first_byte( $in, $out );
+	for ( 1 .. $skips ) {
+		my $t0 = time();
+		close $out;
+		close $in;
+
+		my ($newPid, $newIn, $newOut) = start_single();
+		first_byte( $newIn, $newOut );
+		push @first, ( time() - $t0 ) * 1000;
+
+		waitpid( $pid, 0 );
+		push @gone, ( time() - $t0 ) * 1000;
+
+		($pid, $in, $out) = ($newPid, $newIn, $newOut);
+	}
+	close $out;
+	close $in;
+	waitpid( $pid, 0 );
+
+	printf "%-8s %12.1f %12.1f %12.1f %12.1f\n", 'close',
+		percentile( \@first, 0.5 ), percentile( \@first, 0.99 ), percentile( \@gone, 0.5 ), percentile( \@gone, 0.99 );
+
+	# one daemon, skip with CANCEL
+	my $result = eval { bench_daemon_skips() };
+	if ( !$result ) {
+		my $err = $@ || "failed\n";
+		chomp $err;
+		printf "%-8s %s\n", 'cancel', $err;
+		return;
+	}
+	printf "%-8s %12.1f %12.1f %12.1f %12.1f\n", 'cancel', @$result;
+}
+
+sub start_single {
+	my (undef, $inSock)  = endpoint( 'tcp', 'in' );
+	my (undef, $outSock) = endpoint( 'tcp', 'out' );
+
+	my $pid = spawn( $exe, '-i', $inSock->sockport, '-o', $outSock->sockport, '-c', $command );
+	return ( $pid, accept_both( $inSock, $outSock ) );
+}
+
+sub control {
+	my ($ctl, $line) = @_;
+
+	print $ctl "$line\n";
+	my $reply = <$ctl>;
+	die "control connection closed\n" unless defined $reply;
+	$reply =~ s/\r?\n$//;
+	return $reply;
+}
+
+sub active {
+	my $ctl = shift;
+
+	my $active;
+	print $ctl "STATS\n";
+	while ( my $line = <$ctl> ) {
+		$active = $1 if $line =~ /^ACTIVE (\d+)/;
+		last if $line =~ /^(OK|ERR)/;
+	}
+	return $active;
+}
+
+sub start_daemon_stream {
+	my $ctl = shift;
+
+	my (undef, $inSock)  = endpoint( 'tcp', 'in' );
+	my (undef, $outSock) = endpoint( 'tcp', 'out' );
+
+	my $reply = control( $ctl, join( ' ', 'RUN', $inSock->sockport, $outSock->sockport, $command ) );
+	my ($id) = $reply =~ /^OK (\d+)/;
+	die "RUN: $reply\n" unless $id;
+	return ( $id, accept_both( $inSock, $outSock ) );
+}
+
+sub bench_daemon_skips {
+	# the daemon prints the port it is listening on
+	my $pid = open( my $daemon, '-|', $exe, '-P', '0' ) || die "can't start daemon: $!\n";
+	my $line = <$daemon>;
+	my ($port) = ( $line || '' ) =~ /^PORT (\d+)/;
+	die "daemon didn't start\n" unless $port;
+
+	my $ctl = IO::Socket::INET->new(
+		PeerAddr => '127.0.0.1',
+		PeerPort => $port,
+	) || die "control connect: $!\n";
+	$ctl->autoflush(1);
+
+	my (@first, @gone);
+	my ($id, $in, $out) = start_daemon_stream($ctl);
+	first_byte( $in, $out );
+	for ( 1 .. $skips ) {
+		my $t0 = time();
+		my $reply = control( $ctl, "CANCEL $id" );
+		die "CANCEL: $reply\n" unless $reply eq 'OK';
+
+		my ($newId, $newIn, $newOut) = start_daemon_stream($ctl);
+		first_byte( $newIn, $newOut );
+		push @first, ( time() - $t0 ) * 1000;
+
+		# the old one is gone when only the new one is left
+		while ( active($ctl) > 1 ) {
+			select( undef, undef, undef, 0.001 );
+		}
+		push @gone, ( time() - $t0 ) * 1000;
+
+		close $in;
+		close $out;
+		($id, $in, $out) = ($newId, $newIn, $newOut);
+	}
+	control( $ctl, "CANCEL $id" );
+	control( $ctl, 'SHUTDOWN' );
+	close $in;
+	close $out;
+	close $daemon;
+
+	return [ percentile( \@first, 0.5 ), percentile( \@first, 0.99 ), percentile( \@gone, 0.5 ), percentile( \@gone, 0.99 ) ];
+}
+
+# CPU seconds used by a child we started: cpu_open when it starts, cpu_used once it has
+# been reaped (on POSIX times() only counts reaped children, so that is a running total).
+my ($GetProcessTimes, $OpenProcess, $CloseHandle);
+
+sub cpu_open {
+	my $pid = shift;
+
+	return $pid if $^O ne 'MSWin32';
+	return undef unless eval { require Win32::API };
+
+	$OpenProcess     ||= Win32::API->new( 'kernel32', 'OpenProcess', 'NIN', 'N' );
+	$GetProcessTimes ||= Win32::API->new( 'kernel32', 'GetProcessTimes', 'NPPPP', 'I' );
+	$CloseHandle     ||= Win32::API->new( 'kernel32', 'CloseHandle', 'N', 'I' );
+	return undef unless $OpenProcess && $GetProcessTimes && $CloseHandle;
+
+	# PROCESS_QUERY_INFORMATION, kept open so the times are still there after it exits
+	return $OpenProcess->Call( 0x400, 0, $pid ) || undef;
+}
+
+sub cpu_used {
+	my $h = shift;
+
+	return undef unless defined $h;
+
+	if ( $^O ne 'MSWin32' ) {
+		my (undef, undef, $cuser, $csys) = times();
+		return $cuser + $csys;
+	}
+
+	my ($created, $exited, $kernel, $user) = map { "\0" x 8 } 1 .. 4;
+	my $ok = $GetProcessTimes->Call( $h, $created, $exited, $kernel, $user );
+	$CloseHandle->Call($h);
+	return undef unless $ok;
+	my $secs = 0;
+	for ( $kernel, $user ) {
+		my ($lo, $hi) = unpack( 'VV', $_ );
+		$secs += ( $hi * 4294967296 + $lo ) / 1e7;
+	}
+	return $secs;
+}
+
+sub bench_all_stages {
+	my $ok = 1;
+
+	printf "%6s %7s %10s %10s %8s  %s\n", 'stages', 'block', 'MB/s', 'first ms', 'cpu s', 'result';
+
+	for my $n ( split /,/, $stages ) {
+		for my $size ( split /,/, $sizes ) {
+			my $result = eval { bench_stages( $n, $size ) };
+			if ( !$result ) {
+				my $err = $@ || "failed\n";
+				chomp $err;
+				printf "%6d %7d %s\n", $n, $size, $err;
+				$ok = 0;
+				next;
+			}
+
+			printf "%6d %7d %10.1f %10.1f %8s  %s\n", $n, $size, $result->{mbps}, $result->{first},
+				defined $result->{cpu} ? sprintf( '%.2f', $result->{cpu} ) : '-', $result->{check};
+			$ok = 0 if $result->{check} ne 'ok';
+		}
+	}
+
+	return $ok;
+}
+
+sub bench_stages {
+	my ($n, $size) = @_;
+
+	return bench_stream( join( ' | ', ($cat) x $n ), $size, $mb * 1024 * 1024 );
+}
+
+# pushes $total bytes through $command and checks what comes out, byte-swapped in 16 bit
+# samples first if $swap
+sub bench_stream {
+	my ($command, $size, $total, $swap) = @_;
+
+	my ($inSpec, $inSock)   = endpoint( 'tcp', 'in' );
+	my ($outSpec, $outSock) = endpoint( 'tcp', 'out' );
+
+	my $cpuBefore = $^O eq 'MSWin32' ? 0 : cpu_used(0);
+	my $pid = spawn( $exe, '-i', $inSpec, '-o', $outSpec, '-c', $command );
+	my $cpuHandle = cpu_open($pid);
+
+	my ($in, $out) = accept_both( $inSock, $outSock );
+	$in->blocking(0);
+	$out->blocking(0);
+
+	# a pattern that doesn't line up with any block size, so a lost or repeated block
+	# changes the checksum even when the length comes out right
+	srand(1);
+	my $pattern = join( '', map { chr( int( rand(256) ) ) } 1 .. 65521 );
+	$pattern x= 16;		# room for a block starting anywhere in the first copy
+
+	my $sent    = 0;
+	my $recvd   = 0;
+	my $offset  = 0;
+	my $pending = '';
+	my $eof     = 0;
+	my $first;
+	my $md5In   = Digest::MD5->new;
+	my $md5Out  = Digest::MD5->new;
+	my $rsel    = IO::Select->new($out);
+	my $wsel    = IO::Select->new($in);
+
+	my $t0 = time();
+	while ( !$eof ) {
+		my ($r, $w) = IO::Select->select( $rsel, $sent < $total ? $wsel : undef, undef, 10 );
+		die "stalled after $recvd bytes\n" unless $r || $w;
+
+		if ( $w && @$w ) {
+			if ( $pending eq '' ) {
+				my $len = min( $size, $total - $sent );
+				$pending = substr( $pattern, $offset, $len );
+				$offset = ( $offset + $len ) % 65521;
+				$md5In->add( $swap ? pack( 'v*', unpack( 'n*', $pending ) ) : $pending );
+			}
+			my $n = syswrite( $in, $pending );
+			if ( defined $n ) {
+				$sent += $n;
+				substr( $pending, 0, $n, '' );
+				if ( $sent == $total ) {
+					shutdown( $in, 1 );
+					$wsel->remove($in);
+				}
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "write: $!\n";
+			}
+		}
+
+		if ( $r && @$r ) {
+			my $n = sysread( $out, my $buf, $size );
+			if ( defined $n ) {
+				if ( $n == 0 ) {
+					# read to EOF rather than stopping at $total, to catch extra bytes too
+					$eof = 1;
+				}
+				else {
+					$first = time() - $t0 unless defined $first;
+					$recvd += $n;
+					$md5Out->add($buf);
+				}
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "read: $!\n";
+			}
+		}
+	}
+	my $elapsed = time() - $t0;
+
+	close $in;
+	close $out;
+	waitpid( $pid, 0 );
+
+	my $cpu = cpu_used($cpuHandle);
+	$cpu -= $cpuBefore if defined $cpu;
+
+	my $check = 'ok';
+	if ( $recvd != $total ) {
+		$check = $recvd < $total ? sprintf( 'TRUNCATED %d bytes short', $total - $recvd ) : sprintf( 'EXTRA %d bytes', $recvd - $total );
+	}
+	elsif ( $md5In->hexdigest ne $md5Out->hexdigest ) {
+		$check = 'CORRUPT checksum differs';
+	}
+
+	return {
+		mbps  => $recvd / 1024 / 1024 / ( $elapsed || 1e-6 ),
+		first => ( $first || 0 ) * 1000,
+		cpu   => $cpu,
+		check => $check,
+	};
+}
+
+sub bench_all_shapes {
+	my $ok = 1;
+	my @shapes = (
+		[ 'pipe token',              "$writer #PIPE#",                       0 ],
+		[ 'pipe token, swap, pace',  "$writer #PIPE# | \@swap 16 | \@pace 1M", 1 ],
+		[ 'cat, swap, pace',         "$cat | \@swap 16 | \@pace 1M",          1 ],
+	);
+
+	printf "%-24s %10s %10s  %s\n", 'shape', 'MB/s', 'first ms', 'result';
+
+	for my $shape (@shapes) {
+		my ($name, $command, $swap) = @$shape;
+		my $result = eval { bench_stream( $command, 65536, 1024 * 1024, $swap ) };
+		if ( !$result ) {
+			my $err = $@ || "failed\n";
+			chomp $err;
+			printf "%-24s %s\n", $name, $err;
+			$ok = 0;
+			next;
+		}
+
+		printf "%-24s %10.2f %10.1f  %s\n", $name, $result->{mbps}, $result->{first}, $result->{check};
+		$ok = 0 if $result->{check} ne 'ok';
+	}
+
+	return $ok;
+}
+
+sub bench_all_concurrent {
+	my $ok = 1;
+	my ($n) = split /,/, ( $stages || '2' );
+
+	printf "%-24s %10s %10s %10s %8s  %s\n", 'args', 'total MB/s', 'min MB/s', 'first ms', 'cpu s', 'result';
+
+	for my $args ( length $swArgs ? split( /;/, $swArgs, -1 ) : ('') ) {
+		my $result = eval { bench_concurrent( $n, $args ) };
+		if ( !$result ) {
+			my $err = $@ || "failed\n";
+			chomp $err;
+			printf "%-24s %s\n", $args || '(default)', $err;
+			$ok = 0;
+			next;
+		}
+
+		printf "%-24s %10.1f %10.1f %10.1f %8s  %s\n", $args || '(default)', @{$result}{qw(total min first)},
+			defined $result->{cpu} ? sprintf( '%.2f', $result->{cpu} ) : '-', $result->{check};
+		$ok = 0 if $result->{check} ne 'ok';
+	}
+
+	return $ok;
+}
+
+sub bench_concurrent {
+	my ($n, $args) = @_;
+
+	my @args  = split ' ', $args;
+	my $chain = join( ' | ', ($cat) x $n );
+	my $total = $mb * 1024 * 1024;
+	my $block = 65536;
+
+	srand(1);
+	my $pattern = join( '', map { chr( int( rand(256) ) ) } 1 .. 65521 );
+	$pattern x= 2;
+
+	my $cpuBefore = $^O eq 'MSWin32' ? 0 : cpu_used(0);
+	my @streams;
+	for ( 1 .. $concurrent ) {
+		my ($inSpec, $inSock)   = endpoint( 'tcp', 'in' );
+		my ($outSpec, $outSock) = endpoint( 'tcp', 'out' );
+		my $pid = spawn( $exe, @args, '-i', $inSpec, '-o', $outSpec, '-c', $chain );
+		push @streams, { pid => $pid, cpu => cpu_open($pid), inSock => $inSock, outSock => $outSock };
+	}
+
+	my $rsel = IO::Select->new;
+	my $wsel = IO::Select->new;
+	my %by;
+	for my $st (@streams) {
+		@{$st}{qw(in out)} = accept_both( $st->{inSock}, $st->{outSock} );
+		$st->{$_}->blocking(0) for qw(in out);
+		@{$st}{qw(sent recvd offset)} = ( 0, 0, 0 );
+		$st->{pending} = '';
+		$st->{md5In}   = Digest::MD5->new;
+		$st->{md5Out}  = Digest::MD5->new;
+		$rsel->add( $st->{out} );
+		$wsel->add( $st->{in} );
+		$by{ fileno $st->{in} }  = $st;
+		$by{ fileno $st->{out} } = $st;
+	}
+
+	my $t0 = time();
+	while ( $rsel->count ) {
+		my ($r, $w) = IO::Select->select( $rsel, $wsel->count ? $wsel : undef, undef, 10 );
+		die "stalled\n" unless $r || $w;
+
+		for my $fh ( @{ $w || [] } ) {
+			my $st = $by{ fileno $fh };
+			if ( $st->{pending} eq '' ) {
+				my $len = min( $block, $total - $st->{sent} );
+				$st->{pending} = substr( $pattern, $st->{offset}, $len );
+				$st->{offset} = ( $st->{offset} + $len ) % 65521;
+				$st->{md5In}->add( $st->{pending} );
+			}
+			my $k = syswrite( $fh, $st->{pending} );
+			if ( defined $k ) {
+				$st->{sent} += $k;
+				substr( $st->{pending}, 0, $k, '' );
+				if ( $st->{sent} == $total ) {
+					shutdown( $fh, 1 );
+					$wsel->remove($fh);
+				}
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "write: $!\n";
+			}
+		}
+
+		for my $fh ( @{ $r || [] } ) {
+			my $st = $by{ fileno $fh };
+			my $k = sysread( $fh, my $buf, $block );
+			if ( defined $k ) {
+				if ( $k == 0 ) {
+					$st->{done} = time() - $t0;
+					$rsel->remove($fh);
+				}
+				else {
+					$st->{first} = time() - $t0 unless defined $st->{first};
+					$st->{recvd} += $k;
+					$st->{md5Out}->add($buf);
+				}
+			}
+			elsif ( !$!{EWOULDBLOCK} && !$!{EAGAIN} ) {
+				die "read: $!\n";
+			}
+		}
+	}
+	my $elapsed = time() - $t0;
+
+	my ($cpu, $check, $minRate, $first) = ( 0, 'ok', undef, 0 );
+	for my $st (@streams) {
+		close $st->{in};
+		close $st->{out};
+		waitpid( $st->{pid}, 0 );
+
+		if ( $^O eq 'MSWin32' ) {
+			my $c = cpu_used( $st->{cpu} );
+			$cpu = defined $cpu && defined $c ? $cpu + $c : undef;
+		}
+
+		my $rate = $st->{recvd} / 1024 / 1024 / ( $st->{done} || 1e-6 );
+		$minRate = $rate if !defined $minRate || $rate < $minRate;
+		$first = $st->{first} if ( $st->{first} || 0 ) > $first;
+
+		if ( $st->{recvd} != $total ) {
+			$check = sprintf( 'WRONG LENGTH %d of %d bytes', $st->{recvd}, $total );
+		}
+		elsif ( $st->{md5In}->hexdigest ne $st->{md5Out}->hexdigest ) {
+			$check = 'CORRUPT checksum differs';
+		}
+	}
+	$cpu = cpu_used(0) - $cpuBefore if $^O ne 'MSWin32';
+
+	return {
+		total => $concurrent * $total / 1024 / 1024 / ( $elapsed || 1e-6 ),
+		min   => $minRate,
+		first => $first * 1000,
+		cpu   => $cpu,
+		check => $check,
+	};
+}
@@ -0,0 +1,674 @@
+// swengine.cpp : shared pump engine - see swengine.h
+//
+
+#include <process.h>
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swring.h"
+#include "swengine.h"
+#include "swsched.h"
+
+#define  MAX_ENGINE_THREADS  16
+#define  ENGINE_QUIT         1          // completion key telling an engine thread to exit
+#define  ENGINE_RING_WRITE   2          // completion key for the output of a @buffer step
+
+enum { PUMP_CONNECT, PUMP_READ, PUMP_WRITE, PUMP_PACE };
+
+struct Pump
+{
+	OVERLAPPED ov;			// must be first, completions are mapped back to the pump by it
+	Stage *pS;
+	HANDLE hDone;			// manual reset, set when the pump has ended
+	int state;
+	char *pData;			// data being written
+	unsigned nData;
+	unsigned nWritten;
+	bool fEnd;				// a built-in stage has ended the stream
+	bool fCancel;
+	bool fShowDebug;
+	DWORD nNummsgs;
+	CRITICAL_SECTION cs;	// issuing I/O vs. closing the handles on cancel
+
+	// @buffer steps read into the ring with ov and write out of it with ovRing, both in
+	// flight at once. Everything below is guarded by cs
+	OVERLAPPED ovRing;
+	int nPending;			// operations in flight
+	bool fWriteBusy;
+	bool fReadWaiting;		// the ring was full, read again once the writer makes room
+	bool fFinished;
+
+	// @pace: a write waiting for tokens has this timer in flight instead of a send. Its
+	// completion is posted once, by the timer or by a cancel, whichever is first
+	HANDLE hPaceTimer;
+	volatile LONG fPacePosted;
+};
+
+static HANDLE hPort = NULL;
+static HANDLE hThreads[MAX_ENGINE_THREADS];
+static int nThreads = 0;
+
+// close the pump's handles. Caller holds the pump's lock
+static void ClosePumpHandles(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+
+	if( pS->hInput ) {
+		if( pS->fInputIsSocket ) {
+			closesocket((SOCKET)pS->hInput);
+		} else {
+			CloseHandle(pS->hInput);
+		}
+		pS->hInput = NULL;
+	}
+
+	if( pS->hOutput ) {
+		if( pS->fOutputIsSocket ) {
+			shutdown((SOCKET)pS->hOutput, SD_SEND);
+			closesocket((SOCKET)pS->hOutput);
+		} else if( !CloseHandle(pS->hOutput) ) {
+			stderrMsg ( "CloseHandle for step %i failed with error %i.\n", pS->i, GetLastError() );
+		}
+		pS->hOutput = NULL;
+	}
+}
+
+static void PacePost(Pump *pPump)
+{
+	if( InterlockedExchange(&pPump->fPacePosted, 1) ) return;
+
+	if( pPump->pS->pRing ) {
+		PostQueuedCompletionStatus(hPort, 0, ENGINE_RING_WRITE, &pPump->ovRing);
+	} else {
+		PostQueuedCompletionStatus(hPort, 0, 0, &pPump->ov);
+	}
+}
+
+static VOID CALLBACK PaceTimerProc(PVOID pv, BOOLEAN fTimedOut)
+{
+	PacePost((Pump *)pv);
+}
+
+// wait ms before the next write. Caller holds the pump's lock
+static bool PaceWait(Pump *pPump, DWORD ms)
+{
+	pPump->fPacePosted = 0;
+	if( !CreateTimerQueueTimer(&pPump->hPaceTimer, NULL, PaceTimerProc, pPump, ms, 0, WT_EXECUTEONLYONCE) ) {
+		stderrMsg ( "Pump for step %i failed to set its pacing timer: %i.\n", pPump->pS->i, GetLastError() );
+		pPump->hPaceTimer = NULL;
+		return false;
+	}
+	return true;
+}
+
+// the pacing timer's completion has arrived. Caller holds the pump's lock
+static void PaceWaitDone(Pump *pPump)
+{
+	// waits for the callback to return, so the pump can't be freed under it
+	DeleteTimerQueueTimer(NULL, pPump->hPaceTimer, INVALID_HANDLE_VALUE);
+	pPump->hPaceTimer = NULL;
+}
+
+static void FinishPump(Pump *pPump)
+{
+	debugMsg ( "Pump for step %i ending.\n", pPump->pS->i );
+
+	// no FlushFileBuffers here, it would block an engine thread until the next step has
+	// read everything. The reader still gets the data left in the pipe after we close it.
+	EnterCriticalSection(&pPump->cs);
+	ClosePumpHandles(pPump);
+	LeaveCriticalSection(&pPump->cs);
+
+	SetEvent(pPump->hDone);
+}
+
+//
+// IssueRead / IssueWrite / IssueConnect
+//
+// start the next operation. false if it failed to start, in which case no completion
+// will arrive and the pump should finish
+//
+static bool IssueRead(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+	bool fOK = false;
+
+	EnterCriticalSection(&pPump->cs);
+	if( !pPump->fCancel ) {
+		pPump->state = PUMP_READ;
+		ZeroMemory(&pPump->ov, sizeof(OVERLAPPED));
+
+		if( pPump->fShowDebug ) {
+			debugMsg ( "Pump for step %i about to read.\n", pS->i );
+		}
+
+		unsigned nRead = StageNextRead(pS);
+		if( pS->fInputIsSocket ) {
+			WSABUF buf = { nRead, pS->pBuff };
+			DWORD flags = 0;
+			fOK = WSARecv((SOCKET)pS->hInput, &buf, 1, NULL, &flags, &pPump->ov, NULL) == 0 ||
+				  WSAGetLastError() == WSA_IO_PENDING;
+		} else {
+			fOK = ReadFile(pS->hInput, pS->pBuff, nRead, NULL, &pPump->ov) ||
+				  GetLastError() == ERROR_IO_PENDING;
+		}
+
+		if( !fOK ) {
+			DWORD err = pS->fInputIsSocket ? WSAGetLastError() : GetLastError();
+			if( err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF ) {
+				stderrMsg ( "Pump for step %i failed reading with error %i.\n", pS->i, err );
+			}
+		}
+	}
+	LeaveCriticalSection(&pPump->cs);
+
+	return fOK;
+}
+
+static bool IssueWrite(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+	char *p = pPump->pData + pPump->nWritten;
+	DWORD n = pPump->nData - pPump->nWritten;
+	bool fOK = false;
+
+	EnterCriticalSection(&pPump->cs);
+	if( !pPump->fCancel ) {
+		pPump->state = PUMP_WRITE;
+		ZeroMemory(&pPump->ov, sizeof(OVERLAPPED));
+
+		DWORD wait = 0;
+		if( pS->pPace ) {
+			n = PacerAllow(pS->pPace, n, &wait);
+		}
+
+		if( n == 0 ) {
+			pPump->state = PUMP_PACE;
+			fOK = PaceWait(pPump, wait);
+		} else if( pS->fOutputIsSocket ) {
+			if( pS->pPace ) PacerSpend(pS->pPace, n);
+			WSABUF buf = { n, p };
+			fOK = WSASend((SOCKET)pS->hOutput, &buf, 1, NULL, 0, &pPump->ov, NULL) == 0 ||
+				  WSAGetLastError() == WSA_IO_PENDING;
+			if( !fOK ) {
+				stderrMsg ( "Pump for step %i failed Send writing with error %i.\n", pS->i, WSAGetLastError() );
+				pS->fFailed = true;
+			}
+		} else {
+			fOK = WriteFile(pS->hOutput, p, n, NULL, &pPump->ov) ||
+				  GetLastError() == ERROR_IO_PENDING;
+			if( !fOK ) {
+				stderrMsg ( "Pump for step %i failed WriteFile with error %i.\n", pS->i, GetLastError() );
+				pS->fFailed = true;
+			}
+		}
+	}
+	LeaveCriticalSection(&pPump->cs);
+
+	return fOK;
+}
+
+// returns false if the pump should finish. *pfPending is false if already connected
+static bool IssueConnect(Pump *pPump, bool *pfPending)
+{
+	Stage *pS = pPump->pS;
+	bool fOK = false;
+
+	*pfPending = false;
+
+	EnterCriticalSection(&pPump->cs);
+	if( !pPump->fCancel ) {
+		pPump->state = PUMP_CONNECT;
+		ZeroMemory(&pPump->ov, sizeof(OVERLAPPED));
+
+		if( ConnectNamedPipe(pS->hInput, &pPump->ov) ) {
+			fOK = *pfPending = true;
+		} else {
+			DWORD err = GetLastError();
+			if( err == ERROR_IO_PENDING ) {
+				fOK = *pfPending = true;
+			} else if( err == ERROR_PIPE_CONNECTED ) {
+				fOK = true;		// no completion will be queued
+			} else {
+				stderrMsg ( "Pump for step %i failed to attach to named pipe.\n", pS->i );
+			}
+		}
+	}
+	LeaveCriticalSection(&pPump->cs);
+
+	return fOK;
+}
+
+//
+// PumpCompleted
+//
+// advance the pump's state machine after an operation has completed
+//
+static void PumpCompleted(Pump *pPump, DWORD err, DWORD n)
+{
+	Stage *pS = pPump->pS;
+
+	if( pPump->state == PUMP_PACE ) {
+		EnterCriticalSection(&pPump->cs);
+		PaceWaitDone(pPump);
+		LeaveCriticalSection(&pPump->cs);
+	}
+
+	if( pPump->fCancel ) {
+		FinishPump(pPump);
+		return;
+	}
+
+	switch( pPump->state ) {
+	case PUMP_CONNECT:
+		if( err != ERROR_SUCCESS && err != ERROR_PIPE_CONNECTED ) {
+			stderrMsg ( "Pump for step %i failed to attach to named pipe.\n", pS->i );
+			FinishPump(pPump);
+			return;
+		}
+		debugMsg ( "Pump for step %i attached to named pipe.\n", pS->i );
+		break;
+
+	case PUMP_READ:
+		if( err != ERROR_SUCCESS || n == 0 ) {
+			// EOF - broken pipe from a process or 0 bytes from a socket
+			if( err != ERROR_SUCCESS && err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF ) {
+				stderrMsg ( "Pump for step %i failed reading with error %i.\n", pS->i, err );
+			} else {
+				debugMsg ( "Pump for step %i read returned 0 bytes. Last Error = %i.\n", pS->i, err );
+			}
+			FinishPump(pPump);
+			return;
+		}
+
+		StageRead(pS, n);
+
+		if( pPump->fShowDebug ) {
+			debugMsg ( "Pump for step %i got %i bytes, about to write data.\n", pS->i, n );
+			pPump->nNummsgs++;
+		}
+
+		// run any built-in stages over the buffer
+		pPump->pData = pS->pBuff;
+		pPump->nData = n;
+		pPump->nWritten = 0;
+
+		if( pS->pXform ) {
+			pPump->pData = XformRun( pS->pXform, pS->pBuff, n, &pPump->nData, &pPump->fEnd );
+			if( pPump->pData == NULL ) {
+				stderrMsg ( "Pump for step %i built-in stage failed.\n", pS->i );
+				FinishPump(pPump);
+				return;
+			}
+		}
+
+		if( pPump->nData ) {
+			if( !IssueWrite(pPump) ) FinishPump(pPump);
+			return;
+		}
+		// nothing to write yet, e.g. still skipping a header
+		break;
+
+	case PUMP_WRITE:
+		if( err != ERROR_SUCCESS ) {
+			stderrMsg ( "Pump for step %i failed writing with error %i.\n", pS->i, err );
+			pS->fFailed = true;
+			FinishPump(pPump);
+			return;
+		}
+
+		pPump->nWritten += n;
+		if( pPump->nWritten < pPump->nData ) {
+			if( !IssueWrite(pPump) ) FinishPump(pPump);
+			return;
+		}
+
+		// increase watchdog counter
+		++(pS->WatchDog);
+
+		// turn off debug once going and verbose debug is not set
+		if (pPump->nNummsgs > 1 && !bDebugVerbose) pPump->fShowDebug = false;
+		break;
+
+	case PUMP_PACE:
+		// tokens are due, send what we can
+		if( !IssueWrite(pPump) ) FinishPump(pPump);
+		return;
+	}
+
+	// a built-in stage has ended the stream, so treat it as EOF
+	if( pPump->fEnd ) {
+		debugMsg ( "Pump for step %i built-in stage ended the stream.\n", pS->i );
+		FinishPump(pPump);
+		return;
+	}
+
+	if( !IssueRead(pPump) ) FinishPump(pPump);
+}
+
+//
+// RingIssueRead / RingIssueWrite
+//
+// the two sides of a @buffer step on the engine. Caller holds the pump's lock
+//
+static void RingIssueRead(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+	Ring *pR = pS->pRing;
+
+	if( pPump->fCancel || pR->fEof ) return;
+
+	unsigned n;
+	char *p = RingFreeSpace(pR, &n);
+	if( n == 0 ) {
+		pR->overruns++;
+		pPump->fReadWaiting = true;
+		return;
+	}
+
+	ZeroMemory(&pPump->ov, sizeof(OVERLAPPED));
+	if( ReadFile(pS->hInput, p, n, NULL, &pPump->ov) || GetLastError() == ERROR_IO_PENDING ) {
+		pPump->nPending++;
+	} else {
+		DWORD err = GetLastError();
+		if( err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF ) {
+			stderrMsg ( "Pump for step %i failed reading with error %i.\n", pS->i, err );
+		}
+		pR->fEof = true;
+	}
+}
+
+static void RingIssueWrite(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+	Ring *pR = pS->pRing;
+
+	if( pPump->fCancel || pPump->fWriteBusy ) return;
+
+	if( pPump->nWritten == pPump->nData ) {
+		pPump->pData = RingData(pR, &pPump->nData);
+		pPump->nWritten = 0;
+		if( pPump->nData == 0 ) {
+			if( !pR->fEof && pR->fStarted ) pR->underruns++;
+			return;
+		}
+	}
+
+	char *p = pPump->pData + pPump->nWritten;
+	DWORD n = pPump->nData - pPump->nWritten;
+	DWORD wait = 0;
+	bool fOK;
+
+	if( pS->pPace ) {
+		n = PacerAllow(pS->pPace, n, &wait);
+	}
+
+	ZeroMemory(&pPump->ovRing, sizeof(OVERLAPPED));
+	if( n == 0 ) {
+		// the timer's completion stands in for the write's
+		fOK = PaceWait(pPump, wait);
+	} else if( pS->fOutputIsSocket ) {
+		if( pS->pPace ) PacerSpend(pS->pPace, n);
+		WSABUF buf = { n, p };
+		fOK = WSASend((SOCKET)pS->hOutput, &buf, 1, NULL, 0, &pPump->ovRing, NULL) == 0 ||
+			  WSAGetLastError() == WSA_IO_PENDING;
+	} else {
+		fOK = WriteFile(pS->hOutput, p, n, NULL, &pPump->ovRing) ||
+			  GetLastError() == ERROR_IO_PENDING;
+	}
+
+	if( fOK ) {
+		pPump->fWriteBusy = true;
+		pPump->nPending++;
+	} else {
+		stderrMsg ( "Pump for step %i failed writing with error %i.\n", pS->i,
+					pS->fOutputIsSocket ? WSAGetLastError() : GetLastError() );
+		pS->fFailed = true;
+	}
+}
+
+// true once the ring pump should finish. Caller holds the pump's lock
+static bool RingPumpDone(Pump *pPump)
+{
+	Stage *pS = pPump->pS;
+	Ring *pR = pS->pRing;
+
+	if( pPump->fFinished ) return false;
+
+	if( pS->fFailed && !pPump->fCancel ) {
+		// abort the read still in flight, nobody will take its data
+		pPump->fCancel = true;
+		ClosePumpHandles(pPump);
+	}
+
+	if( pPump->nPending ) return false;
+	if( !pPump->fCancel && !(pR->fEof && pR->count == 0) ) return false;
+
+	pPump->fFinished = true;
+	return true;
+}
+
+static void RingPumpStart(Pump *pPump)
+{
+	EnterCriticalSection(&pPump->cs);
+	RingIssueRead(pPump);
+	bool fDone = RingPumpDone(pPump);
+	LeaveCriticalSection(&pPump->cs);
+
+	if( fDone ) FinishPump(pPump);
+}
+
+static void RingReadCompleted(Pump *pPump, DWORD err, DWORD n)
+{
+	Stage *pS = pPump->pS;
+	Ring *pR = pS->pRing;
+
+	EnterCriticalSection(&pPump->cs);
+	pPump->nPending--;
+
+	if( err != ERROR_SUCCESS || n == 0 ) {
+		if( err != ERROR_SUCCESS && err != ERROR_BROKEN_PIPE && err != ERROR_HANDLE_EOF && !pPump->fCancel ) {
+			stderrMsg ( "Pump for step %i failed reading with error %i.\n", pS->i, err );
+		} else {
+			debugMsg ( "Pump for step %i read returned 0 bytes. Last Error = %i.\n", pS->i, err );
+		}
+		pR->fEof = true;
+	} else {
+		pS->nBytes += n;
+		pS->nBlocks++;
+		RingProduced(pR, n);
+		RingIssueRead(pPump);
+	}
+	RingIssueWrite(pPump);
+
+	bool fDone = RingPumpDone(pPump);
+	LeaveCriticalSection(&pPump->cs);
+
+	if( fDone ) FinishPump(pPump);
+}
+
+static void RingWriteCompleted(Pump *pPump, DWORD err, DWORD n)
+{
+	Stage *pS = pPump->pS;
+	Ring *pR = pS->pRing;
+
+	EnterCriticalSection(&pPump->cs);
+	pPump->nPending--;
+	pPump->fWriteBusy = false;
+	if( pPump->hPaceTimer ) PaceWaitDone(pPump);
+
+	if( err != ERROR_SUCCESS ) {
+		if( !pPump->fCancel ) {
+			stderrMsg ( "Pump for step %i failed writing with error %i.\n", pS->i, err );
+			pS->fFailed = true;
+		}
+	} else {
+		pPump->nWritten += n;
+		if( pPump->nWritten == pPump->nData ) {
+			RingConsumed(pR, pPump->nData);
+			++(pS->WatchDog);
+			if( pPump->fReadWaiting ) {
+				pPump->fReadWaiting = false;
+				RingIssueRead(pPump);
+			}
+		}
+		RingIssueWrite(pPump);
+	}
+
+	bool fDone = RingPumpDone(pPump);
+	LeaveCriticalSection(&pPump->cs);
+
+	if( fDone ) FinishPump(pPump);
+}
+
+unsigned __stdcall EngineThreadProc(void *pv)
+{
+	for(;;) {
+		DWORD n = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED *pov = NULL;
+
+		BOOL fOK = GetQueuedCompletionStatus(hPort, &n, &key, &pov, INFINITE);
+		if( pov == NULL ) {
+			if( key == ENGINE_QUIT || !fOK ) break;
+			continue;
+		}
+
+		// a failed operation still dequeues its OVERLAPPED, with the error in GetLastError
+		DWORD err = fOK ? ERROR_SUCCESS : GetLastError();
+		if( key == ENGINE_RING_WRITE ) {
+			RingWriteCompleted(CONTAINING_RECORD(pov, Pump, ovRing), err, n);
+		} else if( ((Pump *)pov)->pS->pRing ) {
+			RingReadCompleted((Pump *)pov, err, n);
+		} else {
+			PumpCompleted((Pump *)pov, err, n);
+		}
+	}
+
+	_endthreadex(0);
+	return 0;
+}
+
+bool EngineInit(int nWanted)
+{
+	if( nWanted <= 0 ) {
+		nWanted = SchedProcessors();
+	}
+	if( nWanted > MAX_ENGINE_THREADS ) nWanted = MAX_ENGINE_THREADS;
+
+	hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, nWanted);
+	if( hPort == NULL ) {
+		stderrMsg ( "Error creating completion port: %d\n", GetLastError());
+		return false;
+	}
+
+	for( nThreads = 0; nThreads < nWanted; ++nThreads ) {
+		hThreads[nThreads] = (HANDLE)_beginthreadex(NULL, 0, &EngineThreadProc, NULL, 0, NULL);
+		if( hThreads[nThreads] == NULL ) {
+			stderrMsg ( "Error creating engine thread %d : %d\n", nThreads, errno);
+			EngineShutdown();
+			return false;
+		}
+		// same priority the pump threads get
+		if (!SchedPumpThread( hThreads[nThreads] )) {
+			stderrMsg ( "Error changing engine thread priority : %d\n", GetLastError());
+		}
+	}
+
+	debugMsg ( "Pump engine started with %d threads\n", nThreads );
+	return true;
+}
+
+void EngineShutdown()
+{
+	for( int i = 0; i < nThreads; ++i )
+		PostQueuedCompletionStatus(hPort, 0, ENGINE_QUIT, NULL);
+
+	for( int i = 0; i < nThreads; ++i ) {
+		WaitForSingleObject(hThreads[i], INFINITE);
+		CloseHandle(hThreads[i]);
+	}
+	nThreads = 0;
+
+	if( hPort ) CloseHandle(hPort);
+	hPort = NULL;
+}
+
+HANDLE EngineStartPump(Stage *pS)
+{
+	Pump *pPump = (Pump *)calloc(1, sizeof(Pump));
+	if( pPump == NULL ) {
+		stderrMsg ( "Pump calloc failed for step %d\n", pS->i);
+		return NULL;
+	}
+
+	pPump->pS = pS;
+	pPump->fShowDebug = true;
+	pPump->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if( pPump->hDone == NULL ) {
+		stderrMsg ( "Error creating pump event for step %d: %d\n", pS->i, GetLastError());
+		free(pPump);
+		return NULL;
+	}
+	InitializeCriticalSection(&pPump->cs);
+
+	if( CreateIoCompletionPort(pS->hInput, hPort, 0, 0) == NULL ||
+		CreateIoCompletionPort(pS->hOutput, hPort, pS->pRing ? ENGINE_RING_WRITE : 0, 0) == NULL ) {
+		stderrMsg ( "Error attaching step %d to the pump engine: %d\n", pS->i, GetLastError());
+		DeleteCriticalSection(&pPump->cs);
+		CloseHandle(pPump->hDone);
+		free(pPump);
+		return NULL;
+	}
+
+	pS->pPump = pPump;
+	debugMsg ( "Pump for step %i started.\n", pS->i );
+
+	// from here on the pump owns its handles and closes them when it ends
+	if( pS->pRing ) {
+		RingPumpStart(pPump);
+		return pPump->hDone;
+	}
+
+	bool fPending = false;
+	if( pS->fInputIsNamed ) {
+		if( !IssueConnect(pPump, &fPending) ) {
+			FinishPump(pPump);
+		}
+	}
+	if( !fPending && !pPump->fCancel && WaitForSingleObject(pPump->hDone, 0) == WAIT_TIMEOUT ) {
+		if( !IssueRead(pPump) ) FinishPump(pPump);
+	}
+
+	return pPump->hDone;
+}
+
+void EngineCancelPump(Stage *pS)
+{
+	Pump *pPump = pS->pPump;
+	if( pPump == NULL ) return;
+
+	debugMsg ( "Cancelling pump for step %i.\n", pS->i );
+
+	// closing the handles aborts anything in flight and the completion finishes the pump
+	EnterCriticalSection(&pPump->cs);
+	pPump->fCancel = true;
+	ClosePumpHandles(pPump);
+	if( pPump->hPaceTimer ) PacePost(pPump);	// don't wait for the tokens
+	bool fDone = pS->pRing && RingPumpDone(pPump);
+	LeaveCriticalSection(&pPump->cs);
+
+	// a ring pump with nothing in flight gets no completion to finish it
+	if( fDone ) FinishPump(pPump);
+}
+
+void EngineFreePump(Stage *pS)
+{
+	Pump *pPump = pS->pPump;
+	if( pPump == NULL ) return;
+
+	DeleteCriticalSection(&pPump->cs);
+	CloseHandle(pPump->hDone);
+	free(pPump);
+	pS->pPump = NULL;
+}
@@ -0,0 +1,30 @@
+// swengine.h : shared pump engine
+//
+// Instead of a thread per pump, pipelines run by the pool/daemon have their pumps driven
+// by a small set of engine threads waiting on one I/O completion port. Each pump is a
+// little state machine: (connect the named pipe) -> read -> run built-in stages -> write
+// -> read ... so a pump only costs an OVERLAPPED and its buffer while it is waiting.
+//
+// The pump side of every handle must be opened for overlapped I/O (FILE_FLAG_OVERLAPPED
+// for pipes, WSA_FLAG_OVERLAPPED for sockets). The process side must not be.
+//
+// A pump signals its done event when it ends, so the supervisor can wait on it just like
+// a pump thread handle.
+//
+
+#pragma once
+
+typedef struct Pump Pump;
+
+bool EngineInit( int nThreads );
+void EngineShutdown();
+
+// starts pumping for a worker step. Returns the done event (manual reset) or NULL
+HANDLE EngineStartPump( Stage *pS );
+
+// aborts any I/O in flight so the pump ends promptly. The caller must still wait for
+// the done event before freeing the stage
+void EngineCancelPump( Stage *pS );
+
+// frees the pump once its done event is signalled
+void EngineFreePump( Stage *pS );
@@ -0,0 +1,131 @@
+// swgraph.cpp : a parsed and validated pipeline command - see swgraph.h
+//
+
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swgraph.h"
+#include "swpace.h"
+
+//
+// GraphParse
+//
+// returns NULL, having said why, if the command is no good
+//
+Graph *GraphParse(LPCSTR command)
+{
+	Graph *pG = (Graph *)calloc(1, sizeof(Graph));
+	if( pG == NULL ) {
+		stderrMsg ( "Graph calloc failed\n" );
+		return NULL;
+	}
+
+	pG->command = _strdup(command);
+	if( pG->command == NULL ) {
+		stderrMsg ( "Command copy failed\n" );
+		free(pG);
+		return NULL;
+	}
+
+	int nSegments = 1;
+	for( LPCSTR p = command; *p; ++p )
+		if( *p == '|' ) ++nSegments;
+
+	pG->nodes = (GraphNode *)calloc(nSegments, sizeof(GraphNode));
+	if( pG->nodes == NULL ) {
+		stderrMsg ( "Graph calloc failed\n" );
+		GraphFree(pG);
+		return NULL;
+	}
+
+	LPCSTR p = command;
+	for( int i = 0; i < nSegments; ++i ) {
+		size_t n = strcspn(p, "|");
+		LPCSTR next = p + n + (p[n] == '|' ? 1 : 0);
+
+		while( n && *p == ' ' ) { ++p; --n; }
+		while( n && p[n - 1] == ' ' ) --n;
+		if( n == 0 ) {
+			stderrMsg ( "Empty step %d in command: %s\n", i + 1, command );
+			GraphFree(pG);
+			return NULL;
+		}
+
+		GraphNode *pN = &pG->nodes[pG->nNodes++];
+		pN->text = (char *)malloc(n + 1);
+		if( pN->text == NULL ) {
+			stderrMsg ( "Graph malloc failed\n" );
+			GraphFree(pG);
+			return NULL;
+		}
+		memcpy(pN->text, p, n);
+		pN->text[n] = '\0';
+
+		if( *pN->text == XFORM_TOKEN ) {
+			// built-in stage, kept without its XFORM_TOKEN. Parse it now so a bad one is
+			// reported here rather than by every pipeline built from the graph
+			memmove(pN->text, pN->text + 1, n);
+			if( PaceIsSpec(pN->text) ) {
+				if( i != nSegments - 1 || i == 0 ) {
+					stderrMsg ( "%c%s must be the last step of a command\n", XFORM_TOKEN, PACE_NAME );
+					GraphFree(pG);
+					return NULL;
+				}
+				if( !PaceCheck(pN->text) ) {
+					GraphFree(pG);
+					return NULL;
+				}
+				// not a step, the output pump does the pacing
+				pG->pace = pN->text;
+				pN->text = NULL;
+				--pG->nNodes;
+			} else if( RingIsSpec(pN->text) ) {
+				pN->type = NODE_RING;
+				if( !RingCheck(pN->text) ) {
+					GraphFree(pG);
+					return NULL;
+				}
+			} else {
+				pN->type = NODE_XFORM;
+				Xform *pX = XformParse(pN->text);
+				if( pX == NULL ) {
+					GraphFree(pG);
+					return NULL;
+				}
+				XformFree(pX);
+			}
+		} else {
+			pN->type = NODE_PROCESS;
+			char *pToken = strstr(pN->text, PIPE_TOKEN);
+			if( pToken ) {
+				if( strstr(pToken + strlen(PIPE_TOKEN), PIPE_TOKEN) ) {
+					stderrMsg ( "Only one %s per command: %s\n", PIPE_TOKEN, pN->text );
+					GraphFree(pG);
+					return NULL;
+				}
+				pN->fPipeToken = true;
+			}
+		}
+
+		p = next;
+	}
+
+	// a PIPE_TOKEN command takes two steps, and the sockets one thread each
+	pG->maxSteps = 2 * pG->nNodes + 2;
+
+	return pG;
+}
+
+void GraphFree(Graph *pG)
+{
+	if( pG == NULL ) return;
+
+	if( pG->nodes ) {
+		for( int i = 0; i < pG->nNodes; ++i )
+			free(pG->nodes[i].text);
+		free(pG->nodes);
+	}
+	free(pG->pace);
+	free(pG->command);
+	free(pG);
+}
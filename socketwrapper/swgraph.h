@@ -0,0 +1,35 @@
+// swgraph.h : a parsed and validated pipeline command
+//
+// GraphParse splits a -c command into its segments once, without touching the string,
+// and checks everything that can be checked before anything is created: empty segments,
+// more than one PIPE_TOKEN in a command, and the arguments of built-in stages. The graph
+// is read-only afterwards, so any number of pipelines can be built from it - the pool
+// keeps one per template and builds every warm shell from it.
+//
+// The segments form a chain. Branching is done by the @tee stage, which copies the
+// stream to other consumers (see swtee.h). A final @pace (see swpace.h) isn't a segment
+// of its own but a setting for the output socket, kept in pace.
+//
+
+#pragma once
+
+typedef enum { NODE_PROCESS, NODE_XFORM, NODE_RING } NodeType;
+
+typedef struct
+{
+	NodeType type;
+	char *text;				// command line, or a built-in stage's spec without XFORM_TOKEN
+	bool fPipeToken;		// the command line contains PIPE_TOKEN
+} GraphNode;
+
+typedef struct
+{
+	char *command;			// as given, for messages
+	int nNodes;
+	GraphNode *nodes;
+	int maxSteps;			// most steps a pipeline built from this can need
+	char *pace;				// @pace spec without XFORM_TOKEN, or NULL
+} Graph;
+
+Graph *GraphParse( LPCSTR command );
+void GraphFree( Graph *pG );
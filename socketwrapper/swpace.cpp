@@ -0,0 +1,133 @@
+// swpace.cpp : output pacing - see swpace.h
+//
+
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swxform.h"
+#include "swpace.h"
+
+static LARGE_INTEGER perfFreq;
+
+bool PaceIsSpec(const char *spec)
+{
+	size_t n = strlen(PACE_NAME);
+	return !strncmp(spec, PACE_NAME, n) && (spec[n] == ' ' || spec[n] == '\0');
+}
+
+// a number with an optional k or M
+static bool ParseScaled(const char *s, unsigned long long *pn)
+{
+	char *end;
+	unsigned long long n = _strtoui64(s, &end, 10);
+
+	if( end == s ) return false;
+	if( (*end == 'k' || *end == 'K') && end[1] == '\0' ) n *= 1000;
+	else if( *end == 'M' && end[1] == '\0' ) n *= 1000000;
+	else if( *end != '\0' ) return false;
+
+	*pn = n;
+	return true;
+}
+
+//
+// PaceParse
+//
+// spec is the command segment without the leading XFORM_TOKEN, e.g. "pace 320k 3s"
+//
+static bool PaceParse(const char *spec, DWORD *pRate, DWORD *pBurst)
+{
+	char name[16] = "", a1[32] = "", a2[32] = "";
+	int nArgs = sscanf(spec, "%15s %31s %31s", name, a1, a2) - 1;
+	unsigned long long bits, burst;
+
+	if( nArgs < 1 || nArgs > 2 || !ParseScaled(a1, &bits) ) goto bad;
+	if( bits < 8000 || bits > 1000000000 ) goto bad;
+	*pRate = (DWORD)(bits / 8);
+
+	*pBurst = *pRate;
+	if( nArgs == 2 ) {
+		size_t n = strlen(a2);
+		if( n > 1 && a2[n - 1] == 's' ) {
+			char *end;
+			double secs = strtod(a2, &end);
+			if( end != a2 + n - 1 || secs <= 0 || secs > 60 ) goto bad;
+			burst = (unsigned long long)(secs * *pRate);
+		} else {
+			// k and M are binary for sizes, as with @buffer
+			char *end;
+			burst = _strtoui64(a2, &end, 10);
+			if( end == a2 ) goto bad;
+			if( (*end == 'k' || *end == 'K') && end[1] == '\0' ) burst <<= 10;
+			else if( *end == 'M' && end[1] == '\0' ) burst <<= 20;
+			else if( *end != '\0' ) goto bad;
+		}
+		if( burst < PACE_MIN_SEND || burst > (64 << 20) ) goto bad;
+		*pBurst = (DWORD)burst;
+	}
+	return true;
+
+bad:
+	stderrMsg ( "Malformed built-in stage \"%c%s\", expected %s <bits per second>[k|M] [<burst bytes or seconds>]\n", XFORM_TOKEN, spec, PACE_NAME );
+	return false;
+}
+
+bool PaceCheck(const char *spec)
+{
+	DWORD rate, burst;
+	return PaceParse(spec, &rate, &burst);
+}
+
+Pacer *PacerCreate(const char *spec)
+{
+	DWORD rate, burst;
+	if( !PaceParse(spec, &rate, &burst) ) return NULL;
+
+	Pacer *pPace = (Pacer *)calloc(1, sizeof(Pacer));
+	if( pPace == NULL ) {
+		stderrMsg ( "Pacer calloc failed\n" );
+		return NULL;
+	}
+
+	while( *spec == ' ' ) ++spec;
+	strncpy(pPace->spec, spec, sizeof(pPace->spec) - 1);
+
+	pPace->rate = rate;
+	pPace->burst = burst;
+	pPace->tokens = burst;		// the initial burst
+
+	QueryPerformanceFrequency(&perfFreq);
+	QueryPerformanceCounter(&pPace->tLast);
+	return pPace;
+}
+
+void PacerFree(Pacer *pPace)
+{
+	if( pPace == NULL ) return;
+
+	free(pPace);
+}
+
+unsigned PacerAllow(Pacer *pPace, unsigned n, DWORD *pWait)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	pPace->tokens += (double)(now.QuadPart - pPace->tLast.QuadPart) * pPace->rate / perfFreq.QuadPart;
+	if( pPace->tokens > pPace->burst ) pPace->tokens = pPace->burst;
+	pPace->tLast = now;
+
+	// wait for enough to be worth a send, not just the first byte
+	unsigned need = min(n, min(PACE_MIN_SEND, pPace->burst));
+	if( pPace->tokens >= need ) {
+		*pWait = 0;
+		return (unsigned)min((double)n, pPace->tokens);
+	}
+
+	*pWait = (DWORD)((need - pPace->tokens) * 1000 / pPace->rate) + 1;
+	return 0;
+}
+
+void PacerSpend(Pacer *pPace, unsigned n)
+{
+	pPace->tokens -= n;
+}
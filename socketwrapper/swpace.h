@@ -0,0 +1,38 @@
+// swpace.h : output pacing
+//
+//   @pace <bits per second>[k|M] [<burst>]
+//
+// as the last segment of a command sends the output socket no faster than the given bit
+// rate, e.g. "@pace 320k" for a 320kbps MP3 relay. It is a token bucket: the first <burst>
+// bytes go at once so the player can fill its buffer, then the stream is held to the rate
+// with up to <burst> more allowed after a lull. The burst is in bytes (with k or M) or in
+// seconds at the rate ("3s"), one second by default.
+//
+// A paced pump waits for tokens with a timer queue timer that posts its next completion,
+// so no thread is held while a stream waits. It always runs on the engine for that, even
+// in single mode, where the rest of the pipeline keeps its pump threads and the engine
+// gets one thread just for it.
+//
+
+#pragma once
+
+#define  PACE_NAME        "pace"
+#define  PACE_MIN_SEND    1024      // don't wake up to send less than this
+
+typedef struct
+{
+	DWORD rate;				// bytes per second
+	DWORD burst;			// bucket size in bytes
+	double tokens;			// bytes that may be sent now
+	LARGE_INTEGER tLast;	// when tokens was last topped up
+	char spec[64];
+} Pacer;
+
+bool PaceIsSpec( const char *spec );
+bool PaceCheck( const char *spec );		// validate without creating anything
+Pacer *PacerCreate( const char *spec );
+void PacerFree( Pacer *pPace );
+
+// how many of n bytes may be sent now. If none, *pWait is the ms until some may
+unsigned PacerAllow( Pacer *pPace, unsigned n, DWORD *pWait );
+void PacerSpend( Pacer *pPace, unsigned n );
@@ -0,0 +1,1090 @@
+// swpipeline.cpp : pipeline construction, pump threads and tidy up
+//
+// Split out of socketwrapper.cpp so that the pool can run many pipelines in one process.
+// See swpipeline.h for the life cycle of a pipeline.
+//
+
+#include <process.h>
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swengine.h"
+#include "swsched.h"
+
+// RtlGenRandom is exported as SystemFunction036, which ntsecapi.h only declares
+// under that name with the right calling convention if asked
+#define SystemFunction036 NTAPI SystemFunction036
+#include <ntsecapi.h>
+#undef SystemFunction036
+
+static LONG nextPipelineId = 0;
+
+// Children are spawned with bInheritHandles so they get their std handles, which means
+// they would also inherit every other pipe that happens to be inheritable at the time.
+// With several pipelines in one process that keeps other pipelines' pipes open, so pipes
+// are created non-inheritable and a step's handles are only made inheritable while it is
+// being spawned.
+static CRITICAL_SECTION csSpawn;
+
+//
+// StageNextRead / StageRead
+//
+// adaptive transfer buffer sizing. A pump thread or the engine owns its stage, so no lock
+// is needed; the pool only reads the sizes for STATS.
+//
+unsigned StageNextRead(Stage *pS)
+{
+	DWORD n = pS->nLastRead;
+
+	if( n == 0 ) return pS->nBuff;
+
+	// the bitrate caps how large a buffer is worth having: a 32kbps radio stream never
+	// needs more than the minimum, 24/192 PCM soon wants the maximum. Until it is known
+	// the first BUFFER_SIZE is the limit.
+	unsigned cap = BUFFER_SIZE;
+	DWORD elapsed = GetTickCount() - pS->tFirstRead;
+	if( elapsed >= 1000 ) {
+		pS->rate = (DWORD)((ULONGLONG)pS->nBytes * 1000 / elapsed);
+		cap = (unsigned)min((ULONGLONG)pS->rate * BUFFER_HOLD_MS / 1000, BUFFER_MAX);
+	}
+
+	if( n >= pS->nBuff ) {
+		pS->nShortReads = 0;
+		if( ++pS->nFullReads >= BUFFER_RUN && pS->nBuff < cap ) {
+			unsigned nNew = pS->nBuff * 2;
+			if( nNew > pS->nBuffAlloc ) {
+				char *p = (char *)realloc(pS->pBuff, nNew);
+				if( p == NULL ) return pS->nBuff;		// carry on as we are
+				pS->pBuff = p;
+				pS->nBuffAlloc = nNew;
+			}
+			pS->nBuff = nNew;
+			pS->nFullReads = 0;
+			debugMsg ( "Step %i transfer buffer up to %u bytes (%u bytes/s).\n", pS->i, pS->nBuff, pS->rate );
+		}
+	} else if( n < pS->nBuff / 4 ) {
+		pS->nFullReads = 0;
+		if( ++pS->nShortReads >= BUFFER_RUN * 4 && pS->nBuff > BUFFER_MIN ) {
+			// keep the allocation, it may be wanted again
+			pS->nBuff /= 2;
+			pS->nShortReads = 0;
+			debugMsg ( "Step %i transfer buffer down to %u bytes (%u bytes/s).\n", pS->i, pS->nBuff, pS->rate );
+		}
+	} else {
+		pS->nFullReads = pS->nShortReads = 0;
+	}
+
+	return pS->nBuff;
+}
+
+void StageRead(Stage *pS, DWORD n)
+{
+	if( pS->nBlocks == 0 ) pS->tFirstRead = GetTickCount();
+	pS->nLastRead = n;
+	pS->nBytes += n;
+	pS->nBlocks++;
+}
+
+//
+// MoveDataThreadProc
+//
+// this is used for transferring data (when appropriate) as follows
+//	* from the named pipe to the next process (the original use of an extra thread)
+//  * from the input socket via a pipe to the first process
+//	* from the last process via a pipe to the output socket
+//  * between processes, to run built-in stages
+//
+unsigned __stdcall MoveDataThreadProc(void *pv)
+{
+	Stage *pS = (Stage *)pv;
+	bool fShowDebug = true;
+	DWORD nNummsgs = 0;
+
+	debugMsg ( "MoveDataThreadProc for step %i started.\n", pS->i );
+
+	// if the input handle is for a named pipe then wait for the other end
+	if( pS->fInputIsNamed ){
+
+		if( !ConnectNamedPipe( pS->hInput, NULL) ) {
+			stderrMsg ( "MoveDataThreadProc for step %i failed to attach to named pipe.\n", pS->i );
+			_endthreadex(1);
+			return 1;
+		}
+
+		debugMsg ( "MoveDataThreadProc for step %i attached to named pipe.\n", pS->i );
+	}
+
+	DWORD bytesread, byteswritten;
+
+	for(;;)	{
+
+		if( fShowDebug ) {
+			debugMsg ( "MoveDataThreadProc for step %i about to call ReadFile.\n", pS->i );
+		}
+
+		// wait for some data from input. recv works whether or not the socket is overlapped
+		unsigned nRead = StageNextRead(pS);
+		if( pS->fInputIsSocket ) {
+			int r = recv((SOCKET) pS->hInput, pS->pBuff, nRead, 0);
+			if( r == SOCKET_ERROR ) {
+				stderrMsg ( "MoveDataThreadProc for step %i failed recv with error %i.\n", pS->i, WSAGetLastError() );
+				break;
+			}
+			bytesread = r;
+			SetLastError(0);
+		} else if( !ReadFile(pS->hInput, pS->pBuff, nRead, &bytesread, NULL) ) {
+			stderrMsg ( "MoveDataThreadProc for step %i failed reading with error %i.\n", pS->i, GetLastError() );
+			break;
+		}
+		if (bytesread == 0) {
+			DWORD lasterror = GetLastError();
+			stderrMsg ( "MoveDataThreadProc for step %i read returned 0 bytes with no error. Last Error = %i.\n", pS->i, lasterror );
+			if (lasterror != 0) break;
+		// So no error and 0 bytes this means EOF so terminate the thread.
+			break;
+
+		}
+
+
+		StageRead(pS, bytesread);
+
+		// log when data starts
+		if( fShowDebug ) {
+			debugMsg ( "MoveDataThreadProc for step %i got %i bytes, about to write data.\n", pS->i, bytesread );
+			nNummsgs++;
+		}
+
+		// run any built-in stages over the buffer
+		char *pData = pS->pBuff;
+		unsigned nData = bytesread;
+		bool fEnd = false;
+
+		if( pS->pXform ) {
+			pData = XformRun( pS->pXform, pS->pBuff, bytesread, &nData, &fEnd );
+			if( pData == NULL ) {
+				stderrMsg ( "MoveDataThreadProc for step %i built-in stage failed.\n", pS->i );
+				break;
+			}
+		}
+
+		// pass data to output
+		if (nData == 0) {
+			// nothing to write yet, e.g. still skipping a header
+		} else if (!pS->fOutputIsSocket){
+			if( !WriteFile(pS->hOutput, pData, nData, &byteswritten, NULL) ) {
+				stderrMsg ( "MoveDataThreadProc for step %i failed WriteFile with error %i.\n", pS->i, GetLastError() );
+				pS->fFailed = true;
+				break;
+			}
+		} else {
+			byteswritten = send ((SOCKET) pS->hOutput, pData, nData, 0 );
+			if (byteswritten == INVALID_SOCKET) {
+				stderrMsg ( "MoveDataThreadProc for step %i failed Send writing with error %i.\n", pS->i, WSAGetLastError());
+				pS->fFailed = true;
+				break;
+			}
+			if (byteswritten != nData) {
+				stderrMsg ( "MoveDataThreadProc for step %i : bytesread=%i byteswritten=%i\n", pS->i, nData, byteswritten );
+				pS->fFailed = true;
+				break;
+			}
+		}
+
+		// increase watchdog counter
+		++(pS->WatchDog);
+
+		// a built-in stage has ended the stream, so treat it as EOF
+		if( fEnd ) {
+			debugMsg ( "MoveDataThreadProc for step %i built-in stage ended the stream.\n", pS->i );
+			break;
+		}
+
+		// turn off debug once going and verbose debug is not set
+		if (nNummsgs > 1 && !bDebugVerbose) fShowDebug = false;
+	}
+
+
+	debugMsg ( "MoveDataThreadProc for step %i ending.\n", pS->i );
+	if (!pS->fOutputIsSocket) {
+		if (!FlushFileBuffers(pS->hOutput)) {
+			stderrMsg ( "Error Flushing Output in Thread for step %d: %d\n", pS->i, GetLastError());
+		}
+		if(!CloseHandle(pS->hOutput )) {
+			stderrMsg ( "CloseHandle for step %i failed with error %i.\n", pS->i, GetLastError() );
+		}
+	} else {
+		// the socket itself is closed by PipelineTidy, which may already have done so
+		shutdown((SOCKET) pS->hOutput, SD_SEND);
+	}
+
+	_endthreadex(0);
+	return 0;
+}
+
+bool PipelineInit()
+{
+	// Initialize Winsock - 2.2 for AF_UNIX and overlapped sockets
+	WORD wVersionRequested = MAKEWORD( 2, 2 );
+	WSADATA wsaData;
+	int err = WSAStartup( wVersionRequested, &wsaData );
+	if ( err != 0 ) {
+		stderrMsg( " Couldn't initialize winsock\n");
+		return false;
+	}
+
+	InitializeCriticalSection(&csSpawn);
+	return true;
+}
+
+//
+// CreateStepPipe
+//
+// pipe from step k to step k+1. Anonymous pipes can't do overlapped I/O, so if an engine
+// pump is on either end a named pipe is used instead with only the pump's end
+// overlapped. Its name carries 64 bits from RtlGenRandom and it's created as the first
+// instance, as the PIPE_TOKEN's is (see CreateTokenPipe), so no other process can claim
+// the name first or connect before our own CreateFile does.
+//
+static bool CreateStepPipe(Pipeline *pP, int k)
+{
+	HANDLE *phRead = &pP->info[k+1].hInput;
+	HANDLE *phWrite = &pP->info[k].hOutput;
+	bool fOverlappedRead = pP->info[k+1].fOnEngine;
+	bool fOverlappedWrite = pP->info[k].fOnEngine;
+
+	if (!fOverlappedRead && !fOverlappedWrite) {
+		if (!CreatePipe(phRead, phWrite, NULL, 0)){
+			stderrMsg ( "Error Creating Pipe: %d\n", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	unsigned rnd[2];
+	char pszNP[sizeof(PIPE_NAME_ROOT)+56];
+
+	if( !RtlGenRandom(rnd, sizeof(rnd)) ) {
+		stderrMsg ( "Couldn't get a random pipe name for step %d\n", k );
+		return false;
+	}
+	sprintf( pszNP, "%s%06d_%d_s%d_%08x%08x", PIPE_NAME_ROOT, getpid(), pP->id, k, rnd[0], rnd[1] );
+
+	*phRead = CreateNamedPipe( pszNP,
+					PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE | (fOverlappedRead ? FILE_FLAG_OVERLAPPED : 0),
+					PIPE_TYPE_BYTE|PIPE_WAIT,
+					1,
+					BUFFER_SIZE,
+					BUFFER_SIZE,
+					0,
+					NULL);
+	if (*phRead == INVALID_HANDLE_VALUE) {
+		stderrMsg ( "Error Creating Named Pipe for step %d: %d\n", k, GetLastError());
+		*phRead = NULL;
+		return false;
+	}
+
+	// the new instance is listening, so this connects straight away
+	*phWrite = CreateFile( pszNP, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+					fOverlappedWrite ? FILE_FLAG_OVERLAPPED : 0, NULL);
+	if (*phWrite == INVALID_HANDLE_VALUE) {
+		stderrMsg ( "Error Opening Named Pipe for step %d: %d\n", k, GetLastError());
+		*phWrite = NULL;
+		return false;
+	}
+	return true;
+}
+
+//
+// CreateTokenPipe
+//
+// replace the PIPE_TOKEN in step k's command with a named pipe the pump of step k+1
+// will read, overlapped if that pump is on the engine. The name also carries the step
+// and 64 bits from RtlGenRandom so no other process can guess it and get in first, and
+// FILE_FLAG_FIRST_PIPE_INSTANCE makes creation fail rather than join a pipe someone else
+// already owns. The pipe goes away when its last handle is closed, so there is nothing to
+// clean up if the tool never opens it.
+//
+static bool CreateTokenPipe(Pipeline *pP, int k)
+{
+	Stage *pS = &pP->info[k];
+	char *token = pS->pBuff;
+	LPCSTR p = strstr(token, PIPE_TOKEN);
+	unsigned rnd[2];
+	char pszNP[sizeof(PIPE_NAME_ROOT)+56];
+
+	if( !RtlGenRandom(rnd, sizeof(rnd)) ) {
+		stderrMsg ( "Couldn't get a random pipe name for step %d\n", k );
+		return false;
+	}
+	sprintf( pszNP, "%s%06d_%d_t%d_%08x%08x", PIPE_NAME_ROOT, getpid(), pP->id, k, rnd[0], rnd[1] );
+
+	char *pCmd = (char *)malloc(strlen(token) + strlen(pszNP) + 1);
+	if( pCmd == NULL) {
+		stderrMsg ( "pBuff malloc failed\n");
+		return false;
+	}
+	sprintf( pCmd, "%.*s%s%s", (int)(p - token), token, pszNP, p + strlen(PIPE_TOKEN) );
+	pS->pBuff = pCmd;
+	free(token);
+
+	// tools writing to a "file" tend to write large blocks, so give the pipe room for them
+	pP->info[k+1].hInput = CreateNamedPipe( pszNP,
+					PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE | (pP->info[k+1].fOnEngine ? FILE_FLAG_OVERLAPPED : 0),
+					PIPE_TYPE_BYTE|PIPE_WAIT,
+					1,
+					PIPE_TOKEN_BUFFER,
+					PIPE_TOKEN_BUFFER,
+					INFINITE,
+					NULL);
+	if( pP->info[k+1].hInput == INVALID_HANDLE_VALUE ) {
+		stderrMsg ( "Error Creating Named Pipe %s: %d\n", pszNP, GetLastError());
+		pP->info[k+1].hInput = NULL;
+		return false;
+	}
+
+	debugMsg ( "Step %d writes to %s\n", k, pszNP );
+	return true;
+}
+
+static bool IsStdHandle(HANDLE h)
+{
+	return h == GetStdHandle(STD_INPUT_HANDLE) ||
+		   h == GetStdHandle(STD_OUTPUT_HANDLE) ||
+		   h == GetStdHandle(STD_ERROR_HANDLE);
+}
+
+//
+// SetLastOutput
+//
+// the last worker thread either pumps to the output socket (connected at bind time) or stdout
+//
+static void SetLastOutput(Pipeline *pP, Stage *pS)
+{
+	if ( pP->fOutputSocket ){
+		pS->fOutputIsSocket = true;
+	}
+	else{
+		pS->hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+		pS->fOutputIsSocket = false;
+	}
+}
+
+//
+// ExpandParams
+//
+// returns a malloc'd copy of a command line with $1..$9 replaced by the parameters
+//
+static char *ExpandParams(const char *pszTemplate, int nParams, char **params)
+{
+	size_t n = strlen(pszTemplate) + 1;
+	for( const char *s = pszTemplate; *s; ++s ){
+		if( s[0] == '$' && s[1] >= '1' && s[1] <= '9' && s[1] - '1' < nParams )
+			n += strlen(params[s[1] - '1']);
+	}
+
+	char *pszOut = (char *)malloc(n);
+	if( pszOut == NULL ) return NULL;
+
+	char *d = pszOut;
+	for( const char *s = pszTemplate; *s; ++s ){
+		if( s[0] == '$' && s[1] >= '1' && s[1] <= '9' ){
+			int k = s[1] - '1';
+			if( k < nParams ){
+				strcpy(d, params[k]);
+				d += strlen(params[k]);
+			}
+			++s;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+	return pszOut;
+}
+
+//
+// PipelineCreate
+//
+// build a pipeline from a parsed command. The graph isn't referred to afterwards
+//
+Pipeline *PipelineCreate(const Graph *pG, bool fInputSocket, bool fOutputSocket, bool fShared)
+{
+	Pipeline *pP = (Pipeline *)calloc(1, sizeof(Pipeline));
+	if( pP == NULL ) {
+		stderrMsg ( "Pipeline calloc failed\n");
+		return NULL;
+	}
+
+	pP->maxSteps = pG->maxSteps;
+	pP->info = (Stage *)calloc(pP->maxSteps, sizeof(Stage));
+	pP->hChild = (HANDLE *)calloc(pP->maxSteps, sizeof(HANDLE));
+	if( pP->info == NULL || pP->hChild == NULL ) {
+		stderrMsg ( "Pipeline calloc failed\n");
+		free(pP->info);
+		free(pP->hChild);
+		free(pP);
+		return NULL;
+	}
+
+	pP->id = InterlockedIncrement(&nextPipelineId);
+	pP->fInputSocket = fInputSocket;
+	pP->fOutputSocket = fOutputSocket;
+	pP->fShared = fShared;
+	pP->inputSocket = INVALID_SOCKET;
+	pP->outputSocket = INVALID_SOCKET;
+	pP->deadstep = -1;
+	pP->hCancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if( pP->hCancel == NULL ) {
+		stderrMsg ( "Error creating cancel event: %d\n", GetLastError());
+		free(pP->info);
+		free(pP->hChild);
+		free(pP);
+		return NULL;
+	}
+
+	Stage *info = pP->info;
+	int numSteps = 0;
+	int numProcesses = pG->nNodes;
+
+	// input socket - use via unnamed pipe and worker thread
+	if( fInputSocket )
+	{
+		info[numSteps].fIsWorkerThread = true;
+		info[numSteps].fInputIsNamed = false;
+		info[numSteps].fInputIsSocket = true;
+		info[numSteps].fOutputIsSocket = false;
+		info[numSteps].fPipeOut = true;
+		++numSteps;
+	}
+	else{
+		info[numSteps].hInput = GetStdHandle(STD_INPUT_HANDLE);
+	}
+
+	// command line
+	for (int i = 0; i < numProcesses; i++)
+	{
+		const GraphNode *pN = &pG->nodes[i];
+		LPCSTR token = pN->text;
+
+		// read-ahead buffer - a step of its own, never shares a pump with other stages
+		if( pN->type == NODE_RING )
+		{
+			info[numSteps].pRing = RingParse(token);
+			if( info[numSteps].pRing == NULL ) {
+				goto fail;
+			}
+			info[numSteps].fIsWorkerThread = true;
+			info[numSteps].fInputIsNamed = false;
+
+			if ( i == numProcesses - 1 ) {
+				SetLastOutput(pP, &info[numSteps]);
+			} else {
+				info[numSteps].fPipeOut = true;
+			}
+			++numSteps;
+			continue;
+		}
+
+		// built-in stage - runs on a pump thread rather than as a process
+		if( pN->type == NODE_XFORM )
+		{
+			Xform *pX = XformParse(token);
+			if( pX == NULL ) {
+				goto fail;
+			}
+
+			if( numSteps > 0 && info[numSteps-1].fIsWorkerThread && !info[numSteps-1].pRing ) {
+				// chain onto the thread already feeding us. It writes to a pipe to
+				// whatever step comes next.
+				Xform **ppX = &info[numSteps-1].pXform;
+				while( *ppX ) ppX = &(*ppX)->pNext;
+				*ppX = pX;
+
+				if ( i == numProcesses - 1 ) {
+					// no next step, so send the thread's output straight to its destination
+					info[numSteps-1].fPipeOut = false;
+					SetLastOutput(pP, &info[numSteps-1]);
+				}
+			} else {
+				// new thread reading from the previous process (or stdin)
+				info[numSteps].fIsWorkerThread = true;
+				info[numSteps].fInputIsNamed = false;
+				info[numSteps].pXform = pX;
+
+				if ( i == numProcesses - 1 ) {
+					SetLastOutput(pP, &info[numSteps]);
+				} else {
+					info[numSteps].fPipeOut = true;
+				}
+				++numSteps;
+			}
+			continue;
+		}
+
+		info[numSteps].pBuff = _strdup( token );
+		if( info[numSteps].pBuff == NULL) {
+			stderrMsg ( "malloc failed\n");
+			goto fail;
+		}
+
+		// the PIPE_TOKEN's pipe is made with the step pipes, once its reader's pump is known
+		if (pN->fPipeToken)
+		{
+			info[numSteps].hOutput = GetStdHandle(STD_ERROR_HANDLE);
+			++numSteps;
+
+			info[numSteps].fIsWorkerThread = true;
+			info[numSteps].fInputIsNamed = true;
+			info[numSteps].fOutputIsSocket = false;
+		}
+
+		if ( i != numProcesses - 1 || fOutputSocket ) {
+			info[numSteps].fPipeOut = true;
+		}
+
+		// last process
+		if ( i == numProcesses - 1 ) {
+
+			if ( fOutputSocket ){
+				// anon pipe already done, the socket is connected at bind time
+				++numSteps;
+				info[numSteps].fIsWorkerThread = true;
+				info[numSteps].fInputIsNamed = false;
+				SetLastOutput(pP, &info[numSteps]);
+			}
+			else{
+				info[numSteps].hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+			}
+		}
+
+		++numSteps;
+	}
+
+	pP->numSteps = numSteps;
+
+	// a paced output waits for its tokens on the engine's timer, so its pump is always an
+	// engine pump, whether or not the rest of the pipeline is shared
+	if( pG->pace ) {
+		int last = numSteps - 1;
+		if( !info[last].fIsWorkerThread || !info[last].fOutputIsSocket ) {
+			stderrMsg ( "%c%s needs an output socket: %s\n", XFORM_TOKEN, PACE_NAME, pG->command );
+			goto fail;
+		}
+		// stdin can't be read overlapped
+		if( info[last].hInput && IsStdHandle(info[last].hInput) ) {
+			stderrMsg ( "%c%s needs its input from a process or socket: %s\n", XFORM_TOKEN, PACE_NAME, pG->command );
+			goto fail;
+		}
+		info[last].pPace = PacerCreate(pG->pace);
+		if( info[last].pPace == NULL ) goto fail;
+		info[last].fOnEngine = true;
+	}
+	for( int i = 0; i < numSteps; ++i ){
+		if( fShared && info[i].fIsWorkerThread ) info[i].fOnEngine = true;
+	}
+
+	// now both ends of every pipe are known
+	for( int i = 0; i < numSteps; ++i ){
+		if( info[i].fInputIsNamed && !CreateTokenPipe(pP, i - 1) ) {
+			goto fail;
+		}
+		if( info[i].fPipeOut && !CreateStepPipe(pP, i) ) {
+			goto fail;
+		}
+	}
+
+	for( int i = 0; i < numSteps; ++i ){
+		info[i].i = i;
+		if( info[i].fIsWorkerThread )
+		{
+			info[i].pBuff = (char *)malloc(BUFFER_MIN);
+			if( info[i].pBuff == NULL) {
+				stderrMsg ( "malloc failed for step %d \n",i);
+				goto fail;
+			}
+			info[i].nBuff = info[i].nBuffAlloc = BUFFER_MIN;
+		}
+	}
+
+	// debugging
+	debugMsg ( "Init complete for pipeline %d.\n", pP->id );
+	debugMsg ( "# =input== =output= ==type== ===details===\n" );
+	for( int i=0; i<numSteps; ++i ){
+		if( info[i].fIsWorkerThread ) {
+			debugMsg ( "%1x %08x %08x  THREAD  %s%s%s\n", i, info[i].hInput, info[i].hOutput, (info[i].fInputIsNamed ? "Named Pipe" : ""), (info[i].fInputIsSocket ? "Input Socket" : ""), (info[i].fOutputIsSocket ? "Output Socket" : ""));
+			for( Xform *pX = info[i].pXform; pX; pX = pX->pNext )
+				debugMsg ( "                    %c%s\n", XFORM_TOKEN, pX->spec );
+			if( info[i].pRing )
+				debugMsg ( "                    %c%s\n", XFORM_TOKEN, info[i].pRing->spec );
+			if( info[i].pPace )
+				debugMsg ( "                    %c%s\n", XFORM_TOKEN, info[i].pPace->spec );
+		}
+		else
+			debugMsg ( "%1x %08x %08x  PROCESS %s\n" ,i, info[i].hInput, info[i].hOutput, info[i].pBuff );
+	}
+
+	return pP;
+
+fail:
+	pP->numSteps = min(numSteps + 2, pP->maxSteps);	// include any half built steps
+	PipelineTidy(pP);
+	return NULL;
+}
+
+static bool StartPump(Pipeline *pP, int i)
+{
+	if( pP->info[i].fOnEngine ) {
+		pP->hChild[i] = EngineStartPump(&pP->info[i]);
+		if( pP->hChild[i] == NULL ) return false;
+
+		// the pump owns its socket now and closes it when it ends
+		if( pP->info[i].fInputIsSocket ) pP->inputSocket = INVALID_SOCKET;
+		if( pP->info[i].fOutputIsSocket ) pP->outputSocket = INVALID_SOCKET;
+		return true;
+	}
+
+	pP->hChild[i] = (HANDLE)_beginthreadex(NULL, 0, pP->info[i].pRing ? &RingThreadProc : &MoveDataThreadProc, &pP->info[i], 0, NULL);
+	if( pP->hChild[i] == NULL ) {
+		stderrMsg ( "Error creating thread for step %d : %d\n",i, errno);
+		return false;
+	}
+	if (!SchedPumpThread( pP->hChild[i] )) {
+		stderrMsg ( "Error changing thread priority for step %d : %d\n",i, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+static bool SpawnStep(Pipeline *pP, int i, int nParams, char **params)
+{
+	Stage *pS = &pP->info[i];
+
+	if( params && strchr(pS->pBuff, '$') ) {
+		char *pszCmd = ExpandParams(pS->pBuff, nParams, params);
+		if( pszCmd == NULL ) {
+			stderrMsg ( "Parameter expansion failed for step %d\n", i);
+			return false;
+		}
+		free(pS->pBuff);
+		pS->pBuff = pszCmd;
+		debugMsg ( "Step %d command: %s\n", i, pS->pBuff );
+	}
+
+	STARTUPINFO siStartInfo;
+	PROCESS_INFORMATION piProcInfo;
+
+	ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+	ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
+
+	siStartInfo.cb = sizeof(STARTUPINFO);
+
+	siStartInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+	siStartInfo.hStdInput = pS->hInput;
+	siStartInfo.hStdOutput = pS->hOutput;
+	siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+
+	bool fInheritIn = !IsStdHandle(pS->hInput);
+	bool fInheritOut = !IsStdHandle(pS->hOutput);
+
+	EnterCriticalSection(&csSpawn);
+	if (fInheritIn) SetHandleInformation(pS->hInput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	if (fInheritOut) SetHandleInformation(pS->hOutput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+
+	BOOL fOK = CreateProcess(NULL, pS->pBuff,
+							  NULL, // process security attributes
+							  NULL, // primary thread security attributes
+							  TRUE, // handles are inherited
+							  SchedChildFlags(), // creation flags
+							  NULL, // use parent's environment
+							  NULL, // use parent's current directory
+							  &siStartInfo,  // STARTUPINFO pointer
+							  &piProcInfo);  // receives PROCESS_INFORMATION
+	DWORD err = GetLastError();
+
+	if (fInheritIn) SetHandleInformation(pS->hInput, HANDLE_FLAG_INHERIT, 0);
+	if (fInheritOut) SetHandleInformation(pS->hOutput, HANDLE_FLAG_INHERIT, 0);
+	LeaveCriticalSection(&csSpawn);
+
+	if( !fOK ) {
+		stderrMsg ( "Error Creating Process for step %d: %d\n", i, err);
+		return false;
+	}
+
+	pP->hChild[i] = piProcInfo.hProcess;
+	CloseHandle( piProcInfo.hThread );
+
+	// the child has its own copies now
+	if (fInheritOut) {
+		CloseHandle(pS->hOutput);
+		pS->hOutput = NULL;
+	}
+	if (fInheritIn) {
+		CloseHandle(pS->hInput);
+		pS->hInput = NULL;
+	}
+	return true;
+}
+
+//
+// PipelineStart
+//
+// everything that doesn't depend on the ports or parameters
+//
+bool PipelineStart(Pipeline *pP)
+{
+	// turn on the pumps
+	for( int i = 0; i < pP->numSteps; ++i ){
+		Stage *pS = &pP->info[i];
+		if( pS->fIsWorkerThread && !pS->fInputIsSocket && !pS->fOutputIsSocket ) {
+			if( !StartPump(pP, i) ) return false;
+		}
+	}
+
+	// and turn on the taps
+	for( int i = 0; i < pP->numSteps; ++i ){
+		Stage *pS = &pP->info[i];
+		if( !pS->fIsWorkerThread && !strchr(pS->pBuff, '$') ) {
+			if( !SpawnStep(pP, i, 0, NULL) ) return false;
+		}
+	}
+
+	return true;
+}
+
+//
+// PipelineBind
+//
+// the input may be TRANSPORT_NONE for a pipeline built with an input socket, in which
+// case the first process sees EOF on stdin
+//
+bool PipelineBind(Pipeline *pP, const Endpoint *pInput, const Endpoint *pOutput, int nParams, char **params)
+{
+	bool fInput = pInput && pInput->type != TRANSPORT_NONE;
+	Stage *info = pP->info;
+	int last = pP->numSteps - 1;
+
+	// connect both ends before any pump can touch them
+	if( pP->fInputSocket && fInput ) {
+		debugMsg ( "Input from socket ...\n");
+		pP->inputSocket = EndpointConnect(pInput, info[0].fOnEngine);
+		if (pP->inputSocket == INVALID_SOCKET) {
+			return false;
+		}
+		debugMsg ( "Input socket connected OK.\n");
+		info[0].hInput = (HANDLE)pP->inputSocket;
+	}
+
+	if( pP->fOutputSocket ) {
+		pP->outputSocket = EndpointConnect(pOutput, info[last].fOnEngine);
+		if (pP->outputSocket == INVALID_SOCKET) {
+			return false;
+		}
+		info[last].hOutput = (HANDLE)pP->outputSocket;
+	}
+
+	if( pP->fInputSocket ) {
+		if( fInput ) {
+			if( !StartPump(pP, 0) ) return false;
+		} else if( !info[0].fOutputIsSocket ) {
+			// no input - close the pipe so the first process sees EOF
+			CloseHandle(info[0].hOutput);
+			info[0].hOutput = NULL;
+		}
+	}
+
+	// the first step is also the last if there are only built-in stages
+	if( pP->fOutputSocket && !(last == 0 && pP->fInputSocket) ) {
+		if( !StartPump(pP, last) ) return false;
+	}
+
+	for( int i = 0; i < pP->numSteps; ++i ){
+		if( !info[i].fIsWorkerThread && pP->hChild[i] == NULL ) {
+			if( !SpawnStep(pP, i, nParams, params) ) return false;
+		}
+	}
+
+	return true;
+}
+
+// a step that didn't fit in PipelineRun's wait has ended
+static VOID CALLBACK StepEndedCallback(PVOID pv, BOOLEAN fTimedOut)
+{
+	OverflowWait *pW = (OverflowWait *)pv;
+
+	InterlockedCompareExchange(&pW->pP->overflowStep, pW->i, -1);
+	SetEvent(pW->pP->hOverflow);
+}
+
+//
+// PipelineRun
+//
+// wait until one of the steps ends
+//
+void PipelineRun(Pipeline *pP)
+{
+	HANDLE hWait[MAXIMUM_WAIT_OBJECTS];
+	int waitStep[MAXIMUM_WAIT_OBJECTS];
+	DWORD nWait = 0;
+	OverflowWait *pOverflow = NULL;
+	int nOverflow = 0;
+
+	hWait[nWait] = pP->hCancel;
+	waitStep[nWait++] = -1;
+
+	// steps that were never started (e.g. no input socket) aren't watched
+	int nStarted = 0;
+	for( int i = 0; i < pP->numSteps; ++i ){
+		if( pP->hChild[i] ) ++nStarted;
+	}
+
+	// WaitForMultipleObjects can only watch so many handles. Any more steps get a wait
+	// registered with the thread pool instead, which signals hOverflow when one ends
+	if( nStarted > MAXIMUM_WAIT_OBJECTS - 1 ) {
+		pP->hOverflow = CreateEvent(NULL, TRUE, FALSE, NULL);
+		pP->overflowStep = -1;
+		pOverflow = (OverflowWait *)calloc(nStarted, sizeof(OverflowWait));
+		if( pP->hOverflow == NULL || pOverflow == NULL ) {
+			stderrMsg( "Pipeline %d can't watch %d steps\n", pP->id, nStarted );
+			if( pP->hOverflow ) CloseHandle(pP->hOverflow);
+			pP->hOverflow = NULL;
+			free(pOverflow);
+			pP->fDie = true;
+			return;
+		}
+		hWait[MAXIMUM_WAIT_OBJECTS - 1] = pP->hOverflow;
+		waitStep[MAXIMUM_WAIT_OBJECTS - 1] = -1;
+	}
+
+	for( int i = 0; i < pP->numSteps; ++i ){
+		if( pP->hChild[i] == NULL ) continue;
+
+		if( !pOverflow || nWait < MAXIMUM_WAIT_OBJECTS - 1 ) {
+			hWait[nWait] = pP->hChild[i];
+			waitStep[nWait++] = i;
+		} else {
+			OverflowWait *pW = &pOverflow[nOverflow];
+			pW->pP = pP;
+			pW->i = i;
+			if( RegisterWaitForSingleObject(&pW->hWait, pP->hChild[i], StepEndedCallback, pW,
+											INFINITE, WT_EXECUTEONLYONCE) ) {
+				++nOverflow;
+			} else {
+				stderrMsg( "Pipeline %d can't watch step %d: %d\n", pP->id, i, GetLastError() );
+			}
+		}
+	}
+	if( pOverflow ) nWait = MAXIMUM_WAIT_OBJECTS;
+
+	while( !pP->fDie )	{
+		DWORD wr = WaitForMultipleObjects( nWait, hWait, FALSE, bDebug ? DEBUG_TIMEOUT : TIMEOUT );
+		if( wr == WAIT_OBJECT_0 ) {
+			debugMsg( "Pipeline %d cancelled.\n", pP->id );
+			pP->fCancelled = true;
+			pP->fDie = true;
+		} else if( wr!=WAIT_TIMEOUT ) {
+			if( pOverflow && wr == WAIT_OBJECT_0 + MAXIMUM_WAIT_OBJECTS - 1 )
+				pP->deadstep = pP->overflowStep;
+			else if( wr >= WAIT_OBJECT_0 && wr < WAIT_OBJECT_0 + nWait )
+				pP->deadstep = waitStep[wr-WAIT_OBJECT_0];
+			stderrMsg( "Timeout Process/Thread for step %i died.\n", pP->deadstep );
+			pP->fDie = true;
+
+			// whoever was reading the output has gone, so there's nothing left to deliver
+			Stage *pS = pP->deadstep != -1 ? &pP->info[pP->deadstep] : NULL;
+			if( pS && pS->fIsWorkerThread && pS->fOutputIsSocket && pS->fFailed ) {
+				debugMsg( "Output of pipeline %d closed, cancelling.\n", pP->id );
+				pP->fCancelled = true;
+			}
+		}
+		for( int i=0; i<pP->numSteps; ++i ){
+			if( pP->info[i].fIsWorkerThread && pP->hChild[i] ){
+				if( 0==pP->info[i].WatchDog ) {
+					stderrMsg( "Watchdog expired - Thread for step %i stalled.\n", i );
+					if (bWatchdogEnabled)	pP->fDie = true;
+				}
+				pP->info[i].WatchDog=0;
+			}
+		}
+	}
+
+	if( pOverflow ) {
+		// blocks until any callback still running has finished
+		for( int k = 0; k < nOverflow; ++k )
+			UnregisterWaitEx(pOverflow[k].hWait, INVALID_HANDLE_VALUE);
+		free(pOverflow);
+		CloseHandle(pP->hOverflow);
+		pP->hOverflow = NULL;
+	}
+}
+
+//
+// PipelineCancel
+//
+// ask a running pipeline to stop now - PipelineRun returns and PipelineTidy drains nothing
+//
+void PipelineCancel(Pipeline *pP)
+{
+	SetEvent(pP->hCancel);
+}
+
+//
+// CancelSteps
+//
+// the fast path for a cancelled pipeline: release the sockets, abort the pumps' I/O and
+// kill the processes all at once rather than giving each a couple of seconds to finish
+//
+static void CancelSteps(Pipeline *pP)
+{
+	Stage *info = pP->info;
+	HANDLE *hProcs = (HANDLE *)malloc(pP->numSteps * sizeof(HANDLE));
+	DWORD nProcs = 0;
+
+	// frees the ports straight away and fails any send/recv in progress
+	if( pP->outputSocket != INVALID_SOCKET ) {
+		closesocket( pP->outputSocket );
+		pP->outputSocket = INVALID_SOCKET;
+	}
+	if( pP->inputSocket != INVALID_SOCKET ) {
+		closesocket( pP->inputSocket );
+		pP->inputSocket = INVALID_SOCKET;
+	}
+
+	for( int i = 0; i < pP->numSteps; ++i ){
+		if( pP->hChild[i] == NULL ) continue;
+
+		if( info[i].fIsWorkerThread ) {
+			XformAbort(info[i].pXform);
+			if( info[i].fOnEngine ) EngineCancelPump(&info[i]);
+		} else {
+			// a pump blocked on this process's pipes fails once it has gone
+			if( !TerminateProcess( pP->hChild[i], 0 ) )
+				debugMsg ( "TerminateProcess for step %d: %d\n", i, GetLastError());
+			if( hProcs ) hProcs[nProcs++] = pP->hChild[i];
+		}
+	}
+
+	// as many at a time as WaitForMultipleObjects takes, all within CANCEL_TIMEOUT
+	DWORD tStart = GetTickCount();
+	for( DWORD k = 0; k < nProcs; k += MAXIMUM_WAIT_OBJECTS ) {
+		DWORD elapsed = GetTickCount() - tStart;
+		DWORD wr = WaitForMultipleObjects( min(nProcs - k, MAXIMUM_WAIT_OBJECTS), hProcs + k, TRUE,
+										   elapsed < CANCEL_TIMEOUT ? CANCEL_TIMEOUT - elapsed : 0 );
+		if( wr == WAIT_TIMEOUT ) {
+			stderrMsg( "Cancelling pipeline %d - processes haven't died.\n", pP->id );
+			break;
+		}
+	}
+	free(hProcs);
+}
+
+//
+// PipelineTidy
+//
+void PipelineTidy(Pipeline *pP)
+{
+	Stage *info = pP->info;
+	HANDLE *hChild = pP->hChild;
+	int numSteps = pP->numSteps;
+	DWORD deadstep = pP->deadstep;
+	DWORD wr;
+	DWORD waittimeout = 2000; // Wait time for process / thread to pass remaining bytes in buffer.
+
+	debugMsg ( "Tidying up pipeline %d\n", pP->id);
+	if (deadstep == 0) {
+		debugMsg ( " Normal source all read: Process 0 ended \n" );
+	} else {
+		if (deadstep != -1) debugMsg ( " Process/thread %d stopped\n", deadstep );
+		if ((deadstep +1) == numSteps) {
+				debugMsg ( " Output Process/thread %d stopped\n", deadstep );
+				waittimeout = 50 ; // Make shutdown faster if last process has stopped since no more bytes can be sent to output
+		}
+		if (pP->fDie) debugMsg ( "Watchdog expired \n");
+	}
+
+	if (pP->fCancelled) {
+		CancelSteps(pP);
+		waittimeout = CANCEL_TIMEOUT;
+	}
+
+	// a shell that was never bound has processes waiting on input that will never come
+	for( int i = 0; i < numSteps; ++i ){
+		if( !info[i].fIsWorkerThread && hChild[i] == NULL ) {
+			if( info[i].hInput && !IsStdHandle(info[i].hInput) ) CloseHandle(info[i].hInput);
+			if( info[i].hOutput && !IsStdHandle(info[i].hOutput) ) CloseHandle(info[i].hOutput);
+			info[i].hInput = info[i].hOutput = NULL;
+		}
+		if( info[i].fIsWorkerThread && hChild[i] == NULL ) {
+			if( info[i].hOutput && !info[i].fOutputIsSocket && !IsStdHandle(info[i].hOutput) ) CloseHandle(info[i].hOutput);
+			info[i].hOutput = NULL;
+		}
+	}
+
+	for( int i = 0; i < numSteps; ++i ){
+		if( hChild[i] == NULL ) {
+			// never started
+		} else if( info[i].fIsWorkerThread ){
+				wr = WaitForSingleObject( hChild[i],waittimeout );
+				if( wr==WAIT_TIMEOUT ) {
+					stderrMsg( "Tidying up - Thread for step %d hasn't died.\n", i );
+				} else if( wr==WAIT_FAILED ) {
+					stderrMsg ( "Tidying up - Wait for thread to die failed for step  %d: %d\n", i, GetLastError());
+				}
+				debugMsg("Thread for step %i streamed %6i blocks totalling %08X (%d) bytes, buffer %u bytes at %u bytes/s\n",i, info[i].nBlocks , info[i].nBytes, info[i].nBytes, info[i].nBuff, info[i].rate );
+			} else {
+			debugMsg("Waiting for process step %i to terminate\n",i);
+			wr = WaitForSingleObject( hChild[i], pP->fCancelled ? 0 : 2000 );
+			if( wr==WAIT_TIMEOUT || wr==WAIT_FAILED ) {
+				stderrMsg( "Tidying up - process for step %d hasn't died or wait failed. wr=%d :%d \n", i,wr, GetLastError() );
+				if( hChild[i] ) {
+					if (!TerminateProcess( hChild[i], 0 ) )
+						stderrMsg ( "Error Terminating Process for step %d: %d\n", i, GetLastError());
+				}
+			}
+			CloseHandle(hChild[i]);
+		}
+	}
+
+//
+//  Now that all processes are terminated - check if any threads are still running and end them as well.
+//
+
+	for( int i = 0; i < numSteps; ++i ){
+		if( info[i].fIsWorkerThread && hChild[i] && info[i].fOnEngine ){
+			// an engine pump can't be terminated, but it stops as soon as its I/O is aborted
+			if( WaitForSingleObject(hChild[i], 0) == WAIT_TIMEOUT ) {
+				EngineCancelPump(&info[i]);
+				WaitForSingleObject(hChild[i], INFINITE);
+			}
+			EngineFreePump(&info[i]);
+			hChild[i] = NULL;
+		}
+		if( info[i].fIsWorkerThread && hChild[i] ){
+			DWORD threadExitCode;
+			if (GetExitCodeThread(hChild[i],&threadExitCode)) {
+				if (threadExitCode == STILL_ACTIVE){
+					debugMsg("Exitcode for Thread %i Code=%d\n",i,threadExitCode);
+					if(!TerminateThread(hChild[i], 2)) {
+						stderrMsg ( "Error trying to TerminateThread for step %d: %d\n", i, GetLastError());
+					}
+				}
+			} else {
+				stderrMsg ( "Error GetExitThreadCode for step %d: %d\n", i, GetLastError());
+			}
+			CloseHandle(hChild[i]); // CloseHandle is required because _beginthreadex was used.
+		}
+		if( info[i].fIsWorkerThread && !info[i].fInputIsSocket && info[i].hInput && !IsStdHandle(info[i].hInput) )
+			CloseHandle(info[i].hInput);
+		if( info[i].pBuff ) free( info[i].pBuff );
+		XformFree( info[i].pXform );
+		RingFree( info[i].pRing );
+		PacerFree( info[i].pPace );
+	}
+
+	if( pP->outputSocket != INVALID_SOCKET ) closesocket( pP->outputSocket );
+	if( pP->inputSocket != INVALID_SOCKET )  closesocket( pP->inputSocket );
+	CloseHandle( pP->hCancel );
+	debugMsg("Pipeline %d has terminated.\n", pP->id);
+	free(pP->info);
+	free(pP->hChild);
+	free(pP);
+}
@@ -0,0 +1,120 @@
+// swpipeline.h : a single socketwrapper pipeline - its steps, pumps and child processes
+//
+// A pipeline is built from a command (parsed once by GraphParse, see swgraph.h) in two
+// stages so the pool can keep shells warm:
+//   PipelineCreate   creates the steps and the pipes between them
+//   PipelineStart    spawns the processes that don't need parameters and starts the pumps
+//                    between steps
+//   PipelineBind     connects the input/output endpoints (swtransport.h), spawns the
+//                    remaining processes and starts the socket pumps. If params is not
+//                    NULL, $1..$9 in the commands are replaced by the parameters (pool
+//                    mode only)
+//   PipelineRun      waits until a step ends (or the watchdog expires, or it is cancelled)
+//   PipelineTidy     shuts everything down and frees the pipeline
+//
+// PipelineCancel (from another thread) or the output socket being closed by whoever reads
+// it means the rest of the stream isn't wanted, e.g. the user skipped. Tidy then closes the
+// sockets and kills the steps at once instead of letting them drain.
+//
+// A shared pipeline (pool/daemon) has its pumps run by the pump engine (swengine.h)
+// instead of a thread each. It must be created with both input and output sockets so its
+// pumps never touch the std handles.
+//
+
+#pragma once
+
+#include "swxform.h"
+#include "swtransport.h"
+#include "swring.h"
+#include "swgraph.h"
+#include "swpace.h"
+
+#define  MAX_PARAMS       9
+#define  PIPE_TOKEN       "#PIPE#"                     // token to look for
+#define  PIPE_NAME_ROOT   "\\\\.\\pipe\\socketwrapper" // root of named pipe name
+#define  PIPE_TOKEN_BUFFER 65536                        // pipe buffer for a PIPE_TOKEN writer
+#define  BUFFER_SIZE      8192                         // size of named pipe buffers and largest first transfer
+#define  BUFFER_MIN       2048                         // transfer buffer a pump starts with
+#define  BUFFER_MAX       65536                        // largest transfer buffer
+#define  BUFFER_HOLD_MS   250                          // a transfer needn't hold more than this much of the stream
+#define  BUFFER_RUN       4                            // full reads in a row before growing the buffer
+#define  TIMEOUT          60000                        // timeout for wait checking thread state
+#define  DEBUG_TIMEOUT    10000                        // timeout when in debug mode
+#define  CANCEL_TIMEOUT   100                          // wait for killed steps when cancelled
+
+// info about each step in process (also used as context for thread creation)
+typedef struct
+{
+	int i;
+	bool fIsWorkerThread;	// true for thread, false for child process
+	bool fInputIsNamed;		// for thread, true if input handle is named pipe false otherwise
+	bool fInputIsSocket;	// true for first thread reading from the input socket
+	bool fOutputIsSocket;   // true for last thread sending output to a socket
+	char *pBuff;			// either transfer buffer for thread or cmdline for process
+	HANDLE hInput;			// input handle for process/thread
+	HANDLE hOutput;			// output handle for process/thread
+	DWORD WatchDog;			// watchdog for worker threads
+	DWORD nBlocks;			// number of "blocks" read
+	DWORD nBytes;			// number of bytes read
+	Xform *pXform;			// built-in stages run by this thread
+	bool fFailed;			// thread ended because it couldn't write its output
+	bool fPipeOut;			// a pipe connects this step's output to the next step's input
+	bool fOnEngine;			// pumped by the engine: every worker step of a shared pipeline, and a paced one in any
+	struct Pump *pPump;		// engine state when fOnEngine
+	Ring *pRing;			// @buffer step - read ahead into this ring instead of pBuff
+	Pacer *pPace;			// @pace - hold sends to the output socket to a rate
+
+	// adaptive transfer buffer, see StageNextRead
+	unsigned nBuff;			// bytes to ask for on the next read
+	unsigned nBuffAlloc;	// bytes allocated at pBuff
+	DWORD nLastRead;
+	DWORD nFullReads;		// reads in a row that filled the buffer
+	DWORD nShortReads;		// reads in a row that used less than a quarter of it
+	DWORD tFirstRead;		// GetTickCount when data started
+	DWORD rate;				// bytes per second once known
+} Stage;
+
+typedef struct
+{
+	int id;
+	int numSteps;
+	int maxSteps;				// size of info and hChild
+	Stage *info;
+	HANDLE *hChild;				// thread or process handle, NULL until started
+	bool fInputSocket;			// first step pumps from the input socket rather than stdin
+	bool fOutputSocket;			// last step pumps to the output socket rather than stdout
+	SOCKET inputSocket;
+	SOCKET outputSocket;
+	DWORD deadstep;
+	bool fDie;
+	bool fShared;				// pumps run on the shared engine rather than their own threads
+	HANDLE hCancel;				// set by PipelineCancel
+	bool fCancelled;			// tidy without draining
+	HANDLE hOverflow;			// set when a step PipelineRun couldn't wait on directly ends
+	volatile LONG overflowStep;	// which one
+} Pipeline;
+
+// a registered wait for a step beyond what WaitForMultipleObjects can watch
+typedef struct
+{
+	Pipeline *pP;
+	int i;
+	HANDLE hWait;
+} OverflowWait;
+
+extern BOOL bWatchdogEnabled;
+
+bool PipelineInit();
+Pipeline *PipelineCreate( const Graph *pG, bool fInputSocket, bool fOutputSocket, bool fShared );
+bool PipelineStart( Pipeline *pP );
+bool PipelineBind( Pipeline *pP, const Endpoint *pInput, const Endpoint *pOutput, int nParams, char **params );
+void PipelineRun( Pipeline *pP );
+void PipelineCancel( Pipeline *pP );
+void PipelineTidy( Pipeline *pP );
+
+// pumps call these around each read of a worker step's input. StageNextRead returns how
+// much to read into pBuff: small to start with so data gets moving, growing while reads
+// keep filling the buffer and the bitrate says it is worth it, shrinking again when they
+// don't.
+unsigned StageNextRead( Stage *pS );
+void StageRead( Stage *pS, DWORD n );
@@ -0,0 +1,608 @@
+// swpool.cpp : pool/daemon mode - see swpool.h for the control protocol
+//
+
+#include <process.h>
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swengine.h"
+#include "swpool.h"
+
+#define  CONTROL_LINE_MAX  4096
+#define  REFILL_RETRY      5000     // ms before retrying a template that failed to build
+#define  HIST_BUCKETS      12       // 64us, 128us ... 65536us, and everything slower
+#define  HIST_FIRST_US     64
+#define  SHUTDOWN_WAIT     10000    // ms to wait for running pipelines when shutting down
+
+typedef struct
+{
+	Graph *pGraph;				// parsed once, every shell is built from it
+	CRITICAL_SECTION cs;		// guards warm[] and nWarm
+	Pipeline *warm[MAX_WARM];
+	int nWarm;
+	LONG hits;
+	LONG misses;
+	LONG failures;
+	LONG histHit[HIST_BUCKETS];
+	LONG histMiss[HIST_BUCKETS];
+} Template;
+
+// running pipelines, so CANCEL can find them
+typedef struct ActiveNode
+{
+	Pipeline *pP;
+	struct ActiveNode *pNext;
+} ActiveNode;
+
+// a STATS STEP line, copied out under csActive and sent after it's left
+typedef struct
+{
+	int id;
+	int step;
+	DWORD nBytes;
+	DWORD rate;
+	unsigned buffer;
+	bool fRing;
+	unsigned fill, peak, mean;	// the ring's fill levels, for @buffer steps
+	DWORD empty, full;
+} StepStats;
+
+static Template templates[MAX_TEMPLATES];
+static int nTemplates = 0;
+static int nWarmTarget = DEFAULT_WARM;
+static HANDLE hRefill = NULL;				// signalled when a warm shell has been used
+static SOCKET listenSocket = INVALID_SOCKET;
+static volatile LONG nActive = 0;			// bound pipelines still running
+static ActiveNode *pActive = NULL;
+static CRITICAL_SECTION csActive;			// guards pActive
+static volatile bool fShutdown = false;
+static LARGE_INTEGER perfFreq;
+
+static Pipeline *CreateShell(Template *pT)
+{
+	Pipeline *pP = PipelineCreate(pT->pGraph, true, true, true);
+	if( pP && !PipelineStart(pP) ) {
+		PipelineTidy(pP);
+		pP = NULL;
+	}
+	return pP;
+}
+
+//
+// RefillThreadProc
+//
+// keeps every template topped up with warm shells, off the bind path
+//
+unsigned __stdcall RefillThreadProc(void *pv)
+{
+	while( !fShutdown ) {
+		for( int t = 0; t < nTemplates && !fShutdown; ++t ) {
+			Template *pT = &templates[t];
+			for(;;) {
+				EnterCriticalSection(&pT->cs);
+				bool fNeed = pT->nWarm < nWarmTarget;
+				LeaveCriticalSection(&pT->cs);
+				if( !fNeed ) break;
+
+				Pipeline *pP = CreateShell(pT);
+				if( pP == NULL ) {
+					stderrMsg ( "Pool failed to build a shell for template %d\n", t );
+					break;
+				}
+
+				// only this thread adds shells, so there is still room
+				EnterCriticalSection(&pT->cs);
+				pT->warm[pT->nWarm++] = pP;
+				LeaveCriticalSection(&pT->cs);
+				debugMsg ( "Pool shell %d ready for template %d\n", pP->id, t );
+			}
+		}
+		WaitForSingleObject(hRefill, REFILL_RETRY);
+	}
+
+	_endthreadex(0);
+	return 0;
+}
+
+//
+// PipelineThreadProc
+//
+// supervises a bound pipeline until it ends
+//
+static void RemoveActive(Pipeline *pP)
+{
+	EnterCriticalSection(&csActive);
+	for( ActiveNode **ppN = &pActive; *ppN; ppN = &(*ppN)->pNext ) {
+		if( (*ppN)->pP == pP ) {
+			ActiveNode *pN = *ppN;
+			*ppN = pN->pNext;
+			free(pN);
+			break;
+		}
+	}
+	LeaveCriticalSection(&csActive);
+}
+
+unsigned __stdcall PipelineThreadProc(void *pv)
+{
+	Pipeline *pP = (Pipeline *)pv;
+
+	PipelineRun(pP);
+
+	// no more CANCELs once it's being freed
+	RemoveActive(pP);
+	PipelineTidy(pP);
+	InterlockedDecrement(&nActive);
+
+	_endthreadex(0);
+	return 0;
+}
+
+//
+// Supervise
+//
+// hands a bound pipeline to its own supervisor thread. On failure the pipeline is gone
+//
+static bool Supervise(Pipeline *pP)
+{
+	ActiveNode *pN = (ActiveNode *)malloc(sizeof(ActiveNode));
+	if( pN == NULL ) {
+		stderrMsg ( "Pool couldn't track pipeline %d\n", pP->id );
+		PipelineTidy(pP);
+		return false;
+	}
+
+	pN->pP = pP;
+	EnterCriticalSection(&csActive);
+	pN->pNext = pActive;
+	pActive = pN;
+	LeaveCriticalSection(&csActive);
+
+	InterlockedIncrement(&nActive);
+	HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, &PipelineThreadProc, pP, 0, NULL);
+	if( hThread == NULL ) {
+		stderrMsg ( "Pool couldn't start supervisor for pipeline %d: %d\n", pP->id, errno );
+		RemoveActive(pP);
+		PipelineTidy(pP);
+		InterlockedDecrement(&nActive);
+		return false;
+	}
+	CloseHandle(hThread);
+	return true;
+}
+
+static void Reply(SOCKET s, const char *fmt, ...)
+{
+	char str[CONTROL_LINE_MAX];
+	va_list ap;
+
+	va_start(ap,fmt);
+	int n = vsnprintf_s(str, sizeof(str), _TRUNCATE, fmt, ap);
+	va_end(ap);
+
+	if( n < 0 ) n = (int)strlen(str);
+	send(s, str, n, 0);
+}
+
+static void RecordLatency(LONG *hist, double us)
+{
+	int b = 0;
+	double limit = HIST_FIRST_US;
+
+	while( b < HIST_BUCKETS - 1 && us > limit ) {
+		++b;
+		limit *= 2;
+	}
+	InterlockedIncrement(&hist[b]);
+}
+
+static void ReplyHistogram(SOCKET s, const char *name, LONG *hist)
+{
+	char str[CONTROL_LINE_MAX];
+	int n = _snprintf_s(str, sizeof(str), _TRUNCATE, "%s", name);
+	int limit = HIST_FIRST_US;
+
+	for( int b = 0; b < HIST_BUCKETS && n > 0; ++b, limit *= 2 ) {
+		if( b < HIST_BUCKETS - 1 )
+			n += _snprintf_s(str + n, sizeof(str) - n, _TRUNCATE, " %d:%d", limit, hist[b]);
+		else
+			n += _snprintf_s(str + n, sizeof(str) - n, _TRUNCATE, " inf:%d", hist[b]);
+	}
+	Reply(s, "%s\n", str);
+}
+
+//
+// ParseEndpoints
+//
+// reads "input output" from *pp, leaving it pointing after them. The output is required
+//
+static bool ParseEndpoints(char **pp, Endpoint *pInput, Endpoint *pOutput)
+{
+	char in[MAX_UNIX_PATH + 8], out[MAX_UNIX_PATH + 8];
+	int nUsed = 0;
+
+	if( sscanf(*pp, " %115s %115s%n", in, out, &nUsed) < 2 ||
+		!EndpointParse(in, pInput, false) || !EndpointParse(out, pOutput, false) ||
+		pOutput->type == TRANSPORT_NONE ) {
+		return false;
+	}
+	*pp += nUsed;
+	return true;
+}
+
+//
+// DoBind
+//
+// BIND tmpl input output [param1<TAB>param2...]
+//
+static void DoBind(SOCKET s, char *args)
+{
+	int t = -1;
+	int nUsed = 0;
+	Endpoint input, output;
+
+	bool fOK = sscanf(args, "%d%n", &t, &nUsed) == 1 && t >= 0 && t < nTemplates;
+	char *p = args + nUsed;
+	if( !fOK || !ParseEndpoints(&p, &input, &output) ) {
+		Reply(s, "ERR usage: BIND tmpl input output [params]\n");
+		return;
+	}
+
+	// parameters are tab separated so they can contain spaces
+	char *params[MAX_PARAMS];
+	int nParams = 0;
+	if( *p == ' ' ) {
+		++p;
+		while( nParams < MAX_PARAMS ) {
+			params[nParams++] = p;
+			p = strchr(p, '\t');
+			if( p == NULL ) break;
+			*p++ = '\0';
+		}
+	}
+
+	Template *pT = &templates[t];
+	LARGE_INTEGER t0, t1;
+	QueryPerformanceCounter(&t0);
+
+	EnterCriticalSection(&pT->cs);
+	Pipeline *pP = pT->nWarm ? pT->warm[--pT->nWarm] : NULL;
+	LeaveCriticalSection(&pT->cs);
+
+	bool fHit = (pP != NULL);
+	if( pP == NULL ) {
+		pP = CreateShell(pT);
+	}
+
+	if( pP == NULL || !PipelineBind(pP, &input, &output, nParams, params) ) {
+		InterlockedIncrement(&pT->failures);
+		if( pP ) PipelineTidy(pP);
+		SetEvent(hRefill);
+		Reply(s, "ERR bind failed\n");
+		return;
+	}
+
+	QueryPerformanceCounter(&t1);
+	double us = (double)(t1.QuadPart - t0.QuadPart) * 1000000.0 / (double)perfFreq.QuadPart;
+
+	// Supervise has already tidied the pipeline away if it fails
+	int id = pP->id;
+	if( !Supervise(pP) ) {
+		InterlockedIncrement(&pT->failures);
+		SetEvent(hRefill);
+		Reply(s, "ERR bind failed\n");
+		return;
+	}
+
+	if( fHit ) {
+		InterlockedIncrement(&pT->hits);
+		RecordLatency(pT->histHit, us);
+	} else {
+		InterlockedIncrement(&pT->misses);
+		RecordLatency(pT->histMiss, us);
+	}
+
+	SetEvent(hRefill);
+	debugMsg ( "Pool bound pipeline %d (template %d, %s) in %.0fus\n", id, t, fHit ? "hit" : "miss", us );
+	Reply(s, "OK %d %s %.0f\n", id, fHit ? "hit" : "miss", us);
+}
+
+//
+// DoRun
+//
+// RUN input output command
+//
+static void DoRun(SOCKET s, char *args)
+{
+	Endpoint input, output;
+	char *command = args;
+
+	if( !ParseEndpoints(&command, &input, &output) || *command != ' ' ) {
+		Reply(s, "ERR usage: RUN input output command\n");
+		return;
+	}
+	while( *command == ' ' ) ++command;
+
+	Graph *pG = GraphParse(command);
+	Pipeline *pP = pG ? PipelineCreate(pG, true, true, true) : NULL;
+	GraphFree(pG);
+	if( pP == NULL ) {
+		Reply(s, "ERR bad command\n");
+		return;
+	}
+
+	if( !PipelineStart(pP) || !PipelineBind(pP, &input, &output, 0, NULL) ) {
+		PipelineTidy(pP);
+		Reply(s, "ERR run failed\n");
+		return;
+	}
+
+	int id = pP->id;
+	if( !Supervise(pP) ) {
+		Reply(s, "ERR run failed\n");
+		return;
+	}
+
+	debugMsg ( "Daemon running pipeline %d: %s\n", id, command );
+	Reply(s, "OK %d\n", id);
+}
+
+//
+// DoCancel
+//
+// CANCEL id
+//
+static void DoCancel(SOCKET s, char *args)
+{
+	int id = atoi(args);
+	bool fFound = false;
+
+	EnterCriticalSection(&csActive);
+	for( ActiveNode *pN = pActive; pN; pN = pN->pNext ) {
+		if( pN->pP->id == id ) {
+			PipelineCancel(pN->pP);
+			fFound = true;
+			break;
+		}
+	}
+	LeaveCriticalSection(&csActive);
+
+	if( fFound ) {
+		debugMsg ( "Pool cancelled pipeline %d\n", id );
+		Reply(s, "OK\n");
+	} else {
+		Reply(s, "ERR no such pipeline\n");
+	}
+}
+
+static void DoStats(SOCKET s)
+{
+	for( int t = 0; t < nTemplates; ++t ) {
+		Template *pT = &templates[t];
+
+		EnterCriticalSection(&pT->cs);
+		int nWarm = pT->nWarm;
+		LeaveCriticalSection(&pT->cs);
+
+		Reply(s, "TEMPLATE %d warm=%d/%d hits=%d misses=%d failures=%d\n",
+			  t, nWarm, nWarmTarget, pT->hits, pT->misses, pT->failures);
+		ReplyHistogram(s, "HIT_US", pT->histHit);
+		ReplyHistogram(s, "MISS_US", pT->histMiss);
+	}
+
+	// the pumps of each running pipeline. Their counters are only written by the pump,
+	// a slightly stale value is fine here. They're copied out and sent once csActive is
+	// left, so a control client that stops reading can't hold up pipelines starting and
+	// ending
+	EnterCriticalSection(&csActive);
+	int nSteps = 0;
+	for( ActiveNode *pN = pActive; pN; pN = pN->pNext ) nSteps += pN->pP->numSteps;
+	StepStats *pStats = (StepStats *)malloc(max(nSteps, 1) * sizeof(StepStats));
+	nSteps = 0;
+	for( ActiveNode *pN = pActive; pStats && pN; pN = pN->pNext ) {
+		Pipeline *pP = pN->pP;
+		for( int i = 0; i < pP->numSteps; ++i ) {
+			Stage *pS = &pP->info[i];
+			if( !pS->fIsWorkerThread ) continue;
+			StepStats *pStep = &pStats[nSteps++];
+			pStep->id = pP->id;
+			pStep->step = i;
+			pStep->nBytes = pS->nBytes;
+			pStep->rate = pS->rate;
+			pStep->buffer = pS->pRing ? pS->pRing->size : pS->nBuff;
+			pStep->fRing = pS->pRing != NULL;
+			if( pStep->fRing ) {
+				Ring *pR = pS->pRing;
+				unsigned long long samples = pR->fillSamples;
+				pStep->fill = pR->count;
+				pStep->peak = pR->peak;
+				pStep->mean = samples ? (unsigned)(pR->fillSum / samples) : 0;
+				pStep->empty = pR->underruns;
+				pStep->full = pR->overruns;
+			}
+		}
+	}
+	LeaveCriticalSection(&csActive);
+
+	if( pStats == NULL ) {
+		Reply(s, "ERR out of memory\n");
+		return;
+	}
+	for( int i = 0; i < nSteps; ++i ) {
+		StepStats *pStep = &pStats[i];
+		if( pStep->fRing ) {
+			Reply(s, "STEP %d %d bytes=%u rate=%u buffer=%u fill=%u peak=%u mean=%u empty=%u full=%u\n",
+				  pStep->id, pStep->step, pStep->nBytes, pStep->rate, pStep->buffer,
+				  pStep->fill, pStep->peak, pStep->mean, pStep->empty, pStep->full);
+		} else {
+			Reply(s, "STEP %d %d bytes=%u rate=%u buffer=%u\n",
+				  pStep->id, pStep->step, pStep->nBytes, pStep->rate, pStep->buffer);
+		}
+	}
+	free(pStats);
+
+	Reply(s, "ACTIVE %d\n", nActive);
+	Reply(s, "OK\n");
+}
+
+// returns false when the connection should be closed
+static bool DoCommand(SOCKET s, char *line)
+{
+	debugMsg ( "Pool command: %s\n", line );
+
+	if( !strncmp(line, "BIND ", 5) ) {
+		DoBind(s, line + 5);
+	} else if( !strncmp(line, "RUN ", 4) ) {
+		DoRun(s, line + 4);
+	} else if( !strncmp(line, "CANCEL ", 7) ) {
+		DoCancel(s, line + 7);
+	} else if( !strcmp(line, "STATS") ) {
+		DoStats(s);
+	} else if( !strcmp(line, "QUIT") ) {
+		Reply(s, "OK\n");
+		return false;
+	} else if( !strcmp(line, "SHUTDOWN") ) {
+		Reply(s, "OK\n");
+		fShutdown = true;
+		closesocket(listenSocket);	// wakes up accept()
+		return false;
+	} else if( *line ) {
+		Reply(s, "ERR unknown command\n");
+	}
+	return true;
+}
+
+//
+// ControlThreadProc
+//
+// reads command lines from one control connection
+//
+unsigned __stdcall ControlThreadProc(void *pv)
+{
+	SOCKET s = (SOCKET)pv;
+	char line[CONTROL_LINE_MAX];
+	int n = 0;
+	bool fOpen = true;
+
+	while( fOpen ) {
+		int r = recv(s, line + n, sizeof(line) - 1 - n, 0);
+		if( r <= 0 ) break;
+		n += r;
+		line[n] = '\0';
+
+		char *start = line;
+		char *eol;
+		while( fOpen && (eol = strchr(start, '\n')) != NULL ) {
+			*eol = '\0';
+			if( eol > start && eol[-1] == '\r' ) eol[-1] = '\0';
+			fOpen = DoCommand(s, start);
+			start = eol + 1;
+		}
+
+		n -= (int)(start - line);
+		memmove(line, start, n);
+		if( n == sizeof(line) - 1 ) {
+			Reply(s, "ERR line too long\n");
+			n = 0;
+		}
+	}
+
+	closesocket(s);
+	_endthreadex(0);
+	return 0;
+}
+
+//
+// PoolRun
+//
+int PoolRun(USHORT controlPort, int nCommands, char **commands, int nWarm, int nEngineThreads)
+{
+	QueryPerformanceFrequency(&perfFreq);
+
+	if( !EngineInit(nEngineThreads) ) {
+		return -1;
+	}
+
+	InitializeCriticalSection(&csActive);
+	nWarmTarget = nWarm;
+	nTemplates = nCommands;
+	for( int t = 0; t < nTemplates; ++t ) {
+		templates[t].pGraph = GraphParse(commands[t]);
+		if( templates[t].pGraph == NULL ) {
+			stderrMsg( "Pool template %d is no good: %s\n", t, commands[t] );
+			return -1;
+		}
+		InitializeCriticalSection(&templates[t].cs);
+		debugMsg ( "Pool template %d: %s\n", t, commands[t] );
+	}
+
+	listenSocket = WSASocket(AF_INET, SOCK_STREAM, 0, NULL, 0, 0);
+	if (listenSocket == INVALID_SOCKET) {
+		stderrMsg( "Control socket creation error: %d\n", WSAGetLastError());
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	int addrlen = sizeof(addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(controlPort);
+	if (bind(listenSocket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		listen(listenSocket, SOMAXCONN) == SOCKET_ERROR ||
+		getsockname(listenSocket, (sockaddr*)&addr, &addrlen) == SOCKET_ERROR) {
+		stderrMsg( "Control socket error for port %d: %d\n", controlPort, WSAGetLastError());
+		closesocket(listenSocket);
+		return -1;
+	}
+
+	// let whoever started us know where to connect
+	fprintf(stdout, "PORT %d\n", ntohs(addr.sin_port));
+	fflush(stdout);
+	debugMsg ( "Pool listening on port %d with %d warm shells per template\n", ntohs(addr.sin_port), nWarmTarget );
+
+	hRefill = CreateEvent(NULL, FALSE, TRUE, NULL);
+	HANDLE hRefillThread = (HANDLE)_beginthreadex(NULL, 0, &RefillThreadProc, NULL, 0, NULL);
+	if( hRefill == NULL || hRefillThread == NULL ) {
+		stderrMsg( "Pool couldn't start refill thread\n");
+		closesocket(listenSocket);
+		return -1;
+	}
+
+	while( !fShutdown ) {
+		SOCKET s = accept(listenSocket, NULL, NULL);
+		if( s == INVALID_SOCKET ) {
+			if( !fShutdown ) stderrMsg( "Control socket accept error: %d\n", WSAGetLastError());
+			break;
+		}
+
+		HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, &ControlThreadProc, (void *)s, 0, NULL);
+		if( hThread ) {
+			CloseHandle(hThread);
+		} else {
+			stderrMsg( "Pool couldn't start control thread: %d\n", errno);
+			closesocket(s);
+		}
+	}
+
+	debugMsg ( "Pool shutting down\n" );
+	fShutdown = true;
+	SetEvent(hRefill);
+	WaitForSingleObject(hRefillThread, INFINITE);
+	CloseHandle(hRefillThread);
+
+	for( int t = 0; t < nTemplates; ++t ) {
+		while( templates[t].nWarm )
+			PipelineTidy(templates[t].warm[--templates[t].nWarm]);
+	}
+
+	for( int waited = 0; nActive && waited < SHUTDOWN_WAIT; waited += 100 )
+		Sleep(100);
+
+	// pipelines that are still running keep their pumps, so only stop the engine if
+	// they have all gone
+	if( nActive == 0 ) {
+		EngineShutdown();
+	}
+
+	return 0;
+}
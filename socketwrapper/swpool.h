@@ -0,0 +1,47 @@
+// swpool.h : pool/daemon mode - one process running many pipelines
+//
+// socketwrapper -P port [-n warm] [-t threads] [-c template ...]
+//
+// Each -c gives a template, numbered from 0, which may use $1..$9 for parameters supplied
+// when it is bound. For every template the pool keeps a number of shells ready: pipes
+// created, built-in stages parsed, pumps between steps running and any process without
+// parameters already spawned and waiting on its input.
+//
+// Without any -c the pool is just a daemon running whatever commands it is given with RUN.
+// Either way every pipeline's pumps run on the shared pump engine (swengine.h) with
+// -t threads (default one per processor). Each pipeline is still torn down on its own
+// when it ends, as in single mode.
+//
+// The pool listens on localhost:port (0 picks a free port, which is printed to stdout as
+// "PORT n") for control connections. Commands are lines of text:
+//
+//   BIND tmpl input output [param1<TAB>param2...]
+//        connect a shell to the endpoints and start it. Endpoints are ports or unix:path
+//        (see swtransport.h, paths can't contain spaces). input may be 0 for no input.
+//        replies "OK id hit|miss usecs" or "ERR reason"
+//   RUN input output command
+//        build a pipeline from command (as for -c) and start it straight away.
+//        replies "OK id" or "ERR reason"
+//   CANCEL id
+//        stop a running pipeline now, without draining it (e.g. the user skipped).
+//        replies "OK" once it has been told, or "ERR reason"
+//   STATS
+//        replies one TEMPLATE, HIT_US and MISS_US line per template, a STEP line per
+//        pump of each running pipeline, an ACTIVE line with the number of running
+//        pipelines, then "OK". The _US lines are histograms of bind latency, "limit:count"
+//        with limits in microseconds. STEP lines are "STEP id step bytes=n rate=n buffer=n"
+//        with the bytes read so far, bytes per second and current transfer buffer size.
+//        A @buffer step's line goes on with "fill=n peak=n mean=n empty=n full=n", the
+//        ring's fill now, at its highest and on average, and how often it has run empty
+//        and full (see swring.h).
+//   QUIT      close this control connection
+//   SHUTDOWN  stop the pool
+//
+
+#pragma once
+
+#define  MAX_TEMPLATES    8
+#define  MAX_WARM         8
+#define  DEFAULT_WARM     2
+
+int PoolRun( USHORT controlPort, int nCommands, char **commands, int nWarm, int nEngineThreads );
@@ -0,0 +1,280 @@
+// swring.cpp : @buffer read-ahead stage - see swring.h
+//
+
+#include <process.h>
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swpipeline.h"
+#include "swring.h"
+#include "swsched.h"
+
+#define  RING_IO_MAX      65536     // largest single read or write on the ring
+
+bool RingIsSpec(const char *spec)
+{
+	size_t n = strlen(RING_NAME);
+	return !strncmp(spec, RING_NAME, n) && (spec[n] == ' ' || spec[n] == '\0');
+}
+
+//
+// RingSize
+//
+// spec is the command segment without the leading XFORM_TOKEN, e.g. "buffer 5s 176400"
+//
+static bool RingSize(const char *spec, unsigned *pSize)
+{
+	char name[16] = "", a1[32] = "", a2[32] = "";
+	int nArgs = sscanf(spec, "%15s %31s %31s", name, a1, a2) - 1;
+	unsigned long long size = 0;
+	char *end;
+
+	if( nArgs < 1 || nArgs > 2 ) goto bad;
+
+	size = _strtoui64(a1, &end, 10);
+	if( end == a1 ) goto bad;
+	if( *end == 's' && end[1] == '\0' && nArgs == 2 ) {
+		unsigned long rate = strtoul(a2, &end, 10);
+		if( *end != '\0' || rate == 0 ) goto bad;
+		size *= rate;
+	} else if( nArgs != 1 ) {
+		goto bad;
+	} else if( (*end == 'k' || *end == 'K') && end[1] == '\0' ) {
+		size <<= 10;
+	} else if( *end == 'M' && end[1] == '\0' ) {
+		size <<= 20;
+	} else if( *end != '\0' ) {
+		goto bad;
+	}
+	if( size < BUFFER_SIZE || size > RING_MAX_SIZE ) goto bad;
+
+	*pSize = (unsigned)size;
+	return true;
+
+bad:
+	stderrMsg ( "Malformed built-in stage \"%c%s\", size must be %d bytes to %dM\n", XFORM_TOKEN, spec, BUFFER_SIZE, RING_MAX_SIZE >> 20 );
+	return false;
+}
+
+bool RingCheck(const char *spec)
+{
+	unsigned size;
+	return RingSize(spec, &size);
+}
+
+Ring *RingParse(const char *spec)
+{
+	unsigned size;
+	if( !RingSize(spec, &size) ) return NULL;
+
+	Ring *pR = (Ring *)calloc(1, sizeof(Ring));
+	if( pR == NULL ) {
+		stderrMsg ( "Ring calloc failed\n" );
+		return NULL;
+	}
+
+	while( *spec == ' ' ) ++spec;
+	strncpy(pR->spec, spec, sizeof(pR->spec) - 1);
+
+	pR->size = size;
+	pR->pData = (char *)malloc(pR->size);
+	pR->hData = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pR->hSpace = CreateEvent(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&pR->cs);
+	if( pR->pData == NULL || pR->hData == NULL || pR->hSpace == NULL ) {
+		stderrMsg ( "Couldn't allocate %u byte ring for %c%s\n", pR->size, XFORM_TOKEN, pR->spec );
+		RingFree(pR);
+		return NULL;
+	}
+	return pR;
+}
+
+void RingFree(Ring *pR)
+{
+	if( pR == NULL ) return;
+
+	if( pR->fillSamples ) {
+		debugMsg ( "Ring %c%s: size %u, peak %u, mean %I64u, empty %u times, full %u times\n",
+					XFORM_TOKEN, pR->spec, pR->size, pR->peak, pR->fillSum / pR->fillSamples,
+					pR->underruns, pR->overruns );
+	}
+
+	// the pump thread waits for its writer, so this only happens if it was terminated
+	if( pR->hWriter ) {
+		if( WaitForSingleObject(pR->hWriter, 0) == WAIT_TIMEOUT ) {
+			stderrMsg ( "Ring writer hasn't died, terminating it\n" );
+			TerminateThread(pR->hWriter, 2);
+		}
+		CloseHandle(pR->hWriter);
+	}
+
+	if( pR->hData ) CloseHandle(pR->hData);
+	if( pR->hSpace ) CloseHandle(pR->hSpace);
+	DeleteCriticalSection(&pR->cs);
+	if( pR->pData ) free(pR->pData);
+	free(pR);
+}
+
+char *RingFreeSpace(Ring *pR, unsigned *pn)
+{
+	unsigned tail = (pR->head + pR->count) % pR->size;
+	unsigned n = tail >= pR->head && pR->count < pR->size ? pR->size - tail : pR->head - tail;
+	if( pR->count == pR->size ) n = 0;
+	*pn = min(n, RING_IO_MAX);
+	return pR->pData + tail;
+}
+
+char *RingData(Ring *pR, unsigned *pn)
+{
+	unsigned n = min(pR->count, pR->size - pR->head);
+	*pn = min(n, RING_IO_MAX);
+	return pR->pData + pR->head;
+}
+
+void RingProduced(Ring *pR, unsigned n)
+{
+	pR->count += n;
+	if( pR->count > pR->peak ) pR->peak = pR->count;
+}
+
+void RingConsumed(Ring *pR, unsigned n)
+{
+	pR->fillSum += pR->count;
+	pR->fillSamples++;
+	pR->fStarted = true;
+
+	pR->head = (pR->head + n) % pR->size;
+	pR->count -= n;
+}
+
+//
+// RingWriterThreadProc
+//
+// drains the ring to the step's output
+//
+unsigned __stdcall RingWriterThreadProc(void *pv)
+{
+	Stage *pS = (Stage *)pv;
+	Ring *pR = pS->pRing;
+
+	for(;;) {
+		EnterCriticalSection(&pR->cs);
+		if( pR->count == 0 && !pR->fEof && pR->fStarted ) pR->underruns++;
+		while( pR->count == 0 && !pR->fEof ) {
+			LeaveCriticalSection(&pR->cs);
+			WaitForSingleObject(pR->hData, INFINITE);
+			EnterCriticalSection(&pR->cs);
+		}
+		unsigned n;
+		char *p = RingData(pR, &n);
+		LeaveCriticalSection(&pR->cs);
+
+		if( n == 0 ) break;		// EOF and drained
+
+		DWORD byteswritten;
+		if( pS->fOutputIsSocket ) {
+			int r = send((SOCKET) pS->hOutput, p, n, 0);
+			if( r == SOCKET_ERROR || (unsigned)r != n ) {
+				stderrMsg ( "Ring writer for step %i failed Send writing with error %i.\n", pS->i, WSAGetLastError());
+				pS->fFailed = true;
+				break;
+			}
+		} else if( !WriteFile(pS->hOutput, p, n, &byteswritten, NULL) ) {
+			stderrMsg ( "Ring writer for step %i failed WriteFile with error %i.\n", pS->i, GetLastError() );
+			pS->fFailed = true;
+			break;
+		}
+
+		EnterCriticalSection(&pR->cs);
+		RingConsumed(pR, n);
+		LeaveCriticalSection(&pR->cs);
+		SetEvent(pR->hSpace);
+
+		++(pS->WatchDog);
+	}
+
+	if (!pS->fOutputIsSocket) {
+		if (!FlushFileBuffers(pS->hOutput)) {
+			stderrMsg ( "Error Flushing Output in Ring writer for step %d: %d\n", pS->i, GetLastError());
+		}
+		if(!CloseHandle(pS->hOutput )) {
+			stderrMsg ( "CloseHandle for step %i failed with error %i.\n", pS->i, GetLastError() );
+		}
+	} else {
+		shutdown((SOCKET) pS->hOutput, SD_SEND);
+	}
+
+	// tell the reader nothing more will be taken
+	EnterCriticalSection(&pR->cs);
+	pR->fEof = true;
+	LeaveCriticalSection(&pR->cs);
+	SetEvent(pR->hSpace);
+
+	_endthreadex(0);
+	return 0;
+}
+
+//
+// RingThreadProc
+//
+// a pump thread for a @buffer step: fills the ring from the step's input while the writer
+// thread drains it. Ends once everything has been written.
+//
+unsigned __stdcall RingThreadProc(void *pv)
+{
+	Stage *pS = (Stage *)pv;
+	Ring *pR = pS->pRing;
+
+	debugMsg ( "RingThreadProc for step %i started, %u bytes.\n", pS->i, pR->size );
+
+	pR->hWriter = (HANDLE)_beginthreadex(NULL, 0, &RingWriterThreadProc, pS, 0, NULL);
+	if( pR->hWriter == NULL ) {
+		stderrMsg ( "Error creating ring writer for step %d : %d\n", pS->i, errno);
+		_endthreadex(1);
+		return 1;
+	}
+	// the writer is as much a pump as this thread
+	if( !SchedPumpThread(pR->hWriter) ) {
+		stderrMsg ( "Error changing ring writer priority for step %d : %d\n", pS->i, GetLastError());
+	}
+
+	for(;;) {
+		EnterCriticalSection(&pR->cs);
+		if( pR->count == pR->size && !pR->fEof ) pR->overruns++;
+		while( pR->count == pR->size && !pR->fEof ) {
+			LeaveCriticalSection(&pR->cs);
+			WaitForSingleObject(pR->hSpace, INFINITE);
+			EnterCriticalSection(&pR->cs);
+		}
+		bool fWriterGone = pR->fEof;
+		unsigned n;
+		char *p = RingFreeSpace(pR, &n);
+		LeaveCriticalSection(&pR->cs);
+
+		if( fWriterGone ) break;
+
+		DWORD bytesread;
+		if( !ReadFile(pS->hInput, p, n, &bytesread, NULL) || bytesread == 0 ) {
+			debugMsg ( "RingThreadProc for step %i input ended: %i.\n", pS->i, GetLastError() );
+			break;
+		}
+
+		pS->nBytes += bytesread;
+		pS->nBlocks++;
+
+		EnterCriticalSection(&pR->cs);
+		RingProduced(pR, bytesread);
+		LeaveCriticalSection(&pR->cs);
+		SetEvent(pR->hData);
+	}
+
+	EnterCriticalSection(&pR->cs);
+	pR->fEof = true;
+	LeaveCriticalSection(&pR->cs);
+	SetEvent(pR->hData);
+
+	WaitForSingleObject(pR->hWriter, INFINITE);
+	debugMsg ( "RingThreadProc for step %i ending.\n", pS->i );
+
+	_endthreadex(0);
+	return 0;
+}
@@ -0,0 +1,60 @@
+// swring.h : @buffer read-ahead stage
+//
+//   @buffer <size> [<bytes per second>]
+//
+// size is in bytes (with k or M) or in seconds ("5s"), which needs the byte rate of the
+// stream, e.g. "@buffer 5s 176400" for CD audio.
+//
+// Unlike the other built-in stages this is a step of its own, with a preallocated ring
+// between a reader and a writer. The reader keeps taking data from the previous step as
+// long as there is room, so a decoder can run ahead of the encoder and ride out a stall
+// (disk spin-up, network source) without starving the output. Each pump thread has a
+// writer thread of its own; on the pump engine the read and write are in flight together.
+//
+// So the buffer can be sized, it keeps its fill levels: peak and mean fill, how often the
+// writer found it empty once data had started (the output was starved) and how often the
+// reader found it full. The pool shows them live on the step's STATS line (see swpool.h),
+// and the step reports them with -d when it ends.
+//
+// e.g. socketwrapper -i 9000 -o 9001 -c "flac -dcs - | @buffer 10s 176400 | lame ..."
+//
+
+#pragma once
+
+#define  RING_NAME        "buffer"
+#define  RING_MAX_SIZE    (256 << 20)
+
+typedef struct
+{
+	char *pData;
+	unsigned size;
+	unsigned head;				// next byte to write out
+	unsigned count;				// bytes held
+	bool fEof;					// the reader has seen the end of the input
+	bool fStarted;				// data has been through, so an empty ring is an underrun
+	CRITICAL_SECTION cs;
+	HANDLE hData;				// auto reset - reader added data or hit EOF
+	HANDLE hSpace;				// auto reset - writer made room
+	HANDLE hWriter;				// writer thread, pump threads only
+	char spec[64];
+
+	// fill statistics
+	unsigned peak;
+	unsigned long long fillSum;
+	unsigned long long fillSamples;
+	DWORD underruns;
+	DWORD overruns;
+} Ring;
+
+bool RingIsSpec( const char *spec );
+bool RingCheck( const char *spec );		// validate without allocating the ring
+Ring *RingParse( const char *spec );
+void RingFree( Ring *pR );
+
+// contiguous free space / data, with the ring locked by the caller
+char *RingFreeSpace( Ring *pR, unsigned *pn );
+char *RingData( Ring *pR, unsigned *pn );
+void RingProduced( Ring *pR, unsigned n );
+void RingConsumed( Ring *pR, unsigned n );
+
+unsigned __stdcall RingThreadProc( void *pv );
@@ -0,0 +1,166 @@
+// swsched.cpp : CPU affinity and priorities - see swsched.h
+//
+
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swsched.h"
+
+typedef struct
+{
+	const char *name;
+	int value;
+} SchedName;
+
+static const SchedName classNames[] = {
+	{ "idle",     IDLE_PRIORITY_CLASS },
+	{ "below",    BELOW_NORMAL_PRIORITY_CLASS },
+	{ "normal",   NORMAL_PRIORITY_CLASS },
+	{ "above",    ABOVE_NORMAL_PRIORITY_CLASS },
+	{ "high",     HIGH_PRIORITY_CLASS },
+	{ "realtime", REALTIME_PRIORITY_CLASS },
+	{ NULL, 0 }
+};
+
+static const SchedName threadNames[] = {
+	{ "idle",     THREAD_PRIORITY_IDLE },
+	{ "lowest",   THREAD_PRIORITY_LOWEST },
+	{ "below",    THREAD_PRIORITY_BELOW_NORMAL },
+	{ "normal",   THREAD_PRIORITY_NORMAL },
+	{ "above",    THREAD_PRIORITY_ABOVE_NORMAL },
+	{ "highest",  THREAD_PRIORITY_HIGHEST },
+	{ "critical", THREAD_PRIORITY_TIME_CRITICAL },
+	{ NULL, 0 }
+};
+
+static DWORD_PTR affinity = 0;					// 0 - leave as it is
+static DWORD priorityClass = 0;					// 0 - leave as it is
+static int pumpPriority = THREAD_PRIORITY_TIME_CRITICAL;
+
+static bool LookupName(const SchedName *names, const char *name, size_t n, int *pValue)
+{
+	for( ; names->name; ++names ) {
+		if( strlen(names->name) == n && !strncmp(names->name, name, n) ) {
+			*pValue = names->value;
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// SchedParseAffinity
+//
+// a list of processors and ranges, e.g. "0,2-3"
+//
+bool SchedParseAffinity(const char *spec)
+{
+	const char *p = spec;
+	DWORD_PTR mask = 0;
+
+	for(;;) {
+		char *end;
+		unsigned long first = strtoul(p, &end, 10);
+		unsigned long last = first;
+		if( end == p ) goto bad;
+		p = end;
+		if( *p == '-' ) {
+			last = strtoul(++p, &end, 10);
+			if( end == p ) goto bad;
+			p = end;
+		}
+		if( last < first || last >= sizeof(DWORD_PTR) * 8 ) goto bad;
+		for( unsigned long cpu = first; cpu <= last; ++cpu )
+			mask |= (DWORD_PTR)1 << cpu;
+
+		if( *p == '\0' ) break;
+		if( *p++ != ',' ) goto bad;
+	}
+
+	affinity = mask;
+	return true;
+
+bad:
+	stderrMsg ( "Bad processor list: %s\n", spec );
+	return false;
+}
+
+//
+// SchedParsePriority
+//
+// class[:pump], e.g. "below" or "above:highest"
+//
+bool SchedParsePriority(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t n = colon ? (size_t)(colon - spec) : strlen(spec);
+	int value;
+
+	if( !LookupName(classNames, spec, n, &value) ) goto bad;
+	priorityClass = value;
+
+	// the pumps keep up with their children rather than preempting them
+	pumpPriority = THREAD_PRIORITY_NORMAL;
+	if( colon ) {
+		if( !LookupName(threadNames, colon + 1, strlen(colon + 1), &value) ) goto bad;
+		pumpPriority = value;
+	}
+	return true;
+
+bad:
+	stderrMsg ( "Bad priority: %s\n", spec );
+	return false;
+}
+
+bool SchedInit()
+{
+	if( affinity ) {
+		DWORD_PTR processMask, systemMask;
+		if( GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) && (affinity & ~systemMask) ) {
+			stderrMsg ( "Processor set %Ix includes processors this system doesn't have (%Ix)\n", affinity, systemMask );
+			return false;
+		}
+		if( !SetProcessAffinityMask(GetCurrentProcess(), affinity) ) {
+			stderrMsg ( "Error setting processor affinity: %d\n", GetLastError() );
+			return false;
+		}
+		debugMsg ( "Running on processors %Ix\n", affinity );
+	}
+
+	if( priorityClass ) {
+		if( !SetPriorityClass(GetCurrentProcess(), priorityClass) ) {
+			stderrMsg ( "Error setting priority class: %d\n", GetLastError() );
+			return false;
+		}
+		debugMsg ( "Priority class %x, pumps at %d\n", priorityClass, pumpPriority );
+	}
+
+	return true;
+}
+
+DWORD SchedChildFlags()
+{
+	// the affinity is inherited, the priority class only sometimes
+	return priorityClass;
+}
+
+bool SchedPumpThread(HANDLE hThread)
+{
+	return SetThreadPriority(hThread, pumpPriority) != 0;
+}
+
+int SchedProcessors()
+{
+	DWORD_PTR processMask, systemMask;
+	int n = 0;
+
+	if( GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) ) {
+		for( ; processMask; processMask &= processMask - 1 )
+			++n;
+	}
+	if( n == 0 ) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		n = si.dwNumberOfProcessors;
+	}
+	return n;
+}
@@ -0,0 +1,36 @@
+// swsched.h : CPU affinity and priorities for pumps and child processes
+//
+// By default every pump thread runs at THREAD_PRIORITY_TIME_CRITICAL and the children at
+// normal priority, as always. Under load that lets the pumps preempt the decoders they
+// are waiting on. These options give the whole pipeline a consistent policy instead:
+//
+//   -a cpus        run socketwrapper and everything it starts on these processors, e.g.
+//                  "2-3" or "0,2,4". Children inherit the affinity. The engine thread
+//                  count defaults to the number of processors in the set.
+//   -p class[:pump]
+//                  priority class for socketwrapper and its children: idle, below, normal,
+//                  above, high or realtime. The pumps then run at the children's priority
+//                  within it (pump "normal") unless given one of idle, lowest, below,
+//                  normal, above, highest or critical, e.g. "above:above" puts the whole
+//                  pipeline above normal with the pumps a notch above the decoders.
+//
+// realtime needs the increase scheduling priority privilege, without it Windows quietly
+// gives high instead.
+//
+
+#pragma once
+
+bool SchedParseAffinity( const char *spec );
+bool SchedParsePriority( const char *spec );
+
+// applies the affinity and priority class to this process. Call once at startup
+bool SchedInit();
+
+// CreateProcess creation flags for a child
+DWORD SchedChildFlags();
+
+// gives a pump or engine thread its priority
+bool SchedPumpThread( HANDLE hThread );
+
+// processors available to the engine
+int SchedProcessors();
@@ -0,0 +1,389 @@
+// swtee.cpp : @tee built-in stage - see swtee.h
+//
+// The pump copies each buffer once into a reference counted block and queues it for every
+// consumer. Writer threads send the blocks and drop their reference, the last one frees it.
+// Handles are only closed with the lock held, so a writer blocked on a socket can be
+// unstuck by closing the socket under it.
+//
+
+#include <process.h>
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swtransport.h"
+#include "swtee.h"
+
+#define  PIPE_PREFIX      "pipe:"
+#define  PIPE_PATH_ROOT   "\\\\.\\pipe\\"
+
+enum { TEE_BLOCK, TEE_DROP, TEE_DETACH };
+
+static const char *policyNames[] = { "block", "drop", "detach" };
+
+typedef struct
+{
+	volatile LONG refs;
+	unsigned n;
+	char data[1];
+} TeeBlock;
+
+typedef struct
+{
+	struct Tee *pTee;
+	int i;
+	int policy;
+	bool fPipe;
+	char pipeName[MAX_UNIX_PATH + 16];
+	Endpoint ep;
+	SOCKET sock;
+	HANDLE hPipe;
+	TeeBlock *queue[TEE_QUEUE_BLOCKS];
+	int head;
+	int count;
+	bool fDetached;			// gets nothing more
+	HANDLE hThread;
+	HANDLE hData;			// auto reset - something queued, or the stream ended
+	HANDLE hSpace;			// auto reset - something dequeued, or detached
+	ULONGLONG nBytes;
+	DWORD nDropped;
+} TeeOutput;
+
+struct Tee
+{
+	TeeOutput out[TEE_MAX_OUTPUTS];
+	int nOutputs;
+	CRITICAL_SECTION cs;	// guards all the queues and handles
+	bool fStarted;
+	bool fEnd;
+	bool fAbort;
+};
+
+static void ReleaseBlock(TeeBlock *pB)
+{
+	if( InterlockedDecrement(&pB->refs) == 0 ) free(pB);
+}
+
+// caller holds the lock
+static void Detach(TeeOutput *pO, const char *why)
+{
+	if( pO->fDetached ) return;
+
+	stderrMsg ( "Tee output %d detached: %s\n", pO->i, why );
+	pO->fDetached = true;
+	while( pO->count ) {
+		ReleaseBlock(pO->queue[pO->head]);
+		pO->head = (pO->head + 1) % TEE_QUEUE_BLOCKS;
+		--pO->count;
+	}
+	SetEvent(pO->hData);
+	SetEvent(pO->hSpace);
+}
+
+// caller holds the lock
+static void CloseOutput(TeeOutput *pO)
+{
+	if( pO->sock != INVALID_SOCKET ) {
+		shutdown(pO->sock, SD_SEND);
+		closesocket(pO->sock);
+		pO->sock = INVALID_SOCKET;
+	}
+	if( pO->hPipe ) {
+		CloseHandle(pO->hPipe);
+		pO->hPipe = NULL;
+	}
+}
+
+static bool WriteBlock(TeeOutput *pO, TeeBlock *pB)
+{
+	unsigned done = 0;
+
+	while( done < pB->n ) {
+		DWORD n;
+		if( pO->fPipe ) {
+			if( !WriteFile(pO->hPipe, pB->data + done, pB->n - done, &n, NULL) ) return false;
+		} else {
+			int r = send(pO->sock, pB->data + done, pB->n - done, 0);
+			if( r == SOCKET_ERROR ) return false;
+			n = r;
+		}
+		done += n;
+	}
+	pO->nBytes += done;
+	return true;
+}
+
+unsigned __stdcall TeeWriterThreadProc(void *pv)
+{
+	TeeOutput *pO = (TeeOutput *)pv;
+	Tee *pTee = pO->pTee;
+
+	// connect outside the lock, it may take a while
+	SOCKET sock = INVALID_SOCKET;
+	HANDLE hPipe = NULL;
+	if( pO->fPipe ) {
+		hPipe = CreateFile(pO->pipeName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if( hPipe == INVALID_HANDLE_VALUE ) hPipe = NULL;
+	} else {
+		sock = EndpointConnect(&pO->ep, false);
+	}
+
+	EnterCriticalSection(&pTee->cs);
+	pO->sock = sock;
+	pO->hPipe = hPipe;
+	if( sock == INVALID_SOCKET && hPipe == NULL ) {
+		Detach(pO, "can't connect");
+	}
+
+	for(;;) {
+		while( pO->count == 0 && !pTee->fEnd && !pO->fDetached && !pTee->fAbort ) {
+			LeaveCriticalSection(&pTee->cs);
+			WaitForSingleObject(pO->hData, INFINITE);
+			EnterCriticalSection(&pTee->cs);
+		}
+		if( pO->count == 0 || pO->fDetached || pTee->fAbort ) break;
+
+		TeeBlock *pB = pO->queue[pO->head];
+		pO->head = (pO->head + 1) % TEE_QUEUE_BLOCKS;
+		--pO->count;
+		LeaveCriticalSection(&pTee->cs);
+		SetEvent(pO->hSpace);
+
+		bool fOK = WriteBlock(pO, pB);
+		ReleaseBlock(pB);
+
+		EnterCriticalSection(&pTee->cs);
+		if( !fOK ) {
+			Detach(pO, "write failed");
+			break;
+		}
+	}
+
+	CloseOutput(pO);
+	LeaveCriticalSection(&pTee->cs);
+
+	_endthreadex(0);
+	return 0;
+}
+
+//
+// TeeCreate
+//
+// targets is the rest of the command segment after "tee"
+//
+Tee *TeeCreate(const char *targets)
+{
+	Tee *pTee = (Tee *)calloc(1, sizeof(Tee));
+	if( pTee == NULL ) {
+		stderrMsg ( "Tee calloc failed\n" );
+		return NULL;
+	}
+	InitializeCriticalSection(&pTee->cs);
+
+	const char *p = targets;
+	for(;;) {
+		while( *p == ' ' ) ++p;
+		if( *p == '\0' ) break;
+
+		char target[MAX_UNIX_PATH + 16];
+		size_t n = strcspn(p, " ");
+		if( n >= sizeof(target) || pTee->nOutputs == TEE_MAX_OUTPUTS ) goto bad;
+		memcpy(target, p, n);
+		target[n] = '\0';
+		p += n;
+
+		TeeOutput *pO = &pTee->out[pTee->nOutputs];
+		pO->pTee = pTee;
+		pO->i = pTee->nOutputs;
+		pO->sock = INVALID_SOCKET;
+
+		char *t = target;
+		pO->policy = TEE_BLOCK;
+		for( int k = 0; k < 3; ++k ) {
+			size_t len = strlen(policyNames[k]);
+			if( !strncmp(t, policyNames[k], len) && t[len] == ':' ) {
+				pO->policy = k;
+				t += len + 1;
+				break;
+			}
+		}
+
+		if( !strncmp(t, PIPE_PREFIX, strlen(PIPE_PREFIX)) ) {
+			t += strlen(PIPE_PREFIX);
+			if( *t == '\0' ) goto bad;
+			pO->fPipe = true;
+			_snprintf_s(pO->pipeName, sizeof(pO->pipeName), _TRUNCATE, "%s%s", PIPE_PATH_ROOT, t);
+		} else if( !EndpointParse(t, &pO->ep, false) || pO->ep.type == TRANSPORT_NONE ) {
+			goto bad;
+		}
+
+		pO->hData = CreateEvent(NULL, FALSE, FALSE, NULL);
+		pO->hSpace = CreateEvent(NULL, FALSE, FALSE, NULL);
+		++pTee->nOutputs;
+		if( pO->hData == NULL || pO->hSpace == NULL ) {
+			stderrMsg ( "Tee couldn't create events: %d\n", GetLastError() );
+			TeeFree(pTee);
+			return NULL;
+		}
+	}
+
+	if( pTee->nOutputs == 0 ) goto bad;
+	return pTee;
+
+bad:
+	stderrMsg ( "Bad tee targets: %s\n", targets );
+	TeeFree(pTee);
+	return NULL;
+}
+
+static void StartWriters(Tee *pTee)
+{
+	pTee->fStarted = true;
+
+	for( int i = 0; i < pTee->nOutputs; ++i ) {
+		TeeOutput *pO = &pTee->out[i];
+		pO->hThread = (HANDLE)_beginthreadex(NULL, 0, &TeeWriterThreadProc, pO, 0, NULL);
+		if( pO->hThread == NULL ) {
+			EnterCriticalSection(&pTee->cs);
+			Detach(pO, "can't start writer thread");
+			LeaveCriticalSection(&pTee->cs);
+		}
+	}
+}
+
+//
+// TeeWrite
+//
+// queue a buffer for every consumer. Only fails if the copy can't be allocated
+//
+bool TeeWrite(Tee *pTee, const char *pData, unsigned nData)
+{
+	TeeBlock *pB = NULL;
+
+	if( !pTee->fStarted ) StartWriters(pTee);
+	if( nData == 0 ) return true;
+
+	EnterCriticalSection(&pTee->cs);
+	for( int i = 0; i < pTee->nOutputs; ++i ) {
+		TeeOutput *pO = &pTee->out[i];
+
+		if( pO->count == TEE_QUEUE_BLOCKS && !pO->fDetached ) {
+			if( pO->policy == TEE_DROP ) {
+				++pO->nDropped;
+				continue;
+			}
+			if( pO->policy == TEE_DETACH ) {
+				Detach(pO, "too slow");
+				continue;
+			}
+
+			// block - the pump waits for this consumer
+			while( pO->count == TEE_QUEUE_BLOCKS && !pO->fDetached && !pTee->fAbort ) {
+				LeaveCriticalSection(&pTee->cs);
+				DWORD wr = WaitForSingleObject(pO->hSpace, TEE_BLOCK_TIMEOUT);
+				EnterCriticalSection(&pTee->cs);
+				if( wr == WAIT_TIMEOUT && pO->count == TEE_QUEUE_BLOCKS ) {
+					Detach(pO, "stalled");
+				}
+			}
+		}
+		if( pO->fDetached || pTee->fAbort ) continue;
+
+		// one copy, shared by every queue
+		if( pB == NULL ) {
+			pB = (TeeBlock *)malloc(sizeof(TeeBlock) + nData);
+			if( pB == NULL ) {
+				LeaveCriticalSection(&pTee->cs);
+				stderrMsg ( "Tee malloc of %u bytes failed\n", nData );
+				return false;
+			}
+			pB->refs = 1;
+			pB->n = nData;
+			memcpy(pB->data, pData, nData);
+		}
+
+		InterlockedIncrement(&pB->refs);
+		pO->queue[(pO->head + pO->count) % TEE_QUEUE_BLOCKS] = pB;
+		++pO->count;
+		SetEvent(pO->hData);
+	}
+	LeaveCriticalSection(&pTee->cs);
+
+	if( pB ) ReleaseBlock(pB);
+	return true;
+}
+
+//
+// TeeAbort
+//
+// the pipeline is being cancelled - stop waiting for consumers and drop what is queued
+//
+void TeeAbort(Tee *pTee)
+{
+	EnterCriticalSection(&pTee->cs);
+	pTee->fAbort = true;
+	for( int i = 0; i < pTee->nOutputs; ++i ) {
+		SetEvent(pTee->out[i].hData);
+		SetEvent(pTee->out[i].hSpace);
+	}
+	LeaveCriticalSection(&pTee->cs);
+}
+
+void TeeFree(Tee *pTee)
+{
+	if( pTee == NULL ) return;
+
+	HANDLE hThreads[TEE_MAX_OUTPUTS];
+	DWORD nThreads = 0;
+
+	// let the writers finish what's queued, then they close their outputs
+	EnterCriticalSection(&pTee->cs);
+	pTee->fEnd = true;
+	for( int i = 0; i < pTee->nOutputs; ++i ) {
+		if( pTee->out[i].hData ) SetEvent(pTee->out[i].hData);
+		if( pTee->out[i].hThread ) hThreads[nThreads++] = pTee->out[i].hThread;
+	}
+	LeaveCriticalSection(&pTee->cs);
+
+	if( nThreads && WaitForMultipleObjects(nThreads, hThreads, TRUE, pTee->fAbort ? 0 : TEE_DRAIN_TIMEOUT) == WAIT_TIMEOUT ) {
+		// closing a socket fails the send it is stuck in
+		EnterCriticalSection(&pTee->cs);
+		pTee->fAbort = true;
+		for( int i = 0; i < pTee->nOutputs; ++i ) {
+			TeeOutput *pO = &pTee->out[i];
+			if( pO->sock != INVALID_SOCKET ) {
+				closesocket(pO->sock);
+				pO->sock = INVALID_SOCKET;
+			}
+		}
+		LeaveCriticalSection(&pTee->cs);
+
+		if( WaitForMultipleObjects(nThreads, hThreads, TRUE, 100) == WAIT_TIMEOUT ) {
+			// a pipe write can't be interrupted
+			for( DWORD i = 0; i < nThreads; ++i ) {
+				if( WaitForSingleObject(hThreads[i], 0) == WAIT_TIMEOUT ) {
+					stderrMsg ( "Tee writer hasn't died, terminating it\n" );
+					TerminateThread(hThreads[i], 2);
+				}
+			}
+		}
+	}
+
+	for( int i = 0; i < pTee->nOutputs; ++i ) {
+		TeeOutput *pO = &pTee->out[i];
+
+		debugMsg ( "Tee output %d (%s) sent %I64u bytes, dropped %u buffers%s\n", i, policyNames[pO->policy],
+				   pO->nBytes, pO->nDropped, pO->fDetached ? ", detached" : "" );
+
+		CloseOutput(pO);
+		while( pO->count ) {
+			ReleaseBlock(pO->queue[pO->head]);
+			pO->head = (pO->head + 1) % TEE_QUEUE_BLOCKS;
+			--pO->count;
+		}
+		if( pO->hThread ) CloseHandle(pO->hThread);
+		if( pO->hData ) CloseHandle(pO->hData);
+		if( pO->hSpace ) CloseHandle(pO->hSpace);
+	}
+
+	DeleteCriticalSection(&pTee->cs);
+	free(pTee);
+}
@@ -0,0 +1,32 @@
+// swtee.h : @tee built-in stage - copy the stream to extra consumers
+//
+//   @tee [policy:]target [[policy:]target ...]
+//
+// passes the stream on unchanged and also sends it to each target, which is a port,
+// unix:path (see swtransport.h) or pipe:name for a named pipe \\.\pipe\name that the
+// consumer has created. Each target has a writer thread that connects to it and a queue
+// of TEE_QUEUE_BLOCKS buffers. A buffer is copied once and shared by all the queues.
+// When a consumer's queue is full its policy decides what happens:
+//
+//   block    the pump waits for the consumer (the default). After TEE_BLOCK_TIMEOUT
+//            the consumer is detached so one stuck reader can't hang the pipeline. In
+//            pool/daemon mode the waiting pump holds an engine thread
+//   drop     the buffer is dropped for this consumer only
+//   detach   the consumer is disconnected and gets nothing more
+//
+// e.g. socketwrapper -i 9000 -o 9001 -c "flac -dcs - | @tee drop:unix:C:\vis.sock | lame ..."
+//
+
+#pragma once
+
+#define  TEE_MAX_OUTPUTS     4
+#define  TEE_QUEUE_BLOCKS    32
+#define  TEE_BLOCK_TIMEOUT   10000   // ms a blocking consumer may hold up the pump
+#define  TEE_DRAIN_TIMEOUT   2000    // ms to let the writers finish when the stream ends
+
+typedef struct Tee Tee;
+
+Tee *TeeCreate( const char *targets );
+bool TeeWrite( Tee *pTee, const char *pData, unsigned nData );
+void TeeAbort( Tee *pTee );
+void TeeFree( Tee *pTee );
@@ -0,0 +1,141 @@
+// swtransport.cpp : connecting pipeline endpoints - see swtransport.h
+//
+
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swtransport.h"
+
+#define  UNIX_PREFIX      "unix:"
+#define  INHERITED_PREFIX "fd:"
+
+// afunix.h only comes with recent SDKs, the layout is fixed
+typedef struct
+{
+	u_short sun_family;
+	char sun_path[MAX_UNIX_PATH];
+} SockaddrUn;
+
+//
+// EndpointParse
+//
+// false if spec isn't a valid endpoint. A port of 0 gives TRANSPORT_NONE
+//
+bool EndpointParse(const char *spec, Endpoint *pE, bool fAllowInherited)
+{
+	char *end;
+
+	memset(pE, 0, sizeof(Endpoint));
+	pE->inherited = INVALID_SOCKET;
+
+	if( !strncmp(spec, UNIX_PREFIX, strlen(UNIX_PREFIX)) ) {
+		spec += strlen(UNIX_PREFIX);
+		if( *spec == '\0' || strlen(spec) >= MAX_UNIX_PATH ) {
+			stderrMsg( "Bad unix socket path: %s\n", spec );
+			return false;
+		}
+		pE->type = TRANSPORT_UNIX;
+		strcpy(pE->path, spec);
+		return true;
+	}
+
+	if( !strncmp(spec, INHERITED_PREFIX, strlen(INHERITED_PREFIX)) ) {
+		if( !fAllowInherited ) {
+			stderrMsg( "Inherited sockets can only be given on the command line\n" );
+			return false;
+		}
+		unsigned long h = strtoul(spec + strlen(INHERITED_PREFIX), &end, 0);
+		if( *end != '\0' || h == 0 ) {
+			stderrMsg( "Bad inherited socket: %s\n", spec );
+			return false;
+		}
+		pE->type = TRANSPORT_INHERITED;
+		pE->inherited = (SOCKET)h;
+		return true;
+	}
+
+	unsigned long port = strtoul(spec, &end, 10);
+	if( *spec == '\0' || *end != '\0' || port > 65535 ) {
+		stderrMsg( "Bad port: %s\n", spec );
+		return false;
+	}
+	pE->type = port ? TRANSPORT_TCP : TRANSPORT_NONE;
+	pE->port = (USHORT)port;
+	return true;
+}
+
+//
+// EndpointConnect
+//
+// returns a connected, blocking socket
+//
+SOCKET EndpointConnect(const Endpoint *pE, bool fOverlapped)
+{
+	char name[MAX_UNIX_PATH + 8];
+	EndpointName(pE, name, sizeof(name));
+
+	if( pE->type == TRANSPORT_INHERITED ) {
+		// already connected by our parent. Whether it is overlapped is up to them
+		if( fOverlapped ) {
+			stderrMsg( "Inherited socket %s can't be used by the pump engine\n", name );
+			return INVALID_SOCKET;
+		}
+		return pE->inherited;
+	}
+
+	int af = pE->type == TRANSPORT_UNIX ? AF_UNIX : AF_INET;
+	SOCKET sock = WSASocket(af, SOCK_STREAM, 0, NULL, 0, fOverlapped ? WSA_FLAG_OVERLAPPED : 0);
+	if (sock == INVALID_SOCKET) {
+		stderrMsg( "Socket creation error for %s: %d\n", name, WSAGetLastError());
+		return INVALID_SOCKET;
+	}
+
+	int iMode = 0;
+	ioctlsocket(sock, FIONBIO, (u_long FAR*) &iMode);
+
+	int rc;
+	if( pE->type == TRANSPORT_UNIX ) {
+		SockaddrUn addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, pE->path);
+		rc = connect(sock, (const sockaddr*)&addr, sizeof(addr));
+	} else {
+		struct sockaddr_in addr;
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(pE->port);
+
+		// the pumps write whole buffers, Nagle only delays the tail of each burst
+		BOOL fNoDelay = TRUE;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&fNoDelay, sizeof(fNoDelay));
+
+		rc = connect(sock, (const sockaddr*)&addr, sizeof(addr));
+	}
+
+	if (rc == SOCKET_ERROR) {
+		stderrMsg( "Socket connection error for %s: %d\n", name, WSAGetLastError());
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+const char *EndpointName(const Endpoint *pE, char *buf, size_t size)
+{
+	switch( pE->type ) {
+	case TRANSPORT_TCP:
+		_snprintf_s(buf, size, _TRUNCATE, "port %d", pE->port);
+		break;
+	case TRANSPORT_UNIX:
+		_snprintf_s(buf, size, _TRUNCATE, "%s%s", UNIX_PREFIX, pE->path);
+		break;
+	case TRANSPORT_INHERITED:
+		_snprintf_s(buf, size, _TRUNCATE, "%s%lu", INHERITED_PREFIX, (unsigned long)pE->inherited);
+		break;
+	default:
+		_snprintf_s(buf, size, _TRUNCATE, "none");
+		break;
+	}
+	return buf;
+}
@@ -0,0 +1,41 @@
+// swtransport.h : endpoints the input and output of a pipeline connect to
+//
+// An endpoint is given as
+//   port          TCP on localhost, as always (0 means none)
+//   unix:path     AF_UNIX stream socket. Needs Windows 10 1803 or later
+//   fd:handle     an already connected socket inherited from the parent, e.g. one end of
+//                 a socketpair. Only from the command line, not over the control socket.
+//                 Like any socket handle passed between processes it can be upset by
+//                 layered service providers (see Version 1.2/1.3)
+//
+// The TCP and AF_UNIX endpoints avoid handing sockets between processes - socketwrapper
+// makes the connection itself.
+//
+// Only these Windows transports are provided. socketwrapper is a Windows program (it's
+// built on Winsock, named pipes and completion ports), so AF_UNIX on Linux isn't here;
+// a Linux build would need a POSIX EndpointConnect and pump first.
+//
+
+#pragma once
+
+#define  MAX_UNIX_PATH    108     // sun_path in SOCKADDR_UN
+
+typedef enum
+{
+	TRANSPORT_NONE,
+	TRANSPORT_TCP,
+	TRANSPORT_UNIX,
+	TRANSPORT_INHERITED
+} TransportType;
+
+typedef struct
+{
+	TransportType type;
+	USHORT port;
+	char path[MAX_UNIX_PATH];
+	SOCKET inherited;
+} Endpoint;
+
+bool EndpointParse( const char *spec, Endpoint *pE, bool fAllowInherited );
+SOCKET EndpointConnect( const Endpoint *pE, bool fOverlapped );
+const char *EndpointName( const Endpoint *pE, char *buf, size_t size );
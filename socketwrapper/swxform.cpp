@@ -0,0 +1,586 @@
+// swxform.cpp : built-in PCM transform stages run by the pump threads
+//
+// Each stage consumes whole units (samples or frames) of its input. Any partial unit at
+// the end of a buffer is carried over and completed from the start of the next one, so
+// the stages don't depend on how the pipes happen to split the stream.
+//
+
+#include "stdafx.h"
+#include "socketwrapper.h"
+#include "swxform.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XFORM_SSE2
+#include <emmintrin.h>
+#endif
+
+#define CONVERT_BLOCK   256     // samples converted per pass through the int scratch buffer
+
+typedef struct
+{
+	const char *name;
+	unsigned width;
+	bool fSigned;
+	bool fFloat;
+	bool fBigEndian;
+} SampleFormat;
+
+enum { FMT_S8, FMT_U8, FMT_S16LE, FMT_S16BE, FMT_S24LE, FMT_S24BE, FMT_S32LE, FMT_S32BE, FMT_F32LE, FMT_COUNT };
+
+static const SampleFormat formats[FMT_COUNT] = {
+	{ "s8",    1, true,  false, false },
+	{ "u8",    1, false, false, false },
+	{ "s16le", 2, true,  false, false },
+	{ "s16be", 2, true,  false, true  },
+	{ "s24le", 3, true,  false, false },
+	{ "s24be", 3, true,  false, true  },
+	{ "s32le", 4, true,  false, false },
+	{ "s32be", 4, true,  false, true  },
+	{ "f32le", 4, true,  true,  false },
+};
+
+static int
+FindFormat( const char *name )
+{
+	for( int i = 0; i < FMT_COUNT; ++i ){
+		if( !strcmp(formats[i].name, name) ) return i;
+	}
+	return -1;
+}
+
+// parse a decimal byte count, with an optional k or M suffix
+static bool
+ParseBytes( const char *s, unsigned long long *pn )
+{
+	unsigned long long n = 0;
+
+	if( *s < '0' || *s > '9' ) return false;
+	while( *s >= '0' && *s <= '9' ) n = n * 10 + (*s++ - '0');
+
+	if( *s == 'k' || *s == 'K' ) { n <<= 10; ++s; }
+	else if( *s == 'M' ) { n <<= 20; ++s; }
+
+	*pn = n;
+	return *s == '\0';
+}
+
+static bool
+GrowOut( Xform *pX, unsigned n )
+{
+	if( n <= pX->outSize ) return true;
+
+	char *p = (char *)realloc( pX->pOut, n );
+	if( p == NULL ) {
+		stderrMsg ( "Built-in stage %s: realloc of %u bytes failed\n", pX->spec, n );
+		return false;
+	}
+	pX->pOut = p;
+	pX->outSize = n;
+	return true;
+}
+
+//
+// Kernels - each converts n whole units from pIn to pOut
+//
+
+static void
+SwapKernel( unsigned width, const unsigned char *pIn, unsigned char *pOut, unsigned n )
+{
+	unsigned i = 0;
+
+	switch( width ) {
+	case 2:
+#ifdef XFORM_SSE2
+		for( ; i + 8 <= n; i += 8 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i *)(pIn + 2 * i) );
+			v = _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+			_mm_storeu_si128( (__m128i *)(pOut + 2 * i), v );
+		}
+#endif
+		for( ; i < n; ++i ) {
+			pOut[2 * i]     = pIn[2 * i + 1];
+			pOut[2 * i + 1] = pIn[2 * i];
+		}
+		break;
+
+	case 3:
+		for( ; i < n; ++i ) {
+			pOut[3 * i]     = pIn[3 * i + 2];
+			pOut[3 * i + 1] = pIn[3 * i + 1];
+			pOut[3 * i + 2] = pIn[3 * i];
+		}
+		break;
+
+	case 4:
+#ifdef XFORM_SSE2
+		for( ; i + 4 <= n; i += 4 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i *)(pIn + 4 * i) );
+			v = _mm_shufflehi_epi16( _mm_shufflelo_epi16(v, 0xB1), 0xB1 );
+			v = _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+			_mm_storeu_si128( (__m128i *)(pOut + 4 * i), v );
+		}
+#endif
+		for( ; i < n; ++i ) {
+			pOut[4 * i]     = pIn[4 * i + 3];
+			pOut[4 * i + 1] = pIn[4 * i + 2];
+			pOut[4 * i + 2] = pIn[4 * i + 1];
+			pOut[4 * i + 3] = pIn[4 * i];
+		}
+		break;
+	}
+}
+
+static void
+ChmapKernel( const Xform *pX, const unsigned char *pIn, unsigned char *pOut, unsigned n )
+{
+	unsigned w = pX->width;
+	unsigned i = 0;
+
+#ifdef XFORM_SSE2
+	// the two maps we actually see in practice: mono to stereo, and swapping left and right
+	if( w == 2 && pX->nChannelsIn == 1 && pX->nChannelsOut == 2 && pX->map[0] == 0 && pX->map[1] == 0 ) {
+		for( ; i + 8 <= n; i += 8 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i *)(pIn + 2 * i) );
+			_mm_storeu_si128( (__m128i *)(pOut + 4 * i),      _mm_unpacklo_epi16(v, v) );
+			_mm_storeu_si128( (__m128i *)(pOut + 4 * i + 16), _mm_unpackhi_epi16(v, v) );
+		}
+	}
+	else if( w == 2 && pX->nChannelsIn == 2 && pX->nChannelsOut == 2 && pX->map[0] == 1 && pX->map[1] == 0 ) {
+		for( ; i + 4 <= n; i += 4 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i *)(pIn + 4 * i) );
+			v = _mm_shufflehi_epi16( _mm_shufflelo_epi16(v, 0xB1), 0xB1 );
+			_mm_storeu_si128( (__m128i *)(pOut + 4 * i), v );
+		}
+	}
+#endif
+
+	pIn  += i * pX->inUnit;
+	pOut += i * pX->outUnit;
+
+	for( ; i < n; ++i ) {
+		for( unsigned c = 0; c < pX->nChannelsOut; ++c ) {
+			if( pX->map[c] < 0 ) {
+				memset( pOut, 0, w );
+			} else {
+				const unsigned char *pSrc = pIn + pX->map[c] * w;
+				switch( w ) {
+				case 2:  pOut[0] = pSrc[0]; pOut[1] = pSrc[1]; break;
+				case 4:  memcpy( pOut, pSrc, 4 ); break;
+				default: memcpy( pOut, pSrc, w ); break;
+				}
+			}
+			pOut += w;
+		}
+		pIn += pX->inUnit;
+	}
+}
+
+static int
+FloatToInt( float f )
+{
+	double v = (double)f * 2147483648.0;
+	if( v >= 2147483647.0 ) return 0x7fffffff;
+	if( !(v > -2147483648.0) ) return (int)0x80000000;	// NaN too, as cvttps gives
+	return (int)v;
+}
+
+// decode samples to left-justified 32 bit integers
+static void
+DecodeSamples( int fmt, const unsigned char *p, int *pDst, unsigned n )
+{
+	const SampleFormat *f = &formats[fmt];
+	unsigned i = 0;
+
+#ifdef XFORM_SSE2
+	if( fmt == FMT_S16LE ) {
+		__m128i zero = _mm_setzero_si128();
+		for( ; i + 8 <= n; i += 8 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i *)(p + 2 * i) );
+			_mm_storeu_si128( (__m128i *)(pDst + i),     _mm_unpacklo_epi16(zero, v) );
+			_mm_storeu_si128( (__m128i *)(pDst + i + 4), _mm_unpackhi_epi16(zero, v) );
+		}
+	}
+	else if( fmt == FMT_F32LE ) {
+		// saturates as FloatToInt does: anything from 2^31 up converts to
+		// 0x80000000, which the compare mask flips to 0x7fffffff
+		__m128 scale = _mm_set1_ps( 2147483648.0f );
+		__m128 lo = _mm_set1_ps( -2147483648.0f );
+		for( ; i + 4 <= n; i += 4 ) {
+			__m128 v = _mm_mul_ps( _mm_loadu_ps((const float *)(p + 4 * i)), scale );
+			v = _mm_max_ps( v, lo );
+			__m128i over = _mm_castps_si128( _mm_cmpge_ps(v, scale) );
+			_mm_storeu_si128( (__m128i *)(pDst + i), _mm_xor_si128(_mm_cvttps_epi32(v), over) );
+		}
+	}
+#endif
+
+	for( ; i < n; ++i ) {
+		const unsigned char *s = p + i * f->width;
+		unsigned u = 0;
+
+		if( f->fFloat ) {
+			float fl;
+			memcpy( &fl, s, 4 );
+			pDst[i] = FloatToInt( fl );
+			continue;
+		}
+
+		if( f->fBigEndian ) {
+			for( unsigned b = 0; b < f->width; ++b ) u |= (unsigned)s[b] << (24 - 8 * b);
+		} else {
+			for( unsigned b = 0; b < f->width; ++b ) u |= (unsigned)s[b] << (32 - 8 * (f->width - b));
+		}
+		if( !f->fSigned ) u ^= 0x80000000;
+		pDst[i] = (int)u;
+	}
+}
+
+// encode left-justified 32 bit integers, truncating to the output width
+static void
+EncodeSamples( int fmt, const int *pSrc, unsigned char *p, unsigned n )
+{
+	const SampleFormat *f = &formats[fmt];
+	unsigned i = 0;
+
+#ifdef XFORM_SSE2
+	if( fmt == FMT_S16LE ) {
+		for( ; i + 8 <= n; i += 8 ) {
+			__m128i a = _mm_srai_epi32( _mm_loadu_si128((const __m128i *)(pSrc + i)), 16 );
+			__m128i b = _mm_srai_epi32( _mm_loadu_si128((const __m128i *)(pSrc + i + 4)), 16 );
+			_mm_storeu_si128( (__m128i *)(p + 2 * i), _mm_packs_epi32(a, b) );
+		}
+	}
+	else if( fmt == FMT_F32LE ) {
+		__m128 scale = _mm_set1_ps( 1.0f / 2147483648.0f );
+		for( ; i + 4 <= n; i += 4 ) {
+			__m128 v = _mm_cvtepi32_ps( _mm_loadu_si128((const __m128i *)(pSrc + i)) );
+			_mm_storeu_ps( (float *)(p + 4 * i), _mm_mul_ps(v, scale) );
+		}
+	}
+#endif
+
+	for( ; i < n; ++i ) {
+		unsigned char *d = p + i * f->width;
+
+		if( f->fFloat ) {
+			float fl = (float)pSrc[i] * (1.0f / 2147483648.0f);
+			memcpy( d, &fl, 4 );
+			continue;
+		}
+
+		unsigned u = (unsigned)pSrc[i];
+		if( !f->fSigned ) u ^= 0x80000000;
+
+		if( f->fBigEndian ) {
+			for( unsigned b = 0; b < f->width; ++b ) d[b] = (unsigned char)(u >> (24 - 8 * b));
+		} else {
+			for( unsigned b = 0; b < f->width; ++b ) d[b] = (unsigned char)(u >> (32 - 8 * (f->width - b)));
+		}
+	}
+}
+
+static void
+FormatKernel( const Xform *pX, const unsigned char *pIn, unsigned char *pOut, unsigned n )
+{
+	int tmp[CONVERT_BLOCK];
+
+	while( n ) {
+		unsigned k = n < CONVERT_BLOCK ? n : CONVERT_BLOCK;
+		DecodeSamples( pX->fmtIn, pIn, tmp, k );
+		EncodeSamples( pX->fmtOut, tmp, pOut, k );
+		pIn  += k * pX->inUnit;
+		pOut += k * pX->outUnit;
+		n -= k;
+	}
+}
+
+static void
+RunKernel( const Xform *pX, const unsigned char *pIn, unsigned char *pOut, unsigned n )
+{
+	switch( pX->type ) {
+	case XF_SWAP:   SwapKernel( pX->width, pIn, pOut, n ); break;
+	case XF_CHMAP:  ChmapKernel( pX, pIn, pOut, n ); break;
+	case XF_FORMAT: FormatKernel( pX, pIn, pOut, n ); break;
+	default: break;
+	}
+}
+
+//
+// Stages
+//
+
+// run a sample/frame stage over a buffer, carrying partial units between calls
+static char *
+RunUnits( Xform *pX, char *pIn, unsigned nIn, unsigned *pnOut )
+{
+	unsigned nUnits = (pX->nCarry + nIn) / pX->inUnit;
+
+	if( !GrowOut(pX, nUnits * pX->outUnit + 1) ) return NULL;
+
+	unsigned char *pOut = (unsigned char *)pX->pOut;
+
+	if( pX->nCarry ) {
+		unsigned need = pX->inUnit - pX->nCarry;
+		if( nIn < need ) {
+			memcpy( pX->carry + pX->nCarry, pIn, nIn );
+			pX->nCarry += nIn;
+			*pnOut = 0;
+			return pX->pOut;
+		}
+		memcpy( pX->carry + pX->nCarry, pIn, need );
+		RunKernel( pX, pX->carry, pOut, 1 );
+		pOut += pX->outUnit;
+		pIn += need;
+		nIn -= need;
+		pX->nCarry = 0;
+	}
+
+	unsigned n = nIn / pX->inUnit;
+	RunKernel( pX, (const unsigned char *)pIn, pOut, n );
+	pOut += n * pX->outUnit;
+
+	pX->nCarry = nIn - n * pX->inUnit;
+	memcpy( pX->carry, pIn + n * pX->inUnit, pX->nCarry );
+
+	*pnOut = (unsigned)(pOut - (unsigned char *)pX->pOut);
+	return pX->pOut;
+}
+
+static unsigned
+GetLE32( const unsigned char *p )
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+// skip RIFF/WAVE chunks up to and including the data chunk header
+static char *
+RunWavStrip( Xform *pX, char *pIn, unsigned nIn, unsigned *pnOut )
+{
+	while( nIn && !pX->fDone ) {
+
+		// skipping the body of an uninteresting chunk
+		if( pX->remaining ) {
+			unsigned n = pX->remaining < nIn ? (unsigned)pX->remaining : nIn;
+			pIn += n;
+			nIn -= n;
+			pX->remaining -= n;
+			continue;
+		}
+
+		unsigned need = pX->phase == 0 ? 12 : 8;
+		unsigned n = need - pX->nCarry;
+		if( n > nIn ) n = nIn;
+		memcpy( pX->carry + pX->nCarry, pIn, n );
+		pX->nCarry += n;
+		pIn += n;
+		nIn -= n;
+		if( pX->nCarry < need ) break;
+
+		if( pX->phase == 0 ) {
+			if( memcmp(pX->carry, "RIFF", 4) || memcmp(pX->carry + 8, "WAVE", 4) ) {
+				// not a wav file after all - pass everything through untouched
+				debugMsg ( "Built-in stage %s: no RIFF/WAVE header, passing data through\n", pX->spec );
+				if( !GrowOut(pX, 12 + nIn) ) return NULL;
+				memcpy( pX->pOut, pX->carry, 12 );
+				memcpy( pX->pOut + 12, pIn, nIn );
+				pX->fDone = true;
+				pX->nCarry = 0;
+				*pnOut = 12 + nIn;
+				return pX->pOut;
+			}
+			pX->phase = 1;
+		}
+		else {
+			unsigned size = GetLE32( pX->carry + 4 );
+			if( !memcmp(pX->carry, "data", 4) ) {
+				debugMsg ( "Built-in stage %s: data chunk found, %u bytes\n", pX->spec, size );
+				pX->fDone = true;
+			} else {
+				pX->remaining = size + (size & 1);
+			}
+		}
+		pX->nCarry = 0;
+	}
+
+	*pnOut = pX->fDone ? nIn : 0;
+	return pIn;
+}
+
+static char *
+XformStep( Xform *pX, char *pIn, unsigned nIn, unsigned *pnOut )
+{
+	unsigned n;
+
+	switch( pX->type ) {
+	case XF_SKIP:
+		n = pX->remaining < nIn ? (unsigned)pX->remaining : nIn;
+		pX->remaining -= n;
+		*pnOut = nIn - n;
+		return pIn + n;
+
+	case XF_LIMIT:
+		n = pX->remaining < nIn ? (unsigned)pX->remaining : nIn;
+		pX->remaining -= n;
+		if( pX->remaining == 0 ) pX->fDone = true;
+		*pnOut = n;
+		return pIn;
+
+	case XF_WAVSTRIP:
+		return RunWavStrip( pX, pIn, nIn, pnOut );
+
+	case XF_TEE:
+		if( !TeeWrite( pX->pTee, pIn, nIn ) ) return NULL;
+		*pnOut = nIn;
+		return pIn;
+
+	default:
+		return RunUnits( pX, pIn, nIn, pnOut );
+	}
+}
+
+//
+// XformRun
+//
+// Pass a buffer through a chain of stages. Returns the transformed data, which may be
+// the input buffer or a stage's scratch buffer and is valid until the next call, or NULL
+// on failure. *pfEnd is set once a stage has ended the stream.
+//
+char *
+XformRun( Xform *pX, char *pIn, unsigned nIn, unsigned *pnOut, bool *pfEnd )
+{
+	*pfEnd = false;
+
+	for( ; pX; pX = pX->pNext ) {
+		pIn = XformStep( pX, pIn, nIn, &nIn );
+		if( pIn == NULL ) return NULL;
+		if( pX->type == XF_LIMIT && pX->fDone ) *pfEnd = true;
+	}
+
+	*pnOut = nIn;
+	return pIn;
+}
+
+//
+// XformParse
+//
+// spec is a command segment without the leading XFORM_TOKEN, e.g. "chmap 16 1 0,0"
+//
+Xform *
+XformParse( const char *spec )
+{
+	char name[16] = "", a1[32] = "", a2[32] = "", a3[64] = "";
+	int nArgs = sscanf( spec, "%15s %31s %31s %63s", name, a1, a2, a3 ) - 1;
+
+	Xform *pX = (Xform *)calloc( 1, sizeof(Xform) );
+	if( pX == NULL ) {
+		stderrMsg ( "Xform calloc failed\n" );
+		return NULL;
+	}
+
+	while( *spec == ' ' ) ++spec;
+	strncpy( pX->spec, spec, sizeof(pX->spec) - 1 );
+	for( size_t n = strlen(pX->spec); n && pX->spec[n - 1] == ' '; --n ) pX->spec[n - 1] = '\0';
+
+	if( !strcmp(name, "swap") && nArgs == 1 ) {
+		int bits = atoi( a1 );
+		if( bits != 16 && bits != 24 && bits != 32 ) goto bad;
+		pX->type = XF_SWAP;
+		pX->width = pX->inUnit = pX->outUnit = bits / 8;
+	}
+	else if( !strcmp(name, "skip") && nArgs == 1 ) {
+		pX->type = XF_SKIP;
+		if( !ParseBytes(a1, &pX->remaining) ) goto bad;
+	}
+	else if( !strcmp(name, "limit") && nArgs == 1 ) {
+		pX->type = XF_LIMIT;
+		if( !ParseBytes(a1, &pX->remaining) ) goto bad;
+		pX->fDone = (pX->remaining == 0);
+	}
+	else if( !strcmp(name, "tee") && nArgs >= 1 ) {
+		pX->type = XF_TEE;
+		pX->pTee = TeeCreate( spec + strlen(name) );
+		if( pX->pTee == NULL ) {
+			free( pX );
+			return NULL;
+		}
+	}
+	else if( !strcmp(name, "wavstrip") && nArgs == 0 ) {
+		pX->type = XF_WAVSTRIP;
+	}
+	else if( !strcmp(name, "chmap") && nArgs == 3 ) {
+		int bits = atoi( a1 );
+		int nIn = atoi( a2 );
+		if( (bits != 8 && bits != 16 && bits != 24 && bits != 32) || nIn < 1 || nIn > XFORM_MAX_CHANNELS ) goto bad;
+
+		pX->type = XF_CHMAP;
+		pX->width = bits / 8;
+		pX->nChannelsIn = nIn;
+
+		for( const char *p = a3; *p; ) {
+			if( pX->nChannelsOut == XFORM_MAX_CHANNELS ) goto bad;
+			int c = -1;
+			if( *p == '-' ) {
+				++p;
+			} else if( *p >= '0' && *p <= '9' ) {
+				c = atoi( p );
+				while( *p >= '0' && *p <= '9' ) ++p;
+				if( c >= nIn ) goto bad;
+			} else {
+				goto bad;
+			}
+			pX->map[pX->nChannelsOut++] = c;
+			if( *p == ',' ) ++p;
+			else if( *p ) goto bad;
+		}
+		if( pX->nChannelsOut == 0 ) goto bad;
+
+		pX->inUnit  = pX->width * pX->nChannelsIn;
+		pX->outUnit = pX->width * pX->nChannelsOut;
+	}
+	else if( !strcmp(name, "format") && nArgs == 2 ) {
+		pX->type = XF_FORMAT;
+		pX->fmtIn  = FindFormat( a1 );
+		pX->fmtOut = FindFormat( a2 );
+		if( pX->fmtIn < 0 || pX->fmtOut < 0 ) goto bad;
+		pX->inUnit  = formats[pX->fmtIn].width;
+		pX->outUnit = formats[pX->fmtOut].width;
+	}
+	else {
+		goto bad;
+	}
+
+	return pX;
+
+bad:
+	stderrMsg ( "Unknown or malformed built-in stage \"%c%s\"\n", XFORM_TOKEN, pX->spec );
+	free( pX );
+	return NULL;
+}
+
+void
+XformFree( Xform *pX )
+{
+	while( pX ) {
+		Xform *pNext = pX->pNext;
+		if( pX->nCarry && pX->type != XF_WAVSTRIP ) {
+			debugMsg ( "Built-in stage %s dropped %u trailing bytes of a partial sample\n", pX->spec, pX->nCarry );
+		}
+		if( pX->pOut ) free( pX->pOut );
+		TeeFree( pX->pTee );
+		free( pX );
+		pX = pNext;
+	}
+}
+
+//
+// XformAbort
+//
+// the pipeline is being cancelled, so nothing should wait for a consumer any more
+//
+void
+XformAbort( Xform *pX )
+{
+	for( ; pX; pX = pX->pNext ) {
+		if( pX->pTee ) TeeAbort( pX->pTee );
+	}
+}
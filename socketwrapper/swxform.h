@@ -0,0 +1,69 @@
+// swxform.h : built-in PCM transform stages
+//
+// A command segment starting with XFORM_TOKEN is not spawned as a process. Instead it
+// is parsed into an Xform and run by a pump thread on the buffers it is already moving,
+// which saves a process, two pipes and a copy per stage. Consecutive built-in stages
+// are chained on the same pump.
+//
+//   @swap <bits>              byte-swap each 16, 24 or 32 bit sample
+//   @skip <bytes>             discard a fixed size header
+//   @wavstrip                 discard a RIFF/WAVE header up to the start of the data chunk
+//   @chmap <bits> <in> <map>  build output frames from input channels, e.g. "@chmap 16 1 0,0"
+//                             upmixes mono to stereo and "@chmap 16 2 1,0" swaps L/R.
+//                             A '-' in the map produces a silent channel.
+//   @format <from> <to>       convert samples between s8 u8 s16le s16be s24le s24be
+//                             s32le s32be f32le
+//   @limit <bytes>            pass at most this many bytes, then end the stream
+//   @tee <targets>            also send the stream to other consumers, see swtee.h
+//
+// @buffer <size> [<rate>] is also written like a built-in stage but runs as a step of its
+// own, see swring.h, and a final @pace <rate> [<burst>] holds the output socket to a bit
+// rate, see swpace.h
+//
+// e.g. socketwrapper -c "flac -dcs --force-raw-format --endian=little --sign=signed song.flac | @chmap 16 1 0,0 | @swap 16"
+
+#pragma once
+
+#include "swtee.h"
+
+#define XFORM_TOKEN         '@'
+#define XFORM_MAX_CHANNELS  8
+#define XFORM_MAX_WIDTH     4
+#define XFORM_MAX_UNIT      (XFORM_MAX_CHANNELS * XFORM_MAX_WIDTH)
+
+typedef enum {
+	XF_SWAP,
+	XF_SKIP,
+	XF_WAVSTRIP,
+	XF_CHMAP,
+	XF_FORMAT,
+	XF_LIMIT,
+	XF_TEE
+} XformType;
+
+typedef struct Xform
+{
+	XformType type;
+	unsigned inUnit;				// bytes consumed per unit (sample or frame)
+	unsigned outUnit;				// bytes produced per unit
+	unsigned width;					// sample width in bytes
+	unsigned nChannelsIn;
+	unsigned nChannelsOut;
+	int map[XFORM_MAX_CHANNELS];	// source channel for each output channel, -1 for silence
+	int fmtIn, fmtOut;				// indexes into the sample format table
+	unsigned long long remaining;	// bytes left to skip or pass for @skip/@limit
+	unsigned char carry[XFORM_MAX_UNIT];	// partial unit held over to the next buffer
+	unsigned nCarry;
+	int phase;						// @wavstrip parser state
+	bool fDone;						// @wavstrip found the data chunk / @limit reached
+	char *pOut;						// output scratch buffer, grown on demand
+	unsigned outSize;
+	Tee *pTee;						// @tee consumers
+	char spec[64];					// as given on the command line, for debug output
+	struct Xform *pNext;
+} Xform;
+
+Xform *XformParse( const char *spec );
+void XformFree( Xform *pX );
+void XformAbort( Xform *pX );
+char *XformRun( Xform *pX, char *pIn, unsigned nIn, unsigned *pnOut, bool *pfEnd );
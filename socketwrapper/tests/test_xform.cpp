@@ -0,0 +1,483 @@
+// test_xform.cpp : the built-in stages (see swxform.h) against plain reference loops
+//
+// Each case is a chain of stages as they'd be written after the '@'s in a command. A
+// known stream goes through XformRun the way a pump would call it, cut into pieces of a
+// byte each, of a few bytes, and of random sizes up to a few thousand, so samples and
+// frames are split at every odd point, and what comes out has to be the stream the
+// reference loops here make of the whole thing at once. @format is run from and to
+// every sample format, from floats past full scale, infinities and NaNs too.
+//
+// The Makefile builds this twice, as test_xform and as test_xform_scalar with __SSE2__
+// undefined so swxform.cpp takes its one-sample-at-a-time paths, and both have to match
+// the references.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Winsock2.h>
+#include "../../pcmsink/tests/testutil.h"
+#include "../socketwrapper.h"
+#include "../swxform.h"
+
+#define STREAM_BYTES  24000
+#define MAX_GROWTH    8       // most a stage makes of a byte: @chmap 8 1 to 8 channels
+
+BOOL bDebug = FALSE;
+BOOL bDebugVerbose = FALSE;
+
+void stderrMsg( const char *fmt, ... ) {}
+void debugMsg( const char *fmt, ... ) {}
+
+// no @tee here
+Tee *TeeCreate( const char *targets ) { return NULL; }
+bool TeeWrite( Tee *pTee, const char *pData, unsigned nData ) { return true; }
+void TeeAbort( Tee *pTee ) {}
+void TeeFree( Tee *pTee ) {}
+
+static const struct
+{
+	const char *name;
+	unsigned width;
+	bool fSigned;
+	bool fFloat;
+	bool fBigEndian;
+} refFormats[] = {
+	{ "s8",    1, true,  false, false },
+	{ "u8",    1, false, false, false },
+	{ "s16le", 2, true,  false, false },
+	{ "s16be", 2, true,  false, true  },
+	{ "s24le", 3, true,  false, false },
+	{ "s24be", 3, true,  false, true  },
+	{ "s32le", 4, true,  false, false },
+	{ "s32be", 4, true,  false, true  },
+	{ "f32le", 4, true,  true,  false },
+};
+#define REF_FORMATS  (int)(sizeof(refFormats) / sizeof(refFormats[0]))
+
+static int
+RefFormat( const char *name )
+{
+	for( int i = 0; i < REF_FORMATS; ++i ){
+		if( !strcmp(refFormats[i].name, name) ) return i;
+	}
+	return -1;
+}
+
+// a sample as a fraction of full scale times 2^31, floats saturating and NaN at the bottom
+static long long
+RefLoad( int fmt, const unsigned char *p )
+{
+	if( refFormats[fmt].fFloat ) {
+		float f;
+		memcpy( &f, p, 4 );
+		double v = (double)f * 2147483648.0;
+		if( v >= 2147483647.0 ) return 2147483647;
+		if( isnan(v) || v <= -2147483648.0 ) return -2147483648LL;
+		return (long long)v;
+	}
+
+	unsigned w = refFormats[fmt].width;
+	unsigned long long u = 0;
+	for( unsigned b = 0; b < w; ++b ){
+		unsigned byte = refFormats[fmt].fBigEndian ? p[b] : p[w - 1 - b];
+		u = (u << 8) | byte;
+	}
+	long long v = (long long)u;
+	if( refFormats[fmt].fSigned ) {
+		if( u >> (8 * w - 1) ) v -= 1LL << (8 * w);
+	} else {
+		v -= 1LL << (8 * w - 1);
+	}
+	return v << (32 - 8 * w);
+}
+
+// the top bits of it, or a float
+static void
+RefStore( int fmt, long long v, unsigned char *p )
+{
+	if( refFormats[fmt].fFloat ) {
+		float f = (float)((double)v / 2147483648.0);
+		memcpy( p, &f, 4 );
+		return;
+	}
+
+	unsigned w = refFormats[fmt].width;
+	long long top = v >> (32 - 8 * w);		// arithmetic, rounds down
+	if( !refFormats[fmt].fSigned ) top += 1LL << (8 * w - 1);
+	for( unsigned b = 0; b < w; ++b ){
+		unsigned char byte = (unsigned char)(top >> (8 * b));
+		p[refFormats[fmt].fBigEndian ? w - 1 - b : b] = byte;
+	}
+}
+
+// the RIFF/WAVE header up to the data chunk's taken off, or nothing if it isn't all
+// there; anything that isn't RIFF/WAVE is left alone
+static size_t
+RefWavStrip( const unsigned char *p, size_t n, unsigned char *pOut )
+{
+	if( n < 12 ) return 0;
+	if( memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4) ) {
+		memcpy( pOut, p, n );
+		return n;
+	}
+	for( size_t pos = 12; pos + 8 <= n; ){
+		unsigned long long size = p[pos + 4] | p[pos + 5] << 8 | p[pos + 6] << 16 | (unsigned)p[pos + 7] << 24;
+		if( !memcmp(p + pos, "data", 4) ) {
+			memcpy( pOut, p + pos + 8, n - pos - 8 );
+			return n - pos - 8;
+		}
+		unsigned long long next = pos + 8 + size + (size & 1);
+		if( next > n ) break;
+		pos = (size_t)next;
+	}
+	return 0;
+}
+
+// one stage of a case, *pfEnd set if it's a @limit the stream reached
+static size_t
+RefStage( const char *spec, const unsigned char *p, size_t n, unsigned char *pOut, bool *pfEnd )
+{
+	char name[16] = "", a1[32] = "", a2[32] = "", a3[64] = "";
+	sscanf( spec, "%15s %31s %31s %63s", name, a1, a2, a3 );
+
+	if( !strcmp(name, "swap") ) {
+		unsigned w = atoi(a1) / 8;
+		size_t units = n / w;
+		for( size_t i = 0; i < units; ++i ){
+			for( unsigned b = 0; b < w; ++b ) pOut[i * w + b] = p[i * w + w - 1 - b];
+		}
+		return units * w;
+	}
+	if( !strcmp(name, "limit") ) {
+		char *pEnd;
+		size_t limit = (size_t)strtoull( a1, &pEnd, 10 );
+		if( *pEnd == 'k' || *pEnd == 'K' ) limit <<= 10;
+		else if( *pEnd == 'M' ) limit <<= 20;
+		*pfEnd = n >= limit;
+		n = n < limit ? n : limit;
+		memcpy( pOut, p, n );
+		return n;
+	}
+	if( !strcmp(name, "wavstrip") ) {
+		return RefWavStrip( p, n, pOut );
+	}
+	if( !strcmp(name, "chmap") ) {
+		unsigned w = atoi(a1) / 8;
+		unsigned nIn = atoi(a2);
+		int map[16];
+		unsigned nOut = 0;
+		for( const char *q = a3; *q; ){
+			map[nOut++] = *q == '-' ? -1 : atoi(q);
+			while( *q && *q != ',' ) ++q;
+			if( *q == ',' ) ++q;
+		}
+		size_t frames = n / (w * nIn);
+		unsigned char *d = pOut;
+		for( size_t i = 0; i < frames; ++i ){
+			for( unsigned c = 0; c < nOut; ++c ){
+				if( map[c] < 0 ) memset( d, 0, w );
+				else memcpy( d, p + (i * nIn + map[c]) * w, w );
+				d += w;
+			}
+		}
+		return d - pOut;
+	}
+	if( !strcmp(name, "format") ) {
+		int from = RefFormat(a1), to = RefFormat(a2);
+		unsigned wIn = refFormats[from].width, wOut = refFormats[to].width;
+		size_t samples = n / wIn;
+		for( size_t i = 0; i < samples; ++i ){
+			RefStore( to, RefLoad(from, p + i * wIn), pOut + i * wOut );
+		}
+		return samples * wOut;
+	}
+	return 0;
+}
+
+// the whole stream through the references
+static size_t
+Reference( const char **specs, int nSpecs, const unsigned char *pIn, size_t nIn, unsigned char *pOut, bool *pfEnd )
+{
+	size_t cbMax = nIn;
+	for( int s = 0; s < nSpecs; ++s ) cbMax *= MAX_GROWTH;
+	unsigned char *a = new unsigned char[cbMax + 1];
+	unsigned char *b = new unsigned char[cbMax + 1];
+
+	memcpy( a, pIn, nIn );
+	size_t n = nIn;
+	*pfEnd = false;
+	for( int s = 0; s < nSpecs; ++s ){
+		bool fEnd = false;
+		n = RefStage( specs[s], a, n, b, &fEnd );
+		*pfEnd = *pfEnd || fEnd;
+		unsigned char *t = a; a = b; b = t;
+	}
+	memcpy( pOut, a, n );
+	delete [] a;
+	delete [] b;
+	return n;
+}
+
+// the stream through XformRun in pieces: a byte at a time (nSplit 0), 1 to 7 bytes
+// (1), or mostly a few thousand with runs of small ones (2)
+static size_t
+Run( const char **specs, int nSpecs, const unsigned char *pIn, size_t nIn, int nSplit, unsigned nSeed,
+	 unsigned char *pOut, bool *pfEnd )
+{
+	Xform *pChain = NULL, **ppNext = &pChain;
+	for( int s = 0; s < nSpecs; ++s ){
+		Xform *pX = XformParse( specs[s] );
+		CHECK( pX != NULL );
+		if( pX == NULL ) {
+			XformFree( pChain );
+			return 0;
+		}
+		*ppNext = pX;
+		ppNext = &pX->pNext;
+	}
+
+	char *pPiece = new char[nIn + 1];
+	size_t nOut = 0;
+	*pfEnd = false;
+	for( size_t pos = 0; pos < nIn && !*pfEnd; ){
+		size_t n = 1;
+		if( nSplit == 1 ) {
+			n = Random(&nSeed) % 7 + 1;
+		} else if( nSplit == 2 ) {
+			n = Random(&nSeed) % 4 ? Random(&nSeed) % 4000 + 1 : Random(&nSeed) % 7 + 1;
+		}
+		if( n > nIn - pos ) n = nIn - pos;
+
+		// a buffer of its own, as a pump's would be
+		memcpy( pPiece, pIn + pos, n );
+		unsigned nPieceOut;
+		char *p = XformRun( pChain, pPiece, (unsigned)n, &nPieceOut, pfEnd );
+		CHECK( p != NULL );
+		if( p == NULL ) break;
+		memcpy( pOut + nOut, p, nPieceOut );
+		nOut += nPieceOut;
+		pos += n;
+	}
+
+	delete [] pPiece;
+	XformFree( pChain );
+	return nOut;
+}
+
+static void
+Fill( unsigned char *p, size_t n, unsigned nSeed )
+{
+	for( size_t i = 0; i < n; ++i ) p[i] = (unsigned char)Random(&nSeed);
+}
+
+// floats, mostly within full scale, with the ones at and past its edges among them
+static void
+FillFloats( unsigned char *p, size_t n, unsigned nSeed )
+{
+	static const float edges[] = {
+		0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f, 0.99999994f, -0.99999994f, 1.0000001f,
+		-1.0000001f, 2.0f, -2.0f, 1e30f, -1e30f, INFINITY, -INFINITY, NAN, -NAN,
+		4.656613e-10f, -4.656613e-10f, 1e-40f, 2147483520.0f / 2147483648.0f
+	};
+	for( size_t i = 0; i + 4 <= n; i += 4 ){
+		float f;
+		if( Random(&nSeed) % 3 == 0 ) {
+			f = edges[Random(&nSeed) % (sizeof(edges) / sizeof(edges[0]))];
+		} else {
+			f = (float)(((int)Random(&nSeed) / 2147483648.0) * 1.2);
+		}
+		memcpy( p + i, &f, 4 );
+	}
+}
+
+static void
+PutLE( unsigned char *p, unsigned v, int nBytes )
+{
+	for( int i = 0; i < nBytes; ++i ) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+// a WAV header with a fmt chunk and an odd sized LIST chunk ahead of the data
+static size_t
+PutWavHeader( unsigned char *p )
+{
+	memcpy( p, "RIFF\0\0\0\0WAVEfmt ", 16 );
+	PutLE( p + 16, 16, 4 );
+	memset( p + 20, 0x11, 16 );
+	memcpy( p + 36, "LIST", 4 );
+	PutLE( p + 40, 7, 4 );
+	memset( p + 44, 0x22, 8 );			// 7 and a pad byte
+	memcpy( p + 52, "data", 4 );
+	PutLE( p + 56, 0x7FFFFFF0, 4 );		// streamed, so the size is a guess
+	return 60;
+}
+
+// runs a case every way it's split, against the reference
+static void
+TestCase( const char **specs, int nSpecs, const unsigned char *pIn, size_t nIn )
+{
+	size_t cbMax = nIn;
+	for( int s = 0; s < nSpecs; ++s ) cbMax *= MAX_GROWTH;
+	unsigned char *pExpected = new unsigned char[cbMax + 1];
+	unsigned char *pOut = new unsigned char[cbMax + 1];
+
+	bool fRefEnd;
+	size_t nExpected = Reference( specs, nSpecs, pIn, nIn, pExpected, &fRefEnd );
+
+	for( int nSplit = 0; nSplit < 3; ++nSplit ){
+		bool fEnd;
+		size_t nOut = Run( specs, nSpecs, pIn, nIn, nSplit, 0x9E3779B9 + nSplit, pOut, &fEnd );
+		if( nOut != nExpected || memcmp(pOut, pExpected, nOut) != 0 || fEnd != fRefEnd ) {
+			fprintf( stderr, "test_xform:" );
+			for( int s = 0; s < nSpecs; ++s ) fprintf( stderr, " @%s", specs[s] );
+			if( nOut == nExpected && fEnd == fRefEnd ) {
+				fprintf( stderr, " split %d: differs from the reference\n", nSplit );
+			} else {
+				fprintf( stderr, " split %d: %zu bytes%s, not %zu%s\n", nSplit, nOut, fEnd ? " and ended" : "",
+						 nExpected, fRefEnd ? " and ended" : "" );
+			}
+			g_nFailures++;
+		}
+	}
+
+	delete [] pExpected;
+	delete [] pOut;
+}
+
+static void
+TestCase( const char *spec, const unsigned char *pIn, size_t nIn )
+{
+	TestCase( &spec, 1, pIn, nIn );
+}
+
+static void
+TestSwap( const unsigned char *pIn )
+{
+	// a partial sample at the end is dropped
+	TestCase( "swap 16", pIn, STREAM_BYTES - 1 );
+	TestCase( "swap 24", pIn, STREAM_BYTES - 2 );
+	TestCase( "swap 32", pIn, STREAM_BYTES - 3 );
+}
+
+static void
+TestChmap( const unsigned char *pIn )
+{
+	static const char *specs[] = {
+		"chmap 16 1 0,0", "chmap 16 2 1,0", "chmap 16 2 0,1,-,1", "chmap 8 3 2,-,0,1",
+		"chmap 24 2 1,0", "chmap 24 1 0,-,0", "chmap 32 6 0,1,2,3,4,5,5,5", "chmap 16 8 7",
+	};
+	for( size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); ++i ){
+		TestCase( specs[i], pIn, STREAM_BYTES - 5 );
+	}
+}
+
+static void
+TestFormat( const unsigned char *pIn, const unsigned char *pFloats )
+{
+	for( int from = 0; from < REF_FORMATS; ++from ){
+		for( int to = 0; to < REF_FORMATS; ++to ){
+			char spec[32];
+			snprintf( spec, sizeof(spec), "format %s %s", refFormats[from].name, refFormats[to].name );
+			TestCase( spec, refFormats[from].fFloat ? pFloats : pIn, STREAM_BYTES - 1 );
+		}
+	}
+}
+
+static void
+TestWavStrip( const unsigned char *pIn )
+{
+	unsigned char *pWav = new unsigned char[STREAM_BYTES + 64];
+	size_t nHeader = PutWavHeader( pWav );
+	memcpy( pWav + nHeader, pIn, STREAM_BYTES );
+
+	TestCase( "wavstrip", pWav, nHeader + STREAM_BYTES );
+	TestCase( "wavstrip", pWav, nHeader );				// nothing after the header
+	TestCase( "wavstrip", pWav, 47 );					// cut off in the LIST chunk
+	TestCase( "wavstrip", pWav, 11 );					// not even the RIFF header
+	TestCase( "wavstrip", pIn, STREAM_BYTES );			// no header, passed through
+	memcpy( pWav + 8, "AVI ", 4 );
+	TestCase( "wavstrip", pWav, nHeader + STREAM_BYTES );
+
+	delete [] pWav;
+}
+
+static void
+TestLimit( const unsigned char *pIn )
+{
+	TestCase( "limit 0", pIn, STREAM_BYTES );
+	TestCase( "limit 1", pIn, STREAM_BYTES );
+	TestCase( "limit 12345", pIn, STREAM_BYTES );
+	TestCase( "limit 23k", pIn, STREAM_BYTES );
+	TestCase( "limit 24000", pIn, STREAM_BYTES );		// exactly the stream
+	TestCase( "limit 1M", pIn, STREAM_BYTES );			// more than there is
+}
+
+// what a pump chains together for a mono WAV going out as big endian float stereo
+static void
+TestChain( const unsigned char *pIn )
+{
+	unsigned char *pWav = new unsigned char[STREAM_BYTES + 64];
+	size_t nHeader = PutWavHeader( pWav );
+	memcpy( pWav + nHeader, pIn, STREAM_BYTES );
+
+	static const char *chain[] = { "wavstrip", "chmap 16 1 0,0", "format s16le f32le", "swap 32", "limit 54321" };
+	TestCase( chain, 5, pWav, nHeader + STREAM_BYTES );
+	TestCase( chain, 4, pWav, nHeader + STREAM_BYTES );
+	static const char *down[] = { "format s24be s16le", "chmap 16 2 1,0", "limit 9999" };
+	TestCase( down, 3, pIn, STREAM_BYTES );
+
+	delete [] pWav;
+}
+
+// the references against a few values worked out by hand
+static void
+TestReference()
+{
+	unsigned char in[8], out[16];
+	bool fEnd;
+	const char *spec;
+
+	memcpy( in, "\x01\x02\x03\x04\x05\x06", 6 );
+	spec = "swap 24";
+	CHECK( Reference(&spec, 1, in, 6, out, &fEnd) == 6 && !memcmp(out, "\x03\x02\x01\x06\x05\x04", 6) );
+
+	float f = 1.0f;
+	memcpy( in, &f, 4 );
+	f = NAN;
+	memcpy( in + 4, &f, 4 );
+	spec = "format f32le s16be";
+	CHECK( Reference(&spec, 1, in, 8, out, &fEnd) == 4 && !memcmp(out, "\x7f\xff\x80\x00", 4) );
+
+	memcpy( in, "\x00\x80\xff\x7f", 4 );
+	spec = "format s16le u8";
+	CHECK( Reference(&spec, 1, in, 4, out, &fEnd) == 2 && out[0] == 0x00 && out[1] == 0xff );
+	spec = "format s16le f32le";
+	CHECK( Reference(&spec, 1, in, 4, out, &fEnd) == 8 );
+	memcpy( &f, out, 4 );
+	CHECK( f == -1.0f );
+
+	memcpy( in, "\x01\x02\x03\x04", 4 );
+	spec = "chmap 16 2 1,-,0";
+	CHECK( Reference(&spec, 1, in, 4, out, &fEnd) == 6 && !memcmp(out, "\x03\x04\x00\x00\x01\x02", 6) );
+}
+
+int
+main( int argc, char **argv )
+{
+	unsigned char *pIn = new unsigned char[STREAM_BYTES];
+	unsigned char *pFloats = new unsigned char[STREAM_BYTES];
+	Fill( pIn, STREAM_BYTES, 0x2545F491 );
+	FillFloats( pFloats, STREAM_BYTES, 0x6C078965 );
+
+	TestReference();
+	TestSwap( pIn );
+	TestChmap( pIn );
+	TestFormat( pIn, pFloats );
+	TestWavStrip( pIn );
+	TestLimit( pIn );
+	TestChain( pIn );
+
+	delete [] pIn;
+	delete [] pFloats;
+	return Failures( "test_xform" );
+}
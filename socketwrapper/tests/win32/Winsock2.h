@@ -0,0 +1,12 @@
+// Winsock2.h : just enough of the Windows headers for swxform.cpp to build on Linux
+//
+// stdafx.h pulls in Winsock2.h, tchar.h and io.h. The stages only need BOOL, for
+// socketwrapper.h, so the other two are empty. See ../Makefile.
+//
+
+#pragma once
+
+typedef int BOOL;
+
+#define TRUE  1
+#define FALSE 0
@@ -0,0 +1 @@
+// io.h : empty, see Winsock2.h
@@ -0,0 +1 @@
+// tchar.h : empty, see Winsock2.h
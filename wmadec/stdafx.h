@@ -12,6 +12,7 @@
 #define _WIN32_WINNT 0x0500
 
 #include "wmsdk.h"
+#include <mmreg.h>
 #include <iostream>
 #include <tchar.h>
 #include <io.h>
@@ -0,0 +1,61 @@
+// fuzz_probe.cpp : a libFuzzer entry point over WMAProbe::Parse
+//
+// Parse is meant to take anything, so every input is parsed, looked up in and printed,
+// and whatever the ASFInfo points at has to be inside the input. Built by `make fuzz`
+// with clang's -fsanitize=fuzzer, or linked into test_probe, which runs it under gcc's
+// sanitizers on mutations of a good header and on any files it's given.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../wmaprobe.h"
+
+static void
+Fail(const char* pszWhat) {
+  fprintf(stderr, "fuzz_probe: %s\n", pszWhat);
+  abort();
+}
+
+static bool
+Inside(const unsigned char* p, size_t cb, const unsigned char* pData, size_t cbData) {
+  return p >= pData && cb <= cbData && p - pData <= (ptrdiff_t)(cbData - cb);
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput(const unsigned char* pData, size_t cbData) {
+  static FILE* pNull = fopen("/dev/null", "w");
+
+  WMAProbe probe;
+  probe.Parse(pData, cbData);
+  const ASFInfo& info = probe.GetInfo();
+
+  const ASFString* apStrings[5] = {
+    &info.title, &info.author, &info.copyright, &info.description, &info.rating
+  };
+  for (int i = 0; i < 5; i++) {
+    if (apStrings[i]->pText && !Inside(apStrings[i]->pText, apStrings[i]->cbText, pData, cbData)) {
+      Fail("a string runs outside the input");
+    }
+  }
+  if (info.pIndex && (info.cnsIndexInterval == 0 ||
+                      !Inside(info.pIndex, 6 * (size_t)info.dwIndexEntries, pData, cbData))) {
+    Fail("the index runs outside the input");
+  }
+  if (info.nStreams > PROBE_MAX_STREAMS || info.nAudioStreams > info.nStreams) {
+    Fail("more streams than there can be");
+  }
+
+  static const unsigned long long times[] = { 0, 1, 10000000, 0xFFFFFFFFFFFFFFFFULL };
+  for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++) {
+    ASFIndexEntry entry;
+    unsigned long long qwOffset;
+    probe.Lookup(times[i], &entry, &qwOffset);
+  }
+  probe.GetDurationMs();
+  if (pNull) {
+    probe.Print(pNull, "fuzz");
+  }
+  return 0;
+}
@@ -0,0 +1,278 @@
+// test_probe.cpp : WMAProbe on a header built here, then fuzz_probe's entry point on it
+//
+// A small ASF file is put together object by object: header, File Properties, a WMA Pro
+// stream with a channel mask, Content Description, data and Simple Index. Parse has to
+// read back what went in, and Lookup find the packets. Then MUTATIONS copies of it with
+// bytes, sizes and lengths corrupted go through LLVMFuzzerTestOneInput, each in a buffer
+// of exactly its size so the sanitizers see any read past the end.
+//
+//   test_probe                  all that
+//   test_probe FILE...          just the entry point over each file, to replay what a
+//                               libFuzzer run found
+//   test_probe --seed FILE      writes the file built here, to start a corpus with
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "../wmaprobe.h"
+#include "../../pcmsink/tests/testutil.h"
+
+#define MUTATIONS     200000
+#define PACKET_SIZE   64
+#define PACKETS       20
+#define INDEX_ENTRIES 5
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* pData, size_t cbData);
+
+static const unsigned char guidHeader[16] = {
+  0x30, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidFileProperties[16] = {
+  0xA1, 0xDC, 0xAB, 0x8C, 0x47, 0xA9, 0xCF, 0x11, 0x8E, 0xE4, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65
+};
+static const unsigned char guidStreamProperties[16] = {
+  0x91, 0x07, 0xDC, 0xB7, 0xB7, 0xA9, 0xCF, 0x11, 0x8E, 0xE6, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65
+};
+static const unsigned char guidContentDescription[16] = {
+  0x33, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidData[16] = {
+  0x36, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidSimpleIndex[16] = {
+  0x90, 0x08, 0x00, 0x33, 0xB1, 0xE5, 0xCF, 0x11, 0x89, 0xF4, 0x00, 0xA0, 0xC9, 0x03, 0x49, 0xCB
+};
+static const unsigned char guidAudioMedia[16] = {
+  0x40, 0x9E, 0x69, 0xF8, 0x4D, 0x5B, 0xCF, 0x11, 0xA8, 0xFD, 0x00, 0x80, 0x5F, 0x5C, 0x44, 0x2B
+};
+
+static unsigned char*
+PutLE(unsigned char* p, unsigned long long v, int nBytes) {
+  for (int i = 0; i < nBytes; i++) {
+    *p++ = (unsigned char)(v >> (8 * i));
+  }
+  return p;
+}
+
+// an object's GUID and a size to be filled in by EndObject
+static unsigned char*
+StartObject(unsigned char* p, const unsigned char* pGuid) {
+  memcpy(p, pGuid, 16);
+  return p + 24;
+}
+
+static void
+EndObject(unsigned char* pStart, unsigned char* pEnd) {
+  PutLE(pStart + 16, pEnd - pStart, 8);
+}
+
+static unsigned char*
+PutString(unsigned char* p, const char* psz) {
+  for (; *psz; psz++) {
+    p = PutLE(p, (unsigned char)*psz, 2);
+  }
+  return p;
+}
+
+// returns its size
+static size_t
+BuildFile(unsigned char* pFile) {
+  unsigned char* p = StartObject(pFile, guidHeader);
+  p = PutLE(p, 3, 4);                         // child objects
+  *p++ = 1;
+  *p++ = 2;
+
+  unsigned char* pObject = p;
+  p = StartObject(p, guidFileProperties);
+  memset(p, 0, 104 - 24);
+  PutLE(pObject + 40, 123456, 8);             // file size
+  PutLE(pObject + 56, PACKETS, 8);
+  PutLE(pObject + 64, 1234567890, 8);         // play duration, 100ns
+  PutLE(pObject + 80, 3100, 8);               // preroll, ms
+  PutLE(pObject + 88, 2, 4);                  // seekable
+  PutLE(pObject + 92, PACKET_SIZE, 4);
+  PutLE(pObject + 96, PACKET_SIZE, 4);
+  PutLE(pObject + 100, 192000, 4);
+  p = pObject + 104;
+  EndObject(pObject, p);
+
+  pObject = p;
+  p = StartObject(p, guidStreamProperties);
+  memcpy(p, guidAudioMedia, 16);
+  memset(p + 16, 0, 24);                      // error correction GUID, time offset
+  p += 40;
+  p = PutLE(p, 36, 4);                        // type data
+  p = PutLE(p, 0, 4);                         // error correction data
+  p = PutLE(p, 0x8000 | 2, 2);                // encrypted, stream 2
+  p = PutLE(p, 0, 4);
+  p = PutLE(p, 0x162, 2);                     // WMA Pro
+  p = PutLE(p, 6, 2);
+  p = PutLE(p, 48000, 4);
+  p = PutLE(p, 24000, 4);
+  p = PutLE(p, 4096, 2);
+  p = PutLE(p, 24, 2);
+  p = PutLE(p, 18, 2);                        // extra bytes
+  p = PutLE(p, 24, 2);
+  p = PutLE(p, 0x3F, 4);                      // channel mask
+  memset(p, 0, 12);
+  p += 12;
+  EndObject(pObject, p);
+
+  pObject = p;
+  p = StartObject(p, guidContentDescription);
+  p = PutLE(p, 10, 2);                        // "Title" in UTF-16
+  p = PutLE(p, 4, 2);
+  p = PutLE(p, 0, 2);
+  p = PutLE(p, 0, 2);
+  p = PutLE(p, 0, 2);
+  p = PutString(p, "Title");
+  p = PutString(p, "Me");
+  EndObject(pObject, p);
+  EndObject(pFile, p);
+
+  pObject = p;
+  p = StartObject(p, guidData);
+  memset(p, 0, 26 + PACKETS * PACKET_SIZE);
+  PutLE(p + 16, PACKETS, 8);
+  p += 26 + PACKETS * PACKET_SIZE;
+  EndObject(pObject, p);
+
+  pObject = p;
+  p = StartObject(p, guidSimpleIndex);
+  memset(p, 0, 16);
+  p += 16;
+  p = PutLE(p, 30000000, 8);                  // 3s between entries
+  p = PutLE(p, 4, 4);
+  p = PutLE(p, INDEX_ENTRIES, 4);
+  for (int i = 0; i < INDEX_ENTRIES; i++) {
+    p = PutLE(p, 4 * i, 4);
+    p = PutLE(p, 1, 2);
+  }
+  EndObject(pObject, p);
+
+  return p - pFile;
+}
+
+static void
+TestParse(const unsigned char* pFile, size_t cbFile) {
+  WMAProbe probe;
+  CHECK(probe.Parse(pFile, cbFile) == PROBE_OK);
+  const ASFInfo& info = probe.GetInfo();
+  CHECK(info.qwFileSize == 123456);
+  CHECK(info.qwDataPackets == PACKETS);
+  CHECK(probe.GetDurationMs() == 123456 - 3100);
+  CHECK(info.dwMaxBitrate == 192000);
+  CHECK(info.nStreams == 1 && info.nAudioStreams == 1);
+  CHECK(info.wAudioStream == 2 && info.bEncrypted);
+  CHECK(info.wFormatTag == 0x162 && info.nChannels == 6 && info.dwSampleRate == 48000);
+  CHECK(info.nBitsPerSample == 24 && info.dwChannelMask == 0x3F);
+  CHECK(info.title.cbText == 10 && memcmp(info.title.pText, "T\0i\0t\0l\0e\0", 10) == 0);
+  CHECK(info.author.cbText == 4 && info.copyright.cbText == 0);
+  CHECK(info.dwIndexEntries == INDEX_ENTRIES && info.cnsIndexInterval == 30000000);
+
+  // entry 2 is at 6s, packet 8, whose offset follows from the fixed packet size
+  ASFIndexEntry entry;
+  unsigned long long qwOffset;
+  CHECK(probe.Lookup(60000000 + 5, &entry, &qwOffset));
+  CHECK(entry.dwPacket == 8 && entry.wPacketCount == 1);
+  CHECK(qwOffset == info.qwDataOffset + 8 * PACKET_SIZE);
+  CHECK(probe.Lookup(~0ULL, &entry, NULL) && entry.dwPacket == 4 * (INDEX_ENTRIES - 1));
+
+  // cut short in the header: what's there, but not OK
+  CHECK(probe.Parse(pFile, 200) == PROBE_ERR_TRUNCATED);
+  CHECK(probe.GetInfo().qwDataPackets == PACKETS);
+  CHECK(probe.Parse(pFile, 20) == PROBE_ERR_NOT_ASF);
+}
+
+static void
+Fuzz(const unsigned char* pFile, size_t cbFile) {
+  unsigned nSeed = 1;
+  unsigned char* pCopy = new unsigned char[cbFile];
+  for (int i = 0; i < MUTATIONS; i++) {
+    memcpy(pCopy, pFile, cbFile);
+    size_t cb = cbFile;
+    int nChanges = Random(&nSeed) % 4 + 1;
+    for (int c = 0; c < nChanges; c++) {
+      size_t nAt = Random(&nSeed) % cb;
+      switch (Random(&nSeed) % 5) {
+        case 0:
+          pCopy[nAt] ^= (unsigned char)(1 << (Random(&nSeed) % 8));
+          break;
+        case 1:
+          pCopy[nAt] = (unsigned char)Random(&nSeed);
+          break;
+        case 2: {
+          // a size or count somewhere near the edges
+          static const unsigned long long values[] = {
+            0, 1, 23, 24, 30, 56, 78, 104, 0x7FFFFFFF, 0xFFFFFFFF, ~0ULL, ~0ULL / 6 + 1
+          };
+          unsigned long long v = values[Random(&nSeed) % (sizeof(values) / sizeof(values[0]))];
+          int nBytes = 1 << (Random(&nSeed) % 4);
+          if (nAt + nBytes <= cb) {
+            PutLE(pCopy + nAt, v, nBytes);
+          }
+          break;
+        }
+        case 3:
+          cb = nAt + 1;
+          break;
+        default:
+          pCopy[nAt] = pCopy[Random(&nSeed) % cb];
+          break;
+      }
+    }
+    // exactly cb bytes, so reading past them is caught
+    unsigned char* pInput = (unsigned char*)malloc(cb);
+    memcpy(pInput, pCopy, cb);
+    LLVMFuzzerTestOneInput(pInput, cb);
+    free(pInput);
+  }
+  delete [] pCopy;
+  printf("%d mutations parsed\n", MUTATIONS);
+}
+
+static bool
+ReadFile(const char* pszName, unsigned char** ppData, size_t* pcbData) {
+  FILE* pFile = fopen(pszName, "rb");
+  if (!pFile) {
+    return false;
+  }
+  fseek(pFile, 0, SEEK_END);
+  long cb = ftell(pFile);
+  rewind(pFile);
+  *ppData = (unsigned char*)malloc(cb > 0 ? cb : 1);
+  *pcbData = fread(*ppData, 1, cb > 0 ? cb : 0, pFile);
+  fclose(pFile);
+  return true;
+}
+
+int
+main(int argc, char** argv) {
+  unsigned char file[4096];
+  size_t cbFile = BuildFile(file);
+
+  if (argc == 3 && strcmp(argv[1], "--seed") == 0) {
+    FILE* pFile = fopen(argv[2], "wb");
+    CHECK(pFile && fwrite(file, 1, cbFile, pFile) == cbFile);
+    if (pFile) {
+      fclose(pFile);
+    }
+    return Failures("test_probe");
+  }
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      unsigned char* pData;
+      size_t cbData;
+      CHECK(ReadFile(argv[i], &pData, &cbData));
+      if (g_nFailures == 0) {
+        LLVMFuzzerTestOneInput(pData, cbData);
+        free(pData);
+      }
+    }
+    return Failures("test_probe");
+  }
+
+  TestParse(file, cbFile);
+  Fuzz(file, cbFile);
+  return Failures("test_probe");
+}
@@ -0,0 +1,193 @@
+// test_source.cpp : WMASource against a plain copy of its input
+//
+// The same few MB of noise go through a WMASource as a mapped file, as a file read in
+// blocks (by mapping nothing), and down a pipe written in pieces of random size by a
+// thread of its own. Each gets thousands of random reads and seeks, small ones as the
+// reader makes and ones bigger than a block, and everything read has to match the copy.
+//
+// For the pipe, seeks from the end or past the end of the data fail, and a seek back
+// can fail once it's left the window. Whatever the pipe has read ahead, the window
+// always still holds the last SOURCE_WINDOW / 2 bytes before the furthest the reads
+// have got to, so seeks back that far have to work.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../wmasource.h"
+#include "../../pcmsink/pcmthread.h"
+#include "../../pcmsink/tests/testutil.h"
+
+#define DATA_SIZE (3 * SOURCE_WINDOW + 12345)
+#define OPS       20000
+
+static unsigned char* g_pData;
+
+struct PipeWriter {
+  int fd;
+  unsigned nSeed;
+};
+
+static void
+WritePipe(void* pv) {
+  PipeWriter* pWriter = (PipeWriter*)pv;
+  size_t nDone = 0;
+  while (nDone < DATA_SIZE) {
+    size_t n = Random(&pWriter->nSeed) % 100000 + 1;
+    if (n > DATA_SIZE - nDone) {
+      n = DATA_SIZE - nDone;
+    }
+    ssize_t nWritten = write(pWriter->fd, g_pData + nDone, n);
+    if (nWritten <= 0) {
+      break;
+    }
+    nDone += nWritten;
+  }
+  close(pWriter->fd);
+}
+
+static size_t
+ReadSize(unsigned* pSeed) {
+  return Random(pSeed) % 4 ? Random(pSeed) % 4096 : Random(pSeed) % (2 * SOURCE_BLOCK);
+}
+
+// the file modes: any position can be sought to, past the end included
+static void
+TestFile(int fd, unsigned long long qwMaxMap, unsigned long long qwStart) {
+  lseek(fd, (off_t)qwStart, SEEK_SET);
+  WMASource source;
+  CHECK(source.Open(fd, qwMaxMap));
+  CHECK(source.IsSeekable());
+  CHECK(source.GetSize() == DATA_SIZE);
+
+  unsigned char* pBuf = new unsigned char[2 * SOURCE_BLOCK];
+  unsigned long long qwPos = qwStart;
+  unsigned nSeed = (unsigned)(qwMaxMap + qwStart + 1);
+  int nBad = 0;
+  for (int i = 0; i < OPS; i++) {
+    if (Random(&nSeed) % 3 == 0) {
+      long long llTarget = Random(&nSeed) % (DATA_SIZE + 100);
+      int nOrigin = Random(&nSeed) % 3;
+      long long llMove = nOrigin == SOURCE_SEEK_SET ? llTarget :
+                         nOrigin == SOURCE_SEEK_CUR ? llTarget - (long long)qwPos :
+                         llTarget - DATA_SIZE;
+      unsigned long long qwNew;
+      if (!source.Seek(llMove, nOrigin, &qwNew) || qwNew != (unsigned long long)llTarget) {
+        nBad++;
+      }
+      qwPos = llTarget;
+    }
+    size_t cb = ReadSize(&nSeed);
+    size_t cbWanted = qwPos >= DATA_SIZE ? 0 :
+                      cb < DATA_SIZE - qwPos ? cb : (size_t)(DATA_SIZE - qwPos);
+    size_t cbRead;
+    if (!source.Read(pBuf, cb, &cbRead) || cbRead != cbWanted ||
+        memcmp(pBuf, g_pData + qwPos, cbRead) != 0) {
+      nBad++;
+    }
+    qwPos += cbRead;
+  }
+  CHECK(nBad == 0);
+  CHECK(!source.Seek(-1, SOURCE_SEEK_SET, NULL));
+  CHECK(!source.Seek(-(long long)DATA_SIZE - 1, SOURCE_SEEK_END, NULL));
+  delete [] pBuf;
+}
+
+static void
+TestPipe() {
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  PipeWriter writer = { fds[1], 7 };
+  PCMThread thread;
+  CHECK(thread.Start(WritePipe, &writer));
+
+  WMASource source;
+  CHECK(source.Open(fds[0]));
+  CHECK(!source.IsSeekable());
+  CHECK(source.GetSize() == 0);
+  CHECK(!source.Seek(0, SOURCE_SEEK_END, NULL));
+
+  unsigned char* pBuf = new unsigned char[2 * SOURCE_BLOCK];
+  unsigned long long qwPos = 0, qwFurthest = 0;
+  unsigned nSeed = 11;
+  int nBad = 0, nBack = 0, nGone = 0;
+  for (int i = 0; i < OPS; i++) {
+    unsigned r = Random(&nSeed) % 8;
+    if (r == 0) {
+      // back, within the half window that's always kept, or anywhere
+      unsigned long long qwFloor = qwFurthest > SOURCE_WINDOW / 2 ?
+                                   qwFurthest - SOURCE_WINDOW / 2 : 0;
+      bool bKept = Random(&nSeed) % 2 && qwPos >= qwFloor;
+      if (!bKept) {
+        qwFloor = 0;
+      }
+      long long llTarget = (long long)(qwFloor + Random(&nSeed) % (qwPos - qwFloor + 1));
+      unsigned long long qwNew;
+      if (source.Seek(llTarget - (long long)qwPos, SOURCE_SEEK_CUR, &qwNew)) {
+        nBad += qwNew != (unsigned long long)llTarget;
+        qwPos = llTarget;
+        nBack++;
+      }
+      else {
+        nBad += bKept;
+        nGone++;
+      }
+    }
+    else if (r == 1) {
+      // forward, reading and skipping
+      long long llTarget = (long long)qwPos + Random(&nSeed) % 50000;
+      bool bDone = source.Seek(llTarget, SOURCE_SEEK_SET, NULL);
+      nBad += bDone != (llTarget <= DATA_SIZE);
+      if (bDone) {
+        qwPos = llTarget;
+      }
+    }
+    size_t cb = ReadSize(&nSeed);
+    size_t cbWanted = qwPos >= DATA_SIZE ? 0 :
+                      cb < DATA_SIZE - qwPos ? cb : (size_t)(DATA_SIZE - qwPos);
+    size_t cbRead;
+    if (!source.Read(pBuf, cb, &cbRead) || cbRead != cbWanted ||
+        memcmp(pBuf, g_pData + qwPos, cbRead) != 0) {
+      nBad++;
+    }
+    qwPos += cbRead;
+    if (qwPos > qwFurthest) {
+      qwFurthest = qwPos;
+    }
+  }
+  CHECK(nBad == 0);
+  CHECK(qwFurthest == DATA_SIZE);
+  // both kinds of seek back happened
+  CHECK(nBack > 0);
+  CHECK(nGone > 0);
+  thread.Join();
+  close(fds[0]);
+  delete [] pBuf;
+}
+
+int
+main() {
+  g_pData = new unsigned char[DATA_SIZE];
+  unsigned nSeed = 1;
+  for (size_t i = 0; i < DATA_SIZE; i++) {
+    g_pData[i] = (unsigned char)(Random(&nSeed) >> 5);
+  }
+
+  char szName[] = "/tmp/test_sourceXXXXXX";
+  int fd = mkstemp(szName);
+  CHECK(fd >= 0);
+  unlink(szName);
+  CHECK(write(fd, g_pData, DATA_SIZE) == DATA_SIZE);
+
+  TestFile(fd, SOURCE_MAX_MAP, 0);
+  TestFile(fd, 0, 0);
+  // reads start where the descriptor is
+  TestFile(fd, SOURCE_MAX_MAP, 1000);
+  TestFile(fd, 0, SOURCE_BLOCK + 1000);
+  close(fd);
+
+  TestPipe();
+
+  delete [] g_pData;
+  return Failures("test_source");
+}
@@ -38,18 +38,35 @@
 
 #include "stdafx.h"
 #include "getopt.h"
+#include "wmasource.h"
+#include "wmaprobe.h"
+#include "../pcmsink/pcmsink.h"
+#include "../pcmsink/pcmwriter.h"
+#include "../pcmsink/pcmchmap.h"
+#include "../pcmsink/pcmresample.h"
 
 #define ONE_SECOND (QWORD)10000000
-static char* gOptionStr = "dqhwb:r:n:o:l:";
-#define STREAM_BUFFER_SIZE 1024
+
+// How far the user clock lets the reader run ahead of what it has given us.
+// The step grows while the output ring stays below CLOCK_FILL_LOW percent
+// full and shrinks once it passes CLOCK_FILL_HIGH
+#define CLOCK_MIN_STEP  (ONE_SECOND / 8)
+#define CLOCK_MAX_STEP  (ONE_SECOND * 16)
+#define CLOCK_FILL_LOW  25
+#define CLOCK_FILL_HIGH 75
+static char* gOptionStr = "dqhwb:r:n:o:l:Q:D:s:e:f:m:O:";
+#define NO_END (QWORD)-1
 
 DWORD dwTotalSize = 0;
 BOOL bDebug = FALSE;
+int nResampleQuality = RESAMPLE_QUALITY_DEFAULT;
+PCMDitherMode ditherMode = DITHER_TPDF;
 
 class WMAStream : public IStream {
 public:
 
   WMAStream(FILE* pFile);
+  HRESULT Open();
 
   // IUnknown methods
   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject);
@@ -103,15 +120,26 @@ protected:
 
   LONG    m_cRef;
   FILE*   m_pFile;
-  BYTE    m_pBuf[STREAM_BUFFER_SIZE];
-  size_t    m_lBytes;
-  size_t    m_lPosition;
+  WMASource m_Source;
 };
 
 WMAStream::WMAStream(FILE* pFile) 
   :  m_pFile(pFile) {
   m_cRef = 0;
-  m_lBytes = m_lPosition = 0;
+}
+
+HRESULT
+WMAStream::Open() {
+  HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(m_pFile));
+  if (hFile == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Can't get a handle for the input\n");
+    return E_INVALIDARG;
+  }
+  m_Source.SetDebug(bDebug != FALSE);
+  if (!m_Source.Open(hFile)) {
+    return E_FAIL;
+  }
+  return S_OK;
 }
 
 WMAStream::~WMAStream() {
@@ -161,26 +189,27 @@ WMAStream::Release() {
 HRESULT STDMETHODCALLTYPE 
 WMAStream::Read(void *pv, ULONG cb, ULONG *pcbRead) {
 
-  size_t numread = fread(pv, sizeof(char), (size_t)cb, m_pFile);
-
+  size_t cbRead;
+  bool bRead = m_Source.Read(pv, cb, &cbRead);
   if (pcbRead) {
-    *pcbRead = (ULONG)numread;
-  }
-
-  if (ferror(m_pFile)) {
-    fprintf(stderr, "Reading from stream failed with error %d\n", 
-            ferror(m_pFile));
-    return S_FALSE;
+    *pcbRead = (ULONG)cbRead;
   }
 
-  return S_OK;
+  return bRead ? S_OK : S_FALSE;
 }
 
 HRESULT STDMETHODCALLTYPE 
 WMAStream::Seek(LARGE_INTEGER dlibMove, 
                 DWORD dwOrigin, 
                 ULARGE_INTEGER *plibNewPosition) {
-  return E_FAIL;
+  unsigned long long qwPos;
+  if (!m_Source.Seek(dlibMove.QuadPart, (int)dwOrigin, &qwPos)) {
+    return STG_E_INVALIDFUNCTION;
+  }
+  if (plibNewPosition) {
+    plibNewPosition->QuadPart = qwPos;
+  }
+  return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE 
@@ -193,7 +222,7 @@ WMAStream::Stat(STATSTG *pstatstg, DWORD grfStatFlag) {
   memset(pstatstg, 0, sizeof(STATSTG));
   
   pstatstg->type = STGTY_STREAM;
-  pstatstg->cbSize.LowPart = 0;
+  pstatstg->cbSize.QuadPart = m_Source.GetSize();
 
   return S_OK;
 }
@@ -201,14 +230,22 @@ WMAStream::Stat(STATSTG *pstatstg, DWORD grfStatFlag) {
 class WMAReader : public IWMReaderCallback, IWMReaderCallbackAdvanced {
 public:
   WMAReader(WORD wBitsPerSample,
+            BOOL bFloat,
             DWORD dwSamplesPerSec,
             DWORD dwNumChannels);
 
   // Two versions, one that takes a file (or URL) name, the other that
   // takes a stream. The stream path is currently used when getting
   // input from stdin.
-  HRESULT Decode(LPCSTR lpInput, FILE* pOutput);
-  HRESULT Decode(IStream* lpInput, FILE* pOutput); 
+  HRESULT Decode(LPCSTR lpInput, PCMWriter* pOutput);
+  HRESULT Decode(IStream* lpInput, PCMWriter* pOutput); 
+
+  // Only decode the output frames from qwStart up to qwEnd. The reader
+  // is started at qwStart, and what it gives us either side is trimmed
+  void SetWindow(QWORD qwStart, QWORD qwEnd) {
+    m_qwStartFrame = qwStart;
+    m_qwEndFrame = qwEnd;
+  }
 
   // IUnknown methods
   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject);
@@ -266,31 +303,47 @@ public:
 
 protected:
   ~WMAReader();
-  HRESULT Init(FILE* pOutput);
+  HRESULT Init(PCMWriter* pOutput);
   HRESULT StartReading();
+  HRESULT WriteOutput(BYTE* pBuf, DWORD cbBuf);
+  QWORD NextClockStep();
+  double GetSpeed(QWORD cnsTime);
 
   LONG m_cRef;
   BOOL m_bInited;
 
   WORD m_wBitsPerSample;
+  BOOL m_bFloat;
   DWORD m_dwSamplesPerSec;
   DWORD m_dwNumChannels;
-  BOOL m_bMakeStereo;
+  PCMChannelMap m_ChannelMap;
+  PCMResampler m_Resampler;
   
   IWMReader* m_pReader;
   IWMReaderAdvanced* m_pReaderAdvanced;
-  FILE* m_pOutput;
+  PCMWriter* m_pOutput;
   HANDLE m_hEvent;
   HRESULT m_hrAsync;
   DWORD m_dwOutputNum;
   QWORD m_qwReaderTime;
+  QWORD m_cnsClockStep;
+  LARGE_INTEGER m_liStarted;  // performance counter at WMT_STARTED
+  QWORD m_cnsDecoded;         // media time reached so far
+
+  QWORD m_qwStartFrame;
+  QWORD m_qwEndFrame;
+  QWORD m_cnsStart;           // where the reader was started
+  QWORD m_qwFramePos;         // output frame the next sample starts at
+  BOOL m_bPosKnown;
+  BOOL m_bWindowDone;         // past m_qwEndFrame, the rest is dropped
 };
 
 WMAReader::WMAReader(WORD wBitsPerSample,
+                     BOOL bFloat,
                      DWORD dwSamplesPerSec,
                      DWORD dwNumChannels)
-  : m_wBitsPerSample(wBitsPerSample), m_dwSamplesPerSec(dwSamplesPerSec),
-  m_dwNumChannels(dwNumChannels) {
+  : m_wBitsPerSample(wBitsPerSample), m_bFloat(bFloat),
+  m_dwSamplesPerSec(dwSamplesPerSec), m_dwNumChannels(dwNumChannels) {
   m_cRef = 0;
   m_pReader = NULL;
   m_pReaderAdvanced = NULL;
@@ -299,7 +352,15 @@ WMAReader::WMAReader(WORD wBitsPerSample,
   m_hrAsync = S_OK;
   m_dwOutputNum = -1;
   m_qwReaderTime = (QWORD)0;
-  m_bMakeStereo = FALSE;
+  m_cnsClockStep = ONE_SECOND;
+  m_liStarted.QuadPart = 0;
+  m_cnsDecoded = 0;
+  m_qwStartFrame = 0;
+  m_qwEndFrame = NO_END;
+  m_cnsStart = 0;
+  m_qwFramePos = 0;
+  m_bPosKnown = FALSE;
+  m_bWindowDone = FALSE;
 }
 
 WMAReader::~WMAReader() {
@@ -360,7 +421,7 @@ WMAReader::Release() {
 }
 
 HRESULT
-WMAReader::Init(FILE* pOutput) {
+WMAReader::Init(PCMWriter* pOutput) {
   HRESULT hr = S_OK;
   if (!m_bInited) {
     hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
@@ -389,10 +450,23 @@ WMAReader::Init(FILE* pOutput) {
               hr);
       return hr;
     }
-    m_pOutput = pOutput;
     m_bInited = TRUE;
   }
 
+  // In a batch the reader is kept from one input to the next, so only
+  // what belongs to the last input starts again
+  m_pOutput = pOutput;
+  m_dwOutputNum = -1;
+  m_hrAsync = S_OK;
+  m_qwReaderTime = 0;
+  m_cnsClockStep = ONE_SECOND;
+  m_cnsDecoded = 0;
+  m_cnsStart = 0;
+  m_qwFramePos = 0;
+  m_bPosKnown = FALSE;
+  m_bWindowDone = FALSE;
+  ResetEvent(m_hEvent);
+
   return hr;
 }
 
@@ -408,10 +482,20 @@ WMAReader::OnSample(DWORD dwOutputNum,
     fprintf(stderr, "cnsSampleTime: [%d]\n", cnsSampleTime);
   }
 
-  if (dwOutputNum != m_dwOutputNum) {
+  if (dwOutputNum != m_dwOutputNum || m_bWindowDone) {
     return S_OK;
   }
 
+  // After a seek the reader starts wherever it can, which is usually a
+  // little before where we asked. The first sample says where that is
+  if (!m_bPosKnown) {
+    if (m_qwStartFrame > 0 || m_qwEndFrame != NO_END) {
+      m_qwFramePos = (cnsSampleTime * m_dwSamplesPerSec + ONE_SECOND / 2) /
+                     ONE_SECOND;
+    }
+    m_bPosKnown = TRUE;
+  }
+
   BYTE *pData = NULL;
   DWORD cbData = 0;
   HRESULT hr = pSample->GetBufferAndLength(&pData, &cbData);
@@ -423,43 +507,70 @@ WMAReader::OnSample(DWORD dwOutputNum,
     BYTE *pWriteBuf = pData;
     DWORD dwSize = cbData;
 
-    // If we've got to convert from mono to stereo, we need to
-    // allocate and copy. The hope is that the per buffer allocation
-    // is not too expenseive.
-    if (m_bMakeStereo) {
-      int sampleSize = (int)(m_wBitsPerSample / 8);
-      int numSamples = (int)(cbData/sampleSize);
-      dwSize = 2 * cbData;
-      BYTE* pDestBuf = pWriteBuf = new BYTE[dwSize];
-      BYTE* pSrcBuf = pData;
-      for (int i = 0; i < numSamples; i++) {
-        for (int j = 0; j < sampleSize; j++) {
-          pDestBuf[j] = pSrcBuf[j];
-          pDestBuf[j + sampleSize] = pSrcBuf[j];
-        }
-        pDestBuf += (2 * sampleSize);
-        pSrcBuf += sampleSize;
-      }
+    // If the reader couldn't give us the channels asked for, map them
+    // into the channel map's own buffer
+    if (!m_ChannelMap.IsIdentity()) {
+      size_t cbMapped;
+      pWriteBuf = m_ChannelMap.Map(pData, cbData, &cbMapped);
+      dwSize = (DWORD)cbMapped;
+    }
+
+    // Likewise the sample rate and size
+    if (!m_Resampler.IsIdentity()) {
+      size_t cbResampled;
+      pWriteBuf = m_Resampler.Process(pWriteBuf, dwSize, &cbResampled);
+      dwSize = (DWORD)cbResampled;
     }
 
-    // Write out samples
-    if (!fwrite(pWriteBuf, sizeof(BYTE), dwSize, m_pOutput)) {
+    WriteOutput(pWriteBuf, dwSize);
+  }
+
+  return S_OK;
+}
+
+//
+// WriteOutput
+//
+// queues what falls inside the window for the writer thread, which only
+// holds us up once its ring is full. Signals the end once the window has
+// been written
+//
+HRESULT
+WMAReader::WriteOutput(BYTE* pBuf, DWORD cbBuf) {
+  DWORD dwFrameBytes = m_wBitsPerSample / 8 * m_dwNumChannels;
+  QWORD qwFrames = cbBuf / dwFrameBytes;
+  QWORD qwFirst = m_qwFramePos;
+  m_qwFramePos += qwFrames;
+
+  if (m_bWindowDone || m_qwFramePos <= m_qwStartFrame) {
+    return S_OK;
+  }
+  if (qwFirst < m_qwStartFrame) {
+    pBuf += (DWORD)(m_qwStartFrame - qwFirst) * dwFrameBytes;
+    qwFirst = m_qwStartFrame;
+  }
+  QWORD qwLast = min(m_qwFramePos, m_qwEndFrame);
+  DWORD dwSize = qwLast > qwFirst ? (DWORD)(qwLast - qwFirst) * dwFrameBytes : 0;
+
+  if (dwSize > 0) {
+    if (!m_pOutput->Write(pBuf, dwSize)) {
       m_hrAsync = -1;
       if (bDebug) {
         fprintf(stderr, "GOT fwrite event!\n");
       }
       SetEvent(m_hEvent);
-    } else {
-      dwTotalSize += dwSize;
+      return E_FAIL;
     }
-    fflush(m_pOutput);
+    dwTotalSize += dwSize;
+  }
 
-    // If we allocated before, free now
-    if (m_bMakeStereo) {
-      delete [] pWriteBuf;
+  if (m_qwFramePos >= m_qwEndFrame) {
+    m_bWindowDone = TRUE;
+    if (bDebug) {
+      fprintf(stderr, "GOT end of window event!\n");
     }
+    SetEvent(m_hEvent);
   }
-
   return S_OK;
 }
 
@@ -478,7 +589,8 @@ WMAReader::OnStatus(WMT_STATUS Status,
       SetEvent(m_hEvent);        
       break;
     case WMT_STARTED:
-      m_qwReaderTime = ONE_SECOND;
+      QueryPerformanceCounter(&m_liStarted);
+      m_qwReaderTime = m_cnsStart + m_cnsClockStep;
       hr = m_pReaderAdvanced->DeliverTime(m_qwReaderTime);
       if (FAILED(hr)) {
         m_hrAsync = hr;
@@ -515,7 +627,8 @@ WMAReader::OnStatus(WMT_STATUS Status,
 HRESULT STDMETHODCALLTYPE 
 WMAReader::OnTime(QWORD cnsCurrentTime,
                   void *pvContext) {
-  m_qwReaderTime += ONE_SECOND;
+  m_cnsDecoded = cnsCurrentTime;
+  m_qwReaderTime += NextClockStep();
   HRESULT hr = m_pReaderAdvanced->DeliverTime(m_qwReaderTime);
   if (FAILED(hr)) {
     m_hrAsync = hr;
@@ -527,6 +640,49 @@ WMAReader::OnTime(QWORD cnsCurrentTime,
   return S_OK;
 }
 
+//
+// NextClockStep
+//
+// how far to move the user clock on. While the output ring stays nearly
+// empty the output is keeping up, so the step doubles and the reader runs
+// further ahead between calls; as the ring fills it halves, so the reader
+// doesn't decode far past what the output can take
+//
+QWORD
+WMAReader::NextClockStep() {
+  DWORD dwFill = m_pOutput ? m_pOutput->GetFill() : 0;
+  if (dwFill < CLOCK_FILL_LOW && m_cnsClockStep < CLOCK_MAX_STEP) {
+    m_cnsClockStep *= 2;
+  }
+  else if (dwFill > CLOCK_FILL_HIGH && m_cnsClockStep > CLOCK_MIN_STEP) {
+    m_cnsClockStep /= 2;
+  }
+
+  if (bDebug) {
+    fprintf(stderr, "clock: [%I64u] ms, step [%I64u] ms, ring [%d]%%, [%.1f]x realtime\n",
+            m_cnsDecoded / 10000, m_cnsClockStep / 10000, dwFill,
+            GetSpeed(m_cnsDecoded));
+  }
+  return m_cnsClockStep;
+}
+
+//
+// GetSpeed
+//
+// media time decoded since WMT_STARTED against the time it took
+//
+double
+WMAReader::GetSpeed(QWORD cnsTime) {
+  LARGE_INTEGER liNow, liFreq;
+  QueryPerformanceCounter(&liNow);
+  QueryPerformanceFrequency(&liFreq);
+  double dElapsed = (double)(liNow.QuadPart - m_liStarted.QuadPart) / liFreq.QuadPart;
+  if (dElapsed <= 0 || cnsTime <= m_cnsStart) {
+    return 0;
+  }
+  return (double)(cnsTime - m_cnsStart) / ONE_SECOND / dElapsed;
+}
+
 HRESULT
 WMAReader::StartReading() {
 
@@ -576,6 +732,21 @@ WMAReader::StartReading() {
       return E_INVALIDARG;
   }
 
+  // Ask for the stream's own channels rather than the reader's stereo
+  // downmix, so the channel map can give us what was asked for
+  IWMReaderAdvanced2 *pAdvanced2 = NULL;
+  if (SUCCEEDED(m_pReader->QueryInterface(IID_IWMReaderAdvanced2,
+                                          (void**)&pAdvanced2))) {
+    BOOL bDiscrete = TRUE;
+    hr = pAdvanced2->SetOutputSetting(m_dwOutputNum, g_wszEnableDiscreteOutput,
+                                      WMT_TYPE_BOOL, (BYTE*)&bDiscrete,
+                                      sizeof(bDiscrete));
+    if (FAILED(hr) && bDebug) {
+      fprintf(stderr, "Enabling discrete output failed with error code 0x%x\n", hr);
+    }
+    pAdvanced2->Release();
+  }
+
   DWORD dwFormatCount;
   hr = m_pReader->GetOutputFormatCount(m_dwOutputNum, &dwFormatCount);
   if (FAILED(hr)) {
@@ -584,7 +755,18 @@ WMAReader::StartReading() {
     return hr;
   }
 
-  BOOL bFoundMatch = FALSE;
+  // Take the format that matches best, converting whatever doesn't
+  // match ourselves. The sample rate matters most, as converting it
+  // costs the most, then the sample size, then the channels. A sample
+  // size deeper than asked for is as good, as we dither it down, and of
+  // formats that are as good the deepest wins. The reader lists its
+  // native format first, so that wins any other tie
+  IWMOutputMediaProps* pBestProps = NULL;
+  int nBestScore = -1;
+  DWORD dwSourceRate = 0;
+  WORD wSourceBits = 0;
+  DWORD dwSourceChannels = 0;
+  DWORD dwChannelMask = 0;
   for (DWORD i = 0; i < dwFormatCount; i++) {
     IWMOutputMediaProps* pOutputProps;
     hr = m_pReader->GetOutputFormat(m_dwOutputNum, i, &pOutputProps);
@@ -615,25 +797,32 @@ WMAReader::StartReading() {
       if (pMediaType->formattype == WMFORMAT_WaveFormatEx) {
         WAVEFORMATEX* pFormat = (WAVEFORMATEX*)pMediaType->pbFormat;
 
-        if ((pFormat->wFormatTag == WAVE_FORMAT_PCM) &&
-            (pFormat->nSamplesPerSec == m_dwSamplesPerSec) &&
-            (pFormat->wBitsPerSample == m_wBitsPerSample)) {
-          if ((pFormat->nChannels == m_dwNumChannels) ||
-              !bFoundMatch) {
-            bFoundMatch = TRUE;
-            hr = m_pReader->SetOutputProps(m_dwOutputNum, pOutputProps);
-            if (FAILED(hr)) {
-              fprintf(stderr, "Setting audio output properties failed "
-                      "with error code 0x%x\n", hr);
-              break;
-            }
-            if (pFormat->nChannels == 1 &&
-                m_dwNumChannels == 2) {
-              m_bMakeStereo = TRUE;
-            }
-            else {
-              m_bMakeStereo = FALSE;
+        // more than two channels come as WAVEFORMATEXTENSIBLE, which
+        // says which speaker each one is for
+        BOOL bExtensible = (pFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+                            pFormat->cbSize >= 22 &&
+                            ((WAVEFORMATEXTENSIBLE*)pFormat)->SubFormat.Data1 == WAVE_FORMAT_PCM);
+
+        if ((pFormat->wFormatTag == WAVE_FORMAT_PCM || bExtensible) &&
+            (pFormat->wBitsPerSample == 8 ||
+             pFormat->wBitsPerSample == 16 ||
+             pFormat->wBitsPerSample == 24)) {
+          int nScore = (pFormat->nSamplesPerSec == m_dwSamplesPerSec ? 4 : 0) +
+                       (pFormat->wBitsPerSample >= min(m_wBitsPerSample, 24) ? 2 : 0) +
+                       (pFormat->nChannels == m_dwNumChannels ? 1 : 0);
+          if (nScore > nBestScore ||
+              (nScore == nBestScore && pFormat->wBitsPerSample > wSourceBits)) {
+            if (pBestProps) {
+              pBestProps->Release();
             }
+            pBestProps = pOutputProps;
+            pBestProps->AddRef();
+            nBestScore = nScore;
+            dwSourceRate = pFormat->nSamplesPerSec;
+            wSourceBits = pFormat->wBitsPerSample;
+            dwSourceChannels = pFormat->nChannels;
+            dwChannelMask = bExtensible ?
+              ((WAVEFORMATEXTENSIBLE*)pFormat)->dwChannelMask : 0;
           }
         }
       }
@@ -650,18 +839,60 @@ WMAReader::StartReading() {
   } 
 
   if (FAILED(hr)) {
+    if (pBestProps) {
+      pBestProps->Release();
+    }
+    return hr;
+  }
+
+  if (!pBestProps) {
+    fprintf(stderr, "Can't find a PCM output format in the reader\n");
+    return E_INVALIDARG;
+  }
+
+  hr = m_pReader->SetOutputProps(m_dwOutputNum, pBestProps);
+  pBestProps->Release();
+  if (FAILED(hr)) {
+    fprintf(stderr, "Setting audio output properties failed "
+            "with error code 0x%x\n", hr);
     return hr;
   }
 
-  if (!bFoundMatch) {
-    fprintf(stderr, "Can't find reader that matches the specified "
-            "audio output properties\n");
+  if (!m_ChannelMap.Init(wSourceBits, dwSourceChannels, dwChannelMask,
+                         m_dwNumChannels)) {
     return E_INVALIDARG;
   }
+  if (bDebug && !m_ChannelMap.IsIdentity()) {
+    fprintf(stderr, "mapping %d channels (mask 0x%x) to %d\n",
+            dwSourceChannels, dwChannelMask, m_dwNumChannels);
+  }
+
+  if (!m_Resampler.Init(dwSourceRate, wSourceBits, m_dwSamplesPerSec,
+                        m_wBitsPerSample, m_bFloat != FALSE, m_dwNumChannels,
+                        nResampleQuality, ditherMode)) {
+    return E_INVALIDARG;
+  }
+  if (bDebug && !m_Resampler.IsIdentity()) {
+    fprintf(stderr, "converting %d bit %dHz to %d bit%s %dHz, quality %d%s\n",
+            wSourceBits, dwSourceRate, m_wBitsPerSample,
+            m_bFloat ? " float" : "", m_dwSamplesPerSec, nResampleQuality,
+            m_Resampler.IsDithered() ? ", dithered" : "");
+  }
 
   m_pReaderAdvanced->SetUserProvidedClock(TRUE);
 
-  hr = m_pReader->Start(0, 0, 1.0, NULL);
+  // Seek straight to the start of the window. Where the input can't be
+  // seeked, decode from the beginning and let the trimming skip to it
+  m_cnsStart = m_qwStartFrame * ONE_SECOND / m_dwSamplesPerSec;
+  hr = m_pReader->Start(m_cnsStart, 0, 1.0, NULL);
+  if (FAILED(hr) && m_cnsStart > 0) {
+    if (bDebug) {
+      fprintf(stderr, "Starting at %I64u failed with error code 0x%x, "
+              "decoding from the beginning\n", m_cnsStart, hr);
+    }
+    m_cnsStart = 0;
+    hr = m_pReader->Start(0, 0, 1.0, NULL);
+  }
   if (FAILED(hr)) {
     fprintf(stderr, "Attempt to start reading failed "
             "with error code 0x%x\n", hr);
@@ -675,13 +906,33 @@ WMAReader::StartReading() {
     return m_hrAsync;
   }
 
+  // The resampler holds back the last few samples until it knows
+  // there are no more
+  if (m_pOutput && !m_Resampler.IsIdentity() && !m_bWindowDone) {
+    size_t cbTail;
+    BYTE* pTail = m_Resampler.Drain(&cbTail);
+    WriteOutput(pTail, (DWORD)cbTail);
+  }
+
+  if (bDebug) {
+    // what went out, as media time, over the time it took
+    QWORD cnsOut = !m_pOutput ? m_cnsDecoded : m_cnsStart +
+      (QWORD)dwTotalSize / (m_wBitsPerSample / 8 * m_dwNumChannels) *
+      ONE_SECOND / m_dwSamplesPerSec;
+    fprintf(stderr, "decoded [%I64u] ms at [%.1f]x realtime\n",
+            (cnsOut - m_cnsStart) / 10000, GetSpeed(cnsOut));
+  }
+
+  if (m_bWindowDone) {
+    m_pReader->Stop();
+  }
   m_pReader->Close();
 
   return S_OK;
 }
 
 HRESULT
-WMAReader::Decode(LPCSTR lpInput, FILE* pOutput) {
+WMAReader::Decode(LPCSTR lpInput, PCMWriter* pOutput) {
   HRESULT hr = Init(pOutput);
   if (FAILED(hr)) {
     return hr;
@@ -707,7 +958,7 @@ WMAReader::Decode(LPCSTR lpInput, FILE* pOutput) {
 }
 
 HRESULT
-WMAReader::Decode(IStream* lpInput, FILE* pOutput) {
+WMAReader::Decode(IStream* lpInput, PCMWriter* pOutput) {
   HRESULT hr = Init(pOutput);
   if (FAILED(hr)) {
     return hr;
@@ -720,7 +971,16 @@ WMAReader::Decode(IStream* lpInput, FILE* pOutput) {
     fprintf(stderr, "Error QIing WMA reader 0x%x\n", hr);
     return hr;
   }
-  pAdvanced2->SetPlayMode(WMT_PLAY_MODE_STREAMING);
+  // A file redirected to stdin can be read like one, only a pipe needs
+  // the streaming mode
+  STATSTG statstg;
+  if (FAILED(lpInput->Stat(&statstg, STATFLAG_NONAME)) ||
+      statstg.cbSize.QuadPart == 0) {
+    pAdvanced2->SetPlayMode(WMT_PLAY_MODE_STREAMING);
+  }
+  else {
+    pAdvanced2->SetPlayMode(WMT_PLAY_MODE_LOCAL);
+  }
 
   hr = pAdvanced2->OpenStream(lpInput, this, NULL);
   if (SUCCEEDED(hr)) {
@@ -737,8 +997,10 @@ WMAReader::Decode(IStream* lpInput, FILE* pOutput) {
 void
 printUsage() {
   fprintf(stderr, 
-          "wmadec [-dqhw] [ -b bits_per_sample ] [ -r sample_rate ]\n"
-          "[ -n num_channels ] [ -o outputfile ] [input]\n"
+          "wmadec [-dqhw] [ -f format ] [ -b bits_per_sample ] [ -D dither ]\n"
+          "[ -r sample_rate ] [ -n num_channels ] [ -s start ] [ -e end ]\n"
+          "[ -o outputfile ] [ -m listfile ] [ -O directory ] [input ...]\n"
+          "wmadec --probe [ -m listfile ] [input ...]\n"
           "-d\n"
           "\tAdd debugging output.\n"
           "-q\n"
@@ -746,7 +1008,12 @@ printUsage() {
           "-h\n"
           "\tPrint help message.\n"
           "-b n\n"
-          "\tBits per sample of output.  Valid values are 8 or 16 (default)\n"
+          "\tBits per sample of output.  Valid values are 8, 16 (default),\n"
+          "\t24, 32 or float, for 32 bit floating point\n"
+          "-D dither\n"
+          "\tDither used when the output has fewer bits than the source:\n"
+          "\tnone, tpdf (default) or shaped, which moves the noise up out\n"
+          "\tof hearing and is meant for 44.1 and 48kHz output\n"
           "-r n\n"
           "\tSample rate of output. Default is 44100.\n"
           "-n n\n"
@@ -754,61 +1021,261 @@ printUsage() {
           "-o filename\n"
           "\tWrite output to specified filename.  Default is stdout.\n"
           "-w\n"
-          "\tAdd wave headers\n"
+          "\tAdd wave headers, the same as -f wav\n"
+          "-f format\n"
+          "\tOutput format: raw (default), wav, rf64 or aiff. The header\n"
+          "\tsizes are put right at the end when the output is a file\n"
           "-l bytes\n"
-          "\tlength of decoded output in bytes");
+          "\tlength of decoded output in bytes, for the header\n"
+          "-s pos\n"
+          "\tStart decoding at pos, given as [[hh:]mm:]ss[.frac] or as a\n"
+          "\tnumber of samples followed by 's', e.g. 441000s\n"
+          "-e pos\n"
+          "\tStop decoding at pos, given the same way\n"
+          "-Q n\n"
+          "\tQuality of sample rate conversion, when the input has to be\n"
+          "\tconverted: 0 (fastest) to 3 (best). Default is 2\n"
+          "-m listfile\n"
+          "\tDecode the inputs listed in listfile, one to a line, after\n"
+          "\tany on the command line. - reads the list from stdin\n"
+          "-O directory\n"
+          "\tWith more than one input, write each to a file of its own in\n"
+          "\tdirectory, named after it. Without -O they go to the output as\n"
+          "\tone framed stream (see pcmwriter.h), and -f is ignored\n"
+          "--probe\n"
+          "\tDon't decode, print what each input's header says about its\n"
+          "\tduration, format, tags and index as name=value lines\n");
 }
 
-// Superlexx: Write*Bits* and WriteWaveHeader are taken from LAME
+//
+// A list of inputs for a batch
+//
+struct InputList {
+  char** ppNames;
+  int nCount;
+  int nSize;
+};
+
 void
-Write16BitsLowHigh(FILE *fp, int i)
-{
-	putc(i&0xff,fp);
-	putc((i>>8)&0xff,fp);
+AddInput(InputList* pList, const char* pszName) {
+  if (pList->nCount == pList->nSize) {
+    pList->nSize = pList->nSize ? pList->nSize * 2 : 64;
+    char** ppNames = new char*[pList->nSize];
+    if (pList->nCount) {
+      memcpy(ppNames, pList->ppNames, pList->nCount * sizeof(char*));
+    }
+    delete [] pList->ppNames;
+    pList->ppNames = ppNames;
+  }
+  pList->ppNames[pList->nCount++] = _strdup(pszName);
 }
 
-// Superlexx: Write32Bits* and WriteWaveHeader are taken from LAME
-void
-Write32BitsLowHigh(FILE *fp, int i)
-{
-	Write16BitsLowHigh(fp,(int)(i&0xffffL));
-	Write16BitsLowHigh(fp,(int)((i>>16)&0xffffL));
+//
+// ReadInputList
+//
+// adds the inputs named in a file, one to a line, skipping blank lines
+//
+BOOL
+ReadInputList(InputList* pList, LPCSTR pszFile) {
+  FILE* pFile = stdin;
+  if (strcmp(pszFile, "-") != 0 && fopen_s(&pFile, pszFile, "r") != 0) {
+    fprintf(stderr, "Error opening list file %s\n", pszFile);
+    return FALSE;
+  }
+
+  char szLine[MAX_PATH + 2];
+  while (fgets(szLine, sizeof(szLine), pFile)) {
+    size_t len = strcspn(szLine, "\r\n");
+    szLine[len] = '\0';
+    if (len > 0) {
+      AddInput(pList, szLine);
+    }
+  }
+
+  if (pFile != stdin) {
+    fclose(pFile);
+  }
+  return TRUE;
 }
 
-// Superlexx: this function is slightly modified (pcmbytes is a parameter now)
-int WriteWaveHeader(FILE * const fp, 
-	const int freq, const int channels, const int bits, DWORD pcmbytes)
-{
-	int bytes = (bits + 7) / 8;
-
-	/* quick and dirty, but documented */
-	fwrite("RIFF", 1, 4, fp); /* label */
-	Write32BitsLowHigh(fp, pcmbytes + 44 - 8); /* length in bytes without header */
-	fwrite("WAVEfmt ", 2, 4, fp); /* 2 labels */
-	Write32BitsLowHigh(fp, 2 + 2 + 4 + 4 + 2 + 2); /* length of PCM format declaration area */
-	Write16BitsLowHigh(fp, 1); /* is PCM? */
-	Write16BitsLowHigh(fp, channels); /* number of channels */
-	Write32BitsLowHigh(fp, freq); /* sample frequency in [Hz] */
-	Write32BitsLowHigh(fp, freq * channels * bytes); /* bytes per second */
-	Write16BitsLowHigh(fp, channels * bytes); /* bytes per sample time */
-	Write16BitsLowHigh(fp, bits); /* bits per sample */
-	fwrite("data", 1, 4, fp); /* label */
-	Write32BitsLowHigh(fp, pcmbytes); /* length in bytes of raw PCM data */
-
-	return ferror(fp) ? -1 : 0;
+//
+// DecodeBatch
+//
+// decodes every input with the one reader, into a file each in
+// pszOutputDir, or when that's NULL, as frames of pOutput. A failed input
+// is reported and the rest still decoded. Returns the number that failed
+//
+int
+DecodeBatch(WMAReader* pReader, InputList* pList, LPCSTR pszOutputDir,
+            PCMWriter* pOutput, PCMFormat format, DWORD dwSamplesPerSec,
+            DWORD dwNumChannels, WORD wBitsPerSample, BOOL bFloat,
+            DWORD dwPCMBytes) {
+  LARGE_INTEGER liFreq;
+  QueryPerformanceFrequency(&liFreq);
+  int nFailed = 0;
+
+  for (int i = 0; i < pList->nCount; i++) {
+    LPCSTR pszInput = pList->ppNames[i];
+    DWORD dwStartSize = dwTotalSize;
+    LARGE_INTEGER liStart, liEnd;
+    QueryPerformanceCounter(&liStart);
+    HRESULT hr;
+
+    if (pszOutputDir) {
+      // the input's name, less its directory and extension
+      LPCSTR pszBase = pszInput;
+      for (LPCSTR p = pszInput; *p; p++) {
+        if (*p == '\\' || *p == '/' || *p == ':') {
+          pszBase = p + 1;
+        }
+      }
+      LPCSTR pszDot = strrchr(pszBase, '.');
+      int nBase = pszDot ? (int)(pszDot - pszBase) : (int)strlen(pszBase);
+
+      char szOutput[MAX_PATH];
+      FILE* pFile = NULL;
+      if (sprintf_s(szOutput, sizeof(szOutput), "%s\\%.*s%s", pszOutputDir,
+                    nBase, pszBase, PCMSink::GetExtension(format)) < 0 ||
+          fopen_s(&pFile, szOutput, "w+b") != 0) {
+        fprintf(stderr, "Error opening output for %s\n", pszInput);
+        hr = E_FAIL;
+      }
+      else {
+        PCMSink sink;
+        PCMWriter output(&sink);
+        if (!sink.Open(pFile, format, dwSamplesPerSec, dwNumChannels,
+                       wBitsPerSample, bFloat != FALSE, false,
+                       dwPCMBytes != 0xFFFFFFFF ? dwPCMBytes : PCM_LENGTH_UNKNOWN)) {
+          hr = E_FAIL;
+        }
+        else {
+          hr = output.Start() ? pReader->Decode(pszInput, &output) : E_FAIL;
+          if (!output.Close()) {
+            hr = E_FAIL;
+          }
+          if (!sink.Close()) {
+            hr = E_FAIL;
+          }
+        }
+        fclose(pFile);
+      }
+    }
+    else if (pOutput) {
+      // FILE says what's coming, DATA carries it and DONE how it went
+      BYTE start[8 + MAX_PATH];
+      DWORD cbName = min((DWORD)strlen(pszInput), (DWORD)MAX_PATH);
+      *(DWORD*)start = dwSamplesPerSec;
+      *(WORD*)(start + 4) = (WORD)dwNumChannels;
+      *(WORD*)(start + 6) = wBitsPerSample | (bFloat ? 0x8000 : 0);
+      memcpy(start + 8, pszInput, cbName);
+
+      pOutput->SetFrame(i + 1);
+      hr = pOutput->WriteFrame("FILE", start, 8 + cbName) ? S_OK : E_FAIL;
+      if (SUCCEEDED(hr)) {
+        hr = pReader->Decode(pszInput, pOutput);
+      }
+    }
+    else {
+      hr = pReader->Decode(pszInput, NULL);
+    }
+
+    QueryPerformanceCounter(&liEnd);
+    DWORD dwMs = (DWORD)((liEnd.QuadPart - liStart.QuadPart) * 1000 / liFreq.QuadPart);
+    QWORD qwBytes = dwTotalSize - dwStartSize;
+
+    if (!pszOutputDir && pOutput) {
+      BYTE done[16];
+      *(HRESULT*)done = hr;
+      *(DWORD*)(done + 4) = dwMs;
+      *(QWORD*)(done + 8) = qwBytes;
+      if (!pOutput->WriteFrame("DONE", done, sizeof(done))) {
+        hr = E_FAIL;
+      }
+      pOutput->SetFrame(0);
+    }
+
+    if (FAILED(hr)) {
+      nFailed++;
+    }
+    fprintf(stderr, "%s: [%d] ms, [%I64u] bytes, 0x%x\n",
+            pszInput, dwMs, qwBytes, hr);
+  }
+
+  return nFailed;
+}
+
+//
+// ProbeInputs
+//
+// --probe: what each input's ASF header says, as name=value lines with a
+// blank line between inputs, without starting the reader. Returns the number
+// that couldn't be probed
+//
+int
+ProbeInputs(InputList* pList) {
+  static const char* apszErrors[] = {
+    "", "can't be opened", "isn't an ASF file", "is cut short", "has no file properties"
+  };
+  int nFailed = 0;
+  BOOL bPrinted = FALSE;
+
+  for (int i = 0; i < pList->nCount; i++) {
+    LPCSTR pszInput = pList->ppNames[i];
+    if (strcmp(pszInput, "-") == 0) {
+      fprintf(stderr, "Can't probe stdin, it needs to be a file\n");
+      nFailed++;
+      continue;
+    }
+
+    WMAProbe probe;
+    int nResult = probe.Open(pszInput);
+    if (nResult != PROBE_OK) {
+      fprintf(stderr, "%s %s\n", pszInput, apszErrors[nResult]);
+      nFailed++;
+      // what a cut short header had is still worth showing
+      if (nResult != PROBE_ERR_TRUNCATED) {
+        continue;
+      }
+    }
+    // a blank line between files, whichever of them failed
+    if (bPrinted) {
+      printf("\n");
+    }
+    probe.Print(stdout, pszInput);
+    bPrinted = TRUE;
+  }
+
+  return nFailed;
 }
 
 int _tmain(int argc, _TCHAR* argv[])
 {
   BOOL bQuiet = FALSE;
   WORD wBitsPerSample = 16;
+  BOOL bFloat = FALSE;
   DWORD dwSamplesPerSec = 44100;
   DWORD dwNumChannels = 2;
   LPCSTR pOutputFile = NULL;
   FILE* pOutputHandle = stdout;
   BOOL bUsage = FALSE;
-  BOOL bWaveHeaders = FALSE;
+  PCMFormat format = PCM_RAW;
   DWORD dwPCMBytes = 0xFFFFFFFF;
+  const char* pszStart = NULL;
+  const char* pszEnd = NULL;
+  LPCSTR pszListFile = NULL;
+  LPCSTR pszOutputDir = NULL;
+  BOOL bProbe = FALSE;
+
+  // getopt takes "--" as the end of the options, so the one long option
+  // comes out first
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--probe") == 0) {
+      bProbe = TRUE;
+      memmove(&argv[i], &argv[i + 1], (argc - i - 1) * sizeof(argv[0]));
+      argc--;
+      i--;
+    }
+  }
 
   char c;
   while ((c = getopt(argc, argv, gOptionStr)) != EOF) {
@@ -823,14 +1290,20 @@ int _tmain(int argc, _TCHAR* argv[])
       case 'v':
         bUsage = TRUE;
         break;
-      case 'b':
-        wBitsPerSample = atoi(optarg);
-        if (wBitsPerSample != 8 && wBitsPerSample != 16) {
+      case 'b': {
+        unsigned nBits;
+        bool bIsFloat;
+        if (!PCMSink::ParseBits(optarg, &nBits, &bIsFloat)) {
           fprintf(stderr, 
                   "Illegal value passed for bits per sample parameter\n");
           bUsage = TRUE;
         }
+        else {
+          wBitsPerSample = (WORD)nBits;
+          bFloat = bIsFloat;
+        }
         break;
+      }
       case 'r':
         dwSamplesPerSec = atoi(optarg);
         if (dwSamplesPerSec <= 0) {
@@ -851,24 +1324,108 @@ int _tmain(int argc, _TCHAR* argv[])
         pOutputFile = optarg;
         break;
       case 'w':
-	bWaveHeaders = TRUE;
+	format = PCM_WAV;
 	break;
+      case 'f':
+        if (!PCMSink::ParseFormat(optarg, &format)) {
+          fprintf(stderr, 
+                  "Illegal value passed for output format parameter\n");
+          bUsage = TRUE;
+        }
+        break;
       case 'l':
 	dwPCMBytes = atoi(optarg);
 	break;
+      case 'Q':
+        nResampleQuality = atoi(optarg);
+        if (nResampleQuality < 0 || nResampleQuality > RESAMPLE_MAX_QUALITY) {
+          fprintf(stderr, 
+                  "Illegal value passed for resampling quality parameter\n");
+          bUsage = TRUE;
+        }
+        break;
+      case 'D':
+        if (!PCMDither::ParseMode(optarg, &ditherMode)) {
+          fprintf(stderr, 
+                  "Illegal value passed for dither parameter\n");
+          bUsage = TRUE;
+        }
+        break;
+      case 's':
+        pszStart = optarg;
+        break;
+      case 'e':
+        pszEnd = optarg;
+        break;
+      case 'm':
+        pszListFile = optarg;
+        break;
+      case 'O':
+        pszOutputDir = optarg;
+        break;
       case '\0': 
         bUsage = TRUE;
     }
   }
 
+  // The window is counted in output frames, so it's only worked out once
+  // the output rate is known
+  QWORD qwStartFrame = 0;
+  QWORD qwEndFrame = NO_END;
+  if (pszStart && !PCMSink::ParsePosition(pszStart, dwSamplesPerSec, &qwStartFrame)) {
+    fprintf(stderr, "Illegal value passed for start parameter\n");
+    bUsage = TRUE;
+  }
+  if (pszEnd && !PCMSink::ParsePosition(pszEnd, dwSamplesPerSec, &qwEndFrame)) {
+    fprintf(stderr, "Illegal value passed for end parameter\n");
+    bUsage = TRUE;
+  }
+  if (!bUsage && qwEndFrame <= qwStartFrame) {
+    fprintf(stderr, "The end must come after the start\n");
+    bUsage = TRUE;
+  }
+
   if (bUsage) {
     printUsage();
     exit(1);
   }
 
+  // Keep the output to the length the header gives: a length asked for
+  // ends the window, and a window without one sets it
+  DWORD dwFrameBytes = wBitsPerSample / 8 * dwNumChannels;
+  if (dwPCMBytes != 0xFFFFFFFF) {
+    qwEndFrame = min(qwEndFrame, qwStartFrame + dwPCMBytes / dwFrameBytes);
+  }
+  else if (qwEndFrame != NO_END &&
+           (qwEndFrame - qwStartFrame) * dwFrameBytes < 0xFFFFFFFF) {
+    dwPCMBytes = (DWORD)(qwEndFrame - qwStartFrame) * dwFrameBytes;
+  }
+
+  // More than one input, or a list of them, is a batch
+  InputList inputs = { NULL, 0, 0 };
+  for (int i = optind; i < argc; i++) {
+    AddInput(&inputs, argv[i]);
+  }
+  if (pszListFile && !ReadInputList(&inputs, pszListFile)) {
+    exit(1);
+  }
+  if (bProbe) {
+    if (inputs.nCount == 0) {
+      printUsage();
+      exit(1);
+    }
+    return ProbeInputs(&inputs) ? 1 : 0;
+  }
+  BOOL bBatch = (inputs.nCount > 1 || pszListFile || pszOutputDir);
+  if (bBatch && !pszOutputDir) {
+    // the framing says where each input starts, a header wouldn't
+    format = PCM_RAW;
+  }
+
   errno_t err;
 
-  if (bQuiet) {
+  // with -O each input's output is opened as it comes
+  if (bQuiet || pszOutputDir) {
     pOutputHandle = NULL;
   }
   // Open the output file if one is specified.
@@ -882,25 +1439,55 @@ int _tmain(int argc, _TCHAR* argv[])
     pOutputHandle = stdout;
   }
 
-  if (bWaveHeaders) {
-    WriteWaveHeader(pOutputHandle, dwSamplesPerSec, dwNumChannels, wBitsPerSample, dwPCMBytes);
+  PCMSink sink;
+  PCMWriter* pOutput = NULL;
+  if (pOutputHandle) {
+    if (!sink.Open(pOutputHandle, format, dwSamplesPerSec, dwNumChannels,
+                   wBitsPerSample, bFloat != FALSE, false,
+                   dwPCMBytes != 0xFFFFFFFF ? dwPCMBytes : PCM_LENGTH_UNKNOWN)) {
+      exit(1);
+    }
+    pOutput = new PCMWriter(&sink);
+    if (!pOutput->Start()) {
+      exit(1);
+    }
   }
 
   WMAReader* pReader = new WMAReader(wBitsPerSample,
+                                     bFloat,
                                      dwSamplesPerSec,
                                      dwNumChannels);
   pReader->AddRef();
-  if ((optind < argc) && (strcmp(argv[optind], "-") != 0)) {
-    pReader->Decode(argv[optind], pOutputHandle);
+  pReader->SetWindow(qwStartFrame, qwEndFrame);
+  int nFailed = 0;
+  if (bBatch) {
+    nFailed = DecodeBatch(pReader, &inputs, bQuiet ? NULL : pszOutputDir, pOutput, format,
+                dwSamplesPerSec, dwNumChannels, wBitsPerSample, bFloat, dwPCMBytes);
+  }
+  else if (inputs.nCount > 0 && strcmp(inputs.ppNames[0], "-") != 0) {
+    pReader->Decode(inputs.ppNames[0], pOutput);
   }
   else {
     _setmode(_fileno(stdin), O_BINARY);   
     WMAStream* pStream = new WMAStream(stdin);
     pStream->AddRef();
-    pReader->Decode(pStream, pOutputHandle);    
+    if (SUCCEEDED(pStream->Open())) {
+      pReader->Decode(pStream, pOutput);    
+    }
     pStream->Release();
   }
   pReader->Release();
+
+  // everything queued goes out before the file is closed
+  if (pOutput) {
+    pOutput->Close();
+    if (bDebug) {
+      fprintf(stderr, "output: [%I64u] bytes, writer fell behind [%d] times\n",
+              pOutput->GetBytesWritten(), pOutput->GetStalls());
+    }
+    delete pOutput;
+    sink.Close();
+  }
   if (pOutputHandle && pOutputFile) {
     fclose(pOutputHandle);
   }
@@ -909,5 +1496,5 @@ int _tmain(int argc, _TCHAR* argv[])
     fprintf(stderr, "dwTotalSize: [%d]\n", dwTotalSize);
   }
   
-  return 0;
+  return nFailed ? 1 : 0;
 }
@@ -0,0 +1,470 @@
+// wmaprobe.cpp : what an ASF file holds, from its header - see wmaprobe.h
+//
+
+#include <string.h>
+#include "wmaprobe.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define OBJECT_HEADER   24      // GUID and 64 bit size
+#define HEADER_OBJECT   30      // the header object's own, before its children
+#define DATA_OBJECT     50      // the data object's, before its packets
+
+//
+// Object GUIDs, as they are stored
+//
+static const unsigned char guidHeader[16] = {
+  0x30, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidFileProperties[16] = {
+  0xA1, 0xDC, 0xAB, 0x8C, 0x47, 0xA9, 0xCF, 0x11, 0x8E, 0xE4, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65
+};
+static const unsigned char guidStreamProperties[16] = {
+  0x91, 0x07, 0xDC, 0xB7, 0xB7, 0xA9, 0xCF, 0x11, 0x8E, 0xE6, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65
+};
+static const unsigned char guidContentDescription[16] = {
+  0x33, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidData[16] = {
+  0x36, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C
+};
+static const unsigned char guidSimpleIndex[16] = {
+  0x90, 0x08, 0x00, 0x33, 0xB1, 0xE5, 0xCF, 0x11, 0x89, 0xF4, 0x00, 0xA0, 0xC9, 0x03, 0x49, 0xCB
+};
+static const unsigned char guidAudioMedia[16] = {
+  0x40, 0x9E, 0x69, 0xF8, 0x4D, 0x5B, 0xCF, 0x11, 0xA8, 0xFD, 0x00, 0x80, 0x5F, 0x5C, 0x44, 0x2B
+};
+
+static unsigned long long
+GetLE(const unsigned char* p, int nBytes) {
+  unsigned long long v = 0;
+  for (int i = nBytes - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static bool
+IsGuid(const unsigned char* p, const unsigned char* pGuid) {
+  return memcmp(p, pGuid, 16) == 0;
+}
+
+//
+// NextObject
+//
+// the size of the object at p, or 0 if it isn't a whole one inside cb
+//
+static unsigned long long
+NextObject(const unsigned char* p, unsigned long long cb) {
+  if (cb < OBJECT_HEADER) {
+    return 0;
+  }
+  unsigned long long cbObject = GetLE(p + 16, 8);
+  if (cbObject < OBJECT_HEADER || cbObject > cb) {
+    return 0;
+  }
+  return cbObject;
+}
+
+WMAProbe::WMAProbe() {
+  m_pView = NULL;
+  m_cbView = 0;
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hMapping = NULL;
+#endif
+  memset(&m_info, 0, sizeof(m_info));
+  m_bFileProperties = false;
+}
+
+WMAProbe::~WMAProbe() {
+  Close();
+}
+
+void
+WMAProbe::Close() {
+#ifdef _WIN32
+  if (m_pView) {
+    UnmapViewOfFile(m_pView);
+  }
+  if (m_hMapping) {
+    CloseHandle(m_hMapping);
+  }
+  if (m_hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hFile);
+  }
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hMapping = NULL;
+#else
+  if (m_pView) {
+    munmap((void*)m_pView, m_cbView);
+  }
+#endif
+  m_pView = NULL;
+  m_cbView = 0;
+}
+
+int
+WMAProbe::Open(const char* pszFile) {
+  Close();
+
+#ifdef _WIN32
+  m_hFile = CreateFileA(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE) {
+    return PROBE_ERR_OPEN;
+  }
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(m_hFile, &liSize) || (unsigned long long)liSize.QuadPart > (size_t)-1) {
+    return PROBE_ERR_OPEN;
+  }
+  if (liSize.QuadPart == 0) {
+    return PROBE_ERR_NOT_ASF;
+  }
+  m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!m_hMapping) {
+    return PROBE_ERR_OPEN;
+  }
+  m_pView = (const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (!m_pView) {
+    return PROBE_ERR_OPEN;
+  }
+  m_cbView = (size_t)liSize.QuadPart;
+#else
+  int fd = open(pszFile, O_RDONLY);
+  if (fd < 0) {
+    return PROBE_ERR_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (unsigned long long)st.st_size > (size_t)-1) {
+    close(fd);
+    return PROBE_ERR_OPEN;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return PROBE_ERR_NOT_ASF;
+  }
+  void* pView = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (pView == MAP_FAILED) {
+    return PROBE_ERR_OPEN;
+  }
+  m_pView = (const unsigned char*)pView;
+  m_cbView = (size_t)st.st_size;
+#endif
+
+  return Parse(m_pView, m_cbView);
+}
+
+//
+// Parse
+//
+// The header object comes first and holds the properties. After it the data object,
+// whose packets are skipped, and then any index objects. A file cut short still gives
+// whatever its header had, but only a whole header is PROBE_OK.
+//
+int
+WMAProbe::Parse(const unsigned char* pData, size_t cbData) {
+  memset(&m_info, 0, sizeof(m_info));
+  m_bFileProperties = false;
+
+  if (cbData < HEADER_OBJECT || !IsGuid(pData, guidHeader)) {
+    return PROBE_ERR_NOT_ASF;
+  }
+  unsigned long long cbHeader = GetLE(pData + 16, 8);
+  if (cbHeader < HEADER_OBJECT) {
+    return PROBE_ERR_NOT_ASF;
+  }
+  if (cbHeader > cbData) {
+    ParseHeader(pData, cbData);
+    return PROBE_ERR_TRUNCATED;
+  }
+  int nResult = ParseHeader(pData, cbHeader);
+  if (nResult != PROBE_OK) {
+    return nResult;
+  }
+
+  const unsigned char* p = pData + cbHeader;
+  unsigned long long cb = cbData - cbHeader;
+  unsigned long long cbObject;
+  while ((cbObject = NextObject(p, cb)) != 0) {
+    if (IsGuid(p, guidData)) {
+      if (cbObject >= DATA_OBJECT && m_info.qwDataOffset == 0) {
+        m_info.qwDataOffset = (p - pData) + DATA_OBJECT;
+      }
+    }
+    else if (IsGuid(p, guidSimpleIndex)) {
+      if (!m_info.pIndex) {
+        ParseIndex(p, cbObject);
+      }
+    }
+    p += cbObject;
+    cb -= cbObject;
+  }
+
+  return PROBE_OK;
+}
+
+int
+WMAProbe::ParseHeader(const unsigned char* p, unsigned long long cb) {
+  p += HEADER_OBJECT;
+  cb -= HEADER_OBJECT;
+
+  unsigned long long cbObject;
+  while ((cbObject = NextObject(p, cb)) != 0) {
+    if (IsGuid(p, guidFileProperties)) {
+      if (cbObject >= 104) {
+        m_info.qwFileSize = GetLE(p + 40, 8);
+        m_info.qwDataPackets = GetLE(p + 56, 8);
+        m_info.cnsPlayDuration = GetLE(p + 64, 8);
+        m_info.cnsSendDuration = GetLE(p + 72, 8);
+        m_info.msPreroll = GetLE(p + 80, 8);
+        m_info.dwFlags = (unsigned long)GetLE(p + 88, 4);
+        m_info.dwMinPacketSize = (unsigned long)GetLE(p + 92, 4);
+        m_info.dwMaxPacketSize = (unsigned long)GetLE(p + 96, 4);
+        m_info.dwMaxBitrate = (unsigned long)GetLE(p + 100, 4);
+        m_bFileProperties = true;
+      }
+    }
+    else if (IsGuid(p, guidStreamProperties)) {
+      ParseStream(p, cbObject);
+    }
+    else if (IsGuid(p, guidContentDescription)) {
+      ParseContent(p, cbObject);
+    }
+    p += cbObject;
+    cb -= cbObject;
+  }
+
+  return m_bFileProperties ? PROBE_OK : PROBE_ERR_NO_PROPERTIES;
+}
+
+//
+// ParseStream
+//
+// stream type and error correction GUIDs, time offset, the two data lengths, flags with
+// the stream number, then the type's own data: a WAVEFORMATEX for audio
+//
+void
+WMAProbe::ParseStream(const unsigned char* p, unsigned long long cb) {
+  if (cb < 78 || m_info.nStreams >= PROBE_MAX_STREAMS) {
+    return;
+  }
+  m_info.nStreams++;
+  if (!IsGuid(p + 24, guidAudioMedia)) {
+    return;
+  }
+  if (m_info.nAudioStreams++) {
+    return;
+  }
+
+  unsigned long cbFormat = (unsigned long)GetLE(p + 64, 4);
+  unsigned wFlags = (unsigned)GetLE(p + 72, 2);
+  m_info.wAudioStream = wFlags & 0x7F;
+  m_info.bEncrypted = (wFlags & 0x8000) != 0;
+
+  const unsigned char* pFormat = p + 78;
+  if (cbFormat < 16 || cbFormat > cb - 78) {
+    return;
+  }
+  m_info.wFormatTag = (unsigned)GetLE(pFormat, 2);
+  m_info.nChannels = (unsigned)GetLE(pFormat + 2, 2);
+  m_info.dwSampleRate = (unsigned long)GetLE(pFormat + 4, 4);
+  m_info.dwAvgBytesPerSec = (unsigned long)GetLE(pFormat + 8, 4);
+  m_info.nBlockAlign = (unsigned)GetLE(pFormat + 12, 2);
+  m_info.nBitsPerSample = (unsigned)GetLE(pFormat + 14, 2);
+  if (cbFormat < 18) {
+    return;
+  }
+
+  // the extra data after cbSize, where WMA Pro and WAVE_FORMAT_EXTENSIBLE keep the mask
+  unsigned long cbExtra = (unsigned long)GetLE(pFormat + 16, 2);
+  const unsigned char* pExtra = pFormat + 18;
+  if (cbExtra > cbFormat - 18) {
+    cbExtra = cbFormat - 18;
+  }
+  if ((m_info.wFormatTag == 0x162 || m_info.wFormatTag == 0xFFFE) && cbExtra >= 6) {
+    m_info.dwChannelMask = (unsigned long)GetLE(pExtra + 2, 4);
+  }
+}
+
+void
+WMAProbe::ParseContent(const unsigned char* p, unsigned long long cb) {
+  if (cb < OBJECT_HEADER + 10) {
+    return;
+  }
+  ASFString* apStrings[5] = {
+    &m_info.title, &m_info.author, &m_info.copyright, &m_info.description, &m_info.rating
+  };
+  const unsigned char* pText = p + OBJECT_HEADER + 10;
+  unsigned long long cbLeft = cb - OBJECT_HEADER - 10;
+  for (int i = 0; i < 5; i++) {
+    unsigned cbText = (unsigned)GetLE(p + OBJECT_HEADER + 2 * i, 2);
+    if (cbText > cbLeft) {
+      return;
+    }
+    apStrings[i]->pText = pText;
+    apStrings[i]->cbText = cbText;
+    pText += cbText;
+    cbLeft -= cbText;
+  }
+}
+
+//
+// ParseIndex
+//
+// file ID, the time between entries, the most packets any entry covers, the entry
+// count, then the entries: a 32 bit packet number and a 16 bit packet count each
+//
+void
+WMAProbe::ParseIndex(const unsigned char* p, unsigned long long cb) {
+  if (cb < 56) {
+    return;
+  }
+  unsigned long long cnsInterval = GetLE(p + 40, 8);
+  unsigned long long qwEntries = GetLE(p + 52, 4);
+  if (cnsInterval == 0 || qwEntries > (cb - 56) / 6) {
+    return;
+  }
+  m_info.cnsIndexInterval = cnsInterval;
+  m_info.dwIndexEntries = (unsigned long)qwEntries;
+  m_info.pIndex = p + 56;
+}
+
+unsigned long long
+WMAProbe::GetDurationMs() {
+  unsigned long long msPlay = m_info.cnsPlayDuration / 10000;
+  return msPlay > m_info.msPreroll ? msPlay - m_info.msPreroll : 0;
+}
+
+//
+// Lookup
+//
+// cnsTime is presentation time as the index has it, preroll included. The offset is
+// 0 unless every packet is the same size, as they are in anything but broadcast files.
+//
+bool
+WMAProbe::Lookup(unsigned long long cnsTime, ASFIndexEntry* pEntry,
+                 unsigned long long* pqwOffset) {
+  if (!m_info.pIndex || m_info.dwIndexEntries == 0) {
+    return false;
+  }
+  unsigned long long qwEntry = cnsTime / m_info.cnsIndexInterval;
+  if (qwEntry >= m_info.dwIndexEntries) {
+    qwEntry = m_info.dwIndexEntries - 1;
+  }
+  const unsigned char* p = m_info.pIndex + 6 * qwEntry;
+  pEntry->dwPacket = (unsigned long)GetLE(p, 4);
+  pEntry->wPacketCount = (unsigned short)GetLE(p + 4, 2);
+
+  if (pqwOffset) {
+    *pqwOffset = 0;
+    if (m_info.qwDataOffset && m_info.dwMinPacketSize &&
+        m_info.dwMinPacketSize == m_info.dwMaxPacketSize) {
+      *pqwOffset = m_info.qwDataOffset +
+                   (unsigned long long)pEntry->dwPacket * m_info.dwMinPacketSize;
+    }
+  }
+  return true;
+}
+
+//
+// PrintString
+//
+// UTF-16LE to UTF-8, up to the first NUL. Control characters become spaces to keep
+// it on one line, and broken surrogates become U+FFFD.
+//
+static void
+PrintString(FILE* pFile, const char* pszName, const ASFString& s) {
+  if (!s.pText) {
+    return;
+  }
+  fprintf(pFile, "%s=", pszName);
+
+  unsigned nUnits = s.cbText / 2;
+  for (unsigned i = 0; i < nUnits; i++) {
+    unsigned long c = (unsigned long)GetLE(s.pText + 2 * i, 2);
+    if (c == 0) {
+      break;
+    }
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < nUnits) {
+      unsigned long c2 = (unsigned long)GetLE(s.pText + 2 * (i + 1), 2);
+      if (c2 >= 0xDC00 && c2 < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+        i++;
+      }
+    }
+    if (c >= 0xD800 && c < 0xE000) {
+      c = 0xFFFD;
+    }
+    else if (c < 0x20 || c == 0x7F) {
+      c = ' ';
+    }
+
+    if (c < 0x80) {
+      fputc((int)c, pFile);
+    }
+    else if (c < 0x800) {
+      fputc(0xC0 | (int)(c >> 6), pFile);
+      fputc(0x80 | (int)(c & 0x3F), pFile);
+    }
+    else if (c < 0x10000) {
+      fputc(0xE0 | (int)(c >> 12), pFile);
+      fputc(0x80 | (int)((c >> 6) & 0x3F), pFile);
+      fputc(0x80 | (int)(c & 0x3F), pFile);
+    }
+    else {
+      fputc(0xF0 | (int)(c >> 18), pFile);
+      fputc(0x80 | (int)((c >> 12) & 0x3F), pFile);
+      fputc(0x80 | (int)((c >> 6) & 0x3F), pFile);
+      fputc(0x80 | (int)(c & 0x3F), pFile);
+    }
+  }
+  fputc('\n', pFile);
+}
+
+void
+WMAProbe::Print(FILE* pFile, const char* pszName) {
+  fprintf(pFile, "file=%s\n", pszName);
+  fprintf(pFile, "duration_ms=%llu\n", GetDurationMs());
+  fprintf(pFile, "preroll_ms=%llu\n", m_info.msPreroll);
+  fprintf(pFile, "file_size=%llu\n", m_info.qwFileSize);
+  fprintf(pFile, "packets=%llu\n", m_info.qwDataPackets);
+  fprintf(pFile, "packet_size=%lu\n", m_info.dwMaxPacketSize);
+  fprintf(pFile, "max_bitrate=%lu\n", m_info.dwMaxBitrate);
+  fprintf(pFile, "seekable=%d\n", (m_info.dwFlags & 2) ? 1 : 0);
+  fprintf(pFile, "broadcast=%d\n", (m_info.dwFlags & 1) ? 1 : 0);
+  fprintf(pFile, "streams=%u\n", m_info.nStreams);
+  fprintf(pFile, "audio_streams=%u\n", m_info.nAudioStreams);
+  if (m_info.nAudioStreams) {
+    fprintf(pFile, "audio_stream=%u\n", m_info.wAudioStream);
+    fprintf(pFile, "encrypted=%d\n", m_info.bEncrypted ? 1 : 0);
+    fprintf(pFile, "format_tag=0x%04x\n", m_info.wFormatTag);
+    fprintf(pFile, "channels=%u\n", m_info.nChannels);
+    fprintf(pFile, "sample_rate=%lu\n", m_info.dwSampleRate);
+    fprintf(pFile, "bitrate=%lu\n", m_info.dwAvgBytesPerSec * 8);
+    fprintf(pFile, "block_align=%u\n", m_info.nBlockAlign);
+    fprintf(pFile, "bits_per_sample=%u\n", m_info.nBitsPerSample);
+    if (m_info.dwChannelMask) {
+      fprintf(pFile, "channel_mask=0x%lx\n", m_info.dwChannelMask);
+    }
+  }
+  PrintString(pFile, "title", m_info.title);
+  PrintString(pFile, "author", m_info.author);
+  PrintString(pFile, "copyright", m_info.copyright);
+  PrintString(pFile, "description", m_info.description);
+  PrintString(pFile, "rating", m_info.rating);
+  if (m_info.pIndex) {
+    fprintf(pFile, "index_interval_ms=%llu\n", m_info.cnsIndexInterval / 10000);
+    fprintf(pFile, "index_entries=%lu\n", m_info.dwIndexEntries);
+  }
+}
@@ -0,0 +1,123 @@
+// wmaprobe.h : what an ASF file holds, from its header, without decoding it
+//
+// WMAProbe maps the file and walks its top level objects, reading what a scan of the
+// library needs from four of them:
+//
+//   File Properties       size, packet count and size, duration, preroll, max bitrate
+//   Stream Properties     each stream's number and type, and the WAVEFORMATEX of the
+//                         first audio one, with its channel mask where it has one
+//   Content Description   title, author, copyright, description and rating
+//   Simple Index          the packet to start from for each index interval
+//
+// Everything else is skipped by its size. Nothing is allocated: the strings and index
+// entries are left where they are in the mapping, so an ASFInfo is only good while its
+// WMAProbe is. Strings are UTF-16LE and counted in bytes, as the file has them.
+//
+// It only uses the C library and the system's file mapping, so it builds anywhere, and
+// Parse works on any buffer and checks every size against it, so it can be fed garbage.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+enum {
+  PROBE_OK = 0,
+  PROBE_ERR_OPEN,           // can't open or map the file
+  PROBE_ERR_NOT_ASF,        // doesn't start with a header object
+  PROBE_ERR_TRUNCATED,      // an object runs past the end of the data
+  PROBE_ERR_NO_PROPERTIES   // no File Properties object
+};
+
+#define PROBE_MAX_STREAMS 128
+
+struct ASFString {
+  const unsigned char* pText;     // UTF-16LE, in the mapping
+  unsigned cbText;
+};
+
+struct ASFIndexEntry {
+  unsigned long dwPacket;
+  unsigned short wPacketCount;
+};
+
+struct ASFInfo {
+  // File Properties
+  unsigned long long qwFileSize;
+  unsigned long long qwDataPackets;
+  unsigned long long cnsPlayDuration;   // 100ns units, preroll included
+  unsigned long long cnsSendDuration;
+  unsigned long long msPreroll;
+  unsigned long dwFlags;                // 1 broadcast, 2 seekable
+  unsigned long dwMinPacketSize;
+  unsigned long dwMaxPacketSize;
+  unsigned long dwMaxBitrate;
+
+  // Stream Properties
+  unsigned nStreams;
+  unsigned nAudioStreams;
+  unsigned wAudioStream;                // number of the first audio stream
+  bool bEncrypted;
+  unsigned wFormatTag;
+  unsigned nChannels;
+  unsigned long dwSampleRate;
+  unsigned long dwAvgBytesPerSec;
+  unsigned nBlockAlign;
+  unsigned nBitsPerSample;
+  unsigned long dwChannelMask;          // 0 when the format doesn't say
+
+  // Content Description
+  ASFString title;
+  ASFString author;
+  ASFString copyright;
+  ASFString description;
+  ASFString rating;
+
+  // Data object, for turning packet numbers into offsets
+  unsigned long long qwDataOffset;      // of the first packet
+
+  // Simple Index, of the first one there is
+  unsigned long long cnsIndexInterval;
+  unsigned long dwIndexEntries;
+  const unsigned char* pIndex;          // 6 bytes an entry
+};
+
+class WMAProbe {
+public:
+  WMAProbe();
+  ~WMAProbe();
+
+  // maps the file and parses it
+  int Open(const char* pszFile);
+  // parses a file, or as much of one as there is, already in memory
+  int Parse(const unsigned char* pData, size_t cbData);
+
+  const ASFInfo& GetInfo() { return m_info; }
+
+  // the play time without the preroll
+  unsigned long long GetDurationMs();
+  // the index entry for a time, and the offset of its packet
+  bool Lookup(unsigned long long cnsTime, ASFIndexEntry* pEntry,
+              unsigned long long* pqwOffset);
+
+  // the lot, as name=value lines with strings in UTF-8, for --probe
+  void Print(FILE* pFile, const char* pszName);
+
+protected:
+  void Close();
+  int ParseHeader(const unsigned char* p, unsigned long long cb);
+  void ParseStream(const unsigned char* p, unsigned long long cb);
+  void ParseContent(const unsigned char* p, unsigned long long cb);
+  void ParseIndex(const unsigned char* p, unsigned long long cb);
+
+  ASFInfo m_info;
+  bool m_bFileProperties;
+
+  const unsigned char* m_pView;
+  size_t m_cbView;
+#ifdef _WIN32
+  void* m_hFile;
+  void* m_hMapping;
+#endif
+};
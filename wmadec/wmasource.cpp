@@ -0,0 +1,343 @@
+// wmasource.cpp : buffered input for the stream decoder - see wmasource.h
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wmasource.h"
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0500     // for GetFileSizeEx and SetFilePointerEx, as stdafx.h has
+#endif
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define LAST_ERROR ((int)GetLastError())
+#else
+#define LAST_ERROR errno
+#endif
+
+WMASource::WMASource() {
+#ifdef _WIN32
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hMapping = NULL;
+#else
+  m_hFile = -1;
+#endif
+  m_bSeekable = false;
+  m_bDebug = false;
+  m_qwSize = 0;
+  m_qwPos = 0;
+  m_pView = NULL;
+  m_cbView = 0;
+  m_pBuf = NULL;
+  m_cbBuf = 0;
+  m_cbValid = 0;
+  m_qwBufStart = 0;
+  m_bEof = false;
+}
+
+WMASource::~WMASource() {
+#ifdef _WIN32
+  if (m_pView) {
+    UnmapViewOfFile(m_pView);
+  }
+  if (m_hMapping) {
+    CloseHandle(m_hMapping);
+  }
+  if (m_pBuf) {
+    VirtualFree(m_pBuf, 0, MEM_RELEASE);
+  }
+#else
+  if (m_pView) {
+    munmap((void*)m_pView, m_cbView);
+  }
+  free(m_pBuf);
+#endif
+}
+
+bool
+WMASource::Open(SourceHandle hFile, unsigned long long qwMaxMap) {
+  m_hFile = hFile;
+
+  // reads start where the handle is, in case something has been read already
+#ifdef _WIN32
+  LARGE_INTEGER liSize;
+  if (GetFileType(hFile) == FILE_TYPE_DISK && GetFileSizeEx(hFile, &liSize)) {
+    m_bSeekable = true;
+    m_qwSize = liSize.QuadPart;
+    LARGE_INTEGER liZero, liPos;
+    liZero.QuadPart = 0;
+    if (SetFilePointerEx(hFile, liZero, &liPos, FILE_CURRENT)) {
+      m_qwPos = liPos.QuadPart;
+    }
+  }
+#else
+  struct stat st;
+  if (fstat(hFile, &st) == 0 && S_ISREG(st.st_mode)) {
+    m_bSeekable = true;
+    m_qwSize = st.st_size;
+    off_t pos = lseek(hFile, 0, SEEK_CUR);
+    if (pos > 0) {
+      m_qwPos = pos;
+    }
+  }
+#endif
+
+  if (m_bSeekable && m_qwSize > 0 && m_qwSize <= qwMaxMap &&
+      m_qwSize <= (size_t)-1) {
+#ifdef _WIN32
+    m_hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_hMapping) {
+      m_pView = (const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+      if (!m_pView) {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+      }
+    }
+#else
+    void* pView = mmap(NULL, (size_t)m_qwSize, PROT_READ, MAP_SHARED, hFile, 0);
+    if (pView != MAP_FAILED) {
+      m_pView = (const unsigned char*)pView;
+    }
+#endif
+    if (m_pView) {
+      m_cbView = (size_t)m_qwSize;
+      return true;
+    }
+    if (m_bDebug) {
+      fprintf(stderr, "Mapping input failed with error %d, reading it instead\n",
+              LAST_ERROR);
+    }
+  }
+
+  // page aligned, so block reads land on aligned buffers
+  m_cbBuf = m_bSeekable ? SOURCE_BLOCK : SOURCE_WINDOW;
+#ifdef _WIN32
+  m_pBuf = (unsigned char*)VirtualAlloc(NULL, m_cbBuf, MEM_COMMIT | MEM_RESERVE,
+                                        PAGE_READWRITE);
+#else
+  void* pBuf = NULL;
+  if (posix_memalign(&pBuf, 4096, m_cbBuf) == 0) {
+    m_pBuf = (unsigned char*)pBuf;
+  }
+#endif
+  if (!m_pBuf) {
+    fprintf(stderr, "Allocating input buffer failed with error %d\n", LAST_ERROR);
+    return false;
+  }
+  m_qwBufStart = m_bSeekable ? m_qwPos : 0;
+
+  return true;
+}
+
+//
+// ReadInput
+//
+// one read from the handle, which gives what a pipe has so far. The end of a pipe
+// is a read of nothing, not an error
+//
+bool
+WMASource::ReadInput(unsigned char* p, size_t cb, size_t* pcbRead) {
+  *pcbRead = 0;
+#ifdef _WIN32
+  DWORD cbRead = 0;
+  if (!ReadFile(m_hFile, p, (DWORD)cb, &cbRead, NULL)) {
+    DWORD dwErr = GetLastError();
+    if (dwErr != ERROR_BROKEN_PIPE && dwErr != ERROR_HANDLE_EOF) {
+      fprintf(stderr, "Reading input failed with error %d\n", dwErr);
+      return false;
+    }
+  }
+  *pcbRead = cbRead;
+#else
+  ssize_t n;
+  do {
+    n = read(m_hFile, p, cb);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    fprintf(stderr, "Reading input failed with error %d\n", errno);
+    return false;
+  }
+  *pcbRead = (size_t)n;
+#endif
+  return true;
+}
+
+bool
+WMASource::SeekInput(unsigned long long qwPos) {
+#ifdef _WIN32
+  LARGE_INTEGER liPos;
+  liPos.QuadPart = qwPos;
+  bool bDone = SetFilePointerEx(m_hFile, liPos, NULL, FILE_BEGIN) != FALSE;
+#else
+  bool bDone = lseek(m_hFile, (off_t)qwPos, SEEK_SET) != (off_t)-1;
+#endif
+  if (!bDone) {
+    fprintf(stderr, "Seeking input failed with error %d\n", LAST_ERROR);
+  }
+  return bDone;
+}
+
+//
+// FillBlock
+//
+// a seekable file: read the aligned block holding m_qwPos
+//
+bool
+WMASource::FillBlock() {
+  m_qwBufStart = m_qwPos & ~(unsigned long long)(SOURCE_BLOCK - 1);
+  m_cbValid = 0;
+
+  if (!SeekInput(m_qwBufStart)) {
+    return false;
+  }
+  // a file gives the whole block unless it ends first, but reads can come up short
+  while (m_cbValid < m_cbBuf) {
+    size_t cbRead;
+    if (!ReadInput(m_pBuf + m_cbValid, m_cbBuf - m_cbValid, &cbRead)) {
+      return false;
+    }
+    if (cbRead == 0) {
+      break;
+    }
+    m_cbValid += cbRead;
+  }
+  return true;
+}
+
+//
+// FillWindow
+//
+// a pipe: read whatever it has into the window, first dropping the older half if
+// the window is full
+//
+bool
+WMASource::FillWindow() {
+  if (m_cbValid == m_cbBuf) {
+    size_t cbKeep = m_cbBuf / 2;
+    size_t cbDrop = m_cbValid - cbKeep;
+    memmove(m_pBuf, m_pBuf + cbDrop, cbKeep);
+    m_qwBufStart += cbDrop;
+    m_cbValid = cbKeep;
+  }
+
+  size_t cbRead;
+  if (!ReadInput(m_pBuf + m_cbValid, m_cbBuf - m_cbValid, &cbRead)) {
+    return false;
+  }
+  if (cbRead == 0) {
+    m_bEof = true;
+  }
+  m_cbValid += cbRead;
+  return true;
+}
+
+bool
+WMASource::Read(void* pv, size_t cb, size_t* pcbRead) {
+  unsigned char* pDest = (unsigned char*)pv;
+  size_t cbDone = 0;
+  bool bOk = true;
+
+  if (m_pView) {
+    if (m_qwPos < m_qwSize) {
+      cbDone = (size_t)(cb < m_qwSize - m_qwPos ? cb : m_qwSize - m_qwPos);
+      memcpy(pDest, m_pView + m_qwPos, cbDone);
+      m_qwPos += cbDone;
+    }
+  }
+  else {
+    while (cbDone < cb) {
+      if (m_qwPos < m_qwBufStart || m_qwPos >= m_qwBufStart + m_cbValid) {
+        if (m_bSeekable) {
+          if (m_qwPos >= m_qwSize) {
+            break;
+          }
+          bOk = FillBlock();
+        }
+        else {
+          if (m_bEof) {
+            break;
+          }
+          bOk = FillWindow();
+        }
+        if (!bOk || (m_bSeekable && m_cbValid == 0)) {
+          break;
+        }
+        continue;
+      }
+
+      size_t nOffset = (size_t)(m_qwPos - m_qwBufStart);
+      size_t n = cb - cbDone;
+      if (n > m_cbValid - nOffset) {
+        n = m_cbValid - nOffset;
+      }
+      memcpy(pDest + cbDone, m_pBuf + nOffset, n);
+      cbDone += n;
+      m_qwPos += n;
+    }
+  }
+
+  if (pcbRead) {
+    *pcbRead = cbDone;
+  }
+  return bOk;
+}
+
+bool
+WMASource::Seek(long long llMove, int nOrigin, unsigned long long* pqwNewPos) {
+  long long llPos;
+  switch (nOrigin) {
+    case SOURCE_SEEK_SET:
+      llPos = llMove;
+      break;
+    case SOURCE_SEEK_CUR:
+      llPos = (long long)m_qwPos + llMove;
+      break;
+    case SOURCE_SEEK_END:
+      if (!m_bSeekable) {
+        return false;
+      }
+      llPos = (long long)m_qwSize + llMove;
+      break;
+    default:
+      return false;
+  }
+  if (llPos < 0) {
+    return false;
+  }
+
+  if (!m_bSeekable) {
+    if ((unsigned long long)llPos < m_qwBufStart) {
+      // gone from the window
+      if (m_bDebug) {
+        fprintf(stderr, "Can't seek back to %lld in a pipe, the window starts at %llu\n",
+                llPos, m_qwBufStart);
+      }
+      return false;
+    }
+    // forward, read up to it
+    while ((unsigned long long)llPos > m_qwBufStart + m_cbValid && !m_bEof) {
+      if (!FillWindow()) {
+        return false;
+      }
+    }
+    if ((unsigned long long)llPos > m_qwBufStart + m_cbValid) {
+      return false;
+    }
+  }
+
+  m_qwPos = llPos;
+  if (pqwNewPos) {
+    *pqwNewPos = m_qwPos;
+  }
+  return true;
+}
@@ -0,0 +1,89 @@
+// wmasource.h : buffered input for the stream decoder
+//
+// WMASource sits between WMAStream and the input handle so the reader's many small
+// reads and seeks don't each become a system call. How it does that depends on what
+// the input turns out to be:
+//
+//   a file that fits in SOURCE_MAX_MAP   mapped, reads are copies out of the mapping
+//   a bigger file                        read in SOURCE_BLOCK aligned blocks, a whole
+//                                        block at a time, and seekable anywhere
+//   a pipe                               read ahead into a window of SOURCE_WINDOW,
+//                                        taking whatever the pipe has. Seeks forward
+//                                        read and skip; seeks back work as long as
+//                                        they stay in the window, which keeps at least
+//                                        the last half of it
+//
+// GetSize is 0 when the size isn't known, i.e. for a pipe.
+//
+// Like wmaprobe it only uses the C library and the system's file calls, so it builds
+// anywhere: the input is a HANDLE on Windows and a file descriptor elsewhere, and stays
+// the caller's to close. tests/test_source checks it against a plain copy of its input
+// with random reads and seeks in each of the three modes.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define SOURCE_BLOCK   (256 << 10)
+#define SOURCE_WINDOW  (1 << 20)
+#define SOURCE_MAX_MAP ((unsigned long long)512 << 20)
+
+// the same as IStream's STREAM_SEEK_SET, _CUR and _END
+enum {
+  SOURCE_SEEK_SET,
+  SOURCE_SEEK_CUR,
+  SOURCE_SEEK_END
+};
+
+#ifdef _WIN32
+typedef void* SourceHandle;
+#else
+typedef int SourceHandle;
+#endif
+
+class WMASource {
+public:
+  WMASource();
+  ~WMASource();
+
+  // a file bigger than qwMaxMap is read in blocks instead of mapped
+  bool Open(SourceHandle hFile, unsigned long long qwMaxMap = SOURCE_MAX_MAP);
+  // false if reading failed, with *pcbRead what was read before it did. Short at the
+  // end of the input
+  bool Read(void* pv, size_t cb, size_t* pcbRead);
+  // false for a position before the start, past the end of a pipe, or gone from its
+  // window
+  bool Seek(long long llMove, int nOrigin, unsigned long long* pqwNewPos);
+
+  void SetDebug(bool bDebug) { m_bDebug = bDebug; }
+  bool IsSeekable() { return m_bSeekable; }
+  unsigned long long GetSize() { return m_qwSize; }
+
+protected:
+  bool FillBlock();
+  bool FillWindow();
+  // the system calls
+  bool ReadInput(unsigned char* p, size_t cb, size_t* pcbRead);
+  bool SeekInput(unsigned long long qwPos);
+
+  SourceHandle m_hFile;
+  bool m_bSeekable;
+  bool m_bDebug;
+  unsigned long long m_qwSize;
+  unsigned long long m_qwPos;     // where the next read starts
+
+  // mapped file
+  const unsigned char* m_pView;
+  size_t m_cbView;
+#ifdef _WIN32
+  void* m_hMapping;
+#endif
+
+  // block or window buffer, holding the stream from m_qwBufStart on
+  unsigned char* m_pBuf;
+  size_t m_cbBuf;
+  size_t m_cbValid;
+  unsigned long long m_qwBufStart;
+  bool m_bEof;                    // the pipe has ended
+};